@@ -4,6 +4,7 @@
 #include <wmmintrin.h>
 #include <emmintrin.h>
 #include <smmintrin.h>
+#include <string.h>
 
 inline void KEY_256_ASSIST_1(__m128i* temp1, __m128i * temp2) { 
     __m128i temp4; 
@@ -74,6 +75,126 @@ void AES_256_Key_Expansion (const unsigned char *userkey,
     Key_Schedule[14]=temp1; 
 }
 
+inline __m128i AES_128_ASSIST (__m128i temp1, __m128i temp2) {
+    __m128i temp3;
+    temp2 = _mm_shuffle_epi32 (temp2, 0xff);
+    temp3 = _mm_slli_si128 (temp1, 0x4);
+    temp1 = _mm_xor_si128 (temp1, temp3);
+    temp3 = _mm_slli_si128 (temp3, 0x4);
+    temp1 = _mm_xor_si128 (temp1, temp3);
+    temp3 = _mm_slli_si128 (temp3, 0x4);
+    temp1 = _mm_xor_si128 (temp1, temp3);
+    temp1 = _mm_xor_si128 (temp1, temp2);
+    return temp1;
+}
+
+void AES_128_Key_Expansion (const unsigned char *userkey,
+                            unsigned char *key) {
+    __m128i temp1, temp2;
+    __m128i *Key_Schedule = (__m128i*)key;
+
+    temp1 = _mm_loadu_si128((__m128i*)userkey);
+    Key_Schedule[0] = temp1;
+    temp2 = _mm_aeskeygenassist_si128 (temp1, 0x1);
+    temp1 = AES_128_ASSIST(temp1, temp2);
+    Key_Schedule[1] = temp1;
+    temp2 = _mm_aeskeygenassist_si128 (temp1, 0x2);
+    temp1 = AES_128_ASSIST(temp1, temp2);
+    Key_Schedule[2] = temp1;
+    temp2 = _mm_aeskeygenassist_si128 (temp1, 0x4);
+    temp1 = AES_128_ASSIST(temp1, temp2);
+    Key_Schedule[3] = temp1;
+    temp2 = _mm_aeskeygenassist_si128 (temp1, 0x8);
+    temp1 = AES_128_ASSIST(temp1, temp2);
+    Key_Schedule[4] = temp1;
+    temp2 = _mm_aeskeygenassist_si128 (temp1, 0x10);
+    temp1 = AES_128_ASSIST(temp1, temp2);
+    Key_Schedule[5] = temp1;
+    temp2 = _mm_aeskeygenassist_si128 (temp1, 0x20);
+    temp1 = AES_128_ASSIST(temp1, temp2);
+    Key_Schedule[6] = temp1;
+    temp2 = _mm_aeskeygenassist_si128 (temp1, 0x40);
+    temp1 = AES_128_ASSIST(temp1, temp2);
+    Key_Schedule[7] = temp1;
+    temp2 = _mm_aeskeygenassist_si128 (temp1, 0x80);
+    temp1 = AES_128_ASSIST(temp1, temp2);
+    Key_Schedule[8] = temp1;
+    temp2 = _mm_aeskeygenassist_si128 (temp1, 0x1b);
+    temp1 = AES_128_ASSIST(temp1, temp2);
+    Key_Schedule[9] = temp1;
+    temp2 = _mm_aeskeygenassist_si128 (temp1, 0x36);
+    temp1 = AES_128_ASSIST(temp1, temp2);
+    Key_Schedule[10] = temp1;
+}
+
+inline void KEY_192_ASSIST(__m128i* temp1, __m128i * temp2, __m128i * temp3) {
+    __m128i temp4;
+    *temp2 = _mm_shuffle_epi32 (*temp2, 0x55);
+    temp4 = _mm_slli_si128 (*temp1, 0x4);
+    *temp1 = _mm_xor_si128 (*temp1, temp4);
+    temp4 = _mm_slli_si128 (temp4, 0x4);
+    *temp1 = _mm_xor_si128 (*temp1, temp4);
+    temp4 = _mm_slli_si128 (temp4, 0x4);
+    *temp1 = _mm_xor_si128 (*temp1, temp4);
+    *temp1 = _mm_xor_si128 (*temp1, *temp2);
+    *temp2 = _mm_shuffle_epi32(*temp1, 0xff);
+    temp4 = _mm_slli_si128 (*temp3, 0x4);
+    *temp3 = _mm_xor_si128 (*temp3, temp4);
+    *temp3 = _mm_xor_si128 (*temp3, *temp2);
+}
+
+// KEY_192_LO: low halves of a and b, KEY_192_HI: high half of a and low half of b
+inline __m128i KEY_192_LO(__m128i a, __m128i b) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b), 0));
+}
+
+inline __m128i KEY_192_HI(__m128i a, __m128i b) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b), 1));
+}
+
+// userkey is read as 32 bytes, the last 8 are ignored
+void AES_192_Key_Expansion (const unsigned char *userkey,
+                            unsigned char *key) {
+    __m128i temp1, temp2, temp3;
+    __m128i *Key_Schedule = (__m128i*)key;
+
+    temp1 = _mm_loadu_si128((__m128i*)userkey);
+    temp3 = _mm_loadu_si128((__m128i*)(userkey+16));
+    Key_Schedule[0] = temp1;
+    Key_Schedule[1] = temp3;
+    temp2 = _mm_aeskeygenassist_si128 (temp3, 0x1);
+    KEY_192_ASSIST(&temp1, &temp2, &temp3);
+    Key_Schedule[1] = KEY_192_LO(Key_Schedule[1], temp1);
+    Key_Schedule[2] = KEY_192_HI(temp1, temp3);
+    temp2 = _mm_aeskeygenassist_si128 (temp3, 0x2);
+    KEY_192_ASSIST(&temp1, &temp2, &temp3);
+    Key_Schedule[3] = temp1;
+    Key_Schedule[4] = temp3;
+    temp2 = _mm_aeskeygenassist_si128 (temp3, 0x4);
+    KEY_192_ASSIST(&temp1, &temp2, &temp3);
+    Key_Schedule[4] = KEY_192_LO(Key_Schedule[4], temp1);
+    Key_Schedule[5] = KEY_192_HI(temp1, temp3);
+    temp2 = _mm_aeskeygenassist_si128 (temp3, 0x8);
+    KEY_192_ASSIST(&temp1, &temp2, &temp3);
+    Key_Schedule[6] = temp1;
+    Key_Schedule[7] = temp3;
+    temp2 = _mm_aeskeygenassist_si128 (temp3, 0x10);
+    KEY_192_ASSIST(&temp1, &temp2, &temp3);
+    Key_Schedule[7] = KEY_192_LO(Key_Schedule[7], temp1);
+    Key_Schedule[8] = KEY_192_HI(temp1, temp3);
+    temp2 = _mm_aeskeygenassist_si128 (temp3, 0x20);
+    KEY_192_ASSIST(&temp1, &temp2, &temp3);
+    Key_Schedule[9] = temp1;
+    Key_Schedule[10] = temp3;
+    temp2 = _mm_aeskeygenassist_si128 (temp3, 0x40);
+    KEY_192_ASSIST(&temp1, &temp2, &temp3);
+    Key_Schedule[10] = KEY_192_LO(Key_Schedule[10], temp1);
+    Key_Schedule[11] = KEY_192_HI(temp1, temp3);
+    temp2 = _mm_aeskeygenassist_si128 (temp3, 0x80);
+    KEY_192_ASSIST(&temp1, &temp2, &temp3);
+    Key_Schedule[12] = temp1;
+}
+
 void AES_256_Decryption_Keys (const unsigned char *key,
                               unsigned char *decryptionkey) {
     __m128i *Key_Schedule = (__m128i*)key;
@@ -87,11 +208,26 @@ void AES_256_Decryption_Keys (const unsigned char *key,
     }
 }
 
+// Decryption keys of the equivalent inverse cipher, for 10, 12 or 14 rounds
+void AES_Decryption_Keys (const unsigned char *key,
+                          unsigned char *decryptionkey,
+                          int number_of_rounds) {
+    __m128i *Key_Schedule = (__m128i*)key;
+    __m128i *Key_Schedule_Decrypt = (__m128i*)decryptionkey;
+
+    Key_Schedule_Decrypt[0] = Key_Schedule[number_of_rounds];
+    Key_Schedule_Decrypt[number_of_rounds] = Key_Schedule[0];
+
+    for (int i = 1; i < number_of_rounds; i++) {
+        Key_Schedule_Decrypt[i] = _mm_aesimc_si128(Key_Schedule[number_of_rounds-i]);
+    }
+}
+
 void AES_CBC_encrypt(const unsigned char *in,  
                      unsigned char *out, 
                      unsigned char ivec[16], 
                      unsigned long length, 
-                     unsigned char *key, 
+                     const unsigned char *key, 
                      int number_of_rounds) { 
     __m128i feedback,data; 
     unsigned long i;
@@ -117,7 +253,7 @@ void AES_CBC_decrypt(const unsigned char *in,
                      unsigned char *out, 
                      unsigned char ivec[16], 
                      unsigned long length, 
-                     unsigned char *key, 
+                     const unsigned char *key, 
                      int number_of_rounds) { 
     __m128i data,feedback,last_in; 
     unsigned long i;
@@ -231,4 +367,560 @@ void AES_ECB_decrypt(const unsigned char *in,  //pointer to the CIPHERTEXT
     }     
 }
 
+//---------------------------------------------------------------------------------------
+//  Interleaved blocks
+//---------------------------
+// aesenc/aesdec take several cycles but a new one issues every cycle, so the loops
+// above, which wait for each block, keep the AES unit mostly idle. The _x<N> versions
+// run every round over N independent blocks (4 or 8) with the round keys loaded once,
+// and do the blocks left over one at a time. Arguments and results are the same as
+// for the single block versions. CBC encryption chains every block of a stream, it is
+// interleaved across streams instead (AES_CBC_encrypt_mb).
+//---------------------------------------------------------------------------------------
+
+// The block loops must be unrolled for the blocks to stay in registers
+#if defined(__clang__)
+#define AES_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__) && __GNUC__ >= 8
+#define AES_UNROLL _Pragma("GCC unroll 8")
+#else
+#define AES_UNROLL
+#endif
+
+inline void AES_LOAD_KEYS(__m128i *rk, const unsigned char *key, int number_of_rounds) {
+    for(int j = 0; j <= number_of_rounds; j++)
+        rk[j] = _mm_loadu_si128(&((const __m128i*)key)[j]);
+}
+
+template <int N>
+inline void AES_ENC_N(__m128i *b, const __m128i *rk, int number_of_rounds) {
+    int j, k;
+    AES_UNROLL
+    for(k = 0; k < N; k++)
+        b[k] = _mm_xor_si128(b[k], rk[0]);
+    for(j = 1; j < number_of_rounds; j++) {
+        AES_UNROLL
+        for(k = 0; k < N; k++)
+            b[k] = _mm_aesenc_si128(b[k], rk[j]);
+    }
+    AES_UNROLL
+    for(k = 0; k < N; k++)
+        b[k] = _mm_aesenclast_si128(b[k], rk[j]);
+}
+
+template <int N>
+inline void AES_DEC_N(__m128i *b, const __m128i *rk, int number_of_rounds) {
+    int j, k;
+    AES_UNROLL
+    for(k = 0; k < N; k++)
+        b[k] = _mm_xor_si128(b[k], rk[0]);
+    for(j = 1; j < number_of_rounds; j++) {
+        AES_UNROLL
+        for(k = 0; k < N; k++)
+            b[k] = _mm_aesdec_si128(b[k], rk[j]);
+    }
+    AES_UNROLL
+    for(k = 0; k < N; k++)
+        b[k] = _mm_aesdeclast_si128(b[k], rk[j]);
+}
+
+template <int N>
+void AES_ECB_encrypt_x(const unsigned char *in,
+                       unsigned char *out,
+                       unsigned long length,
+                       const unsigned char *key,
+                       int number_of_rounds) {
+    __m128i rk[15], b[N];
+    unsigned long i, blocks = (length + 15)/16;
+    int k;
+
+    AES_LOAD_KEYS(rk, key, number_of_rounds);
+    for(i = 0; i + N <= blocks; i += N) {
+        for(k = 0; k < N; k++)
+            b[k] = _mm_loadu_si128(&((__m128i*)in)[i+k]);
+        AES_ENC_N<N>(b, rk, number_of_rounds);
+        for(k = 0; k < N; k++)
+            _mm_storeu_si128(&((__m128i*)out)[i+k], b[k]);
+    }
+    for(; i < blocks; i++) {
+        b[0] = _mm_loadu_si128(&((__m128i*)in)[i]);
+        AES_ENC_N<1>(b, rk, number_of_rounds);
+        _mm_storeu_si128(&((__m128i*)out)[i], b[0]);
+    }
+}
+
+template <int N>
+void AES_ECB_decrypt_x(const unsigned char *in,
+                       unsigned char *out,
+                       unsigned long length,
+                       const unsigned char *key,
+                       int number_of_rounds) {
+    __m128i rk[15], b[N];
+    unsigned long i, blocks = (length + 15)/16;
+    int k;
+
+    AES_LOAD_KEYS(rk, key, number_of_rounds);
+    for(i = 0; i + N <= blocks; i += N) {
+        for(k = 0; k < N; k++)
+            b[k] = _mm_loadu_si128(&((__m128i*)in)[i+k]);
+        AES_DEC_N<N>(b, rk, number_of_rounds);
+        for(k = 0; k < N; k++)
+            _mm_storeu_si128(&((__m128i*)out)[i+k], b[k]);
+    }
+    for(; i < blocks; i++) {
+        b[0] = _mm_loadu_si128(&((__m128i*)in)[i]);
+        AES_DEC_N<1>(b, rk, number_of_rounds);
+        _mm_storeu_si128(&((__m128i*)out)[i], b[0]);
+    }
+}
+
+// The decryption of every block only needs the previous ciphertext block
+template <int N>
+void AES_CBC_decrypt_x(const unsigned char *in,
+                       unsigned char *out,
+                       unsigned char ivec[16],
+                       unsigned long length,
+                       const unsigned char *key,
+                       int number_of_rounds) {
+    __m128i rk[15], b[N], c[N], feedback;
+    unsigned long i, blocks = (length + 15)/16;
+    int k;
+
+    AES_LOAD_KEYS(rk, key, number_of_rounds);
+    feedback = _mm_loadu_si128((__m128i*)ivec);
+    for(i = 0; i + N <= blocks; i += N) {
+        for(k = 0; k < N; k++)
+            b[k] = c[k] = _mm_loadu_si128(&((__m128i*)in)[i+k]);
+        AES_DEC_N<N>(b, rk, number_of_rounds);
+        _mm_storeu_si128(&((__m128i*)out)[i], _mm_xor_si128(b[0], feedback));
+        for(k = 1; k < N; k++)
+            _mm_storeu_si128(&((__m128i*)out)[i+k], _mm_xor_si128(b[k], c[k-1]));
+        feedback = c[N-1];
+    }
+    for(; i < blocks; i++) {
+        b[0] = c[0] = _mm_loadu_si128(&((__m128i*)in)[i]);
+        AES_DEC_N<1>(b, rk, number_of_rounds);
+        _mm_storeu_si128(&((__m128i*)out)[i], _mm_xor_si128(b[0], feedback));
+        feedback = c[0];
+    }
+}
+
+template <int N>
+void AES_CTR_encrypt_x(const unsigned char *in,
+                       unsigned char *out,
+                       const unsigned char ivec[8],
+                       const unsigned char nonce[4],
+                       unsigned long length,
+                       const unsigned char *key,
+                       int number_of_rounds) {
+    __m128i rk[15], b[N], ctr_block, ONE, BSWAP_EPI64;
+    unsigned long i, blocks = (length + 15)/16;
+    int k;
+
+    AES_LOAD_KEYS(rk, key, number_of_rounds);
+    ONE = _mm_set_epi32(0,1,0,0);
+    BSWAP_EPI64 = _mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+    ctr_block = _mm_setzero_si128();
+    ctr_block = _mm_insert_epi64(ctr_block, *(long long*)ivec, 1);
+    ctr_block = _mm_insert_epi32(ctr_block, *(long*)nonce, 1);
+    ctr_block = _mm_srli_si128(ctr_block, 4);
+    ctr_block = _mm_shuffle_epi8(ctr_block, BSWAP_EPI64);
+    ctr_block = _mm_add_epi64(ctr_block, ONE);
+    for(i = 0; i + N <= blocks; i += N) {
+        for(k = 0; k < N; k++) {
+            b[k] = _mm_shuffle_epi8(ctr_block, BSWAP_EPI64);
+            ctr_block = _mm_add_epi64(ctr_block, ONE);
+        }
+        AES_ENC_N<N>(b, rk, number_of_rounds);
+        for(k = 0; k < N; k++)
+            _mm_storeu_si128(&((__m128i*)out)[i+k],
+                             _mm_xor_si128(b[k], _mm_loadu_si128(&((__m128i*)in)[i+k])));
+    }
+    for(; i < blocks; i++) {
+        b[0] = _mm_shuffle_epi8(ctr_block, BSWAP_EPI64);
+        ctr_block = _mm_add_epi64(ctr_block, ONE);
+        AES_ENC_N<1>(b, rk, number_of_rounds);
+        _mm_storeu_si128(&((__m128i*)out)[i], _mm_xor_si128(b[0], _mm_loadu_si128(&((__m128i*)in)[i])));
+    }
+}
+
+//---------------------------------------------------------------------------------------
+//  Multi-buffer CBC encryption
+//---------------------------
+// Encrypts n_buffers independent CBC streams (pages with their own IVs) on N lanes in
+// lock-step, so the rounds of N blocks are in flight although every stream is serial.
+// All lanes advance by the blocks left in the shortest stream, then the lanes that are
+// done take the next streams. When fewer than N streams are left, the idle lanes encrypt
+// a scratch block that is thrown away. Streams are padded to whole blocks as in
+// AES_CBC_encrypt, and in[b] may equal out[b].
+//---------------------------------------------------------------------------------------
+
+template <int N>
+void AES_CBC_encrypt_mb(const unsigned char *const in[],
+                        unsigned char *const out[],
+                        const unsigned char *const ivec[],
+                        const unsigned long length[],
+                        unsigned int n_buffers,
+                        const unsigned char *key,
+                        int number_of_rounds) {
+    __m128i rk[15], b[N];
+    const unsigned char *src[N];
+    unsigned char *dst[N];
+    unsigned long left[N], step[N];
+    alignas(16) unsigned char scratch[2][16] = {{0}};
+    unsigned int next = 0, active = 0;
+    int k;
+
+    AES_LOAD_KEYS(rk, key, number_of_rounds);
+    for(k = 0; k < N; k++) {
+        left[k] = 0;
+        src[k] = scratch[0];
+        dst[k] = scratch[1];
+        step[k] = 0;
+        b[k] = _mm_setzero_si128();
+    }
+
+    for(;;) {
+        // give the idle lanes the next streams
+        for(k = 0; k < N; k++) {
+            while(left[k] == 0 && next < n_buffers) {
+                unsigned int n = next++;
+                left[k] = (length[n] + 15)/16;
+                if(left[k] == 0)
+                    continue;
+                src[k] = in[n];
+                dst[k] = out[n];
+                step[k] = 16;
+                b[k] = _mm_loadu_si128((const __m128i*)ivec[n]);
+                active++;
+            }
+        }
+        if(active == 0)
+            break;
+
+        unsigned long blocks = ~0UL;
+        for(k = 0; k < N; k++)
+            if(left[k] != 0 && left[k] < blocks)
+                blocks = left[k];
+
+        for(unsigned long i = 0; i < blocks; i++) {
+            for(k = 0; k < N; k++)
+                b[k] = _mm_xor_si128(b[k], _mm_loadu_si128((const __m128i*)(src[k] + i*step[k])));
+            AES_ENC_N<N>(b, rk, number_of_rounds);
+            for(k = 0; k < N; k++)
+                _mm_storeu_si128((__m128i*)(dst[k] + i*step[k]), b[k]);
+        }
+
+        for(k = 0; k < N; k++) {
+            if(left[k] == 0)
+                continue;
+            src[k] += blocks*step[k];
+            dst[k] += blocks*step[k];
+            left[k] -= blocks;
+            if(left[k] == 0) {
+                src[k] = scratch[0];
+                dst[k] = scratch[1];
+                step[k] = 0;
+                active--;
+            }
+        }
+    }
+}
+
+//---------------------------------------------------------------------------------------
+//  GCM
+//---------------------------
+// Carry-less multiplication in GF(2^128) as in the Intel CLMUL white paper. Operands
+// are byte reflected (BSWAP_MASK) blocks, the product is shifted left by one bit before
+// the reduction to account for the bit reflection of GHASH.
+//---------------------------------------------------------------------------------------
+
+inline void GFMUL_NOREDUCE(__m128i a, __m128i b, __m128i *lo, __m128i *hi) {
+    __m128i tmp3, tmp4, tmp5, tmp6;
+    tmp3 = _mm_clmulepi64_si128(a, b, 0x00);
+    tmp4 = _mm_clmulepi64_si128(a, b, 0x10);
+    tmp5 = _mm_clmulepi64_si128(a, b, 0x01);
+    tmp6 = _mm_clmulepi64_si128(a, b, 0x11);
+    tmp4 = _mm_xor_si128(tmp4, tmp5);
+    tmp5 = _mm_slli_si128(tmp4, 8);
+    tmp4 = _mm_srli_si128(tmp4, 8);
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(tmp3, tmp5));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(tmp6, tmp4));
+}
+
+inline __m128i GFREDUCE(__m128i tmp3, __m128i tmp6) {
+    __m128i tmp2, tmp4, tmp5, tmp7, tmp8, tmp9;
+    tmp7 = _mm_srli_epi32(tmp3, 31);
+    tmp8 = _mm_srli_epi32(tmp6, 31);
+    tmp3 = _mm_slli_epi32(tmp3, 1);
+    tmp6 = _mm_slli_epi32(tmp6, 1);
+    tmp9 = _mm_srli_si128(tmp7, 12);
+    tmp8 = _mm_slli_si128(tmp8, 4);
+    tmp7 = _mm_slli_si128(tmp7, 4);
+    tmp3 = _mm_or_si128(tmp3, tmp7);
+    tmp6 = _mm_or_si128(tmp6, tmp8);
+    tmp6 = _mm_or_si128(tmp6, tmp9);
+    tmp7 = _mm_slli_epi32(tmp3, 31);
+    tmp8 = _mm_slli_epi32(tmp3, 30);
+    tmp9 = _mm_slli_epi32(tmp3, 25);
+    tmp7 = _mm_xor_si128(tmp7, tmp8);
+    tmp7 = _mm_xor_si128(tmp7, tmp9);
+    tmp8 = _mm_srli_si128(tmp7, 4);
+    tmp7 = _mm_slli_si128(tmp7, 12);
+    tmp3 = _mm_xor_si128(tmp3, tmp7);
+    tmp2 = _mm_srli_epi32(tmp3, 1);
+    tmp4 = _mm_srli_epi32(tmp3, 2);
+    tmp5 = _mm_srli_epi32(tmp3, 7);
+    tmp2 = _mm_xor_si128(tmp2, tmp4);
+    tmp2 = _mm_xor_si128(tmp2, tmp5);
+    tmp2 = _mm_xor_si128(tmp2, tmp8);
+    tmp3 = _mm_xor_si128(tmp3, tmp2);
+    return _mm_xor_si128(tmp6, tmp3);
+}
+
+inline __m128i GFMUL(__m128i a, __m128i b) {
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    GFMUL_NOREDUCE(a, b, &lo, &hi);
+    return GFREDUCE(lo, hi);
+}
+
+inline __m128i AES_encrypt_block(__m128i block, const unsigned char *key, int number_of_rounds) {
+    int j;
+    block = _mm_xor_si128(block, ((__m128i*)key)[0]);
+    for(j = 1; j < number_of_rounds; j++) {
+        block = _mm_aesenc_si128(block, ((__m128i*)key)[j]);
+    }
+    return _mm_aesenclast_si128(block, ((__m128i*)key)[j]);
+}
+
+// Powers of the hash key for the 4-block aggregated GHASH: H[0]=H^1 .. H[3]=H^4
+inline void GHASH_init(const unsigned char *key, int number_of_rounds, __m128i H[4]) {
+    const __m128i BSWAP_MASK = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    H[0] = AES_encrypt_block(_mm_setzero_si128(), key, number_of_rounds);
+    H[0] = _mm_shuffle_epi8(H[0], BSWAP_MASK);
+    H[1] = GFMUL(H[0], H[0]);
+    H[2] = GFMUL(H[1], H[0]);
+    H[3] = GFMUL(H[2], H[0]);
+}
+
+// Absorb length bytes (zero padded to whole blocks) into the byte reflected state X
+inline __m128i GHASH_update(__m128i X, const __m128i H[4], const unsigned char *in,
+                            unsigned long length) {
+    const __m128i BSWAP_MASK = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    unsigned long i, blocks = length/16;
+    __m128i b0, b1, b2, b3, lo, hi;
+
+    for(i = 0; i + 4 <= blocks; i += 4) {
+        b0 = _mm_shuffle_epi8(_mm_loadu_si128(&((__m128i*)in)[i+0]), BSWAP_MASK);
+        b1 = _mm_shuffle_epi8(_mm_loadu_si128(&((__m128i*)in)[i+1]), BSWAP_MASK);
+        b2 = _mm_shuffle_epi8(_mm_loadu_si128(&((__m128i*)in)[i+2]), BSWAP_MASK);
+        b3 = _mm_shuffle_epi8(_mm_loadu_si128(&((__m128i*)in)[i+3]), BSWAP_MASK);
+        lo = hi = _mm_setzero_si128();
+        GFMUL_NOREDUCE(_mm_xor_si128(X, b0), H[3], &lo, &hi);
+        GFMUL_NOREDUCE(b1, H[2], &lo, &hi);
+        GFMUL_NOREDUCE(b2, H[1], &lo, &hi);
+        GFMUL_NOREDUCE(b3, H[0], &lo, &hi);
+        X = GFREDUCE(lo, hi);
+    }
+    for(; i < blocks; i++) {
+        b0 = _mm_shuffle_epi8(_mm_loadu_si128(&((__m128i*)in)[i]), BSWAP_MASK);
+        X = GFMUL(_mm_xor_si128(X, b0), H[0]);
+    }
+    if(length%16) {
+        unsigned char last[16] = {0};
+        memcpy(last, in + blocks*16, length%16);
+        b0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)last), BSWAP_MASK);
+        X = GFMUL(_mm_xor_si128(X, b0), H[0]);
+    }
+    return X;
+}
+
+// Tag = E(J0) ^ GHASH(A || C || len(A) || len(C)), returned in memory byte order
+inline __m128i GHASH_final(__m128i X, const __m128i H[4], unsigned long abytes,
+                           unsigned long cbytes, __m128i EJ0) {
+    const __m128i BSWAP_MASK = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    __m128i len = _mm_set_epi64x((long long)abytes*8, (long long)cbytes*8);
+    X = GFMUL(_mm_xor_si128(X, len), H[0]);
+    return _mm_xor_si128(_mm_shuffle_epi8(X, BSWAP_MASK), EJ0);
+}
+
+// CTR part of GCM, 32-bit big endian counter in the last 4 bytes of the block
+inline void GCM_CTR(const unsigned char *in, unsigned char *out, __m128i ctr_block,
+                    unsigned long length, const unsigned char *key, int number_of_rounds) {
+    const __m128i BSWAP_MASK = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    const __m128i ONE = _mm_set_epi32(0,0,0,1);
+    unsigned long i, blocks = length/16;
+    __m128i tmp;
+
+    ctr_block = _mm_shuffle_epi8(ctr_block, BSWAP_MASK);
+    for(i = 0; i < blocks; i++) {
+        ctr_block = _mm_add_epi32(ctr_block, ONE);
+        tmp = AES_encrypt_block(_mm_shuffle_epi8(ctr_block, BSWAP_MASK), key, number_of_rounds);
+        tmp = _mm_xor_si128(tmp, _mm_loadu_si128(&((__m128i*)in)[i]));
+        _mm_storeu_si128(&((__m128i*)out)[i], tmp);
+    }
+    if(length%16) {
+        unsigned char last[16];
+        ctr_block = _mm_add_epi32(ctr_block, ONE);
+        tmp = AES_encrypt_block(_mm_shuffle_epi8(ctr_block, BSWAP_MASK), key, number_of_rounds);
+        _mm_storeu_si128((__m128i*)last, tmp);
+        for(unsigned long j = 0; j < length%16; j++)
+            out[blocks*16+j] = in[blocks*16+j] ^ last[j];
+    }
+}
+
+// Counter mode part of GCM, GCM_CTR or a wider version of it
+typedef void (*GCM_CTR_fn)(const unsigned char *, unsigned char *, __m128i, unsigned long,
+                           const unsigned char *, int);
+
+// AES-GCM with a 96-bit IV (NIST SP 800-38D). The tag is written to tag[16].
+void AES_GCM_encrypt(const unsigned char *in,
+                     unsigned char *out,
+                     const unsigned char *addt,
+                     const unsigned char ivec[12],
+                     unsigned char tag[16],
+                     unsigned long length,
+                     unsigned long abytes,
+                     const unsigned char *key,
+                     int number_of_rounds,
+                     GCM_CTR_fn ctr = GCM_CTR) {
+    __m128i H[4], X, J0;
+    unsigned char j0[16] = {0};
+
+    memcpy(j0, ivec, 12);
+    j0[15] = 1;
+    J0 = _mm_loadu_si128((__m128i*)j0);
+
+    GHASH_init(key, number_of_rounds, H);
+    ctr(in, out, J0, length, key, number_of_rounds);
+
+    X = _mm_setzero_si128();
+    X = GHASH_update(X, H, addt, abytes);
+    X = GHASH_update(X, H, out, length);
+    X = GHASH_final(X, H, abytes, length, AES_encrypt_block(J0, key, number_of_rounds));
+    _mm_storeu_si128((__m128i*)tag, X);
+}
+
+// Returns 1 and the plaintext if the tag matches, 0 otherwise
+int AES_GCM_decrypt(const unsigned char *in,
+                    unsigned char *out,
+                    const unsigned char *addt,
+                    const unsigned char ivec[12],
+                    const unsigned char tag[16],
+                    unsigned long length,
+                    unsigned long abytes,
+                    const unsigned char *key,
+                    int number_of_rounds,
+                    GCM_CTR_fn ctr = GCM_CTR) {
+    __m128i H[4], X, J0;
+    unsigned char j0[16] = {0};
+
+    memcpy(j0, ivec, 12);
+    j0[15] = 1;
+    J0 = _mm_loadu_si128((__m128i*)j0);
+
+    GHASH_init(key, number_of_rounds, H);
+
+    X = _mm_setzero_si128();
+    X = GHASH_update(X, H, addt, abytes);
+    X = GHASH_update(X, H, in, length);
+    X = GHASH_final(X, H, abytes, length, AES_encrypt_block(J0, key, number_of_rounds));
+    X = _mm_xor_si128(X, _mm_loadu_si128((__m128i*)tag));
+    if (!_mm_testz_si128(X, X))
+        return 0;
+
+    ctr(in, out, J0, length, key, number_of_rounds);
+    return 1;
+}
+
+//---------------------------------------------------------------------------------------
+//  XTS
+//---------------------------
+// IEEE 1619 XTS-AES with the page number as data unit sequence number. key1 is the data
+// key schedule (decryption schedule for AES_XTS_decrypt), key2 the encryption schedule
+// of the tweak key. A partial last block uses ciphertext stealing, so length must be
+// at least 16.
+//---------------------------------------------------------------------------------------
+
+// Multiply the tweak by alpha in GF(2^128), little endian
+inline __m128i XTS_MUL_ALPHA(__m128i t) {
+    __m128i carry = _mm_srai_epi32(_mm_shuffle_epi32(t, 0x13), 31);
+    carry = _mm_and_si128(carry, _mm_set_epi32(0, 1, 0, 0x87));
+    return _mm_xor_si128(_mm_add_epi64(t, t), carry);
+}
+
+inline __m128i XTS_encrypt_block(__m128i block, __m128i tweak, const unsigned char *key, int number_of_rounds) {
+    return _mm_xor_si128(AES_encrypt_block(_mm_xor_si128(block, tweak), key, number_of_rounds), tweak);
+}
+
+inline __m128i XTS_decrypt_block(__m128i block, __m128i tweak, const unsigned char *key, int number_of_rounds) {
+    int j;
+    block = _mm_xor_si128(_mm_xor_si128(block, tweak), ((__m128i*)key)[0]);
+    for(j = 1; j < number_of_rounds; j++) {
+        block = _mm_aesdec_si128(block, ((__m128i*)key)[j]);
+    }
+    return _mm_xor_si128(_mm_aesdeclast_si128(block, ((__m128i*)key)[j]), tweak);
+}
+
+void AES_XTS_encrypt(const unsigned char *in,
+                     unsigned char *out,
+                     unsigned long length,
+                     unsigned long long page,
+                     const unsigned char *key1,
+                     const unsigned char *key2,
+                     int number_of_rounds) {
+    unsigned long i, blocks = length/16, tail = length%16;
+    unsigned char cc[16], pp[16];
+    __m128i tweak, tmp;
+
+    tweak = AES_encrypt_block(_mm_set_epi64x(0, (long long)page), key2, number_of_rounds);
+    for(i = 0; i < blocks; i++) {
+        tmp = XTS_encrypt_block(_mm_loadu_si128(&((__m128i*)in)[i]), tweak, key1, number_of_rounds);
+        _mm_storeu_si128(&((__m128i*)out)[i], tmp);
+        tweak = XTS_MUL_ALPHA(tweak);
+    }
+    if(tail && blocks) {
+        // Ciphertext stealing: the partial block borrows the end of the last
+        // full ciphertext block, which moves to the tail
+        _mm_storeu_si128((__m128i*)cc, _mm_loadu_si128(&((__m128i*)out)[blocks-1]));
+        memcpy(pp, in + blocks*16, tail);
+        memcpy(pp + tail, cc + tail, 16 - tail);
+        memcpy(out + blocks*16, cc, tail);
+        tmp = XTS_encrypt_block(_mm_loadu_si128((__m128i*)pp), tweak, key1, number_of_rounds);
+        _mm_storeu_si128(&((__m128i*)out)[blocks-1], tmp);
+    }
+}
+
+void AES_XTS_decrypt(const unsigned char *in,
+                     unsigned char *out,
+                     unsigned long length,
+                     unsigned long long page,
+                     const unsigned char *key1,
+                     const unsigned char *key2,
+                     int number_of_rounds) {
+    unsigned long i, blocks = length/16, tail = length%16;
+    unsigned char cc[16], pp[16];
+    __m128i tweak, tmp;
+
+    // With a partial tail the last full block was encrypted with the tweak after it
+    unsigned long full = (tail && blocks) ? blocks - 1 : blocks;
+
+    tweak = AES_encrypt_block(_mm_set_epi64x(0, (long long)page), key2, number_of_rounds);
+    for(i = 0; i < full; i++) {
+        tmp = XTS_decrypt_block(_mm_loadu_si128(&((__m128i*)in)[i]), tweak, key1, number_of_rounds);
+        _mm_storeu_si128(&((__m128i*)out)[i], tmp);
+        tweak = XTS_MUL_ALPHA(tweak);
+    }
+    if(full != blocks) {
+        tmp = XTS_decrypt_block(_mm_loadu_si128(&((__m128i*)in)[full]), XTS_MUL_ALPHA(tweak), key1, number_of_rounds);
+        _mm_storeu_si128((__m128i*)pp, tmp);
+        memcpy(cc, in + blocks*16, tail);
+        memcpy(cc + tail, pp + tail, 16 - tail);
+        memcpy(out + blocks*16, pp, tail);
+        tmp = XTS_decrypt_block(_mm_loadu_si128((__m128i*)cc), tweak, key1, number_of_rounds);
+        _mm_storeu_si128(&((__m128i*)out)[full], tmp);
+    }
+}
+
 #endif
\ No newline at end of file
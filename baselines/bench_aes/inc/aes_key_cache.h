@@ -0,0 +1,111 @@
+#ifndef AES_KEY_CACHE
+#define AES_KEY_CACHE
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include <atomic>
+
+#include "aes.h"
+
+// keys a cache holds, a power of two
+#ifndef AES_KEY_CACHE_SLOTS
+#define AES_KEY_CACHE_SLOTS 4096
+#endif
+
+// Expanded schedules of one key, room for the 15 round keys of AES-256
+struct aes_schedule_t {
+    alignas(16) unsigned char enc[16*15];
+    alignas(16) unsigned char dec[16*15];
+    alignas(16) unsigned char tweak[16*15];
+};
+
+// Key id -> expanded schedules, shared by all threads. A lookup is a few atomic loads on an
+// open addressing table, no lock. The first thread to miss a key claims its slot and expands
+// it, others asking for the same key meanwhile wait for it. Entries live as long as the
+// cache, an id must always name the same key.
+template <int KeyBits>
+class aes_key_cache {
+  public:
+    aes_key_cache() {
+        for (unsigned int s = 0; s < AES_KEY_CACHE_SLOTS; s++) {
+            slots[s].id.store(0, std::memory_order_relaxed);
+            slots[s].keys.store(NULL, std::memory_order_relaxed);
+        }
+    }
+    ~aes_key_cache() {
+        for (unsigned int s = 0; s < AES_KEY_CACHE_SLOTS; s++)
+            delete slots[s].keys.load();
+    }
+
+    // Schedules of key_id, expanded from key and tweak_key on its first lookup. NULL if the
+    // key is not cached and the cache is full.
+    const aes_schedule_t *get(uint32_t key_id, const unsigned char *key, const unsigned char *tweak_key);
+
+    // Expands key and tweak_key into a new schedule, for callers that do not cache it
+    static aes_schedule_t *expand(const unsigned char *key, const unsigned char *tweak_key);
+
+    // The cache of the process
+    static aes_key_cache &shared() {
+        static aes_key_cache cache;
+        return cache;
+    }
+
+  private:
+    static_assert((AES_KEY_CACHE_SLOTS & (AES_KEY_CACHE_SLOTS - 1)) == 0, "AES_KEY_CACHE_SLOTS must be a power of two");
+
+    struct slot_t {
+        std::atomic<uint64_t> id;     // key id + 1, 0 while the slot is free
+        std::atomic<aes_schedule_t *> keys;
+    };
+
+    aes_key_cache(const aes_key_cache &);
+    aes_key_cache &operator=(const aes_key_cache &);
+
+    slot_t slots[AES_KEY_CACHE_SLOTS];
+};
+
+template <int KeyBits>
+aes_schedule_t *aes_key_cache<KeyBits>::expand(const unsigned char *key, const unsigned char *tweak_key) {
+    aes_schedule_t *keys = new aes_schedule_t;
+    if (KeyBits == 128) {
+        AES_128_Key_Expansion(key, keys->enc);
+        AES_128_Key_Expansion(tweak_key, keys->tweak);
+    } else if (KeyBits == 192) {
+        AES_192_Key_Expansion(key, keys->enc);
+        AES_192_Key_Expansion(tweak_key, keys->tweak);
+    } else {
+        AES_256_Key_Expansion(key, keys->enc);
+        AES_256_Key_Expansion(tweak_key, keys->tweak);
+    }
+    AES_Decryption_Keys(keys->enc, keys->dec, KeyBits / 32 + 6);
+    return keys;
+}
+
+template <int KeyBits>
+const aes_schedule_t *aes_key_cache<KeyBits>::get(uint32_t key_id, const unsigned char *key, const unsigned char *tweak_key) {
+    uint64_t const tag = (uint64_t)key_id + 1;
+    unsigned int s = (key_id * 2654435761u) & (AES_KEY_CACHE_SLOTS - 1);
+
+    for (unsigned int n = 0; n < AES_KEY_CACHE_SLOTS; n++, s = (s + 1) & (AES_KEY_CACHE_SLOTS - 1)) {
+        uint64_t id = slots[s].id.load(std::memory_order_acquire);
+
+        if (id == 0) {
+            if (slots[s].id.compare_exchange_strong(id, tag, std::memory_order_acq_rel)) {
+                aes_schedule_t *keys = expand(key, tweak_key);
+                slots[s].keys.store(keys, std::memory_order_release);
+                return keys;
+            }
+            // another thread claimed the slot first, id is its key now
+        }
+        if (id == tag) {
+            aes_schedule_t *keys;
+            while ((keys = slots[s].keys.load(std::memory_order_acquire)) == NULL)
+                _mm_pause();
+            return keys;
+        }
+    }
+    return NULL;
+}
+
+#endif
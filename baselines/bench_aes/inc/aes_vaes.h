@@ -0,0 +1,361 @@
+#ifndef AES_VAES_H
+#define AES_VAES_H
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "aes.h"
+
+//---------------------------------------------------------------------------------------
+//  VAES
+//---------------------------
+// VAES runs aesenc/aesdec on every 128-bit lane of a 256-bit (AVX2) or 512-bit (AVX-512)
+// register, 2 or 4 blocks per instruction. The functions carry their own target
+// attributes and are only called after AES_impl_detect has found the CPU and OS support,
+// so the file builds without -mvaes and the binary still runs on AES-NI only CPUs. Four
+// registers are in flight, the blocks that do not fill them go through the AES-NI loops.
+// GCM only runs its counter blocks here, GHASH stays on the 128-bit PCLMULQDQ path.
+// The 512-bit broadcasts and lane extracts use the zero masked forms with all lanes set,
+// the plain forms start from an undefined register that GCC 12 warns about.
+//---------------------------------------------------------------------------------------
+
+#define AES_IMPL_AESNI   0
+#define AES_IMPL_VAES256 1
+#define AES_IMPL_VAES512 2
+
+#define AES_TARGET_VAES256 __attribute__((target("avx2,vaes")))
+#define AES_TARGET_VAES512 __attribute__((target("avx512f,avx512bw,vaes")))
+
+// Widest variant the CPU and the OS (saved register state) support
+inline int AES_impl_detect() {
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_OSXSAVE))
+        return AES_IMPL_AESNI;
+
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    bool os_avx    = (xcr0_lo & 0x06) == 0x06; // XMM, YMM
+    bool os_avx512 = (xcr0_lo & 0xE6) == 0xE6; // and opmask, ZMM 0-15, ZMM 16-31
+
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        return AES_IMPL_AESNI;
+    bool vaes     = c & (1u << 9);
+    bool avx2     = b & (1u << 5);
+    bool avx512f  = b & (1u << 16);
+    bool avx512bw = b & (1u << 30);
+
+    if (vaes && avx512f && avx512bw && os_avx512)
+        return AES_IMPL_VAES512;
+    if (vaes && avx2 && os_avx)
+        return AES_IMPL_VAES256;
+    return AES_IMPL_AESNI;
+}
+
+inline const char *AES_impl_name(int impl) {
+    switch (impl) {
+        case AES_IMPL_VAES256: return "vaes256";
+        case AES_IMPL_VAES512: return "vaes512";
+        default:               return "aesni";
+    }
+}
+
+//---------------------------------------------------------------------------------------
+//  256-bit
+//---------------------------------------------------------------------------------------
+
+AES_TARGET_VAES256
+inline void AES_LOAD_KEYS256(__m256i *rk, const unsigned char *key, int number_of_rounds) {
+    for(int j = 0; j <= number_of_rounds; j++)
+        rk[j] = _mm256_broadcastsi128_si256(_mm_loadu_si128(&((const __m128i*)key)[j]));
+}
+
+template <int N, bool DEC>
+AES_TARGET_VAES256
+inline void AES_CRYPT256_N(__m256i *b, const __m256i *rk, int number_of_rounds) {
+    int j, k;
+    AES_UNROLL
+    for(k = 0; k < N; k++)
+        b[k] = _mm256_xor_si256(b[k], rk[0]);
+    for(j = 1; j < number_of_rounds; j++) {
+        AES_UNROLL
+        for(k = 0; k < N; k++)
+            b[k] = DEC ? _mm256_aesdec_epi128(b[k], rk[j]) : _mm256_aesenc_epi128(b[k], rk[j]);
+    }
+    AES_UNROLL
+    for(k = 0; k < N; k++)
+        b[k] = DEC ? _mm256_aesdeclast_epi128(b[k], rk[j]) : _mm256_aesenclast_epi128(b[k], rk[j]);
+}
+
+template <bool DEC>
+AES_TARGET_VAES256
+void AES_ECB_vaes256(const unsigned char *in, unsigned char *out, unsigned long length,
+                     const unsigned char *key, int number_of_rounds) {
+    __m256i rk[15], b[4];
+    unsigned long i, blocks = (length + 15)/16;
+    int k;
+
+    AES_LOAD_KEYS256(rk, key, number_of_rounds);
+    for(i = 0; i + 8 <= blocks; i += 8) {
+        for(k = 0; k < 4; k++)
+            b[k] = _mm256_loadu_si256((const __m256i*)(in + 16*(i + 2*k)));
+        AES_CRYPT256_N<4, DEC>(b, rk, number_of_rounds);
+        for(k = 0; k < 4; k++)
+            _mm256_storeu_si256((__m256i*)(out + 16*(i + 2*k)), b[k]);
+    }
+    if(i < blocks) {
+        if(DEC) AES_ECB_decrypt_x<4>(in + 16*i, out + 16*i, (blocks - i)*16, key, number_of_rounds);
+        else    AES_ECB_encrypt_x<4>(in + 16*i, out + 16*i, (blocks - i)*16, key, number_of_rounds);
+    }
+}
+
+AES_TARGET_VAES256
+void AES_CBC_decrypt_vaes256(const unsigned char *in, unsigned char *out, unsigned char ivec[16],
+                             unsigned long length, const unsigned char *key, int number_of_rounds) {
+    __m256i rk[15], b[4], c[4];
+    __m128i feedback = _mm_loadu_si128((__m128i*)ivec);
+    unsigned long i, blocks = (length + 15)/16;
+    int k;
+
+    AES_LOAD_KEYS256(rk, key, number_of_rounds);
+    for(i = 0; i + 8 <= blocks; i += 8) {
+        for(k = 0; k < 4; k++)
+            b[k] = c[k] = _mm256_loadu_si256((const __m256i*)(in + 16*(i + 2*k)));
+        AES_CRYPT256_N<4, true>(b, rk, number_of_rounds);
+        // {previous block, first block} of every register
+        __m256i prev = _mm256_permute2x128_si256(_mm256_castsi128_si256(feedback), c[0], 0x20);
+        for(k = 0; k < 4; k++) {
+            _mm256_storeu_si256((__m256i*)(out + 16*(i + 2*k)), _mm256_xor_si256(b[k], prev));
+            if(k < 3)
+                prev = _mm256_permute2x128_si256(c[k], c[k+1], 0x21);
+        }
+        feedback = _mm256_extracti128_si256(c[3], 1);
+    }
+    if(i < blocks) {
+        unsigned char iv[16];
+        _mm_storeu_si128((__m128i*)iv, feedback);
+        AES_CBC_decrypt_x<4>(in + 16*i, out + 16*i, iv, (blocks - i)*16, key, number_of_rounds);
+    }
+}
+
+AES_TARGET_VAES256
+void AES_CTR_encrypt_vaes256(const unsigned char *in, unsigned char *out, const unsigned char ivec[8],
+                             const unsigned char nonce[4], unsigned long length,
+                             const unsigned char *key, int number_of_rounds) {
+    __m256i rk[15], b[4], ctr, TWO, BSWAP_EPI64;
+    __m128i rk128[15], t[1], ctr_block, ONE;
+    unsigned long i, blocks = (length + 15)/16;
+    int k;
+
+    AES_LOAD_KEYS256(rk, key, number_of_rounds);
+    ONE = _mm_set_epi32(0,1,0,0);
+    ctr_block = _mm_setzero_si128();
+    ctr_block = _mm_insert_epi64(ctr_block, *(long long*)ivec, 1);
+    ctr_block = _mm_insert_epi32(ctr_block, *(long*)nonce, 1);
+    ctr_block = _mm_srli_si128(ctr_block, 4);
+    ctr_block = _mm_shuffle_epi8(ctr_block, _mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8));
+    ctr_block = _mm_add_epi64(ctr_block, ONE);
+
+    // counters n, n+1 in the lanes of a register
+    TWO = _mm256_set_epi64x(2,0,2,0);
+    BSWAP_EPI64 = _mm256_broadcastsi128_si256(_mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8));
+    ctr = _mm256_add_epi64(_mm256_broadcastsi128_si256(ctr_block), _mm256_set_epi64x(1,0,0,0));
+    for(i = 0; i + 8 <= blocks; i += 8) {
+        for(k = 0; k < 4; k++) {
+            b[k] = _mm256_shuffle_epi8(ctr, BSWAP_EPI64);
+            ctr = _mm256_add_epi64(ctr, TWO);
+        }
+        AES_CRYPT256_N<4, false>(b, rk, number_of_rounds);
+        for(k = 0; k < 4; k++)
+            _mm256_storeu_si256((__m256i*)(out + 16*(i + 2*k)),
+                _mm256_xor_si256(b[k], _mm256_loadu_si256((const __m256i*)(in + 16*(i + 2*k)))));
+    }
+    ctr_block = _mm256_castsi256_si128(ctr);
+    AES_LOAD_KEYS(rk128, key, number_of_rounds);
+    for(; i < blocks; i++) {
+        t[0] = _mm_shuffle_epi8(ctr_block, _mm256_castsi256_si128(BSWAP_EPI64));
+        ctr_block = _mm_add_epi64(ctr_block, ONE);
+        AES_ENC_N<1>(t, rk128, number_of_rounds);
+        _mm_storeu_si128(&((__m128i*)out)[i], _mm_xor_si128(t[0], _mm_loadu_si128(&((__m128i*)in)[i])));
+    }
+}
+
+// Same as GCM_CTR
+AES_TARGET_VAES256
+void GCM_CTR_vaes256(const unsigned char *in, unsigned char *out, __m128i ctr_block,
+                     unsigned long length, const unsigned char *key, int number_of_rounds) {
+    const __m128i BSWAP_MASK = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    __m256i rk[15], b[4], ctr, TWO, BSWAP;
+    unsigned long i, blocks = length/16;
+    int k;
+
+    AES_LOAD_KEYS256(rk, key, number_of_rounds);
+    TWO = _mm256_set_epi32(0,0,0,2,0,0,0,2);
+    BSWAP = _mm256_broadcastsi128_si256(BSWAP_MASK);
+    ctr = _mm256_broadcastsi128_si256(_mm_shuffle_epi8(ctr_block, BSWAP_MASK));
+    ctr = _mm256_add_epi32(ctr, _mm256_set_epi32(0,0,0,2,0,0,0,1));
+    for(i = 0; i + 8 <= blocks; i += 8) {
+        for(k = 0; k < 4; k++) {
+            b[k] = _mm256_shuffle_epi8(ctr, BSWAP);
+            ctr = _mm256_add_epi32(ctr, TWO);
+        }
+        AES_CRYPT256_N<4, false>(b, rk, number_of_rounds);
+        for(k = 0; k < 4; k++)
+            _mm256_storeu_si256((__m256i*)(out + 16*(i + 2*k)),
+                _mm256_xor_si256(b[k], _mm256_loadu_si256((const __m256i*)(in + 16*(i + 2*k)))));
+    }
+    // the counter before the next block
+    ctr_block = _mm_sub_epi32(_mm256_castsi256_si128(ctr), _mm_set_epi32(0,0,0,1));
+    GCM_CTR(in + 16*i, out + 16*i, _mm_shuffle_epi8(ctr_block, BSWAP_MASK), length - 16*i, key, number_of_rounds);
+}
+
+//---------------------------------------------------------------------------------------
+//  512-bit
+//---------------------------------------------------------------------------------------
+
+AES_TARGET_VAES512
+inline void AES_LOAD_KEYS512(__m512i *rk, const unsigned char *key, int number_of_rounds) {
+    for(int j = 0; j <= number_of_rounds; j++)
+        rk[j] = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_loadu_si128(&((const __m128i*)key)[j]));
+}
+
+template <int N, bool DEC>
+AES_TARGET_VAES512
+inline void AES_CRYPT512_N(__m512i *b, const __m512i *rk, int number_of_rounds) {
+    int j, k;
+    AES_UNROLL
+    for(k = 0; k < N; k++)
+        b[k] = _mm512_xor_si512(b[k], rk[0]);
+    for(j = 1; j < number_of_rounds; j++) {
+        AES_UNROLL
+        for(k = 0; k < N; k++)
+            b[k] = DEC ? _mm512_aesdec_epi128(b[k], rk[j]) : _mm512_aesenc_epi128(b[k], rk[j]);
+    }
+    AES_UNROLL
+    for(k = 0; k < N; k++)
+        b[k] = DEC ? _mm512_aesdeclast_epi128(b[k], rk[j]) : _mm512_aesenclast_epi128(b[k], rk[j]);
+}
+
+template <bool DEC>
+AES_TARGET_VAES512
+void AES_ECB_vaes512(const unsigned char *in, unsigned char *out, unsigned long length,
+                     const unsigned char *key, int number_of_rounds) {
+    __m512i rk[15], b[4];
+    unsigned long i, blocks = (length + 15)/16;
+    int k;
+
+    AES_LOAD_KEYS512(rk, key, number_of_rounds);
+    for(i = 0; i + 16 <= blocks; i += 16) {
+        for(k = 0; k < 4; k++)
+            b[k] = _mm512_loadu_si512(in + 16*(i + 4*k));
+        AES_CRYPT512_N<4, DEC>(b, rk, number_of_rounds);
+        for(k = 0; k < 4; k++)
+            _mm512_storeu_si512(out + 16*(i + 4*k), b[k]);
+    }
+    if(i < blocks) {
+        if(DEC) AES_ECB_decrypt_x<8>(in + 16*i, out + 16*i, (blocks - i)*16, key, number_of_rounds);
+        else    AES_ECB_encrypt_x<8>(in + 16*i, out + 16*i, (blocks - i)*16, key, number_of_rounds);
+    }
+}
+
+AES_TARGET_VAES512
+void AES_CBC_decrypt_vaes512(const unsigned char *in, unsigned char *out, unsigned char ivec[16],
+                             unsigned long length, const unsigned char *key, int number_of_rounds) {
+    __m512i rk[15], b[4], c[4], prev;
+    __m128i feedback = _mm_loadu_si128((__m128i*)ivec);
+    unsigned long i, blocks = (length + 15)/16;
+    int k;
+
+    AES_LOAD_KEYS512(rk, key, number_of_rounds);
+    for(i = 0; i + 16 <= blocks; i += 16) {
+        for(k = 0; k < 4; k++)
+            b[k] = c[k] = _mm512_loadu_si512(in + 16*(i + 4*k));
+        AES_CRYPT512_N<4, true>(b, rk, number_of_rounds);
+        // the previous block of every lane: the last lane of the register before and
+        // the first three lanes of this one
+        prev = _mm512_maskz_alignr_epi64(0xFF, c[0], _mm512_maskz_broadcast_i32x4(0xFFFF, feedback), 6);
+        for(k = 0; k < 4; k++) {
+            _mm512_storeu_si512(out + 16*(i + 4*k), _mm512_xor_si512(b[k], prev));
+            if(k < 3)
+                prev = _mm512_maskz_alignr_epi64(0xFF, c[k+1], c[k], 6);
+        }
+        feedback = _mm512_maskz_extracti32x4_epi32(0xF, c[3], 3);
+    }
+    if(i < blocks) {
+        unsigned char iv[16];
+        _mm_storeu_si128((__m128i*)iv, feedback);
+        AES_CBC_decrypt_x<8>(in + 16*i, out + 16*i, iv, (blocks - i)*16, key, number_of_rounds);
+    }
+}
+
+AES_TARGET_VAES512
+void AES_CTR_encrypt_vaes512(const unsigned char *in, unsigned char *out, const unsigned char ivec[8],
+                             const unsigned char nonce[4], unsigned long length,
+                             const unsigned char *key, int number_of_rounds) {
+    __m512i rk[15], b[4], ctr, FOUR, BSWAP_EPI64;
+    __m128i rk128[15], t[1], ctr_block, ONE;
+    unsigned long i, blocks = (length + 15)/16;
+    int k;
+
+    AES_LOAD_KEYS512(rk, key, number_of_rounds);
+    ONE = _mm_set_epi32(0,1,0,0);
+    ctr_block = _mm_setzero_si128();
+    ctr_block = _mm_insert_epi64(ctr_block, *(long long*)ivec, 1);
+    ctr_block = _mm_insert_epi32(ctr_block, *(long*)nonce, 1);
+    ctr_block = _mm_srli_si128(ctr_block, 4);
+    ctr_block = _mm_shuffle_epi8(ctr_block, _mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8));
+    ctr_block = _mm_add_epi64(ctr_block, ONE);
+
+    // counters n .. n+3 in the lanes of a register
+    FOUR = _mm512_set_epi64(4,0,4,0,4,0,4,0);
+    BSWAP_EPI64 = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8));
+    ctr = _mm512_add_epi64(_mm512_maskz_broadcast_i32x4(0xFFFF, ctr_block), _mm512_set_epi64(3,0,2,0,1,0,0,0));
+    for(i = 0; i + 16 <= blocks; i += 16) {
+        for(k = 0; k < 4; k++) {
+            b[k] = _mm512_shuffle_epi8(ctr, BSWAP_EPI64);
+            ctr = _mm512_add_epi64(ctr, FOUR);
+        }
+        AES_CRYPT512_N<4, false>(b, rk, number_of_rounds);
+        for(k = 0; k < 4; k++)
+            _mm512_storeu_si512(out + 16*(i + 4*k),
+                _mm512_xor_si512(b[k], _mm512_loadu_si512(in + 16*(i + 4*k))));
+    }
+    ctr_block = _mm512_maskz_extracti32x4_epi32(0xF, ctr, 0);
+    AES_LOAD_KEYS(rk128, key, number_of_rounds);
+    for(; i < blocks; i++) {
+        t[0] = _mm_shuffle_epi8(ctr_block, _mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8));
+        ctr_block = _mm_add_epi64(ctr_block, ONE);
+        AES_ENC_N<1>(t, rk128, number_of_rounds);
+        _mm_storeu_si128(&((__m128i*)out)[i], _mm_xor_si128(t[0], _mm_loadu_si128(&((__m128i*)in)[i])));
+    }
+}
+
+// Same as GCM_CTR
+AES_TARGET_VAES512
+void GCM_CTR_vaes512(const unsigned char *in, unsigned char *out, __m128i ctr_block,
+                     unsigned long length, const unsigned char *key, int number_of_rounds) {
+    const __m128i BSWAP_MASK = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    __m512i rk[15], b[4], ctr, FOUR, BSWAP;
+    unsigned long i, blocks = length/16;
+    int k;
+
+    AES_LOAD_KEYS512(rk, key, number_of_rounds);
+    FOUR = _mm512_set_epi32(0,0,0,4,0,0,0,4,0,0,0,4,0,0,0,4);
+    BSWAP = _mm512_maskz_broadcast_i32x4(0xFFFF, BSWAP_MASK);
+    ctr = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_shuffle_epi8(ctr_block, BSWAP_MASK));
+    ctr = _mm512_add_epi32(ctr, _mm512_set_epi32(0,0,0,4,0,0,0,3,0,0,0,2,0,0,0,1));
+    for(i = 0; i + 16 <= blocks; i += 16) {
+        for(k = 0; k < 4; k++) {
+            b[k] = _mm512_shuffle_epi8(ctr, BSWAP);
+            ctr = _mm512_add_epi32(ctr, FOUR);
+        }
+        AES_CRYPT512_N<4, false>(b, rk, number_of_rounds);
+        for(k = 0; k < 4; k++)
+            _mm512_storeu_si512(out + 16*(i + 4*k),
+                _mm512_xor_si512(b[k], _mm512_loadu_si512(in + 16*(i + 4*k))));
+    }
+    // the counter before the next block
+    ctr_block = _mm_sub_epi32(_mm512_maskz_extracti32x4_epi32(0xF, ctr, 0), _mm_set_epi32(0,0,0,1));
+    GCM_CTR(in + 16*i, out + 16*i, _mm_shuffle_epi8(ctr_block, BSWAP_MASK), length - 16*i, key, number_of_rounds);
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef BENCH_HIST
+#define BENCH_HIST
+
+#include <math.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <vector>
+
+// exact below 2^BENCH_HIST_BITS, BENCH_HIST_HALF buckets per power of two above, so less than 1/64 off
+#define BENCH_HIST_BITS 7
+#define BENCH_HIST_HALF (1 << (BENCH_HIST_BITS - 1))
+#define BENCH_HIST_BUCKETS ((64 - BENCH_HIST_BITS + 1) * BENCH_HIST_HALF + BENCH_HIST_HALF)
+
+// steady_clock in ns, what the pool times its jobs with
+inline uint64_t bench_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Nearest rank percentile p (0-100) of sorted, any size, 0 if it is empty
+template <typename T>
+T bench_percentile(const std::vector<T> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t rank = (size_t)ceil(p / 100.0 * sorted.size());
+    if (rank < 1)
+        rank = 1;
+    if (rank > sorted.size())
+        rank = sorted.size();
+    return sorted[rank - 1];
+}
+
+// HDR style histogram of ns latencies: values below 2^BENCH_HIST_BITS are exact, above
+// each power of two is split in BENCH_HIST_HALF buckets. Recording is a few instructions,
+// so every worker records into its own histogram and they are merged after the run. The
+// counters are allocated on the first record, by the recording thread.
+class bench_hist {
+  public:
+    bench_hist() : n(0), max_ns(0) {}
+
+    void record(uint64_t ns, uint64_t times = 1);
+    void merge(const bench_hist &other);
+
+    uint64_t count() const { return n; }
+    uint64_t max() const { return max_ns; }
+    // Value at percentile p (0-100): the top of the bucket the rank falls in
+    uint64_t value_at(double p) const;
+
+  private:
+    static unsigned int bucket(uint64_t ns);
+    static uint64_t top(unsigned int b);
+
+    std::vector<uint64_t> counts;
+    uint64_t n;
+    uint64_t max_ns;
+};
+
+inline unsigned int bench_hist::bucket(uint64_t ns) {
+    if (ns < (1u << BENCH_HIST_BITS))
+        return ns;
+    unsigned int const shift = 63 - __builtin_clzll(ns) - BENCH_HIST_BITS + 1;
+    return shift * BENCH_HIST_HALF + (ns >> shift);
+}
+
+inline uint64_t bench_hist::top(unsigned int b) {
+    if (b < (1u << BENCH_HIST_BITS))
+        return b;
+    unsigned int const shift = b / BENCH_HIST_HALF - 1;
+    uint64_t const sub = b - shift * BENCH_HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+inline void bench_hist::record(uint64_t ns, uint64_t times) {
+    if (counts.empty())
+        counts.resize(BENCH_HIST_BUCKETS, 0);
+    counts[bucket(ns)] += times;
+    n += times;
+    if (ns > max_ns)
+        max_ns = ns;
+}
+
+inline void bench_hist::merge(const bench_hist &other) {
+    if (other.counts.empty())
+        return;
+    if (counts.empty())
+        counts.resize(BENCH_HIST_BUCKETS, 0);
+    for (unsigned int b = 0; b < BENCH_HIST_BUCKETS; b++)
+        counts[b] += other.counts[b];
+    n += other.n;
+    if (other.max_ns > max_ns)
+        max_ns = other.max_ns;
+}
+
+inline uint64_t bench_hist::value_at(double p) const {
+    if (n == 0)
+        return 0;
+    uint64_t rank = (uint64_t)ceil(p / 100.0 * n);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (unsigned int b = 0; b < BENCH_HIST_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen >= rank)
+            return (top(b) < max_ns) ? top(b) : max_ns;
+    }
+    return max_ns;
+}
+
+#endif
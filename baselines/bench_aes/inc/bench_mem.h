@@ -0,0 +1,83 @@
+#ifndef BENCH_MEM
+#define BENCH_MEM
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <string>
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+#define BENCH_HUGE_PAGE (2UL << 20)
+
+// How the buffers of a run start out
+#define BENCH_COLD 0 // the timed phases touch them first, page faults and growth included
+#define BENCH_WARM 1 // prefaulted, and output strings reserved, before the timed phases
+#define BENCH_BOTH 2 // a cold run, then a warm run on the same buffers
+
+inline const char *bench_prefault_name(int prefault) {
+    switch (prefault) {
+        case BENCH_COLD: return "cold";
+        case BENCH_BOTH: return "both";
+        default:         return "warm";
+    }
+}
+
+// Returns the setting called name, -1 if there is none
+inline int bench_prefault(const char *name) {
+    for (int p = BENCH_COLD; p <= BENCH_BOTH; p++)
+        if (strcmp(name, bench_prefault_name(p)) == 0)
+            return p;
+    return -1;
+}
+
+// Maps size bytes without touching them, so the worker that writes a page first decides its
+// NUMA node (MAP_POPULATE would fault everything on the calling thread's node). With huge,
+// the buffer is on 2 MB pages: from the hugetlbfs pool if it has enough, else transparent
+// huge pages on a 2 MB aligned range. Returns NULL on error.
+inline void *bench_alloc(size_t size, bool huge) {
+    if (!huge) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return (p == MAP_FAILED) ? NULL : p;
+    }
+
+    size_t const len = (size + BENCH_HUGE_PAGE - 1) & ~(BENCH_HUGE_PAGE - 1);
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (p != MAP_FAILED)
+        return p;
+
+    // one huge page more than needed, then the unaligned head and tail are dropped
+    char *raw = (char *)mmap(NULL, len + BENCH_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    char *aligned = (char *)(((uintptr_t)raw + BENCH_HUGE_PAGE - 1) & ~(BENCH_HUGE_PAGE - 1));
+    if (aligned > raw)
+        munmap(raw, aligned - raw);
+    munmap(aligned + len, raw + BENCH_HUGE_PAGE - aligned);
+    madvise(aligned, len, MADV_HUGEPAGE);
+    return aligned;
+}
+
+inline void bench_free(void *p, size_t size, bool huge) {
+    if (p != NULL)
+        munmap(p, huge ? (size + BENCH_HUGE_PAGE - 1) & ~(BENCH_HUGE_PAGE - 1) : size);
+}
+
+// Gives s room for size bytes and faults that room in, s stays empty
+inline void bench_reserve(std::string &s, size_t size) {
+    s.reserve(size);
+    s.resize(size);
+    s.clear();
+}
+
+// Frees the room of s, so the next appends grow it from scratch
+inline void bench_release(std::string &s) {
+    std::string().swap(s);
+}
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef BENCH_POOL
+#define BENCH_POOL
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <immintrin.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "bench_topology.h"
+
+// pause loops of a barrier wait before the thread sleeps on the futex
+#define BENCH_SPIN 4096
+
+// Barrier of n threads. Waiters spin for a while, then sleep on the generation word, so
+// an oversubscribed machine does not burn the cores the other threads need.
+class bench_barrier {
+  public:
+    explicit bench_barrier(int n) : n(n), count(0), generation(0), sleepers(0) {}
+    void wait();
+
+  private:
+    int const n;
+    std::atomic<int> count;
+    std::atomic<int> generation;
+    std::atomic<int> sleepers;
+};
+
+inline void bench_barrier::wait() {
+    int const gen = generation.load(std::memory_order_acquire);
+
+    if (count.fetch_add(1, std::memory_order_acq_rel) + 1 == n) {
+        count.store(0, std::memory_order_relaxed);
+        generation.fetch_add(1);
+        if (sleepers.load() > 0)
+            syscall(SYS_futex, (int*)&generation, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        return;
+    }
+
+    for (int spin = 0; generation.load(std::memory_order_acquire) == gen; spin++) {
+        if (spin < BENCH_SPIN) {
+            _mm_pause();
+            continue;
+        }
+        sleepers.fetch_add(1);
+        // returns at once if the generation moved on since the load above
+        syscall(SYS_futex, (int*)&generation, FUTEX_WAIT_PRIVATE, gen, NULL, NULL, 0);
+        sleepers.fetch_sub(1);
+    }
+}
+
+// Worker threads that live for the whole benchmark, worker i is pinned to cpus[i].
+// run() starts a job on all workers at once through a barrier, the workers time the job
+// themselves, so thread start up and joins stay out of the numbers. Buffers a worker
+// touches first in a job are placed on its NUMA node by the kernel.
+class bench_pool {
+  public:
+    explicit bench_pool(const std::vector<int> &cpus);
+    ~bench_pool();
+
+    // Runs job(i) on every worker i and returns when all are done
+    void run(const std::function<void(unsigned int)> &job);
+    // ns from the first worker starting the last job to the last worker finishing it
+    double elapsed_ns() const;
+    // the same over the given workers only
+    double elapsed_ns(const std::vector<unsigned int> &workers) const;
+    // ns worker i spent on the last job
+    double elapsed_ns(unsigned int i) const;
+
+  private:
+    typedef std::chrono::steady_clock clock;
+
+    void worker(unsigned int i);
+
+    unsigned int const n_threads;
+    std::vector<std::thread> threads;
+    bench_barrier start;
+    bench_barrier done;
+    const std::function<void(unsigned int)> *job;
+    bool stop;
+    std::vector<clock::time_point> t_start;
+    std::vector<clock::time_point> t_end;
+};
+
+inline bench_pool::bench_pool(const std::vector<int> &cpus)
+    : n_threads(cpus.size()), start(cpus.size() + 1), done(cpus.size() + 1), job(NULL), stop(false),
+      t_start(cpus.size()), t_end(cpus.size()) {
+
+    for (unsigned int i = 0; i < n_threads; i++) {
+        threads.emplace_back(&bench_pool::worker, this, i);
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i], &set);
+        pthread_setaffinity_np(threads.back().native_handle(), sizeof(set), &set);
+    }
+}
+
+inline bench_pool::~bench_pool() {
+    stop = true;
+    start.wait();
+    for (std::thread &t : threads)
+        t.join();
+}
+
+inline void bench_pool::run(const std::function<void(unsigned int)> &f) {
+    job = &f;
+    start.wait();
+    done.wait();
+    job = NULL;
+}
+
+inline void bench_pool::worker(unsigned int i) {
+    for (;;) {
+        start.wait();
+        if (stop)
+            return;
+        t_start[i] = clock::now();
+        (*job)(i);
+        t_end[i] = clock::now();
+        done.wait();
+    }
+}
+
+inline double bench_pool::elapsed_ns() const {
+    std::vector<unsigned int> all(n_threads);
+    for (unsigned int i = 0; i < n_threads; i++)
+        all[i] = i;
+    return elapsed_ns(all);
+}
+
+inline double bench_pool::elapsed_ns(const std::vector<unsigned int> &workers) const {
+    clock::time_point first = t_start[workers[0]], last = t_end[workers[0]];
+    for (unsigned int i : workers) {
+        if (t_start[i] < first) first = t_start[i];
+        if (t_end[i] > last)    last  = t_end[i];
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(last - first).count();
+}
+
+inline double bench_pool::elapsed_ns(unsigned int i) const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t_end[i] - t_start[i]).count();
+}
+
+// Throughput of the workers of every NUMA node, over all the phases added. A phase of a
+// node lasts from its first worker starting to its last one finishing.
+class bench_node_stats {
+  public:
+    bench_node_stats(const bench_topology &topo, const std::vector<int> &cpus);
+
+    // Adds the last job of pool, worker i moved bytes[i]
+    void add(const bench_pool &pool, const std::vector<double> &bytes);
+    // One line per node with workers: "<prefix> node <n>: <GB/s> GB/s (<threads> threads)"
+    void print(const char *prefix) const;
+
+  private:
+    std::vector<int> node;
+    std::vector<std::vector<unsigned int> > workers;
+    std::vector<double> bytes;
+    std::vector<double> ns;
+};
+
+inline bench_node_stats::bench_node_stats(const bench_topology &topo, const std::vector<int> &cpus)
+    : workers(topo.n_nodes()), bytes(topo.n_nodes(), 0), ns(topo.n_nodes(), 0) {
+    for (unsigned int i = 0; i < cpus.size(); i++) {
+        node.push_back(topo.node_of(cpus[i]));
+        workers[node.back()].push_back(i);
+    }
+}
+
+inline void bench_node_stats::add(const bench_pool &pool, const std::vector<double> &moved) {
+    for (unsigned int i = 0; i < node.size(); i++)
+        bytes[node[i]] += moved[i];
+    for (unsigned int n = 0; n < ns.size(); n++)
+        if (!workers[n].empty())
+            ns[n] += pool.elapsed_ns(workers[n]);
+}
+
+inline void bench_node_stats::print(const char *prefix) const {
+    for (unsigned int n = 0; n < ns.size(); n++)
+        if (ns[n] > 0)
+            std::cout << prefix << " node " << n << ": " << bytes[n] / ns[n] << " GB/s ("
+                      << workers[n].size() << " threads)" << std::endl;
+}
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef BENCH_TOPOLOGY
+#define BENCH_TOPOLOGY
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+// Thread placement policies
+#define PLACE_CORE    0 // one thread per physical core, node by node, then the siblings
+#define PLACE_COMPACT 1 // fill node by node, hyperthread siblings next to each other
+#define PLACE_SCATTER 2 // one thread per physical core, round robin over the nodes
+
+struct bench_cpu_t {
+    int cpu;
+    int core;       // core_id, unique within a package
+    int package;
+    int node;
+    int sibling;    // 0 for the first hyperthread of a core, 1 for the second ...
+    int core_rank;  // physical core index within the node
+};
+
+// CPUs this process may run on, with their core, package and NUMA node from sysfs. Without
+// sysfs every CPU is its own core on node 0.
+class bench_topology {
+  public:
+    bench_topology();
+
+    // CPU of each of n_threads workers, wraps around when there are more threads than CPUs
+    std::vector<int> place(unsigned int n_threads, int policy) const;
+    int node_of(int cpu) const;
+    unsigned int n_nodes() const { return nodes; }
+
+    std::vector<bench_cpu_t> cpus;
+
+  private:
+    static int read_int(const char *path, int fallback);
+    static void parse_cpulist(const char *list, std::vector<int> &out);
+
+    unsigned int nodes;
+};
+
+inline const char *bench_placement_name(int policy) {
+    switch (policy) {
+        case PLACE_COMPACT: return "compact";
+        case PLACE_SCATTER: return "scatter";
+        default:            return "core";
+    }
+}
+
+// Returns the policy called name, -1 if there is none
+inline int bench_placement(const char *name) {
+    for (int p = PLACE_CORE; p <= PLACE_SCATTER; p++)
+        if (strcmp(name, bench_placement_name(p)) == 0)
+            return p;
+    return -1;
+}
+
+inline int bench_topology::read_int(const char *path, int fallback) {
+    FILE *f = fopen(path, "r");
+    int v;
+    if (f == NULL)
+        return fallback;
+    if (fscanf(f, "%d", &v) != 1)
+        v = fallback;
+    fclose(f);
+    return v;
+}
+
+// "0-3,8,10-11"
+inline void bench_topology::parse_cpulist(const char *list, std::vector<int> &out) {
+    const char *p = list;
+    while (*p >= '0' && *p <= '9') {
+        char *end;
+        int lo = strtol(p, &end, 10), hi = lo;
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        for (int c = lo; c <= hi; c++)
+            out.push_back(c);
+        p = (*end == ',') ? end + 1 : end;
+    }
+}
+
+inline bench_topology::bench_topology() : nodes(1) {
+    char path[128];
+    cpu_set_t allowed;
+
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            CPU_SET(c, &allowed);
+
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, &allowed))
+            continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", c);
+        bench_cpu_t cpu;
+        cpu.cpu     = c;
+        cpu.core    = read_int(path, c);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", c);
+        cpu.package = read_int(path, 0);
+        cpu.node    = 0;
+        cpus.push_back(cpu);
+    }
+
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir != NULL) {
+        struct dirent *e;
+        while ((e = readdir(dir)) != NULL) {
+            int node;
+            if (sscanf(e->d_name, "node%d", &node) != 1)
+                continue;
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            FILE *f = fopen(path, "r");
+            char list[4096];
+            if (f == NULL)
+                continue;
+            if (fgets(list, sizeof(list), f) != NULL) {
+                std::vector<int> node_cpus;
+                parse_cpulist(list, node_cpus);
+                for (bench_cpu_t &cpu : cpus)
+                    if (std::find(node_cpus.begin(), node_cpus.end(), cpu.cpu) != node_cpus.end())
+                        cpu.node = node;
+            }
+            fclose(f);
+        }
+        closedir(dir);
+    }
+
+    // sibling index within the physical core, rank of the core within its node
+    std::sort(cpus.begin(), cpus.end(), [](const bench_cpu_t &a, const bench_cpu_t &b) {
+        if (a.node != b.node)       return a.node < b.node;
+        if (a.package != b.package) return a.package < b.package;
+        if (a.core != b.core)       return a.core < b.core;
+        return a.cpu < b.cpu;
+    });
+    int max_node = 0;
+    for (size_t i = 0; i < cpus.size(); i++) {
+        bool const same_core = i > 0 && cpus[i].node == cpus[i-1].node &&
+            cpus[i].package == cpus[i-1].package && cpus[i].core == cpus[i-1].core;
+        bool const same_node = i > 0 && cpus[i].node == cpus[i-1].node;
+        cpus[i].sibling   = same_core ? cpus[i-1].sibling + 1 : 0;
+        cpus[i].core_rank = !same_node ? 0 : same_core ? cpus[i-1].core_rank : cpus[i-1].core_rank + 1;
+        max_node = std::max(max_node, cpus[i].node);
+    }
+    nodes = max_node + 1;
+}
+
+inline std::vector<int> bench_topology::place(unsigned int n_threads, int policy) const {
+    std::vector<bench_cpu_t> order(cpus);
+
+    // cpus is sorted for PLACE_COMPACT already
+    if (policy == PLACE_CORE)
+        std::stable_sort(order.begin(), order.end(), [](const bench_cpu_t &a, const bench_cpu_t &b) {
+            return a.sibling < b.sibling;
+        });
+    else if (policy == PLACE_SCATTER)
+        std::stable_sort(order.begin(), order.end(), [](const bench_cpu_t &a, const bench_cpu_t &b) {
+            if (a.sibling != b.sibling)     return a.sibling < b.sibling;
+            if (a.core_rank != b.core_rank) return a.core_rank < b.core_rank;
+            return a.node < b.node;
+        });
+
+    std::vector<int> placed(n_threads);
+    for (unsigned int i = 0; i < n_threads; i++)
+        placed[i] = order[i % order.size()].cpu;
+    return placed;
+}
+
+inline int bench_topology::node_of(int cpu) const {
+    for (const bench_cpu_t &c : cpus)
+        if (c.cpu == cpu)
+            return c.node;
+    return 0;
+}
+
+#endif
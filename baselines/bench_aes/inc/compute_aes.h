@@ -1,53 +1,255 @@
 #ifndef COMPUTE_AES
 #define COMPUTE_AES
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
 #include "aes.h"
+#include "aes_key_cache.h"
+#include "aes_vaes.h"
+#include "bench_hist.h"
 
 #define MAX_NUM_THREADS 14
 
+// line of the page IV block, as in sw/inc/compNcrypt.h
+#ifndef AES_PRF_LINE
+#define AES_PRF_LINE 0xFFFFFFFF
+#endif
+
+// mode argument of aes_test and the pipeline benchmark
+enum aes_mode_t { MODE_CBC = 1, MODE_CTR, MODE_ECB, MODE_GCM, MODE_XTS };
+
+template <int KeyBits>
+struct aes_key_size {
+    static_assert(KeyBits == 128 || KeyBits == 192 || KeyBits == 256, "AES keys are 128, 192 or 256 bits");
+    static constexpr int rounds = KeyBits / 32 + 6;
+};
+
+// Mode and key size are template arguments, so the mode is picked once where the object
+// is made and the round count is a constant in the loops. The key schedules come from the
+// shared aes_key_cache, making an object per file or page costs a lookup.
+template <unsigned int Mode, int KeyBits = 256>
 class compute_aes {
+    static_assert(Mode >= MODE_CBC && Mode <= MODE_XTS, "Unknown AES mode");
+
   public:
+    static constexpr int rounds = aes_key_size<KeyBits>::rounds;
+
     unsigned char initKey[32];
-    unsigned char* KEYS_enc;
-    unsigned char* KEYS_dec;
-    unsigned char ivec[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
-    unsigned char ctr_ivec[8]  = {0, 1, 2, 3, 4, 5, 6, 7};
+    unsigned char tweakKey[32];
+    const unsigned char* KEYS_enc;
+    const unsigned char* KEYS_dec;
+    const unsigned char* KEYS_tweak;
+    // File salt. Page p gets the IV E_K({salt ^ p, 4 * AES_PRF_LINE}) of the FPGA: all of
+    // it for CBC, bytes 0..7 as the CTR IV and bytes 0..11 as the GCM IV.
+    uint64_t      salt         = 0;
+    // IVs of the last page encrypted or decrypted
+    unsigned char ivec[16];
+    unsigned char ctr_ivec[8];
     unsigned char ctr_nonce[4] = {0, 1, 2, 3};
+    unsigned char gcm_iv[12];
+    unsigned char gcm_tag[16];
+    unsigned int  auth_errors  = 0;
+    // ECB, CTR, CBC decryption and the GCM counter blocks run on VAES (AES_IMPL_*), or
+    // on AES-NI with 1, 4 or 8 blocks in flight
+    int           impl         = AES_IMPL_AESNI;
+    unsigned int  interleave   = 8;
 
+    // Key id 0 is the benchmark key, bytes 0..31 with tweak key 32..63
     compute_aes(){
 
         for (unsigned int i = 0; i < 32; i++) {
-            initKey[i] = (unsigned char)i;
+            initKey[i]  = (unsigned char)i;
+            tweakKey[i] = (unsigned char)(i+32);
         }
-        KEYS_enc = (unsigned char*)malloc(16*15);
-        KEYS_dec = (unsigned char*)malloc(16*15);
-        AES_256_Key_Expansion(initKey, KEYS_enc);
-        AES_256_Decryption_Keys(KEYS_enc, KEYS_dec);
+        set_key(0);
+    }
+
+    // Encrypts with the key key_id, key and tweak_key (KeyBits/8 bytes each) are only read
+    // the first time the process uses key_id
+    compute_aes(uint32_t key_id, const unsigned char* key, const unsigned char* tweak_key){
+
+        memcpy(initKey, key, KeyBits/8);
+        memcpy(tweakKey, tweak_key, KeyBits/8);
+        set_key(key_id);
     }
 
     ~compute_aes(){
-        free(KEYS_enc);
-        free(KEYS_dec); 
+        delete own_keys;
     }
     
-    void encrypt_file(unsigned char* originalValues, unsigned int inNumWords, unsigned char* encryptedValues, unsigned int mode);
-    void decrypt_file(unsigned char* encryptedValues, unsigned int inNumWords, unsigned char* decryptedValues, unsigned int mode);
+    // page is the data unit number, the XTS tweak and the input of the page IV
+    void encrypt_file(unsigned char* originalValues, unsigned int inNumWords, unsigned char* encryptedValues, unsigned long long page = 0);
+    void decrypt_file(unsigned char* encryptedValues, unsigned int inNumWords, unsigned char* decryptedValues, unsigned long long page = 0);
+    // Encrypts n_pages independent pages, page p as page first_page + p. CBC
+    // pages are encrypted side by side on interleave lanes, the other modes page by page.
+    // GCM keeps the tag of every page in page_tags for decrypt_pages. With lat, the time
+    // of every page goes into it: its own time when the pages run one after another, the
+    // time of the whole call for the side by side CBC pages, which all finish together.
+    void encrypt_pages(unsigned char* const* originalValues, const unsigned int* inNumWords, unsigned char* const* encryptedValues, unsigned int n_pages, unsigned long long first_page = 0, bench_hist* lat = NULL);
+    void decrypt_pages(unsigned char* const* encryptedValues, const unsigned int* inNumWords, unsigned char* const* decryptedValues, unsigned int n_pages, unsigned long long first_page = 0, bench_hist* lat = NULL);
+    std::vector<unsigned char> page_tags;
+
+  private:
+    compute_aes(const compute_aes&);
+    compute_aes& operator=(const compute_aes&);
+
+    void set_key(uint32_t key_id);
+    // IV of page into iv, and into the IV of the mode
+    void page_iv(unsigned long long page, unsigned char* iv);
+    void set_page(unsigned long long page);
+
+    // schedules of a key that did not fit in the cache
+    aes_schedule_t* own_keys = NULL;
+
+    void ctr(unsigned char* in, unsigned char* out, uint32_t length);
+    void ecb_encrypt(unsigned char* in, unsigned char* out, uint32_t length);
+    void ecb_decrypt(unsigned char* in, unsigned char* out, uint32_t length);
+    void cbc_decrypt(unsigned char* in, unsigned char* out, uint32_t length);
+    GCM_CTR_fn gcm_ctr();
 };
 
-void compute_aes::encrypt_file(unsigned char* originalValues, uint32_t inNumWords, unsigned char* encryptedValues, unsigned int mode) {    
-    switch(mode){
-        case 1: AES_CBC_encrypt(originalValues, encryptedValues, ivec, (uint32_t) inNumWords, KEYS_enc, 14);
-        case 2: AES_CTR_encrypt(originalValues, encryptedValues, ctr_ivec, ctr_nonce, (uint32_t) inNumWords, KEYS_enc, 14);
-        case 3: AES_ECB_encrypt(originalValues, encryptedValues, (uint32_t) inNumWords, KEYS_enc, 14);
+template <unsigned int Mode, int KeyBits>
+void compute_aes<Mode, KeyBits>::set_key(uint32_t key_id) {
+    const aes_schedule_t* keys = aes_key_cache<KeyBits>::shared().get(key_id, initKey, tweakKey);
+    if (keys == NULL)
+        keys = own_keys = aes_key_cache<KeyBits>::expand(initKey, tweakKey);
+    KEYS_enc   = keys->enc;
+    KEYS_dec   = keys->dec;
+    KEYS_tweak = keys->tweak;
+}
+
+template <unsigned int Mode, int KeyBits>
+void compute_aes<Mode, KeyBits>::page_iv(unsigned long long page, unsigned char* iv) {
+    __m128i x = _mm_set_epi64x(salt ^ page, 4 * (uint64_t)AES_PRF_LINE);
+    _mm_storeu_si128((__m128i*)iv, AES_encrypt_block(x, KEYS_enc, rounds));
+}
+
+template <unsigned int Mode, int KeyBits>
+void compute_aes<Mode, KeyBits>::set_page(unsigned long long page) {
+    switch(Mode){
+        case MODE_CBC: page_iv(page, ivec); break;
+        case MODE_CTR: { unsigned char iv[16]; page_iv(page, iv); memcpy(ctr_ivec, iv, 8); break; }
+        case MODE_GCM: { unsigned char iv[16]; page_iv(page, iv); memcpy(gcm_iv, iv, 12); break; }
+        default: break;
+    }
+}
+
+template <unsigned int Mode, int KeyBits>
+void compute_aes<Mode, KeyBits>::encrypt_file(unsigned char* originalValues, uint32_t inNumWords, unsigned char* encryptedValues, unsigned long long page) {
+    set_page(page);
+    switch(Mode){
+        case MODE_CBC: AES_CBC_encrypt(originalValues, encryptedValues, ivec, (uint32_t) inNumWords, KEYS_enc, rounds); break;
+        case MODE_CTR: ctr(originalValues, encryptedValues, inNumWords); break;
+        case MODE_ECB: ecb_encrypt(originalValues, encryptedValues, inNumWords); break;
+        case MODE_GCM: AES_GCM_encrypt(originalValues, encryptedValues, NULL, gcm_iv, gcm_tag, (uint32_t) inNumWords, 0, KEYS_enc, rounds, gcm_ctr()); break;
+        case MODE_XTS: AES_XTS_encrypt(originalValues, encryptedValues, (uint32_t) inNumWords, page, KEYS_enc, KEYS_tweak, rounds); break;
     } 
 }
 
-void compute_aes::decrypt_file(unsigned char* encryptedValues, uint32_t inNumWords, unsigned char* decryptedValues, unsigned int mode) {    
-    switch(mode){
-        case 1: AES_CBC_decrypt(encryptedValues, decryptedValues, ivec, (uint32_t) inNumWords, KEYS_dec, 14);
-        case 2: AES_CTR_encrypt(encryptedValues, decryptedValues, ctr_ivec, ctr_nonce, (uint32_t) inNumWords, KEYS_enc, 14);
-        case 3: AES_ECB_decrypt(encryptedValues, decryptedValues, (uint32_t) inNumWords, KEYS_dec, 14);
+template <unsigned int Mode, int KeyBits>
+void compute_aes<Mode, KeyBits>::decrypt_file(unsigned char* encryptedValues, uint32_t inNumWords, unsigned char* decryptedValues, unsigned long long page) {
+    set_page(page);
+    switch(Mode){
+        case MODE_CBC: cbc_decrypt(encryptedValues, decryptedValues, inNumWords); break;
+        case MODE_CTR: ctr(encryptedValues, decryptedValues, inNumWords); break;
+        case MODE_ECB: ecb_decrypt(encryptedValues, decryptedValues, inNumWords); break;
+        case MODE_GCM:
+            if (!AES_GCM_decrypt(encryptedValues, decryptedValues, NULL, gcm_iv, gcm_tag, (uint32_t) inNumWords, 0, KEYS_enc, rounds, gcm_ctr()))
+                auth_errors++;
+            break;
+        case MODE_XTS: AES_XTS_decrypt(encryptedValues, decryptedValues, (uint32_t) inNumWords, page, KEYS_dec, KEYS_tweak, rounds); break;
+    }
+}
+
+template <unsigned int Mode, int KeyBits>
+void compute_aes<Mode, KeyBits>::encrypt_pages(unsigned char* const* originalValues, const unsigned int* inNumWords, unsigned char* const* encryptedValues, unsigned int n_pages, unsigned long long first_page, bench_hist* lat) {
+    uint64_t t0 = lat ? bench_now_ns() : 0;
+    if (Mode == MODE_CBC && interleave > 1 && n_pages > 1) {
+        std::vector<unsigned char> ivs(16 * n_pages);
+        std::vector<const unsigned char*> ivecs(n_pages);
+        for (unsigned int p = 0; p < n_pages; p++) {
+            page_iv(first_page + p, &ivs[16 * p]);
+            ivecs[p] = &ivs[16 * p];
+        }
+        std::vector<unsigned long> lengths(inNumWords, inNumWords + n_pages);
+        if (interleave == 8) AES_CBC_encrypt_mb<8>(originalValues, encryptedValues, ivecs.data(), lengths.data(), n_pages, KEYS_enc, rounds);
+        else                 AES_CBC_encrypt_mb<4>(originalValues, encryptedValues, ivecs.data(), lengths.data(), n_pages, KEYS_enc, rounds);
+        if (lat)
+            lat->record(bench_now_ns() - t0, n_pages);
+        return;
+    }
+    if (Mode == MODE_GCM)
+        page_tags.resize(16 * n_pages);
+    for (unsigned int p = 0; p < n_pages; p++) {
+        encrypt_file(originalValues[p], inNumWords[p], encryptedValues[p], first_page + p);
+        if (Mode == MODE_GCM)
+            memcpy(&page_tags[16 * p], gcm_tag, 16);
+        if (lat) {
+            uint64_t const t1 = bench_now_ns();
+            lat->record(t1 - t0);
+            t0 = t1;
+        }
+    }
+}
+
+template <unsigned int Mode, int KeyBits>
+void compute_aes<Mode, KeyBits>::decrypt_pages(unsigned char* const* encryptedValues, const unsigned int* inNumWords, unsigned char* const* decryptedValues, unsigned int n_pages, unsigned long long first_page, bench_hist* lat) {
+    uint64_t t0 = lat ? bench_now_ns() : 0;
+    for (unsigned int p = 0; p < n_pages; p++) {
+        if (Mode == MODE_GCM)
+            memcpy(gcm_tag, &page_tags[16 * p], 16);
+        decrypt_file(encryptedValues[p], inNumWords[p], decryptedValues[p], first_page + p);
+        if (lat) {
+            uint64_t const t1 = bench_now_ns();
+            lat->record(t1 - t0);
+            t0 = t1;
+        }
     }
 }
 
+template <unsigned int Mode, int KeyBits>
+void compute_aes<Mode, KeyBits>::ctr(unsigned char* in, unsigned char* out, uint32_t length) {
+    if (impl == AES_IMPL_VAES512)      AES_CTR_encrypt_vaes512(in, out, ctr_ivec, ctr_nonce, length, KEYS_enc, rounds);
+    else if (impl == AES_IMPL_VAES256) AES_CTR_encrypt_vaes256(in, out, ctr_ivec, ctr_nonce, length, KEYS_enc, rounds);
+    else if (interleave == 8)          AES_CTR_encrypt_x<8>(in, out, ctr_ivec, ctr_nonce, length, KEYS_enc, rounds);
+    else if (interleave == 4)          AES_CTR_encrypt_x<4>(in, out, ctr_ivec, ctr_nonce, length, KEYS_enc, rounds);
+    else                               AES_CTR_encrypt(in, out, ctr_ivec, ctr_nonce, length, KEYS_enc, rounds);
+}
+
+template <unsigned int Mode, int KeyBits>
+void compute_aes<Mode, KeyBits>::ecb_encrypt(unsigned char* in, unsigned char* out, uint32_t length) {
+    if (impl == AES_IMPL_VAES512)      AES_ECB_vaes512<false>(in, out, length, KEYS_enc, rounds);
+    else if (impl == AES_IMPL_VAES256) AES_ECB_vaes256<false>(in, out, length, KEYS_enc, rounds);
+    else if (interleave == 8)          AES_ECB_encrypt_x<8>(in, out, length, KEYS_enc, rounds);
+    else if (interleave == 4)          AES_ECB_encrypt_x<4>(in, out, length, KEYS_enc, rounds);
+    else                               AES_ECB_encrypt(in, out, length, KEYS_enc, rounds);
+}
+
+template <unsigned int Mode, int KeyBits>
+void compute_aes<Mode, KeyBits>::ecb_decrypt(unsigned char* in, unsigned char* out, uint32_t length) {
+    if (impl == AES_IMPL_VAES512)      AES_ECB_vaes512<true>(in, out, length, KEYS_dec, rounds);
+    else if (impl == AES_IMPL_VAES256) AES_ECB_vaes256<true>(in, out, length, KEYS_dec, rounds);
+    else if (interleave == 8)          AES_ECB_decrypt_x<8>(in, out, length, KEYS_dec, rounds);
+    else if (interleave == 4)          AES_ECB_decrypt_x<4>(in, out, length, KEYS_dec, rounds);
+    else                               AES_ECB_decrypt(in, out, length, KEYS_dec, rounds);
+}
+
+template <unsigned int Mode, int KeyBits>
+void compute_aes<Mode, KeyBits>::cbc_decrypt(unsigned char* in, unsigned char* out, uint32_t length) {
+    if (impl == AES_IMPL_VAES512)      AES_CBC_decrypt_vaes512(in, out, ivec, length, KEYS_dec, rounds);
+    else if (impl == AES_IMPL_VAES256) AES_CBC_decrypt_vaes256(in, out, ivec, length, KEYS_dec, rounds);
+    else if (interleave == 8)          AES_CBC_decrypt_x<8>(in, out, ivec, length, KEYS_dec, rounds);
+    else if (interleave == 4)          AES_CBC_decrypt_x<4>(in, out, ivec, length, KEYS_dec, rounds);
+    else                               AES_CBC_decrypt(in, out, ivec, length, KEYS_dec, rounds);
+}
+
+template <unsigned int Mode, int KeyBits>
+GCM_CTR_fn compute_aes<Mode, KeyBits>::gcm_ctr() {
+    if (impl == AES_IMPL_VAES512) return GCM_CTR_vaes512;
+    if (impl == AES_IMPL_VAES256) return GCM_CTR_vaes256;
+    return GCM_CTR;
+}
+
 #endif
@@ -30,8 +30,13 @@
 #include <algorithm>
 #include <atomic>
 #include <thread>
+#include <memory>
 
 #include "compute_aes.h"
+#include "bench_hist.h"
+#include "bench_mem.h"
+#include "bench_pool.h"
+#include "bench_topology.h"
 
 #define xstr(s) str(s)
 #define str(s) #s
@@ -53,6 +58,218 @@ unsigned long get_filesize(FILE *f)
     return size;
 }
 
+// Buffers, settings and results of one aes_test run
+struct aes_run_t {
+  const unsigned char *file;
+  size_t file_size;
+  unsigned char *input;
+  unsigned char *output_enc;
+  unsigned char *output_dec;
+  size_t page_size;
+  unsigned pages;
+  unsigned num_threads;
+  unsigned repeat;
+  unsigned interleave;
+  int impl;
+  const bench_topology *topo;
+  std::vector<int> cpus;
+  bool warm;
+  bool latency;
+  std::vector<float> th_encrypt;
+  std::vector<float> th_decrypt;
+  bench_hist lat_encrypt;
+  bench_hist lat_decrypt;
+};
+
+// Encrypts and decrypts run.repeat times, the throughput of each repeat goes to
+// run.th_encrypt and run.th_decrypt. With run.latency every page is also timed into
+// run.lat_encrypt and run.lat_decrypt (see compute_aes::encrypt_pages). Returns the GCM
+// pages that failed authentication.
+template <unsigned int Mode, int KeyBits>
+unsigned int run_aes(aes_run_t &run)
+{
+  unsigned char *const input      = run.input;
+  unsigned char *const output_enc = run.output_enc;
+  unsigned char *const output_dec = run.output_dec;
+  size_t const page_size   = run.page_size;
+  unsigned const pages       = run.pages;
+  unsigned const num_threads = run.num_threads;
+  unsigned const repeat      = run.repeat;
+  size_t const chunk = page_size * pages;
+
+  std::vector<float> &th_encrypt = run.th_encrypt;
+  std::vector<float> &th_decrypt = run.th_decrypt;
+
+  bench_pool pool(run.cpus);
+  bench_node_stats enc_nodes(*run.topo, run.cpus), dec_nodes(*run.topo, run.cpus);
+  std::vector<double> const moved(num_threads, chunk);
+  std::vector<bench_hist> lat_encrypt(num_threads), lat_decrypt(num_threads);
+
+  // Thread i owns the slice i of every repeat. Its worker makes its compute_aes and writes
+  // the slices first, so the kernel places them on the node of the worker. Cold runs leave
+  // the outputs to the timed phases.
+  std::vector<std::unique_ptr<compute_aes<Mode, KeyBits> > > aes_app(num_threads);
+  pool.run([&](unsigned int i){
+    aes_app[i].reset(new compute_aes<Mode, KeyBits>());
+    aes_app[i]->interleave = run.interleave;
+    aes_app[i]->impl       = run.impl;
+
+    for(unsigned int r=0; r<repeat; r++){
+      size_t const o = (r*num_threads+i)*chunk;
+      for(size_t b=0; b<chunk; ){
+        size_t const at = (o+b) % run.file_size;
+        size_t const n  = std::min(chunk-b, run.file_size-at);
+        memcpy(input+o+b, run.file+at, n);
+        b += n;
+      }
+      if(run.warm){
+        memset(output_enc+o, 0, chunk);
+        memset(output_dec+o, 0, chunk);
+      }
+    }
+  });
+  
+  size_t ofs = 0;
+
+  std::vector<unsigned char *> enc_in(num_threads*pages), enc_out(num_threads*pages), dec_out(num_threads*pages);
+  std::vector<unsigned int> page_sizes(pages, page_size);
+
+  for(unsigned int r=0; r<repeat; r++) {
+  
+    // the pages of this repeat, thread i gets pages i*pages ...
+    for(unsigned int p=0; p<num_threads*pages; p++){
+      enc_in[p]  = input+ofs+p*page_size;
+      enc_out[p] = output_enc+ofs+p*page_size;
+      dec_out[p] = output_dec+ofs+p*page_size;
+    }
+    unsigned long long const first_page = (unsigned long long)r*num_threads*pages;
+
+    pool.run([&](unsigned int i){
+      aes_app[i]->encrypt_pages(&enc_in[i*pages], &page_sizes[0], &enc_out[i*pages], pages, first_page+i*pages,
+                                run.latency ? &lat_encrypt[i] : NULL);
+    });
+    float const d0 = pool.elapsed_ns();
+    enc_nodes.add(pool, moved);
+
+    pool.run([&](unsigned int i){
+      aes_app[i]->decrypt_pages(&enc_out[i*pages], &page_sizes[0], &dec_out[i*pages], pages, first_page+i*pages,
+                                run.latency ? &lat_decrypt[i] : NULL);
+    });
+    float const d1 = pool.elapsed_ns();
+    dec_nodes.add(pool, moved);
+
+    ofs += num_threads * chunk;
+
+    th_encrypt.push_back((double)(num_threads*chunk)/d0);
+    th_decrypt.push_back((double)(num_threads*chunk)/d1);
+  }
+
+  enc_nodes.print("Encrypt");
+  dec_nodes.print("Decrypt");
+
+  for(unsigned int i=0; i<num_threads; i++){
+    run.lat_encrypt.merge(lat_encrypt[i]);
+    run.lat_decrypt.merge(lat_decrypt[i]);
+  }
+
+  unsigned int auth_errors = 0;
+  for(unsigned int i=0; i<num_threads; i++)
+    auth_errors += aes_app[i]->auth_errors;
+
+  return auth_errors;
+}
+
+typedef unsigned int (*run_aes_fn)(aes_run_t &);
+
+template <unsigned int Mode>
+run_aes_fn run_aes_fn_for_key(unsigned key_bits)
+{
+  if (key_bits == 128) return run_aes<Mode, 128>;
+  if (key_bits == 192) return run_aes<Mode, 192>;
+  return run_aes<Mode, 256>;
+}
+
+// The mode and key size are picked here, once, the repeat loop runs on the instance
+run_aes_fn run_aes_fn_for(unsigned int mode, unsigned key_bits)
+{
+  switch(mode){
+    case MODE_CBC: return run_aes_fn_for_key<MODE_CBC>(key_bits);
+    case MODE_CTR: return run_aes_fn_for_key<MODE_CTR>(key_bits);
+    case MODE_ECB: return run_aes_fn_for_key<MODE_ECB>(key_bits);
+    case MODE_GCM: return run_aes_fn_for_key<MODE_GCM>(key_bits);
+    default:       return run_aes_fn_for_key<MODE_XTS>(key_bits);
+  }
+}
+
+// One encrypt_file call has to give exactly what a single call of the plain AES-NI
+// routine of its mode gives, with the IV of the page derived here. A mode that runs a
+// second mode over the buffer, or a variant that differs from the plain loop, fails.
+// Returns 0 if ciphertext and GCM tag match.
+template <unsigned int Mode, int KeyBits>
+int check_single_pass(const unsigned char *in, unsigned int length, int impl, unsigned interleave)
+{
+  static const int rounds = aes_key_size<KeyBits>::rounds;
+  unsigned long long const page = 5;
+
+  compute_aes<Mode, KeyBits> aes;
+  aes.impl = impl;
+  aes.interleave = interleave;
+  aes.salt = 0x0123456789abcdefULL;
+  std::vector<unsigned char> out(length), ref(length);
+  aes.encrypt_file((unsigned char *)in, length, out.data(), page);
+
+  std::unique_ptr<aes_schedule_t> keys(aes_key_cache<KeyBits>::expand(aes.initKey, aes.tweakKey));
+  unsigned char iv[16], tag[16];
+  _mm_storeu_si128((__m128i*)iv, AES_encrypt_block(_mm_set_epi64x(aes.salt ^ page,
+    4 * (uint64_t)AES_PRF_LINE), keys->enc, rounds));
+  switch(Mode){
+    case MODE_CBC: AES_CBC_encrypt(in, ref.data(), iv, length, keys->enc, rounds); break;
+    case MODE_CTR: AES_CTR_encrypt(in, ref.data(), iv, aes.ctr_nonce, length, keys->enc, rounds); break;
+    case MODE_ECB: AES_ECB_encrypt(in, ref.data(), length, keys->enc, rounds); break;
+    case MODE_GCM: AES_GCM_encrypt(in, ref.data(), NULL, iv, tag, length, 0, keys->enc, rounds); break;
+    case MODE_XTS: AES_XTS_encrypt(in, ref.data(), length, page, keys->enc, keys->tweak, rounds); break;
+  }
+
+  if (Mode == MODE_GCM && memcmp(tag, aes.gcm_tag, 16) != 0)
+    return 1;
+  return memcmp(out.data(), ref.data(), length) != 0;
+}
+
+template <unsigned int Mode>
+int check_single_pass_keys(const unsigned char *in, unsigned int length, int impl, unsigned interleave)
+{
+  int errors = 0;
+  if (check_single_pass<Mode, 128>(in, length, impl, interleave)) {
+    std::cerr << "Mode " << Mode << ", 128-bit key: encrypt_file differs from the reference" << std::endl;
+    errors++;
+  }
+  if (check_single_pass<Mode, 192>(in, length, impl, interleave)) {
+    std::cerr << "Mode " << Mode << ", 192-bit key: encrypt_file differs from the reference" << std::endl;
+    errors++;
+  }
+  if (check_single_pass<Mode, 256>(in, length, impl, interleave)) {
+    std::cerr << "Mode " << Mode << ", 256-bit key: encrypt_file differs from the reference" << std::endl;
+    errors++;
+  }
+  return errors;
+}
+
+// Every mode and key size with the variant of this run, 65 blocks so the interleaved
+// and VAES loops also run their tails
+int check_single_pass_all(int impl, unsigned interleave)
+{
+  unsigned int const length = 65 * 16;
+  std::vector<unsigned char> in(length);
+  for (unsigned int i = 0; i < length; i++)
+    in[i] = (unsigned char)rand();
+
+  return check_single_pass_keys<MODE_CBC>(in.data(), length, impl, interleave) +
+         check_single_pass_keys<MODE_CTR>(in.data(), length, impl, interleave) +
+         check_single_pass_keys<MODE_ECB>(in.data(), length, impl, interleave) +
+         check_single_pass_keys<MODE_GCM>(in.data(), length, impl, interleave) +
+         check_single_pass_keys<MODE_XTS>(in.data(), length, impl, interleave);
+}
+
 //---------------------------------------------------------------------------------------
 //  MAIN FUNCTION
 //---------------------------------------------------------------------------------------
@@ -62,9 +279,9 @@ int main(int argc, char **argv)
   FILE *f, *g, *h;
   srand(time(NULL));
 
-  if (argc < 5) {
-    std::cerr << argv[0] << " <file> <page_size> <mode> <threads> <repeat>" << std::endl;
-    std::cout << "CBC:1 CTR:2 ECB:3" <<std::endl;
+  if (argc < 6) {
+    std::cerr << argv[0] << " <file> <page_size> <mode> <threads> <repeat> [interleave] [auto|aesni|vaes256|vaes512] [pages] [key_bits] [core|compact|scatter] [warm|cold|both] [4k|2m] [thr|lat]" << std::endl;
+    std::cout << "CBC:1 CTR:2 ECB:3 GCM:4 XTS:5" <<std::endl;
     return -1;
   }
   
@@ -80,20 +297,104 @@ int main(int argc, char **argv)
   size_t page_size = atoi(argv[2]);
 
   unsigned int mode = atoi(argv[3]);
-  if (mode > 3) {
+  if (mode < MODE_CBC || mode > MODE_XTS) {
     std::cerr << "Unknown mode '" << argv[3] << '\'' << std::endl;
-    std::cout << "CBC:1 CTR:2 ECB:3" <<std::endl;
+    std::cout << "CBC:1 CTR:2 ECB:3 GCM:4 XTS:5" <<std::endl;
     return  -1;
   }
-  
+  // ciphertext stealing covers a partial last block, but needs one full block to steal from
+  if (mode == MODE_XTS && page_size < 16) {
+    std::cerr << "XTS needs pages of at least 16 bytes" << std::endl;
+    return -1;
+  }
+
   unsigned const num_threads = atoi(argv[4]);
   unsigned const repeat      = atoi(argv[5]);
   unsigned const num_cores   = std::thread::hardware_concurrency();
+  // blocks per AES-NI loop iteration (ECB, CTR, CBC decryption), 1 is the plain loop
+  unsigned const interleave  = (argc > 6) ? atoi(argv[6]) : 8;
+  if (interleave != 1 && interleave != 4 && interleave != 8) {
+    std::cerr << "Interleave must be 1, 4 or 8" << std::endl;
+    return -1;
+  }
+
+  // pages each thread encrypts per repeat, CBC encrypts them side by side
+  unsigned const pages       = (argc > 8) ? atoi(argv[8]) : 1;
+  if (pages < 1) {
+    std::cerr << "Pages must be at least 1" << std::endl;
+    return -1;
+  }
+
+  unsigned const key_bits    = (argc > 9) ? atoi(argv[9]) : 256;
+  if (key_bits != 128 && key_bits != 192 && key_bits != 256) {
+    std::cerr << "Key bits must be 128, 192 or 256" << std::endl;
+    return -1;
+  }
+
+  // where the worker threads run, their buffers follow them
+  int const placement        = (argc > 10) ? bench_placement(argv[10]) : PLACE_CORE;
+  if (placement < 0) {
+    std::cerr << "Unknown placement '" << argv[10] << '\'' << std::endl;
+    return -1;
+  }
+  bench_topology const topo;
+  std::vector<int> const cpus = topo.place(num_threads, placement);
+
+  // cold runs fault the output pages in the timed phases, as the first run on fresh buffers
+  int const prefault         = (argc > 11) ? bench_prefault(argv[11]) : BENCH_WARM;
+  if (prefault < 0) {
+    std::cerr << "Unknown prefault '" << argv[11] << '\'' << std::endl;
+    return -1;
+  }
+  bool const huge            = (argc > 12) && strcmp(argv[12], "2m") == 0;
+  // lat adds per page latency percentiles to the throughput of each repeat
+  bool const latency         = (argc > 13) && strcmp(argv[13], "lat") == 0;
+
+  // widest VAES variant the CPU runs unless one is asked for, AES-NI otherwise
+  int const detected = AES_impl_detect();
+  int impl = detected;
+  if (argc > 7 && strcmp(argv[7], "auto") != 0) {
+    for (impl = AES_IMPL_AESNI; impl <= AES_IMPL_VAES512; impl++)
+      if (strcmp(argv[7], AES_impl_name(impl)) == 0)
+        break;
+    if (impl > AES_IMPL_VAES512) {
+      std::cerr << "Unknown variant '" << argv[7] << '\'' << std::endl;
+      return -1;
+    }
+    if (impl > detected) {
+      std::cerr << "This CPU does not support " << argv[7] << ", at most " << AES_impl_name(detected) << std::endl;
+      return -1;
+    }
+  }
+  // blocks in flight of the loops that the variant runs. CBC encryption is serial
+  // within a page, and interleaved across the pages of a thread on AES-NI. XTS always
+  // runs one block at a time on AES-NI.
+  unsigned const blocks = (impl == AES_IMPL_VAES512) ? 16 : (impl == AES_IMPL_VAES256) ? 8 : interleave;
+  bool const enc_aesni  = (mode == 1 || mode == 5);
+  unsigned const enc_blocks = (mode == 1) ? ((pages > 1) ? interleave : 1) : (mode == 5) ? 1 : blocks;
+  unsigned const dec_blocks = (mode == 5) ? 1 : blocks;
+  char const *enc_variant = enc_aesni   ? AES_impl_name(AES_IMPL_AESNI) : AES_impl_name(impl);
+  char const *dec_variant = (mode == 5) ? AES_impl_name(AES_IMPL_AESNI) : AES_impl_name(impl);
+
+  if (check_single_pass_all(impl, interleave) != 0) {
+    std::cerr << "Single pass check failed" << std::endl;
+    return -1;
+  }
 
   std::cout<< "Input file: " << filename << std::endl;
   std::cout<< "AES Mode  : " << mode << std::endl;
+  std::cout<< "Key bits  : " << key_bits << std::endl;
   std::cout<< "Repeat    : " << repeat << std::endl;
+  std::cout<< "Variant   : encrypt " << enc_variant << " (" << enc_blocks << " blocks), decrypt "
+           << dec_variant << " (" << dec_blocks << " blocks)" << std::endl;
+  std::cout<< "Pages     : " << pages << " per thread" << std::endl;
   std::cout<< "Threads   : " << num_threads << " (mod " << num_cores << " cores)" <<std::endl;
+  std::cout<< "Placement : " << bench_placement_name(placement) << ", cpu/node";
+  for(int cpu : cpus)
+    std::cout << " " << cpu << "/" << topo.node_of(cpu);
+  std::cout << std::endl;
+  std::cout<< "Buffers   : " << bench_prefault_name(prefault) << ", " << (huge ? "2 MB" : "4 KB") << " pages" << std::endl;
+  std::cout<< "Measure   : throughput" << (latency ? ", page latency" : "") << std::endl;
   
   size_t total_size, file_size;
   
@@ -111,7 +412,10 @@ int main(int argc, char **argv)
     std::cout<<"File size [B] : "<< file_size <<std::endl;
   }
   
-  total_size = page_size * num_threads * repeat;
+  // bytes of one thread per repeat
+  size_t const chunk = page_size * pages;
+
+  total_size = chunk * num_threads * repeat;
   
   unsigned augment = 1;
 
@@ -120,178 +424,166 @@ int main(int argc, char **argv)
   else
     total_size = file_size;
 
-  std::cout<<"Total size [B]: "<<(unsigned long)page_size * num_threads * repeat<<std::endl;
+  std::cout<<"Total size [B]: "<<(unsigned long)chunk * num_threads * repeat<<std::endl;
   std::cout<<"Augment       : "<<augment<<std::endl;
 
-  unsigned char *input      = (unsigned char *)malloc(total_size);
-  unsigned char *output_enc = (unsigned char *)malloc(total_size);
-  unsigned char *output_dec = (unsigned char *)malloc(total_size);
+  // the workers fill input with copies of the file, see run_aes
+  unsigned char *file_data  = (unsigned char *)malloc(file_size);
+  unsigned char *input      = (unsigned char *)bench_alloc(total_size, huge);
+  unsigned char *output_enc = (unsigned char *)bench_alloc(total_size, huge);
+  unsigned char *output_dec = (unsigned char *)bench_alloc(total_size, huge);
+  if (input == NULL || output_enc == NULL || output_dec == NULL) {
+    std::cerr << "Unable to map " << total_size << " bytes" << std::endl;
+    return -1;
+  }
   
   // Read and close input file 
   if (fseek(f, 0, SEEK_SET) != 0)
     exit(1);
-  if (fread(input, 1, file_size, f) != file_size)
+  if (fread(file_data, 1, file_size, f) != file_size)
     exit(1);
   fclose(f);
-  
-  for(unsigned i=1; i<augment; i++)
-    memcpy((input+i*file_size), input, (size_t)file_size);
 
   int numerrors = 0;
 
-  std::vector<float> th_encrypt;
-  std::vector<float> th_decrypt;
-  
-  compute_aes aes_app[32];
-  
-  size_t ofs = 0;
-
-  for(unsigned int r=0; r<repeat; r++) {
-      
-    std::vector<std::thread> threads_enc, threads_dec;
-  
-    auto const t0 = std::chrono::system_clock::now();
+  // a cold run first, it still gets fresh buffers
+  for(int pass=BENCH_COLD; pass<=BENCH_WARM; pass++) {
+
+    if(prefault != BENCH_BOTH && pass != prefault)
+      continue;
+    bool const warm = (pass == BENCH_WARM);
+
+    aes_run_t run;
+    run.file        = file_data;
+    run.file_size   = file_size;
+    run.input       = input;
+    run.output_enc  = output_enc;
+    run.output_dec  = output_dec;
+    run.page_size   = page_size;
+    run.pages       = pages;
+    run.num_threads = num_threads;
+    run.repeat      = repeat;
+    run.interleave  = interleave;
+    run.impl        = impl;
+    run.topo        = &topo;
+    run.cpus        = cpus;
+    run.warm        = warm;
+    run.latency     = latency;
+
+    unsigned int const auth_errors = run_aes_fn_for(mode, key_bits)(run);
+
+    std::vector<float> &th_encrypt = run.th_encrypt;
+    std::vector<float> &th_decrypt = run.th_decrypt;
  
-    for(unsigned int i=0; i<num_threads; i++){
+    numerrors = memcmp((const void *)input, (const void *)output_dec, (size_t)(chunk*num_threads*repeat));
 
-      //size_t const nofs  = (((i+1)*page_size)/num_threads);
-      //size_t const cnt = nofs-ofs;
-         
-      threads_enc.emplace_back(std::thread(&compute_aes::encrypt_file,&aes_app[i],
-          input+ofs+i*page_size, page_size, output_enc+ofs+i*page_size, mode));
- 
-      cpu_set_t  cpus;
-      CPU_ZERO(&cpus);
-      CPU_SET((2*i)%num_cores, &cpus);
-      pthread_setaffinity_np(threads_enc.back().native_handle(), sizeof(cpus), &cpus);
-    }
- 
-    // Wait for all to finish
-    for(std::thread& t : threads_enc) t.join();
-     
-    auto const t1 = std::chrono::system_clock::now();
-
-    for(unsigned int i=0; i<num_threads; i++){
-
-      //size_t const nofs = (((i+1)*page_size)/num_threads);
-      //size_t const cnt  = nofs-ofs;
-         
-      threads_dec.emplace_back(std::thread(&compute_aes::decrypt_file,&aes_app[i],
-          output_enc+ofs+i*page_size, page_size, output_dec+ofs+i*page_size, mode));
- 
-      cpu_set_t  cpus;
-      CPU_ZERO(&cpus);
-      CPU_SET((2*i)%num_cores, &cpus);
-      pthread_setaffinity_np(threads_dec.back().native_handle(), sizeof(cpus), &cpus);
+    if(auth_errors!=0){
+      std::cerr<<"GCM tag mismatch on "<<auth_errors<<" pages!"<<std::endl;
+      return -1;
     }
-    
-    // Wait for all to finish
-    for(std::thread& t : threads_dec) t.join();
- 
-    auto const t2 = std::chrono::system_clock::now();
-
-    ofs += num_threads * page_size;
-     
-    float const d0 = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
-    float const d1 = std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count();
-   
-    th_encrypt.push_back((double)(num_threads*page_size)/d0);
-    th_decrypt.push_back((double)(num_threads*page_size)/d1);
-  }
- 
-  numerrors = memcmp((const void *)input, (const void *)output_dec, (size_t)(page_size*num_threads*repeat));
   
-  if(numerrors!=0){
+    if(numerrors!=0){
     
-    g = fopen("input.txt", "a");
-    h = fopen("output.txt", "a");
-    std::cout<<"Position:"<<numerrors<<std::endl;
+      g = fopen("input.txt", "a");
+      h = fopen("output.txt", "a");
+      std::cout<<"Position:"<<numerrors<<std::endl;
 
-    fwrite(input, 1, total_size, g);
-    fwrite(output_dec, 1, total_size, h);
+      fwrite(input, 1, total_size, g);
+      fwrite(output_dec, 1, total_size, h);
 
-    std::cerr<<"Encryption and decryption don't give equal results!"<<std::endl;
-    return -1;
-  }
+      std::cerr<<"Encryption and decryption don't give equal results!"<<std::endl;
+      return -1;
+    }
     
-  std::sort(th_encrypt.begin(),th_encrypt.end());
-  std::sort(th_decrypt.begin(),th_decrypt.end());
-  
-  float min_encrypt = th_encrypt[0];
-  float min_decrypt = th_decrypt[0];
-  float max_encrypt = th_encrypt[repeat-1];
-  float max_decrypt = th_decrypt[repeat-1];
-
-  float p25_encrypt = 0.0;
-  float p50_encrypt = 0.0;
-  float p75_encrypt = 0.0;
+    std::sort(th_encrypt.begin(),th_encrypt.end());
+    std::sort(th_decrypt.begin(),th_decrypt.end());
   
-  float p25_decrypt = 0.0;
-  float p50_decrypt = 0.0;
-  float p75_decrypt = 0.0;
+    float min_encrypt = th_encrypt[0];
+    float min_decrypt = th_decrypt[0];
+    float max_encrypt = th_encrypt[repeat-1];
+    float max_decrypt = th_decrypt[repeat-1];
+
+    float const p1_encrypt  = bench_percentile(th_encrypt, 1);
+    float const p5_encrypt  = bench_percentile(th_encrypt, 5);
+    float const p25_encrypt = bench_percentile(th_encrypt, 25);
+    float const p50_encrypt = bench_percentile(th_encrypt, 50);
+    float const p75_encrypt = bench_percentile(th_encrypt, 75);
+    float const p95_encrypt = bench_percentile(th_encrypt, 95);
+    float const p99_encrypt = bench_percentile(th_encrypt, 99);
+
+    float const p1_decrypt  = bench_percentile(th_decrypt, 1);
+    float const p5_decrypt  = bench_percentile(th_decrypt, 5);
+    float const p25_decrypt = bench_percentile(th_decrypt, 25);
+    float const p50_decrypt = bench_percentile(th_decrypt, 50);
+    float const p75_decrypt = bench_percentile(th_decrypt, 75);
+    float const p95_decrypt = bench_percentile(th_decrypt, 95);
+    float const p99_decrypt = bench_percentile(th_decrypt, 99);
+
+    FILE *file;
+    //Open input file
+    std::string name = "aes_thr_encrypt_" + std::to_string(mode) + "_" + std::to_string(num_threads) + ".dat";
+
+    file = fopen(name.c_str(), "a");
+
+    //input files size
+    unsigned int file_size_result = get_filesize(file);
+    if (file_size_result == 0)
+      fprintf(file, "file_size page_size mode repeat min max p1 p5 p25 p50 p75 p95 p99 interleave variant pages key_bits prefault \n");
+ 
+    fseek(file, file_size_result, SEEK_END); 
+    fprintf(file,"%zu %zu %u %u %.2f %.2f %.2f %.2f %.2f %.2f %.2f %.2f %.2f %u %s %u %u %s\n",total_size, page_size, mode, repeat, min_encrypt, max_encrypt, p1_encrypt, p5_encrypt, p25_encrypt, p50_encrypt, p75_encrypt, p95_encrypt, p99_encrypt, enc_blocks, enc_variant, pages, key_bits, warm ? "warm" : "cold");
+    fclose(file);
+
+    name = "aes_thr_decrypt_" + std::to_string(mode) + "_" + std::to_string(num_threads) + ".dat";
+    file = fopen(name.c_str(), "a");
+    //input files size
+    file_size_result = get_filesize(file);
+    if (file_size_result == 0)
+      fprintf(file, "file_size page_size mode repeat min max p1 p5 p25 p50 p75 p95 p99 interleave variant pages key_bits prefault \n");
+   
+    fseek(file, file_size_result, SEEK_END);
+    fprintf(file,"%zu %zu %u %u %.2f %.2f %.2f %.2f %.2f %.2f %.2f %.2f %.2f %u %s %u %u %s\n",total_size, page_size, mode, repeat, min_decrypt, max_decrypt, p1_decrypt, p5_decrypt, p25_decrypt, p50_decrypt, p75_decrypt, p95_decrypt, p99_decrypt, dec_blocks, dec_variant, pages, key_bits, warm ? "warm" : "cold");
+    fclose(file); 
 
-  if(repeat>=4){
+    if(latency){
 
-      p25_encrypt = th_encrypt[(repeat/4)-1];
-      p50_encrypt = th_encrypt[(repeat/2)-1];
-      p75_encrypt = th_encrypt[(repeat*3)/4-1];
-  
-      p25_decrypt = th_decrypt[(repeat/4)-1];
-      p50_decrypt = th_decrypt[(repeat/2)-1];
-      p75_decrypt = th_decrypt[(repeat*3)/4-1];
-  }
+      const char *stage[2] = {"encrypt", "decrypt"};
+      const bench_hist *lat[2] = {&run.lat_encrypt, &run.lat_decrypt};
 
-  float p1_encrypt  = 0.0;
-  float p5_encrypt  = 0.0;
-  float p95_encrypt = 0.0;
-  float p99_encrypt = 0.0;
-    
-  float p1_decrypt  = 0.0;
-  float p5_decrypt  = 0.0;
-  float p95_decrypt = 0.0;
-  float p99_decrypt = 0.0;
+      for(int st=0; st<2; st++){
 
-  if (repeat >= 100) {
-  
-    p1_encrypt  = th_encrypt[((repeat)/100)-1];
-    p5_encrypt  = th_encrypt[((repeat*5)/100)-1];
-    p95_encrypt = th_encrypt[((repeat*95)/100)-1];
-    p99_encrypt = th_encrypt[((repeat*99)/100)-1];
-
-    p1_decrypt  = th_decrypt[((repeat)/100)-1];
-    p5_decrypt  = th_decrypt[((repeat*5)/100)-1];
-    p95_decrypt = th_decrypt[((repeat*95)/100)-1];
-    p99_decrypt = th_decrypt[((repeat*99)/100)-1];
-  }
+        // us, the histogram is in ns
+        float const p50  = lat[st]->value_at(50)/1e3;
+        float const p99  = lat[st]->value_at(99)/1e3;
+        float const p999 = lat[st]->value_at(99.9)/1e3;
+        float const pmax = lat[st]->max()/1e3;
 
-  FILE *file;
-  //Open input file
-  std::string name = "aes_thr_encrypt_" + std::to_string(mode) + "_" + std::to_string(num_threads) + ".dat";
+        std::cout<<"Latency "<<stage[st]<<" [us] : p50 "<<p50<<", p99 "<<p99<<", p99.9 "<<p999<<", max "<<pmax
+                 <<" ("<<lat[st]->count()<<" pages)"<<std::endl;
 
-  file = fopen(name.c_str(), "a");
+        name = std::string("aes_lat_") + stage[st] + "_" + std::to_string(mode) + "_" + std::to_string(num_threads) + ".dat";
+        file = fopen(name.c_str(), "a");
+        file_size_result = get_filesize(file);
+        if (file_size_result == 0)
+          fprintf(file, "file_size page_size mode repeat samples p50 p99 p999 max pages key_bits prefault \n");
 
-  //input files size
-  unsigned int file_size_result = get_filesize(file);
-  if (file_size_result == 0)
-    fprintf(file, "file_size page_size mode repeat min max p1 p5 p25 p50 p75 p95 p99 \n");
- 
-  fseek(file, file_size_result, SEEK_END); 
-  fprintf(file,"%zu %zu %u %u %.2f %.2f %.2f %.2f %.2f %.2f %.2f %.2f %.2f\n",total_size, page_size, mode, repeat, min_encrypt, max_encrypt, p1_encrypt, p5_encrypt, p25_encrypt, p50_encrypt, p75_encrypt, p95_encrypt, p99_encrypt);
-  fclose(file);
-
-  name = "aes_thr_decrypt_" + std::to_string(mode) + "_" + std::to_string(num_threads) + ".dat";
-  file = fopen(name.c_str(), "a");
-  //input files size
-  file_size_result = get_filesize(file);
-  if (file_size_result == 0)
-    fprintf(file, "file_size page_size mode repeat min max p1 p5 p25 p50 p75 p95 p99 \n");
-   
-  fseek(file, file_size_result, SEEK_END);
-  fprintf(file,"%zu %zu %u %u %.2f %.2f %.2f %.2f %.2f %.2f %.2f %.2f %.2f\n",total_size, page_size, mode, repeat, min_decrypt, max_decrypt, p1_decrypt, p5_decrypt, p25_decrypt, p50_decrypt, p75_decrypt, p95_decrypt, p99_decrypt);
-  fclose(file); 
+        fseek(file, file_size_result, SEEK_END);
+        fprintf(file,"%zu %zu %u %u %llu %.3f %.3f %.3f %.3f %u %u %s\n",total_size, page_size, mode, repeat, (unsigned long long)lat[st]->count(), p50, p99, p999, pmax, pages, key_bits, warm ? "warm" : "cold");
+        fclose(file);
+      }
+    }
+
+    th_encrypt.clear();
+    th_decrypt.clear();
+
+    if(prefault == BENCH_BOTH)
+      std::cout<<(warm ? "Warm" : "Cold")<<" [GB/s] : encrypt "<<min_encrypt<<"-"<<max_encrypt<<", decrypt "<<min_decrypt<<"-"<<max_decrypt<<std::endl;
+  }
 
-  th_encrypt.clear();
-  th_decrypt.clear();
+  bench_free(input, total_size, huge);
+  bench_free(output_enc, total_size, huge);
+  bench_free(output_dec, total_size, huge);
+  free(file_data);
 
   return 0;
 }
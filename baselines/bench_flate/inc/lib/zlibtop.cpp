@@ -126,7 +126,11 @@ std::string ZLibBaseDecompressor::baseDecompress(const std::string& input) {
       }
       have = ZLIB_COMPLETE_CHUNK - strm_.avail_out;
       result += std::string(out_, have);
-    } while (strm_.avail_out == 0);
+      // independent streams (one per FPGA page) follow each other, start over
+      if (retval == Z_STREAM_END) {
+        inflateReset(&strm_);
+      }
+    } while (strm_.avail_out == 0 || (retval == Z_STREAM_END && strm_.avail_in > 0));
   }
   return result;
 }
@@ -33,6 +33,10 @@
 
 #include <zlc/zlibcomplete.hpp>
 #include "compute_flate.h"
+#include "bench_hist.h"
+#include "bench_mem.h"
+#include "bench_pool.h"
+#include "bench_topology.h"
 
 using namespace zlibcomplete;
 
@@ -54,7 +58,7 @@ int main(int argc, char **argv)
 
   if (argc < 7) {
 
-    std::cerr << argv[0] << " <file> <page_size> <window_bits> <level> <threads> <repeat> " << std::endl;
+    std::cerr << argv[0] << " <file> <page_size> <window_bits> <level> <threads> <repeat> [core|compact|scatter] [warm|cold|both] [4k|2m] [thr|lat]" << std::endl;
     return -1;
   }
 
@@ -96,7 +100,32 @@ int main(int argc, char **argv)
   std::cout<< "Level      : " << level << std::endl;
   std::cout<< "Window bits: " << window_bits << std::endl;
   std::cout<< "Repeat     : " << repeat << std::endl;
+  // where the worker threads run, their buffers follow them
+  int const placement = (argc > 7) ? bench_placement(argv[7]) : PLACE_CORE;
+  if (placement < 0) {
+    std::cerr << "Unknown placement '" << argv[7] << '\'' << std::endl;
+    return -1;
+  }
+  bench_topology const topo;
+  std::vector<int> const cpus = topo.place(num_threads, placement);
+
+  // cold runs grow the output strings in the timed phases, as the first run does
+  int const prefault  = (argc > 8) ? bench_prefault(argv[8]) : BENCH_WARM;
+  if (prefault < 0) {
+    std::cerr << "Unknown prefault '" << argv[8] << '\'' << std::endl;
+    return -1;
+  }
+  bool const huge     = (argc > 9) && strcmp(argv[9], "2m") == 0;
+  // lat adds per page latency percentiles to the throughput of each repeat
+  bool const latency  = (argc > 10) && strcmp(argv[10], "lat") == 0;
+
   std::cout<< "Threads    : " << num_threads << " (mod " << num_cores << " cores)" <<std::endl;
+  std::cout<< "Placement  : " << bench_placement_name(placement) << ", cpu/node";
+  for(int cpu : cpus)
+    std::cout << " " << cpu << "/" << topo.node_of(cpu);
+  std::cout << std::endl;
+  std::cout<< "Buffers    : " << bench_prefault_name(prefault) << ", " << (huge ? "2 MB" : "4 KB") << " pages" << std::endl;
+  std::cout<< "Measure    : throughput" << (latency ? ", page latency" : "") << std::endl;
   
   size_t total_size, file_size;
   
@@ -126,8 +155,12 @@ int main(int argc, char **argv)
   std::cout<<"Total size [B]: "<<(unsigned long)page_size * num_threads * repeat<<std::endl;
   std::cout<<"Augment       : "<<augment<<std::endl;
 
-  char *input          = (char *)malloc(total_size);
-  char *output_inflate = (char *)malloc(total_size);
+  char *input          = (char *)bench_alloc(total_size, huge);
+  char *output_inflate = (char *)bench_alloc(total_size, huge);
+  if (input == NULL || output_inflate == NULL) {
+    std::cerr << "Unable to map " << total_size << " bytes" << std::endl;
+    return -1;
+  }
   
   // Read and close input file 
   if (fseek(f, 0, SEEK_SET) != 0)
@@ -143,232 +176,245 @@ int main(int argc, char **argv)
   std::string output[num_threads];
   std::string result[num_threads];
   
-  std::vector<RawDeflater *> deflater;
-  for(unsigned i=0; i<num_threads; i++) deflater.push_back(new RawDeflater(level, auto_flush, window_bits));
-
-  std::vector<RawInflater *> inflater; 
-  for(unsigned i=0; i<num_threads; i++) inflater.push_back(new RawInflater(window_bits));
+  bench_pool pool(cpus);
+  std::vector<double> const moved(num_threads, page_size);
+  std::vector<double> compressed(num_threads);
+  // bytes a thread writes at most per repeat
+  size_t const out_bound = 64 + (compressBound(page_size)+63)/64*64;
+
+  // the workers make their streams, so zlib allocates them on their nodes
+  std::vector<RawDeflater *> deflater(num_threads);
+  std::vector<RawInflater *> inflater(num_threads);
+  pool.run([&](unsigned int i){
+    deflater[i] = new RawDeflater(level, auto_flush, window_bits);
+    inflater[i] = new RawInflater(window_bits);
+  });
    
-  int numerrors = 0;
+  // a cold run first, it still gets fresh strings
+  for(int pass=BENCH_COLD; pass<=BENCH_WARM; pass++) {
+
+    if(prefault != BENCH_BOTH && pass != prefault)
+      continue;
+    bool const warm = (pass == BENCH_WARM);
+
+    int numerrors = 0;
+    bench_node_stats def_nodes(topo, cpus), inf_nodes(topo, cpus);
   
-  std::vector<float> th_deflate;
-  std::vector<float> th_inflate;
-  std::vector<float> comp_ratio;
+    std::vector<float> th_deflate;
+    std::vector<float> th_inflate;
+    std::vector<float> comp_ratio;
+    // one page per worker and repeat, each worker records its own
+    std::vector<bench_hist> lat_deflate(num_threads), lat_inflate(num_threads);
    
-  size_t ofs = 0;
+    size_t ofs = 0;
   
-  for(unsigned int r=0; r<repeat; r++) {
-      
-    std::vector<std::thread> threads_def, threads_inf;  // def-deflate(compression); inf-inflate(decompression)
-   
-    auto const t0 = std::chrono::system_clock::now();
- 
-    for(unsigned int i=0; i<num_threads; i++){
-            
-      in[i].assign(input+ofs+i*page_size, page_size);
-     
-      threads_def.emplace_back(std::thread(&RawDeflater::deflate_file, deflater[i],
-          std::cref(in[i]), std::ref(output[i]), page_size, page_size));
-      
-      cpu_set_t  cpus;
-      CPU_ZERO(&cpus);
-      CPU_SET((2*i)%num_cores, &cpus);
-      pthread_setaffinity_np(threads_def.back().native_handle(), sizeof(cpus), &cpus);
-    }
- 
-    // Wait for all threads to finish
-    for(std::thread& t : threads_def) t.join();
-
-    auto const t1 = std::chrono::system_clock::now();
-    
-    for(unsigned int i=0; i<num_threads; i++){
-              
-      threads_inf.emplace_back(std::thread(&RawInflater::inflate_file, inflater[i],
-          std::cref(output[i]), std::ref(result[i])));
-      
-      cpu_set_t  cpus;
-      CPU_ZERO(&cpus);
-      CPU_SET((2*i)%num_cores, &cpus);
-      pthread_setaffinity_np(threads_inf.back().native_handle(), sizeof(cpus), &cpus);    
-    }
-    
-    // Wait for all to finish
-    for(std::thread& t : threads_inf) t.join();
-
-    auto const t2 = std::chrono::system_clock::now();
+    for(unsigned int r=0; r<repeat; r++) {
+
+      // copied by the workers, not timed, so each page sits on the node of its worker
+      pool.run([&](unsigned int i){
+        in[i].assign(input+ofs+i*page_size, page_size);
+        if(warm){
+          bench_reserve(output[i], out_bound);
+          bench_reserve(result[i], page_size);
+        }
+      });
+
+      // def-deflate(compression); inf-inflate(decompression)
+      pool.run([&](unsigned int i){
+        uint64_t const t0 = latency ? bench_now_ns() : 0;
+        deflater[i]->deflate_file(in[i], output[i], page_size, page_size);
+        if(latency)
+          lat_deflate[i].record(bench_now_ns()-t0);
+      });
+      float const d0 = pool.elapsed_ns();
+      def_nodes.add(pool, moved);
+
+      pool.run([&](unsigned int i){
+        uint64_t const t0 = latency ? bench_now_ns() : 0;
+        inflater[i]->inflate_file(output[i], result[i]);
+        if(latency)
+          lat_inflate[i].record(bench_now_ns()-t0);
+      });
+      float const d1 = pool.elapsed_ns();
+      for(unsigned int i=0; i<num_threads; i++)
+        compressed[i] = output[i].size();
+      inf_nodes.add(pool, compressed);
     
-    size_t compressed_sizes = 0;
-    size_t compressed_min   = page_size;
+      size_t compressed_sizes = 0;
+      size_t compressed_min   = page_size;
 
-    for(unsigned int i=0; i<num_threads; i++){
+      for(unsigned int i=0; i<num_threads; i++){
 
-      result[i].copy(output_inflate+ofs+i*page_size, result[i].size());
-      compressed_sizes += output[i].size();
+        result[i].copy(output_inflate+ofs+i*page_size, result[i].size());
+        compressed_sizes += output[i].size();
       
-      if(output[i].size()<compressed_min)
-        compressed_min = output[i].size();
-    }
+        if(output[i].size()<compressed_min)
+          compressed_min = output[i].size();
+      }
     
-    ofs += num_threads*page_size;
-
-    float const d0 = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
-    float const d1 = std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count();
-   
-    th_deflate.push_back((double)(num_threads*page_size)/d0);
-    th_inflate.push_back((double)(compressed_sizes)/d1);
-    comp_ratio.push_back((double)(page_size)/compressed_min);
-
-    for(unsigned i=0; i<num_threads; i++){
-
-      in[i].clear();
-      output[i].clear();
-      result[i].clear();
+      ofs += num_threads*page_size;
+
+      th_deflate.push_back((double)(num_threads*page_size)/d0);
+      th_inflate.push_back((double)(compressed_sizes)/d1);
+      comp_ratio.push_back((double)(page_size)/compressed_min);
+
+      for(unsigned i=0; i<num_threads; i++){
+
+        in[i].clear();
+        if(warm){
+          output[i].clear();
+          result[i].clear();
+        }
+        else {
+          bench_release(output[i]);
+          bench_release(result[i]);
+        }
+      }
     }
-  }
 
-  for(unsigned i=0; i<num_threads; i++) {
-    
-    delete(deflater[i]);
-    delete(inflater[i]);
-  }
+    def_nodes.print("Deflate");
+    inf_nodes.print("Inflate");
 
-  numerrors = memcmp((const void *)input, (const void *)output_inflate, (size_t)(page_size*num_threads*repeat));
+    numerrors = memcmp((const void *)input, (const void *)output_inflate, (size_t)(page_size*num_threads*repeat));
   
-  if(numerrors!=0){
+    if(numerrors!=0){
 
-    g = fopen("input.txt", "a");
-    h = fopen("output.txt", "a");
-    std::cout<<"Position:"<<numerrors<<std::endl;
+      g = fopen("input.txt", "a");
+      h = fopen("output.txt", "a");
+      std::cout<<"Position:"<<numerrors<<std::endl;
 
-    fwrite(input, 1, page_size*num_threads*repeat, g);
-    fwrite(output_inflate, 1, page_size*num_threads*repeat, h);
+      fwrite(input, 1, page_size*num_threads*repeat, g);
+      fwrite(output_inflate, 1, page_size*num_threads*repeat, h);
 
-    std::cerr<<"Compression and decompression don't give equal results!"<<std::endl;
-    return -1;
-  }
+      std::cerr<<"Compression and decompression don't give equal results!"<<std::endl;
+      return -1;
+    }
     
-  std::sort(th_deflate.begin(),th_deflate.end());
-  std::sort(th_inflate.begin(),th_inflate.end());
-
-  std::sort(comp_ratio.begin(),comp_ratio.end());
-
-  float min_deflate = th_deflate[0];
-  float min_inflate = th_inflate[0];
-  float max_deflate = th_deflate[repeat-1];
-  float max_inflate = th_inflate[repeat-1];
-
-  float p25_deflate = 0.0;
-  float p50_deflate = 0.0;
-  float p75_deflate = 0.0;
+    std::sort(th_deflate.begin(),th_deflate.end());
+    std::sort(th_inflate.begin(),th_inflate.end());
+
+    std::sort(comp_ratio.begin(),comp_ratio.end());
+
+    float min_deflate = th_deflate[0];
+    float min_inflate = th_inflate[0];
+    float max_deflate = th_deflate[repeat-1];
+    float max_inflate = th_inflate[repeat-1];
+
+    float const p1_deflate  = bench_percentile(th_deflate, 1);
+    float const p5_deflate  = bench_percentile(th_deflate, 5);
+    float const p25_deflate = bench_percentile(th_deflate, 25);
+    float const p50_deflate = bench_percentile(th_deflate, 50);
+    float const p75_deflate = bench_percentile(th_deflate, 75);
+    float const p95_deflate = bench_percentile(th_deflate, 95);
+    float const p99_deflate = bench_percentile(th_deflate, 99);
+
+    float const p1_inflate  = bench_percentile(th_inflate, 1);
+    float const p5_inflate  = bench_percentile(th_inflate, 5);
+    float const p25_inflate = bench_percentile(th_inflate, 25);
+    float const p50_inflate = bench_percentile(th_inflate, 50);
+    float const p75_inflate = bench_percentile(th_inflate, 75);
+    float const p95_inflate = bench_percentile(th_inflate, 95);
+    float const p99_inflate = bench_percentile(th_inflate, 99);
+
+    float min_ratio = comp_ratio[0];
+    float max_ratio = comp_ratio[repeat-1];
+
+    float const p1_ratio  = bench_percentile(comp_ratio, 1);
+    float const p5_ratio  = bench_percentile(comp_ratio, 5);
+    float const p25_ratio = bench_percentile(comp_ratio, 25);
+    float const p50_ratio = bench_percentile(comp_ratio, 50);
+    float const p75_ratio = bench_percentile(comp_ratio, 75);
+    float const p95_ratio = bench_percentile(comp_ratio, 95);
+    float const p99_ratio = bench_percentile(comp_ratio, 99);
+
+    FILE *file;
+    //Open input file
+    std::string name = "zlib_thr_deflate_" + std::to_string(window_bits) + "_" + std::to_string(level) + "_" + std::to_string(num_threads) + ".dat";
+
+    file = fopen(name.c_str(), "a");
+
+    //input files size
+    unsigned int file_size_result = get_filesize(file);
+    if (file_size_result == 0)
+      fprintf(file, "file_size page_size window level repeat min max p1 p5 p25 p50 p75 p95 p99 prefault \n");
+ 
+    fseek(file, file_size_result, SEEK_END); 
+    fprintf(file,"%zu %zu %u %u %u %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %s\n",total_size, page_size, window_bits, level, repeat, 
+      min_deflate, max_deflate, p1_deflate, p5_deflate, p25_deflate, p50_deflate, p75_deflate, p95_deflate, p99_deflate, warm ? "warm" : "cold");
+    fclose(file);
   
-  float p25_inflate = 0.0;
-  float p50_inflate = 0.0;
-  float p75_inflate = 0.0;
-
-  if(repeat>=4){
-      p25_deflate = th_deflate[(repeat/4)-1];
-      p50_deflate = th_deflate[(repeat/2)-1];
-      p75_deflate = th_deflate[(repeat*3)/4-1];
-
-      p25_inflate = th_inflate[(repeat/4)-1];
-      p50_inflate = th_inflate[(repeat/2)-1];
-      p75_inflate = th_inflate[(repeat*3)/4-1];
-  }
+    name = "zlib_thr_inflate_" + std::to_string(window_bits) + "_" +std::to_string(level) + "_" + std::to_string(num_threads) + ".dat";
+    file = fopen(name.c_str(), "a");
 
-  float p1_deflate  = 0.0;
-  float p5_deflate  = 0.0;
-  float p95_deflate = 0.0;
-  float p99_deflate = 0.0;
-    
-  float p1_inflate  = 0.0;
-  float p5_inflate  = 0.0;
-  float p95_inflate = 0.0;
-  float p99_inflate = 0.0;
-
-  if (repeat >= 100) {
-    p1_deflate  = th_deflate[((repeat)/100)-1];
-    p5_deflate  = th_deflate[((repeat*5)/100)-1];
-    p95_deflate = th_deflate[((repeat*95)/100)-1];
-    p99_deflate = th_deflate[((repeat*99)/100)-1];
-    
-    p1_inflate  = th_inflate[((repeat)/100)-1];
-    p5_inflate  = th_inflate[((repeat*5)/100)-1];
-    p95_inflate = th_inflate[((repeat*95)/100)-1];
-    p99_inflate = th_inflate[((repeat*99)/100)-1];
-  } 
-
-  float min_ratio = comp_ratio[0];
-  float max_ratio = comp_ratio[repeat-1];
-
-  float p25_ratio = 0.0;
-  float p50_ratio = 0.0;
-  float p75_ratio = 0.0;
-  
-  if(repeat>=4){
+    //input files size
+    file_size_result = get_filesize(file);
+    if (file_size_result == 0)
+      fprintf(file, "file_size page_size window level repeat min max p1 p5 p25 p50 p75 p95 p99 prefault \n");
+   
+    fseek(file, file_size_result, SEEK_END);
+    fprintf(file,"%zu %zu %u %u %u %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %s\n",total_size, page_size, window_bits, level, repeat, 
+      min_inflate, max_inflate, p1_inflate, p5_inflate, p25_inflate, p50_inflate, p75_inflate, p95_inflate, p99_inflate, warm ? "warm" : "cold");
+    fclose(file);  
+
+    name = "zlib_compression_ratio_" + std::to_string(window_bits) + "_" +std::to_string(level) + ".dat";
+    file = fopen(name.c_str(), "a");
+
+    //input files size
+    file_size_result = get_filesize(file);
+    if (file_size_result == 0)
+      fprintf(file, "file_size page_size window level repeat min max p1 p5 p25 p50 p75 p95 p99 prefault \n");
+   
+    fseek(file, file_size_result, SEEK_END);
+    fprintf(file,"%zu %zu %u %u %u %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %s\n",total_size, page_size, window_bits, level, repeat, 
+      min_ratio, max_ratio, p1_ratio, p5_ratio, p25_ratio, p50_ratio, p75_ratio, p95_ratio, p99_ratio, warm ? "warm" : "cold");
+    fclose(file);  
+
+    if(latency){
+
+      const char *stage[2] = {"deflate", "inflate"};
+      bench_hist lat[2];
+      for(unsigned int i=0; i<num_threads; i++){
+        lat[0].merge(lat_deflate[i]);
+        lat[1].merge(lat_inflate[i]);
+      }
+
+      for(int st=0; st<2; st++){
+
+        // us, the histogram is in ns
+        float const p50  = lat[st].value_at(50)/1e3;
+        float const p99  = lat[st].value_at(99)/1e3;
+        float const p999 = lat[st].value_at(99.9)/1e3;
+        float const pmax = lat[st].max()/1e3;
+
+        std::cout<<"Latency "<<stage[st]<<" [us] : p50 "<<p50<<", p99 "<<p99<<", p99.9 "<<p999<<", max "<<pmax
+                 <<" ("<<lat[st].count()<<" pages)"<<std::endl;
+
+        name = std::string("zlib_lat_") + stage[st] + "_" + std::to_string(window_bits) + "_" + std::to_string(level) + "_" + std::to_string(num_threads) + ".dat";
+        file = fopen(name.c_str(), "a");
+        file_size_result = get_filesize(file);
+        if (file_size_result == 0)
+          fprintf(file, "file_size page_size window level repeat samples p50 p99 p999 max prefault \n");
+
+        fseek(file, file_size_result, SEEK_END);
+        fprintf(file,"%zu %zu %u %u %u %llu %.3f %.3f %.3f %.3f %s\n",total_size, page_size, window_bits, level, repeat,
+          (unsigned long long)lat[st].count(), p50, p99, p999, pmax, warm ? "warm" : "cold");
+        fclose(file);
+      }
+    }
 
-      p25_ratio = comp_ratio[(repeat/4)-1];
-      p50_ratio = comp_ratio[(repeat/2)-1];
-      p75_ratio = comp_ratio[(repeat*3)/4-1];
+    th_deflate.clear();
+    th_inflate.clear();
+    comp_ratio.clear();
   }
 
-  float p1_ratio  = 0.0;
-  float p5_ratio  = 0.0;
-  float p95_ratio = 0.0;
-  float p99_ratio = 0.0;
+  for(unsigned i=0; i<num_threads; i++) {
     
-  if (repeat >= 100) {
-
-    p1_ratio  = comp_ratio[((repeat)/100)-1];
-    p5_ratio  = comp_ratio[((repeat*5)/100)-1];
-    p95_ratio = comp_ratio[((repeat*95)/100)-1];
-    p99_ratio = comp_ratio[((repeat*99)/100)-1];
-  } 
-
-  FILE *file;
-  //Open input file
-  std::string name = "zlib_thr_deflate_" + std::to_string(window_bits) + "_" + std::to_string(level) + "_" + std::to_string(num_threads) + ".dat";
-
-  file = fopen(name.c_str(), "a");
-
-  //input files size
-  unsigned int file_size_result = get_filesize(file);
-  if (file_size_result == 0)
-    fprintf(file, "file_size page_size window level repeat min max p1 p5 p25 p50 p75 p95 p99 \n");
- 
-  fseek(file, file_size_result, SEEK_END); 
-  fprintf(file,"%zu %zu %u %u %u %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f\n",total_size, page_size, window_bits, level, repeat, 
-    min_deflate, max_deflate, p1_deflate, p5_deflate, p25_deflate, p50_deflate, p75_deflate, p95_deflate, p99_deflate);
-  fclose(file);
-  
-  name = "zlib_thr_inflate_" + std::to_string(window_bits) + "_" +std::to_string(level) + "_" + std::to_string(num_threads) + ".dat";
-  file = fopen(name.c_str(), "a");
+    delete(deflater[i]);
+    delete(inflater[i]);
+  }
 
-  //input files size
-  file_size_result = get_filesize(file);
-  if (file_size_result == 0)
-    fprintf(file, "file_size page_size window level repeat min max p1 p5 p25 p50 p75 p95 p99 \n");
-   
-  fseek(file, file_size_result, SEEK_END);
-  fprintf(file,"%zu %zu %u %u %u %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f\n",total_size, page_size, window_bits, level, repeat, 
-    min_inflate, max_inflate, p1_inflate, p5_inflate, p25_inflate, p50_inflate, p75_inflate, p95_inflate, p99_inflate);
-  fclose(file);  
-
-  name = "zlib_compression_ratio_" + std::to_string(window_bits) + "_" +std::to_string(level) + ".dat";
-  file = fopen(name.c_str(), "a");
-
-  //input files size
-  file_size_result = get_filesize(file);
-  if (file_size_result == 0)
-    fprintf(file, "file_size page_size window level repeat min max p1 p5 p25 p50 p75 p95 p99 \n");
-   
-  fseek(file, file_size_result, SEEK_END);
-  fprintf(file,"%zu %zu %u %u %u %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f\n",total_size, page_size, window_bits, level, repeat, 
-    min_ratio, max_ratio, p1_ratio, p5_ratio, p25_ratio, p50_ratio, p75_ratio, p95_ratio, p99_ratio);
-  fclose(file);  
-
-  th_deflate.clear();
-  th_inflate.clear();
-  comp_ratio.clear();
+  bench_free(input, total_size, huge);
+  bench_free(output_inflate, total_size, huge);
 
   return 0;
 }
@@ -9,12 +9,18 @@
 #include <vector>
 
 #include "compute_aes.h"
+#include "bench_hist.h"
 
 namespace zlibcomplete {
 
 RawDeflater::RawDeflater(int level, flush_parameter autoFlush,
                                int windowBits) :
-  ZLibBaseCompressor(level, autoFlush, -windowBits) {
+  ZLibBaseCompressor(level, autoFlush, -windowBits), lat_compress(NULL), lat_encrypt(NULL) {
+}
+
+void RawDeflater::record_latency(bench_hist *compress, bench_hist *encrypt) {
+  lat_compress = compress;
+  lat_encrypt  = encrypt;
 }
 
 std::string RawDeflater::deflate(const std::string& input) {
@@ -51,36 +57,74 @@ void RawDeflater::deflate_file(const std::string& input, std::string& output, st
 
 void RawDeflater::defenc_file(const std::string& input, std::string& output, std::size_t insize, std::size_t total_size, unsigned int mode) {
 
+  switch(mode){
+    case MODE_CBC: defenc_pages<MODE_CBC>(input, output, insize, total_size); break;
+    case MODE_CTR: defenc_pages<MODE_CTR>(input, output, insize, total_size); break;
+    case MODE_ECB: defenc_pages<MODE_ECB>(input, output, insize, total_size); break;
+  }
+}
+
+template <unsigned int Mode>
+void RawDeflater::defenc_pages(const std::string& input, std::string& output, std::size_t insize, std::size_t total_size) {
+
+  // compressed pages are encrypted in batches, so CBC runs on several pages at once
+  unsigned int const batch = 8;
+
   std::string in_split;
-  std::string out_split;
   std::string header;
+  std::vector<std::string> out_split;
+  std::vector<std::string> encrypted(batch);
+  std::vector<std::size_t> cmp_size;
   
-  compute_aes aes_local;
+  compute_aes<Mode> aes_local;
   std::size_t cnt = 0;
-  std::size_t cmp_size = 0;
-  
-  unsigned char *encrypted = (unsigned char*) malloc(2*insize);
+  unsigned long long n_pages = 0;
+
+  auto flush = [&]() {
+    unsigned char *in[batch];
+    unsigned char *out[batch];
+    unsigned int size[batch];
+
+    for(unsigned int i=0; i<out_split.size(); i++){
+      encrypted[i].resize(out_split[i].size());
+      in[i]   = (unsigned char*)&out_split[i][0];
+      out[i]  = (unsigned char*)&encrypted[i][0];
+      size[i] = out_split[i].size();
+    }
+    aes_local.encrypt_pages(in, size, out, out_split.size(), n_pages, lat_encrypt);
+
+    for(unsigned int i=0; i<out_split.size(); i++){
+      header = std::to_string(cmp_size[i]);
+      header.resize(64);
+
+      output.append(header);
+      output.append(encrypted[i]);
+    }
+
+    n_pages += out_split.size();
+    out_split.clear();
+    cmp_size.clear();
+  };
 
   while(cnt<total_size){
     
-    in_split  = input.substr(cnt, insize);
-    out_split = baseCompress(in_split);
+    in_split = input.substr(cnt, insize);
+    uint64_t const t0 = lat_compress ? bench_now_ns() : 0;
+    out_split.push_back(baseCompress(in_split));
+    if(lat_compress)
+      lat_compress->record(bench_now_ns()-t0);
 
-    cmp_size  = out_split.size();
-    header    = std::to_string(cmp_size);
-    header.resize(64);
+    cmp_size.push_back(out_split.back().size());
+    if(cmp_size.back()%64 != 0)
+      out_split.back().resize((cmp_size.back()/64+1)*64);
 
-    output.append(header);
-    
-    if(cmp_size%64 != 0)
-      out_split.resize((cmp_size/64+1)*64);
-    
-    aes_local.encrypt_file((unsigned char*)out_split.c_str(), out_split.size(), encrypted, mode);
+    if(out_split.size() == batch)
+      flush();
 
-    output.append((const char*)encrypted, out_split.size());
-    
     cnt += insize;
   }
+  if(!out_split.empty())
+    flush();
 }
 
 std::string RawDeflater::finish(void) {
@@ -90,7 +134,12 @@ std::string RawDeflater::finish(void) {
 RawDeflater::~RawDeflater(void) {
 }
 
-RawInflater::RawInflater(int window_bits) : ZLibBaseDecompressor(-window_bits) {
+RawInflater::RawInflater(int window_bits) : ZLibBaseDecompressor(-window_bits), lat_decrypt(NULL), lat_inflate(NULL) {
+}
+
+void RawInflater::record_latency(bench_hist *decrypt, bench_hist *inflate) {
+  lat_decrypt = decrypt;
+  lat_inflate = inflate;
 }
 
 RawInflater::~RawInflater(void) {
@@ -129,6 +178,16 @@ void RawInflater::inflate_file(const std::string& input, std::string& output) {
 }
 
 void RawInflater::decinf_file(const std::string& input, std::string& output, std::size_t insize, unsigned int mode) {
+
+  switch(mode){
+    case MODE_CBC: decinf_pages<MODE_CBC>(input, output, insize); break;
+    case MODE_CTR: decinf_pages<MODE_CTR>(input, output, insize); break;
+    case MODE_ECB: decinf_pages<MODE_ECB>(input, output, insize); break;
+  }
+}
+
+template <unsigned int Mode>
+void RawInflater::decinf_pages(const std::string& input, std::string& output, std::size_t insize) {
  
   std::string header;
   std::string in_split;
@@ -140,7 +199,8 @@ void RawInflater::decinf_file(const std::string& input, std::string& output, std
   std::size_t total_size = input.size();
   std::size_t cnt = 0;
   
-  compute_aes aes_local;
+  compute_aes<Mode> aes_local;
+  unsigned long long page = 0;
   
   unsigned char *decrypted = (unsigned char*) malloc(2*insize);
   
@@ -155,14 +215,23 @@ void RawInflater::decinf_file(const std::string& input, std::string& output, std
 
     in_split = input.substr(cnt+64, (cmp_size+extra_size));
    
-    aes_local.decrypt_file((unsigned char*)in_split.c_str(), (cmp_size+extra_size), decrypted, mode);
+    // the XTS tweak is the page number, as in defenc_file
+    uint64_t const t0 = lat_decrypt ? bench_now_ns() : 0;
+    aes_local.decrypt_file((unsigned char*)in_split.c_str(), (cmp_size+extra_size), decrypted, page++);
+    if(lat_decrypt)
+      lat_decrypt->record(bench_now_ns()-t0);
 
     cmp = std::string((const char*)decrypted, cmp_size);
 
+    uint64_t const t1 = lat_inflate ? bench_now_ns() : 0;
     output.append(baseDecompress(cmp));
+    if(lat_inflate)
+      lat_inflate->record(bench_now_ns()-t1);
 
     cnt += (64 + cmp_size + extra_size);
   }
+
+  free(decrypted);
 }
 
 } // namespace zlib_complete
\ No newline at end of file
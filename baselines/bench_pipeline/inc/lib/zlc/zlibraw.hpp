@@ -14,6 +14,8 @@
 
 #include <zlc/zlibbase.hpp>
 
+class bench_hist;
+
 namespace zlibcomplete {
 
 /**
@@ -58,6 +60,20 @@ public:
     
     void defenc_file(const std::string& input, std::string& output, std::size_t insize, std::size_t total_size, unsigned int mode);
 
+    // defenc_file records the ns of every page in compress and encrypt, NULL records nothing.
+    // The pages encrypted together all get the time of their batch.
+    void record_latency(bench_hist *compress, bench_hist *encrypt);
+
+private:
+    bench_hist *lat_compress;
+    bench_hist *lat_encrypt;
+
+    // defenc_file for one AES mode (CBC, CTR or ECB), defenc_file picks it
+    template <unsigned int Mode>
+    void defenc_pages(const std::string& input, std::string& output, std::size_t insize, std::size_t total_size);
+
+public:
+
 /**
   * @brief Writes a termination block to the raw zlib stream indicating the end.
   *
@@ -106,6 +122,16 @@ public:
     void inflate_file(const std::string& input, std::string& output);
 
     void decinf_file(const std::string& input, std::string& output, std::size_t insize, unsigned int mode);
+
+    // decinf_file records the ns of every page in decrypt and inflate, NULL records nothing
+    void record_latency(bench_hist *decrypt, bench_hist *inflate);
+
+private:
+    bench_hist *lat_decrypt;
+    bench_hist *lat_inflate;
+
+    template <unsigned int Mode>
+    void decinf_pages(const std::string& input, std::string& output, std::size_t insize);
   };
 
 }
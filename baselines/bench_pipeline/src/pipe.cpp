@@ -35,6 +35,10 @@
 
 #include <zlc/zlibcomplete.hpp>
 #include "compute_pipe.h"
+#include "bench_hist.h"
+#include "bench_mem.h"
+#include "bench_pool.h"
+#include "bench_topology.h"
 
 using namespace zlibcomplete;
 
@@ -56,7 +60,7 @@ int main(int argc, char **argv)
 
   if (argc < 8) {
     
-    std::cerr << argv[0] << " <file> <page_size> <window_bits> <level> <mode> <threads> <repeat> <batch_size>" << std::endl;
+    std::cerr << argv[0] << " <file> <page_size> <window_bits> <level> <mode> <threads> <repeat> <batch_size> [core|compact|scatter] [warm|cold|both] [4k|2m] [thr|lat]" << std::endl;
     return -1;
   }
   
@@ -115,7 +119,32 @@ int main(int argc, char **argv)
   std::cout<< "Window bits: " << window_bits <<std::endl;
   std::cout<< "AES Mode   : " << mode        <<std::endl;
   std::cout<< "Repeat     : " << repeat      <<std::endl;
+  // where the worker threads run, their buffers follow them
+  int const placement = (argc > 9) ? bench_placement(argv[9]) : PLACE_CORE;
+  if (placement < 0) {
+    std::cerr << "Unknown placement '" << argv[9] << '\'' << std::endl;
+    return -1;
+  }
+  bench_topology const topo;
+  std::vector<int> const cpus = topo.place(num_threads, placement);
+
+  // cold runs grow the output strings in the timed phases, as the first run does
+  int const prefault  = (argc > 10) ? bench_prefault(argv[10]) : BENCH_WARM;
+  if (prefault < 0) {
+    std::cerr << "Unknown prefault '" << argv[10] << '\'' << std::endl;
+    return -1;
+  }
+  bool const huge     = (argc > 11) && strcmp(argv[11], "2m") == 0;
+  // lat adds per page latency percentiles of each stage to the throughput of each repeat
+  bool const latency  = (argc > 12) && strcmp(argv[12], "lat") == 0;
+
   std::cout<< "Threads    : " << num_threads << " (mod " << num_cores << " cores)" <<std::endl;
+  std::cout<< "Placement  : " << bench_placement_name(placement) << ", cpu/node";
+  for(int cpu : cpus)
+    std::cout << " " << cpu << "/" << topo.node_of(cpu);
+  std::cout << std::endl;
+  std::cout<< "Buffers    : " << bench_prefault_name(prefault) << ", " << (huge ? "2 MB" : "4 KB") << " pages" << std::endl;
+  std::cout<< "Measure    : throughput" << (latency ? ", page latency" : "") << std::endl;
   
   size_t total_size, file_size;
 
@@ -147,8 +176,12 @@ int main(int argc, char **argv)
   std::cout<<"Total size [B]: "<<(unsigned long)batch_size * num_threads * repeat<<std::endl;
   std::cout<<"Augment       : "<<augment<<std::endl;
 
-  char *input          = (char *)malloc(total_size);
-  char *output_inflate = (char *)malloc(total_size);
+  char *input          = (char *)bench_alloc(total_size, huge);
+  char *output_inflate = (char *)bench_alloc(total_size, huge);
+  if (input == NULL || output_inflate == NULL) {
+    std::cerr << "Unable to map " << total_size << " bytes" << std::endl;
+    return -1;
+  }
   
   // Read and close input file 
   if (fseek(f, 0, SEEK_SET) != 0)
@@ -164,185 +197,213 @@ int main(int argc, char **argv)
   std::string output[num_threads];
   std::string result[num_threads];
   
-  std::vector<RawDeflater *> deflater;
-  for(unsigned i=0; i<num_threads; i++) deflater.push_back(new RawDeflater(level, auto_flush, window_bits));
-
-  std::vector<RawInflater *> inflater; 
-  for(unsigned i=0; i<num_threads; i++) inflater.push_back(new RawInflater(window_bits));
-
-  int numerrors = 0;
+  bench_pool pool(cpus);
+  std::vector<double> const moved(num_threads, batch_size);
+  std::vector<double> compressed(num_threads);
+  // bytes a thread writes at most per repeat
+  size_t const out_bound = (batch_size+page_size-1)/page_size * (64 + (compressBound(page_size)+63)/64*64);
+
+  // the workers make their streams, so zlib allocates them on their nodes
+  std::vector<RawDeflater *> deflater(num_threads);
+  std::vector<RawInflater *> inflater(num_threads);
+  pool.run([&](unsigned int i){
+    deflater[i] = new RawDeflater(level, auto_flush, window_bits);
+    inflater[i] = new RawInflater(window_bits);
+  });
+
+  // a cold run first, it still gets fresh strings
+  for(int pass=BENCH_COLD; pass<=BENCH_WARM; pass++) {
+
+    if(prefault != BENCH_BOTH && pass != prefault)
+      continue;
+    bool const warm = (pass == BENCH_WARM);
+
+    int numerrors = 0;
+    bench_node_stats def_nodes(topo, cpus), inf_nodes(topo, cpus);
   
-  std::vector<float> th_deflate;
-  std::vector<float> th_inflate;
-
-  size_t ofs = 0;
+    std::vector<float> th_deflate;
+    std::vector<float> th_inflate;
+
+    // compress, encrypt, decrypt and inflate of every page, each worker records its own
+    std::vector<bench_hist> lat_compress(num_threads), lat_encrypt(num_threads);
+    std::vector<bench_hist> lat_decrypt(num_threads), lat_inflate(num_threads);
+    if(latency)
+      for(unsigned int i=0; i<num_threads; i++){
+        deflater[i]->record_latency(&lat_compress[i], &lat_encrypt[i]);
+        inflater[i]->record_latency(&lat_decrypt[i], &lat_inflate[i]);
+      }
+
+    size_t ofs = 0;
   
 
-  for(unsigned int r=0; r<repeat; r++) {
-
-    std::vector<std::thread> threads_defenc, threads_decinf;  // def-deflate(compression); inf-inflate(decompression)
-   
-    auto const t0 = std::chrono::system_clock::now();
+    for(unsigned int r=0; r<repeat; r++) {
+
+      // copied by the workers, not timed, so each batch sits on the node of its worker
+      pool.run([&](unsigned int i){
+        in[i].assign(input+ofs+i*batch_size, batch_size);
+        if(warm){
+          bench_reserve(output[i], out_bound);
+          bench_reserve(result[i], batch_size);
+        }
+      });
+
+      // def-deflate(compression); inf-inflate(decompression)
+      pool.run([&](unsigned int i){ deflater[i]->defenc_file(in[i], output[i], page_size, batch_size, mode); });
+      float const d0 = pool.elapsed_ns();
+      def_nodes.add(pool, moved);
+
+      pool.run([&](unsigned int i){ inflater[i]->decinf_file(output[i], result[i], page_size, mode); });
+      float const d1 = pool.elapsed_ns();
+      for(unsigned int i=0; i<num_threads; i++)
+        compressed[i] = output[i].size();
+      inf_nodes.add(pool, compressed);
     
-    for(unsigned int i=0; i<num_threads; i++){
-            
-      in[i].assign(input+ofs+i*batch_size, batch_size);
-
-      threads_defenc.emplace_back(std::thread(&RawDeflater::defenc_file, deflater[i],
-          std::cref(in[i]), std::ref(output[i]), page_size, batch_size, mode));
-      
-      cpu_set_t  cpus;
-      CPU_ZERO(&cpus);
-      CPU_SET((2*i)%num_cores, &cpus);
-      pthread_setaffinity_np(threads_defenc.back().native_handle(), sizeof(cpus), &cpus);
-    }
-    
-    // Wait for all threads to finish
-    for(std::thread& t : threads_defenc) t.join();
+       size_t compressed_sizes = 0;
 
-    auto const t1 = std::chrono::system_clock::now();
-    
-    for(unsigned int i=0; i<num_threads; i++){
-              
-      threads_decinf.emplace_back(std::thread(&RawInflater::decinf_file, inflater[i],
-          std::cref(output[i]), std::ref(result[i]), page_size, mode));
-      
-      cpu_set_t  cpus;
-      CPU_ZERO(&cpus);
-      CPU_SET((2*i)%num_cores, &cpus);
-      pthread_setaffinity_np(threads_decinf.back().native_handle(), sizeof(cpus), &cpus);   
-    }
-    
-    // Wait for all to finish
-    for(std::thread& t : threads_decinf) t.join();
+      for(unsigned int i=0; i<num_threads; i++){
 
-    auto const t2 = std::chrono::system_clock::now();
+        result[i].copy(output_inflate+ofs+i*batch_size, result[i].size());
+        compressed_sizes += output[i].size();
+      }
     
-     size_t compressed_sizes = 0;
-
-    for(unsigned int i=0; i<num_threads; i++){
-
-      result[i].copy(output_inflate+ofs+i*batch_size, result[i].size());
-      compressed_sizes += output[i].size();
+      ofs += num_threads*batch_size;
+
+      th_deflate.push_back((double)(num_threads*batch_size)/d0);
+      th_inflate.push_back((double)(compressed_sizes)/d1);
+
+      for(unsigned i=0; i<num_threads; i++){
+
+        in[i].clear();
+        if(warm){
+          output[i].clear();
+          result[i].clear();
+        }
+        else {
+          bench_release(output[i]);
+          bench_release(result[i]);
+        }
+      }
     }
-    
-    ofs += num_threads*batch_size;
-
-    float const d0 = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
-    float const d1 = std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count();
-   
-    th_deflate.push_back((double)(num_threads*batch_size)/d0);
-    th_inflate.push_back((double)(compressed_sizes)/d1);
-
-    for(unsigned i=0; i<num_threads; i++){
-
-      in[i].clear();
-      output[i].clear();
-      result[i].clear();
-    }
-  }
 
-  for(unsigned i=0; i<num_threads; i++){
-
-    delete(deflater[i]);
-    delete(inflater[i]);
-  }
+    def_nodes.print("Defenc");
+    inf_nodes.print("Decinf");
   
-  numerrors = memcmp((const void *)input, (const void *)output_inflate, (batch_size*num_threads*repeat));  //total_size
+    numerrors = memcmp((const void *)input, (const void *)output_inflate, (batch_size*num_threads*repeat));  //total_size
   
-  if(numerrors!=0){
+    if(numerrors!=0){
 
-    //g = fopen("input.txt", "a");
-    //h = fopen("output.txt", "a");
-    std::cout<<"Position:"<<numerrors<<std::endl;
+      //g = fopen("input.txt", "a");
+      //h = fopen("output.txt", "a");
+      std::cout<<"Position:"<<numerrors<<std::endl;
 
-    //fwrite(input, 1, total_size, g);
-    //fwrite(output_inflate, 1, total_size, h);
+      //fwrite(input, 1, total_size, g);
+      //fwrite(output_inflate, 1, total_size, h);
 
-    std::cerr<<"Compression and encryption pipeline doesn't give the same results as decryption and decompression pipeline!"<<std::endl;
-    return -1;
-  }
+      std::cerr<<"Compression and encryption pipeline doesn't give the same results as decryption and decompression pipeline!"<<std::endl;
+      return -1;
+    }
     
-  std::sort(th_deflate.begin(),th_deflate.end());
-  std::sort(th_inflate.begin(),th_inflate.end());
+    std::sort(th_deflate.begin(),th_deflate.end());
+    std::sort(th_inflate.begin(),th_inflate.end());
+  
+    float min_deflate = th_deflate[0];
+    float min_inflate = th_inflate[0];
+    float max_deflate = th_deflate[repeat-1];
+    float max_inflate = th_inflate[repeat-1];
+
+    float const p1_deflate  = bench_percentile(th_deflate, 1);
+    float const p5_deflate  = bench_percentile(th_deflate, 5);
+    float const p25_deflate = bench_percentile(th_deflate, 25);
+    float const p50_deflate = bench_percentile(th_deflate, 50);
+    float const p75_deflate = bench_percentile(th_deflate, 75);
+    float const p95_deflate = bench_percentile(th_deflate, 95);
+    float const p99_deflate = bench_percentile(th_deflate, 99);
+
+    float const p1_inflate  = bench_percentile(th_inflate, 1);
+    float const p5_inflate  = bench_percentile(th_inflate, 5);
+    float const p25_inflate = bench_percentile(th_inflate, 25);
+    float const p50_inflate = bench_percentile(th_inflate, 50);
+    float const p75_inflate = bench_percentile(th_inflate, 75);
+    float const p95_inflate = bench_percentile(th_inflate, 95);
+    float const p99_inflate = bench_percentile(th_inflate, 99);
+
+    FILE *file;
+    //Open input file
+    std::string name = "pipe_thr_defenc_" + std::to_string(window_bits) + "_" + std::to_string(level) + "_" + std::to_string(mode) + "_" + std::to_string(num_threads) + ".txt";
+    file = fopen(name.c_str(), "a");
+
+    //input files size
+    unsigned int file_size_result = get_filesize(file);
+    if (file_size_result == 0)
+      fprintf(file, "file_size page_size batch_size window level mode repeat min max p1 p5 p25 p50 p75 p95 p99 prefault \n");
+ 
+    fseek(file, file_size_result, SEEK_END); 
+    fprintf(file,"%zu %zu %zu %u %u %u %u %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %s\n",total_size, page_size, batch_size, window_bits, level, mode, repeat, 
+      min_deflate, max_deflate, p1_deflate, p5_deflate, p25_deflate, p50_deflate, p75_deflate, p95_deflate, p99_deflate, warm ? "warm" : "cold");
+    fclose(file);
   
-  float min_deflate = th_deflate[0];
-  float min_inflate = th_inflate[0];
-  float max_deflate = th_deflate[repeat-1];
-  float max_inflate = th_inflate[repeat-1];
-
-  float p25_deflate = 0.0;
-  float p50_deflate = 0.0;
-  float p75_deflate = 0.0;
+    name = "pipe_thr_decinf_" + std::to_string(window_bits) + "_" + std::to_string(level) + "_" + std::to_string(mode) + "_" + std::to_string(num_threads) + ".txt";
+    file = fopen(name.c_str(), "a");
   
-  float p25_inflate = 0.0;
-  float p50_inflate = 0.0;
-  float p75_inflate = 0.0;
-
-  if(repeat>=4){
-
-    p25_deflate = th_deflate[(repeat/4)-1];
-    p50_deflate = th_deflate[(repeat/2)-1];
-    p75_deflate = th_deflate[(repeat*3)/4-1];
+    //input files size
+    file_size_result = get_filesize(file);
+    if (file_size_result == 0)
+      fprintf(file, "file_size page_size batch_size window level mode repeat min max p1 p5 p25 p50 p75 p95 p99 prefault \n");
+   
+    fseek(file, file_size_result, SEEK_END);
+    fprintf(file,"%zu %zu %zu %u %u %u %u %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %s\n",total_size, page_size, batch_size, window_bits, level, mode, repeat, 
+      min_inflate, max_inflate, p1_inflate, p5_inflate, p25_inflate, p50_inflate, p75_inflate, p95_inflate, p99_inflate, warm ? "warm" : "cold");
+    fclose(file);  
+
+    if(latency){
+
+      const char *stage[4] = {"compress", "encrypt", "decrypt", "inflate"};
+      bench_hist lat[4];
+      for(unsigned int i=0; i<num_threads; i++){
+        lat[0].merge(lat_compress[i]);
+        lat[1].merge(lat_encrypt[i]);
+        lat[2].merge(lat_decrypt[i]);
+        lat[3].merge(lat_inflate[i]);
+        deflater[i]->record_latency(NULL, NULL);
+        inflater[i]->record_latency(NULL, NULL);
+      }
+
+      for(int st=0; st<4; st++){
+
+        // us, the histogram is in ns
+        float const p50  = lat[st].value_at(50)/1e3;
+        float const p99  = lat[st].value_at(99)/1e3;
+        float const p999 = lat[st].value_at(99.9)/1e3;
+        float const pmax = lat[st].max()/1e3;
+
+        std::cout<<"Latency "<<stage[st]<<" [us] : p50 "<<p50<<", p99 "<<p99<<", p99.9 "<<p999<<", max "<<pmax
+                 <<" ("<<lat[st].count()<<" pages)"<<std::endl;
+
+        name = std::string("pipe_lat_") + stage[st] + "_" + std::to_string(window_bits) + "_" + std::to_string(level) + "_" + std::to_string(mode) + "_" + std::to_string(num_threads) + ".txt";
+        file = fopen(name.c_str(), "a");
+        file_size_result = get_filesize(file);
+        if (file_size_result == 0)
+          fprintf(file, "file_size page_size batch_size window level mode repeat samples p50 p99 p999 max prefault \n");
+
+        fseek(file, file_size_result, SEEK_END);
+        fprintf(file,"%zu %zu %zu %u %u %u %u %llu %.3f %.3f %.3f %.3f %s\n",total_size, page_size, batch_size, window_bits, level, mode, repeat,
+          (unsigned long long)lat[st].count(), p50, p99, p999, pmax, warm ? "warm" : "cold");
+        fclose(file);
+      }
+    }
 
-    p25_inflate = th_inflate[(repeat/4)-1];
-    p50_inflate = th_inflate[(repeat/2)-1];
-    p75_inflate = th_inflate[(repeat*3)/4-1];
+    th_deflate.clear();
+    th_inflate.clear();
   }
 
-  float p1_deflate  = 0.0;
-  float p5_deflate  = 0.0;
-  float p95_deflate = 0.0;
-  float p99_deflate = 0.0;
-    
-  float p1_inflate  = 0.0;
-  float p5_inflate  = 0.0;
-  float p95_inflate = 0.0;
-  float p99_inflate = 0.0;
-
-  if (repeat >= 100) {
+  for(unsigned i=0; i<num_threads; i++){
 
-    p1_deflate  = th_deflate[((repeat)/100)-1];
-    p5_deflate  = th_deflate[((repeat*5)/100)-1];
-    p95_deflate = th_deflate[((repeat*95)/100)-1];
-    p99_deflate = th_deflate[((repeat*99)/100)-1];
-    
-    p1_inflate  = th_inflate[((repeat)/100)-1];
-    p5_inflate  = th_inflate[((repeat*5)/100)-1];
-    p95_inflate = th_inflate[((repeat*95)/100)-1];
-    p99_inflate = th_inflate[((repeat*99)/100)-1];
+    delete(deflater[i]);
+    delete(inflater[i]);
   }
-  
-  FILE *file;
-  //Open input file
-  std::string name = "pipe_thr_defenc_" + std::to_string(window_bits) + "_" + std::to_string(level) + "_" + std::to_string(mode) + "_" + std::to_string(num_threads) + ".txt";
-  file = fopen(name.c_str(), "a");
-
-  //input files size
-  unsigned int file_size_result = get_filesize(file);
-  if (file_size_result == 0)
-    fprintf(file, "file_size page_size batch_size window level mode repeat min max p1 p5 p25 p50 p75 p95 p99 \n");
- 
-  fseek(file, file_size_result, SEEK_END); 
-  fprintf(file,"%zu %zu %zu %u %u %u %u %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f\n",total_size, page_size, batch_size, window_bits, level, mode, repeat, 
-    min_deflate, max_deflate, p1_deflate, p5_deflate, p25_deflate, p50_deflate, p75_deflate, p95_deflate, p99_deflate);
-  fclose(file);
-  
-  name = "pipe_thr_decinf_" + std::to_string(window_bits) + "_" + std::to_string(level) + "_" + std::to_string(mode) + "_" + std::to_string(num_threads) + ".txt";
-  file = fopen(name.c_str(), "a");
-  
-  //input files size
-  file_size_result = get_filesize(file);
-  if (file_size_result == 0)
-    fprintf(file, "file_size page_size batch_size window level mode repeat min max p1 p5 p25 p50 p75 p95 p99 \n");
-   
-  fseek(file, file_size_result, SEEK_END);
-  fprintf(file,"%zu %zu %zu %u %u %u %u %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f %.5f\n",total_size, page_size, batch_size, window_bits, level, mode, repeat, 
-    min_inflate, max_inflate, p1_inflate, p5_inflate, p25_inflate, p50_inflate, p75_inflate, p95_inflate, p99_inflate);
-  fclose(file);  
 
-  th_deflate.clear();
-  th_inflate.clear();
+  bench_free(input, total_size, huge);
+  bench_free(output_inflate, total_size, huge);
 
   return 0;
 }
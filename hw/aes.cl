@@ -25,11 +25,257 @@ union header_u {
   long8 datalong;
 };
 
+// Per-line config word. The first line of a page reloads the IV. In CTR
+// mode the counter blocks are {page nonce, 4 * line + k}, so any engine
+// can encrypt any line of any page. GCM shifts the data lines by one so that
+// {page nonce, 0} is free for J0. iv is the aes_page_iv of the page.
+int8 aes_line_config(int8 config_data, ulong2 iv, unsigned int line)
+{
+  int8 config = config_data;
+#if defined(AES_MODE_GCM)
+  // line slot 0 holds J0, data lines start at slot 1
+  config.s0 = (uint)iv.s0;
+  config.s1 = (uint)(iv.s0 >> 32);
+  config.s2 = line + 1;
+#elif defined(AES_MODE_CTR)
+  config.s0 = (uint)iv.s0;
+  config.s1 = (uint)(iv.s0 >> 32);
+  config.s2 = line;
+#else
+  config.s2 = line;
+#endif
+  config.s3 = (line == 0) ? AES_CONFIG_PAGE_START : 0;
+#ifdef AES_MODE_CBC
+  config.s4 = (uint)iv.s0;
+  config.s5 = (uint)(iv.s0 >> 32);
+  config.s6 = (uint)iv.s1;
+  config.s7 = (uint)(iv.s1 >> 32);
+#endif
+  return config;
+}
+
+#if AES_PAGE_IV
+// IV of a page: E_K({4 * AES_PRF_LINE, salt ^ page}), the salt is config_data.s0/s1.
+// In CBC it is the IV of the page, in CTR and GCM its low half is the page nonce.
+// Only block 0 of the line is used.
+ulong2 aes_page_iv(int8 config_data, unsigned int page, long16 key_lsb, long16 key_msb)
+{
+  ulong nonce = ((((ulong)(uint)config_data.s1) << 32) | (uint)config_data.s0) ^ page;
+  long8 x = (long8)(0);
+  int8 config = (int8)(0);
+#if defined(AES_MODE_CBC)
+  // zero IV, so block 0 is E(x)
+  x.s0 = 4 * (ulong)AES_PRF_LINE;
+  x.s1 = nonce;
+  config.s3 = AES_CONFIG_PAGE_START;
+#else
+  // keystream block 0 of line AES_PRF_LINE under the nonce
+  config.s0 = (uint)nonce;
+  config.s1 = (uint)(nonce >> 32);
+  config.s2 = AES_PRF_LINE;
+#endif
+  long8 y = aes_256(x, config, key_lsb, key_msb);
+#if defined(AES_MODE_GCM)
+  return (ulong2)(y.s0 | ((ulong)AES_GCM_NONCE_BIT << 32), 0);
+#elif defined(AES_MODE_CTR)
+  return (ulong2)(y.s0, 0);
+#else
+  return (ulong2)(y.s0, y.s1);
+#endif
+}
+
+void aes_header_put_iv(union header_u *header, ulong2 iv)
+{
+  header->values[HDR_PAGE_IV + 0] = (unsigned int)iv.s0;
+  header->values[HDR_PAGE_IV + 1] = (unsigned int)(iv.s0 >> 32);
+  header->values[HDR_PAGE_IV + 2] = (unsigned int)iv.s1;
+  header->values[HDR_PAGE_IV + 3] = (unsigned int)(iv.s1 >> 32);
+}
+
+ulong2 aes_header_iv(union header_u header)
+{
+  return (ulong2)(((ulong)header.values[HDR_PAGE_IV + 1] << 32) | header.values[HDR_PAGE_IV + 0],
+                  ((ulong)header.values[HDR_PAGE_IV + 3] << 32) | header.values[HDR_PAGE_IV + 2]);
+}
+#endif
+
+#ifdef AES_MODE_XTS
+// XTS tweaks are 128-bit little endian integers held as (.s0 = bytes 0..7,
+// .s1 = bytes 8..15). The tweak of page p is E_K2(p), block k of the page uses
+// E_K2(p) * alpha^k, so every page can be decrypted on its own.
+ulong2 xts_mul_alpha(ulong2 t)
+{
+  ulong carry = t.s1 >> 63;
+  return (ulong2)((t.s0 << 1) ^ (carry ? 0x87UL : 0), (t.s1 << 1) | (t.s0 >> 63));
+}
+
+// Tweaks of the four blocks of a line whose first block uses t
+long8 xts_line_tweaks(ulong2 t)
+{
+  ulong2 t1 = xts_mul_alpha(t);
+  ulong2 t2 = xts_mul_alpha(t1);
+  ulong2 t3 = xts_mul_alpha(t2);
+  return as_long8((ulong8)(t, t1, t2, t3));
+}
+
+// Tweak of the line after the one encrypted with tweaks tw
+ulong2 xts_next_tweak(long8 tw)
+{
+  return xts_mul_alpha((ulong2)(tw.s6, tw.s7));
+}
+
+// Page tweak with the K2 schedule. Only block 0 of the line is used.
+ulong2 xts_page_tweak(unsigned int page, long16 key_lsb, long16 key_msb)
+{
+  long8 x = (long8)(0);
+  x.s0 = page;
+  long8 y = aes_256(x, (int8)(0), key_lsb, key_msb);
+  return (ulong2)(y.s0, y.s1);
+}
+#endif
+
+#if AES_STRIPE
+// Lines arrive round-robin from the load balancer. Each line lands at its
+// position in the page, so the page is reassembled in order in memory.
+// The engine holding the last line of the page writes the header.
 void aes_encrypt_internal (unsigned int engine_id)
 {
+  long16 round_key_lsb;
+  long16 round_key_msb;
+  struct aes_enc_setup_t setup;
+
+  while(true) {
+    struct aes_line_t line;
+    union enc_t data_enc;
+
+    line = read_channel_intel(ch_load2aes[engine_id]);
+
+    if (line.first) {
+      setup = read_channel_intel(ch_aes_enc_setup[engine_id]);
+
+      if (setup.new_key) {
+        round_key_lsb = read_channel_intel(ch_aes_enc_keylsb[engine_id]);
+        round_key_msb = read_channel_intel(ch_aes_enc_keymsb[engine_id]);
+      }
+    }
+
+    #pragma unroll
+    for (unsigned int i=0; i<VECX2; i++) {
+      data_enc.data[i] = line.data[i];
+    }
+
+    int8 config = aes_line_config(setup.config_data, setup.iv, line.line);
+    setup.out[setup.offset + 1 + line.line] = aes_256(data_enc.datalong, config, round_key_lsb, round_key_msb);
+
+    if (line.last) {
+      struct gzip_header_t header_int = read_channel_intel(ch_header2aes[engine_id]);
+
+      union header_u header;
+      header.values[HDR_N_LINES] = line.line + 1;
+      header.values[HDR_FIRST_VALID_POS] = header_int.first_valid_pos;
+      header.values[HDR_COMPSIZE_LZ] = header_int.compsize_lz;
+      header.values[HDR_COMPSIZE_HUFFMAN] = header_int.compsize_huffman;
+      header.values[HDR_FLAGS] = header_int.stored ? HDR_FLAG_STORED : 0;
+      header.values[HDR_CRC32C] = header_int.crc32c;
+      header.values[HDR_PAGE_BYTES] = header_int.page_bytes;
+      aes_header_put_iv(&header, setup.iv);
+
+      setup.out[setup.offset] = header.datalong;
+    }
+  }
+}
+#elif defined(AES_MODE_GCM)
+// CTR engine that also streams its keystream/ciphertext to a GHASH unit. Two
+// leading lines of zeros yield E(0) (the hash key H) and E(J0). They go through
+// the same aes_256 instance as the data and are not stored.
+void aes_encrypt_internal (unsigned int engine_id)
+{
+  // kept from page to page, the load balancer only sends them with a new key
+  long16 round_key_lsb;
+  long16 round_key_msb;
+
+  while(true) {
+    unsigned int pointer;
+    unsigned int n_lines;
+    unsigned int step;
+    bool last;
+    struct aes_enc_setup_t setup;
+
+    setup = read_channel_intel(ch_aes_enc_setup[engine_id]);
+
+    if (setup.new_key) {
+      round_key_lsb = read_channel_intel(ch_aes_enc_keylsb[engine_id]);
+      round_key_msb = read_channel_intel(ch_aes_enc_keymsb[engine_id]);
+    }
+
+    pointer = setup.offset + 1; // HEADER SIZE = 512 bits = 1 LINE
+    n_lines = 0;
+    step = 0;
+    last = false;
+    do {
+      union enc_t data_enc;
+      int8 config;
+
+      if (step == 0) {
+        data_enc.datalong = (long8)(0);
+        config = (int8)(0);
+      } else if (step == 1) {
+        data_enc.datalong = (long8)(0);
+        config = aes_line_config(setup.config_data, setup.iv, 0);
+        config.s2 = 0;
+      } else {
+        struct gzip_to_aes_t huffman_data = read_channel_intel(ch_load2aes[engine_id]);
+
+        #pragma unroll
+        for (unsigned int i=0; i<VECX2; i++) {
+          data_enc.data[i] = huffman_data.data[i];
+        }
+        config = aes_line_config(setup.config_data, setup.iv, n_lines);
+        last = huffman_data.last;
+      }
+
+      struct gcm_line_t ghash_line;
+      ghash_line.data = aes_256(data_enc.datalong, config, round_key_lsb, round_key_msb);
+      ghash_line.last = last;
+      write_channel_intel(ch_aes2ghash[engine_id], ghash_line);
+
+      if (step >= 2) {
+        setup.out[pointer] = ghash_line.data;
+        pointer = pointer + 1;
+        n_lines = n_lines + 1;
+      }
+      step = step + 1;
+    } while (!last);
+
+    // store header
+    struct gzip_header_t header_int = read_channel_intel(ch_header2aes[engine_id]);
+    ulong2 tag = read_channel_intel(ch_ghash2aes[engine_id]);
+
+    union header_u header;
+    header.values[HDR_N_LINES] = n_lines;
+    header.values[HDR_FIRST_VALID_POS] = header_int.first_valid_pos;
+    header.values[HDR_COMPSIZE_LZ] = header_int.compsize_lz;
+    header.values[HDR_COMPSIZE_HUFFMAN] = header_int.compsize_huffman;
+    header.values[HDR_FLAGS] = header_int.stored ? HDR_FLAG_STORED : 0;
+    header.values[HDR_CRC32C] = header_int.crc32c;
+    header.values[HDR_PAGE_BYTES] = header_int.page_bytes;
+    header.values[HDR_GCM_TAG + 0] = (unsigned int)tag.s0;
+    header.values[HDR_GCM_TAG + 1] = (unsigned int)(tag.s0 >> 32);
+    header.values[HDR_GCM_TAG + 2] = (unsigned int)tag.s1;
+    header.values[HDR_GCM_TAG + 3] = (unsigned int)(tag.s1 >> 32);
+    aes_header_put_iv(&header, setup.iv);
+
+    setup.out[setup.offset] = header.datalong;
+  }
+}
+#else
+void aes_encrypt_internal (unsigned int engine_id)
+{
+  // kept from page to page, the load balancer only sends them with a new key
+  long16 round_key_lsb;
+  long16 round_key_msb;
+
   while(true) {
-    long16 round_key_lsb;
-    long16 round_key_msb;
     unsigned int pointer;
     unsigned int n_lines;
     struct gzip_to_aes_t huffman_data;
@@ -38,11 +284,16 @@ void aes_encrypt_internal (unsigned int engine_id)
 
     setup = read_channel_intel(ch_aes_enc_setup[engine_id]);
 
-    round_key_lsb = aes_key_256(setup.key, 0x01);
-    round_key_msb = aes_key_256(setup.key, 0x02);
+    if (setup.new_key) {
+      round_key_lsb = read_channel_intel(ch_aes_enc_keylsb[engine_id]);
+      round_key_msb = read_channel_intel(ch_aes_enc_keymsb[engine_id]);
+    }
 
     pointer = setup.offset + 1; // HEADER SIZE = 512 bits = 1 LINE
     n_lines = 0;
+#ifdef AES_MODE_XTS
+    ulong2 tweak = setup.tweak;
+#endif
     do {
       huffman_data = read_channel_intel(ch_load2aes[engine_id]);
 
@@ -51,7 +302,14 @@ void aes_encrypt_internal (unsigned int engine_id)
         data_enc.data[i] = huffman_data.data[i];
       }
 
-      setup.out[pointer] = aes_256(data_enc.datalong, setup.config_data, round_key_lsb, round_key_msb);
+      int8 config = aes_line_config(setup.config_data, setup.iv, n_lines);
+#ifdef AES_MODE_XTS
+      long8 tw = xts_line_tweaks(tweak);
+      setup.out[pointer] = aes_256(data_enc.datalong ^ tw, config, round_key_lsb, round_key_msb) ^ tw;
+      tweak = xts_next_tweak(tw);
+#else
+      setup.out[pointer] = aes_256(data_enc.datalong, config, round_key_lsb, round_key_msb);
+#endif
       pointer = pointer + 1;
       n_lines = n_lines + 1;
 
@@ -61,14 +319,21 @@ void aes_encrypt_internal (unsigned int engine_id)
     struct gzip_header_t header_int = read_channel_intel(ch_header2aes[engine_id]);
 
     union header_u header;
-    header.values[0] = n_lines;
-    header.values[1] = header_int.first_valid_pos;
-    header.values[2] = header_int.compsize_lz;
-    header.values[3] = header_int.compsize_huffman;
+    header.values[HDR_N_LINES] = n_lines;
+    header.values[HDR_FIRST_VALID_POS] = header_int.first_valid_pos;
+    header.values[HDR_COMPSIZE_LZ] = header_int.compsize_lz;
+    header.values[HDR_COMPSIZE_HUFFMAN] = header_int.compsize_huffman;
+    header.values[HDR_FLAGS] = header_int.stored ? HDR_FLAG_STORED : 0;
+    header.values[HDR_CRC32C] = header_int.crc32c;
+    header.values[HDR_PAGE_BYTES] = header_int.page_bytes;
+#if AES_PAGE_IV
+    aes_header_put_iv(&header, setup.iv);
+#endif
 
     setup.out[setup.offset] = header.datalong;
   }
 }
+#endif
 
 __attribute__((max_global_work_dim(0)))
 __attribute__((autorun))
@@ -132,6 +397,173 @@ void kernel aes_encrypt7() {
 }
 #endif
 
+#ifdef AES_MODE_GCM
+//---------------------------------------------------------------------------------------
+// GHASH
+//---------------------------------------------------------------------------------------
+
+// Blocks in GCM bit order: .s0 holds bytes 0..7 and .s1 bytes 8..15 of the
+// block, both big endian
+ulong bswap64(ulong x)
+{
+  return as_ulong(as_uchar8(x).s76543210);
+}
+
+ulong2 gcm_block(long8 line, unsigned int k)
+{
+  ulong lanes[8] = {line.s0, line.s1, line.s2, line.s3, line.s4, line.s5, line.s6, line.s7};
+  return (ulong2)(bswap64(lanes[2*k]), bswap64(lanes[2*k+1]));
+}
+
+// 64x64 carry-less multiply, returns (hi, lo). Each bit of b selects a shifted
+// copy of a, so this is an AND/XOR tree without a carried dependency.
+ulong2 clmul64(ulong a, ulong b)
+{
+  ulong hi = 0, lo = a & (0 - (b & 1));
+
+  #pragma unroll
+  for (int i = 1; i < 64; i++) {
+    ulong m = 0 - ((b >> i) & 1);
+    lo ^= (a << i) & m;
+    hi ^= (a >> (64 - i)) & m;
+  }
+  return (ulong2)(hi, lo);
+}
+
+// Unreduced 256-bit product of two GCM blocks, .s0 holds the lowest degree
+// terms like the blocks themselves. Karatsuba: three 64-bit multiplies instead
+// of four. The products are bit reflected, so the result is shifted left by one.
+ulong4 gf128_clmul(ulong2 x, ulong2 y)
+{
+  ulong2 hh = clmul64(x.s0, y.s0);
+  ulong2 ll = clmul64(x.s1, y.s1);
+  ulong2 mm = clmul64(x.s0 ^ x.s1, y.s0 ^ y.s1) ^ hh ^ ll;
+
+  ulong4 p = (ulong4)(hh.s0, hh.s1 ^ mm.s0, ll.s0 ^ mm.s1, ll.s1);
+  return (ulong4)((p.s0 << 1) | (p.s1 >> 63), (p.s1 << 1) | (p.s2 >> 63),
+                  (p.s2 << 1) | (p.s3 >> 63), p.s3 << 1);
+}
+
+// Reduction modulo x^128 + x^7 + x^2 + x + 1. In the reflected order a shift
+// right raises the degree, so the upper half is folded in as h * (1 + x + x^2 + x^7)
+// and the at most 7 terms that spill past x^127 are folded once more.
+ulong2 gf128_reduce(ulong4 p)
+{
+  ulong h0 = p.s2, h1 = p.s3;
+  ulong t0 = h0 ^ (h0 >> 1) ^ (h0 >> 2) ^ (h0 >> 7);
+  ulong t1 = h1 ^ (h1 >> 1) ^ (h1 >> 2) ^ (h1 >> 7) ^ (h0 << 63) ^ (h0 << 62) ^ (h0 << 57);
+  ulong t2 = (h1 << 63) ^ (h1 << 62) ^ (h1 << 57);
+  t0 ^= t2 ^ (t2 >> 1) ^ (t2 >> 2) ^ (t2 >> 7);
+  return (ulong2)(p.s0 ^ t0, p.s1 ^ t1);
+}
+
+// Multiplication in GF(2^128), same result as SP 800-38D Algorithm 1
+ulong2 gf128_mul(ulong2 x, ulong2 y)
+{
+  return gf128_reduce(gf128_clmul(x, y));
+}
+
+// One page: H, E(J0), then the ciphertext lines. The four blocks of a line are
+// folded in with H^4..H^1 so only one multiplication sits on the recurrence,
+// and the four products are summed before a single reduction.
+void aes_ghash_internal (unsigned int engine_id)
+{
+  while(true) {
+    struct gcm_line_t in;
+    ulong2 h[4];
+    ulong2 ej0;
+    ulong2 y = (ulong2)(0, 0);
+    unsigned int n_lines = 0;
+
+    in = read_channel_intel(ch_aes2ghash[engine_id]);
+    h[0] = gcm_block(in.data, 0);
+    h[1] = gf128_mul(h[0], h[0]);
+    h[2] = gf128_mul(h[1], h[0]);
+    h[3] = gf128_mul(h[2], h[0]);
+
+    in = read_channel_intel(ch_aes2ghash[engine_id]);
+    ej0 = (ulong2)(in.data.s0, in.data.s1);
+
+    do {
+      in = read_channel_intel(ch_aes2ghash[engine_id]);
+
+      y = gf128_reduce(gf128_clmul(y ^ gcm_block(in.data, 0), h[3]) ^
+                       gf128_clmul(gcm_block(in.data, 1), h[2]) ^
+                       gf128_clmul(gcm_block(in.data, 2), h[1]) ^
+                       gf128_clmul(gcm_block(in.data, 3), h[0]));
+      n_lines++;
+    } while (!in.last);
+
+    // len(A) = 0, len(C) in bits
+    y = gf128_mul(y ^ (ulong2)(0, (ulong)n_lines * 512), h[0]);
+
+    write_channel_intel(ch_ghash2aes[engine_id], (ulong2)(ej0.s0 ^ bswap64(y.s0), ej0.s1 ^ bswap64(y.s1)));
+  }
+}
+
+__attribute__((max_global_work_dim(0)))
+__attribute__((autorun))
+void kernel aes_ghash0() {
+  aes_ghash_internal(0);
+}
+
+#if AES_ENGINES > 1
+__attribute__((max_global_work_dim(0)))
+__attribute__((autorun))
+void kernel aes_ghash1() {
+  aes_ghash_internal(1);
+}
+#endif
+
+#if AES_ENGINES > 2
+__attribute__((max_global_work_dim(0)))
+__attribute__((autorun))
+void kernel aes_ghash2() {
+  aes_ghash_internal(2);
+}
+#endif
+
+#if AES_ENGINES > 3
+__attribute__((max_global_work_dim(0)))
+__attribute__((autorun))
+void kernel aes_ghash3() {
+  aes_ghash_internal(3);
+}
+#endif
+
+#if AES_ENGINES > 4
+__attribute__((max_global_work_dim(0)))
+__attribute__((autorun))
+void kernel aes_ghash4() {
+  aes_ghash_internal(4);
+}
+#endif
+
+#if AES_ENGINES > 5
+__attribute__((max_global_work_dim(0)))
+__attribute__((autorun))
+void kernel aes_ghash5() {
+  aes_ghash_internal(5);
+}
+#endif
+
+#if AES_ENGINES > 6
+__attribute__((max_global_work_dim(0)))
+__attribute__((autorun))
+void kernel aes_ghash6() {
+  aes_ghash_internal(6);
+}
+#endif
+
+#if AES_ENGINES > 7
+__attribute__((max_global_work_dim(0)))
+__attribute__((autorun))
+void kernel aes_ghash7() {
+  aes_ghash_internal(7);
+}
+#endif
+#endif
+
 void aes_keygen_dec_internal (int8 key, unsigned int engine_id)
 {
     long16 round_key_lsb;
@@ -144,36 +576,82 @@ void aes_keygen_dec_internal (int8 key, unsigned int engine_id)
     write_channel_intel(ch_aes_keymsb[1][engine_id], round_key_msb);
 }
 
+#ifdef AES_MODE_XTS
+// The tweak is always encrypted, so decryption also needs the K2 encryption schedule
+void aes_keygen_tweak_internal (int8 key, unsigned int engine_id)
+{
+    long16 round_key_lsb;
+    long16 round_key_msb;
+
+    round_key_lsb = aes_key_256(key, 0x01);
+    round_key_msb = aes_key_256(key, 0x02);
+
+    write_channel_intel(ch_aes_keylsb[0][engine_id], round_key_lsb);
+    write_channel_intel(ch_aes_keymsb[0][engine_id], round_key_msb);
+}
+
+__attribute__((max_global_work_dim(0)))
+void kernel aes_keygen_dec0(int8 key, int8 tweak_key)
+{
+  aes_keygen_dec_internal(key, 0);
+  aes_keygen_tweak_internal(tweak_key, 0);
+}
+#else
 __attribute__((max_global_work_dim(0)))
 void kernel aes_keygen_dec0(int8 key)
 {
   aes_keygen_dec_internal(key, 0);
 }
+#endif
 
+// Decrypts pages [first_page, first_page + n_pages) in place of the page slots,
+// without reading any other page
 __attribute__((max_global_work_dim(0)))
 kernel void aes_decrypt0 (
   global long8 * restrict in,
   global long8 * restrict out,
   int8 config_data,
+  unsigned int first_page,
   unsigned int n_pages,
   unsigned int mem_offset)
 {
   long16 round_keys[2];
   round_keys[0] = read_channel_intel(ch_aes_keylsb[1][0]);
   round_keys[1] = read_channel_intel(ch_aes_keymsb[1][0]);
+#ifdef AES_MODE_XTS
+  long16 tweak_keys[2];
+  tweak_keys[0] = read_channel_intel(ch_aes_keylsb[0][0]);
+  tweak_keys[1] = read_channel_intel(ch_aes_keymsb[0][0]);
+#endif
 
-  unsigned int pointer = 0;
-  unsigned int offset = 0;
+  unsigned int offset = first_page * mem_offset;
+  unsigned int pointer = offset;
 
-  for (unsigned page = 0; page < n_pages; page++) {
+  for (unsigned page = first_page; page < first_page + n_pages; page++) {
     union header_u header;
     header.datalong = in[pointer];
     out[pointer] = header.datalong;
     pointer++;
 
-    for (unsigned int k = 0; k < header.values[0]; k++) {
+#ifdef AES_MODE_XTS
+    ulong2 tweak = xts_page_tweak(page, tweak_keys[0], tweak_keys[1]);
+#endif
+#if AES_PAGE_IV
+    ulong2 iv = aes_header_iv(header);
+#else
+    ulong2 iv = (ulong2)(0);
+#endif
+
+    for (unsigned int k = 0; k < header.values[HDR_N_LINES]; k++) {
       long8 data = in[pointer];
-      out[pointer] = aes_256_decrypt(data, config_data, round_keys[0], round_keys[1]);
+      int8 config = aes_line_config(config_data, iv, k);
+#ifdef AES_MODE_XTS
+      long8 tw = xts_line_tweaks(tweak);
+      out[pointer] = aes_256_decrypt(data ^ tw, config, round_keys[0], round_keys[1]) ^ tw;
+      tweak = xts_next_tweak(tw);
+#else
+      out[pointer] = aes_256_decrypt(data, config, round_keys[0], round_keys[1]);
+#endif
       pointer++;
     }
 
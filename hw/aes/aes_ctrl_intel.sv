@@ -28,8 +28,7 @@ module aes_ctrl_intel #(
 );
 
 localparam logic[N_PIPES*128/8-1:0] keep_1 = ~('b0);
-logic[63:0]  s_elements;
-logic[63:0]  s_elements_cntr;
+logic[31:0]  s_line;
 logic[63:0]  s_cntr;
 logic[63:0]  s_nonce;
 logic[63:0]  s_element0;
@@ -58,6 +57,11 @@ endgenerate
 
 assign olast = s_last;
 
+// Config word layout (one word per line):
+//   iconfig[63:0]    nonce, reloaded on every line so pages can be interleaved
+//   iconfig[95:64]   line index inside the page (CTR counter)
+//   iconfig[127]     first line of a page: reload the IVs
+//   iconfig[255:128] IV
 always_ff @(posedge clk) begin
   if(~resetn) begin
     ovalid    <= 1'b0;
@@ -65,10 +69,8 @@ always_ff @(posedge clk) begin
     okey      <= 'bx;  
     s_nonce   <= 'bx;
     
-    s_elements_cntr <= '0;
     s_data          <= '0;
-    s_elements      <= 'b0;
-    s_cntr          <= 'b0;
+    s_line          <= 'b0;
     s_iv_en         <= 'b0;
     s_iv_de         <= 'b0;
     s_ctrl_ready    <= 1'b1;  
@@ -81,7 +83,6 @@ always_ff @(posedge clk) begin
         s_data         <= idata;
         okeep          <= keep_1;
         ovalid         <= 1'b1;
-        s_elements_cntr<= s_elements_cntr + 1;
         
         if (MODE==2)
             if (OPERATION==0)
@@ -91,30 +92,19 @@ always_ff @(posedge clk) begin
         else
             s_ctrl_ready <= 1'b1;
 
-        if(s_elements_cntr==0) begin
-            s_nonce    <= iconfig[64-1:0];
-            s_elements <= iconfig[128-1:64];
+        s_nonce <= iconfig[64-1:0];
+        s_line  <= iconfig[96-1:64];
+        okey    <= {ikeymsb,ikeylsb};
+
+        if(iconfig[127]) begin
             s_iv_en    <= iconfig[256-1:128];
             s_iv_de    <= iconfig[256-1:128];
-
-            okey       <= {ikeymsb,ikeylsb};
-            if((s_elements_cntr+1)==iconfig[128-1:64]) 
-                 s_last <= 1'b1;    
         end
         else begin
-            if((s_elements_cntr+1)==s_elements) begin
-                 s_elements_cntr <= 'b0;
-                 s_last <= 1'b1;
-            end 
             s_iv_de <= s_data[N_PIPES*128-1:(N_PIPES-1)*128];
         end    
     end
 
-    if(s_last==1)
-      s_cntr <= 'b0;
-    else
-      s_cntr <= s_elements_cntr;
-
     if(ifeedbackvalid) begin
         s_iv_en      <= ifeedbackiv;
         s_ctrl_ready <= 1'b1;
@@ -124,10 +114,12 @@ end
 
 always_comb begin
 
-    s_element0 = s_cntr ^ 64'h00;
-    s_element1 = s_cntr ^ 64'h01;
-    s_element2 = s_cntr ^ 64'h02;
-    s_element3 = s_cntr ^ 64'h03;
+    // counter of block k in line n is 4*n + k, unique within a page
+    s_cntr     = {30'b0, s_line, 2'b00};
+    s_element0 = s_cntr | 64'h00;
+    s_element1 = s_cntr | 64'h01;
+    s_element2 = s_cntr | 64'h02;
+    s_element3 = s_cntr | 64'h03;
     
     if(MODE==1)
       odata = {s_nonce,s_element3,s_nonce,s_element2,s_nonce,s_element1,s_nonce,s_element0};
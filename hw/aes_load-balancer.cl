@@ -7,21 +7,40 @@ void kernel aes_loadbalancer(
   global long8 *restrict out,
   int8 config_data,
   unsigned int n_pages,
-  unsigned int mem_offset)
+  unsigned int mem_offset
+#ifdef AES_MODE_XTS
+  , int8 tweak_key
+#endif
+  )
 {
   struct gzip_to_aes_t datain;
   struct aes_enc_setup_t setup;
   struct gzip_header_t header;
 
   unsigned int pages = 0;
+  unsigned int n_lines = 0;
   unsigned char aes_engine_id = 0;
   unsigned char gzip_engine_id = 0;
   bool first = true;
+  // engines that have the round keys of this launch, one bit each
+  unsigned char keyed = 0;
 
-  setup.key = key;
   setup.out = out;
   setup.config_data = config_data;
   setup.offset = 0;
+  setup.page = 0;
+  setup.iv = (ulong2)(0);
+
+  // One key expansion for all engines, they keep the round keys for the whole launch.
+  // Here the same schedule derives the IV of every page from the salt in config_data.
+  long16 key_lsb = aes_key_256(key, 0x01);
+  long16 key_msb = aes_key_256(key, 0x02);
+
+#ifdef AES_MODE_XTS
+  // One K2 instance computes the tweak of every page, the engines only step it
+  long16 tweak_key_lsb = aes_key_256(tweak_key, 0x01);
+  long16 tweak_key_msb = aes_key_256(tweak_key, 0x02);
+#endif
 
   do {
     switch (gzip_engine_id) {
@@ -53,77 +72,77 @@ void kernel aes_loadbalancer(
 #endif
     }
 
-    switch (aes_engine_id) {
-      case 0:
-        if (first)
-          write_channel_intel(ch_aes_enc_setup[0], setup);
-        write_channel_intel(ch_load2aes[0], datain);
-        if (datain.last)
-          write_channel_intel(ch_header2aes[0], header);
-        break;
-#if AES_ENGINES > 1
-      case 1: 
-        if (first)
-          write_channel_intel(ch_aes_enc_setup[1], setup);
-        write_channel_intel(ch_load2aes[1], datain);
-        if (datain.last)
-          write_channel_intel(ch_header2aes[1], header);
-        break;
-#endif
-#if AES_ENGINES > 2
-      case 2:
-        if (first)
-          write_channel_intel(ch_aes_enc_setup[2], setup);
-        write_channel_intel(ch_load2aes[2], datain);
-        if (datain.last)
-          write_channel_intel(ch_header2aes[2], header);
-        break;
-#endif
-#if AES_ENGINES > 3
-      case 3:
-        if (first)
-          write_channel_intel(ch_aes_enc_setup[3], setup);
-        write_channel_intel(ch_load2aes[3], datain);
-        if (datain.last)
-          write_channel_intel(ch_header2aes[3], header);
-        break;
-#endif
-#if AES_ENGINES > 4
-      case 4:
-        if (first)
-          write_channel_intel(ch_aes_enc_setup[4], setup);
-        write_channel_intel(ch_load2aes[4], datain);
-        if (datain.last)
-          write_channel_intel(ch_header2aes[4], header);
-        break;
-#endif
-#if AES_ENGINES > 5
-      case 5:
-        if (first)
-          write_channel_intel(ch_aes_enc_setup[5], setup);
-        write_channel_intel(ch_load2aes[5], datain);
-        if (datain.last)
-          write_channel_intel(ch_header2aes[5], header);
-        break;
+#if AES_STRIPE
+    // CTR lines are independent: deal the lines of the page round-robin
+    struct aes_line_t line;
+
+    #pragma unroll
+    for (unsigned int i=0; i<VECX2; i++) {
+      line.data[i] = datain.data[i];
+    }
+    line.line = n_lines;
+    line.first = n_lines < AES_ENGINES;
+    line.last = datain.last;
+
+    if (n_lines == 0)
+      setup.iv = aes_page_iv(config_data, setup.page, key_lsb, key_msb);
+
+    // the channel index is a constant in every copy of the unrolled loop
+    #pragma unroll
+    for (unsigned char e = 0; e < AES_ENGINES; e++) {
+      if (e == aes_engine_id) {
+        if (line.first) {
+          setup.new_key = (keyed & (1 << e)) == 0;
+          write_channel_intel(ch_aes_enc_setup[e], setup);
+          if (setup.new_key) {
+            write_channel_intel(ch_aes_enc_keylsb[e], key_lsb);
+            write_channel_intel(ch_aes_enc_keymsb[e], key_msb);
+            keyed |= 1 << e;
+          }
+        }
+        write_channel_intel(ch_load2aes[e], line);
+        if (line.last)
+          write_channel_intel(ch_header2aes[e], header);
+      }
+    }
+
+    n_lines++;
+    aes_engine_id++;
+
+    if (datain.last) {
+      pages++;
+      gzip_engine_id++;
+      n_lines = 0;
+      aes_engine_id = 0;
+      setup.offset += mem_offset;
+      setup.page++;
+    }
+#else
+#if AES_PAGE_IV
+    if (first)
+      setup.iv = aes_page_iv(config_data, setup.page, key_lsb, key_msb);
 #endif
-#if AES_ENGINES > 6
-      case 6:
-        if (first)
-          write_channel_intel(ch_aes_enc_setup[6], setup);
-        write_channel_intel(ch_load2aes[6], datain);
-        if (datain.last)
-          write_channel_intel(ch_header2aes[6], header);
-        break;
+#ifdef AES_MODE_XTS
+    if (first)
+      setup.tweak = xts_page_tweak(setup.page, tweak_key_lsb, tweak_key_msb);
 #endif
-#if AES_ENGINES > 7
-      case 7:
-        if (first)
-          write_channel_intel(ch_aes_enc_setup[7], setup);
-        write_channel_intel(ch_load2aes[7], datain);
+
+    #pragma unroll
+    for (unsigned char e = 0; e < AES_ENGINES; e++) {
+      if (e == aes_engine_id) {
+        if (first) {
+          setup.new_key = (keyed & (1 << e)) == 0;
+          write_channel_intel(ch_aes_enc_setup[e], setup);
+          if (setup.new_key) {
+            write_channel_intel(ch_aes_enc_keylsb[e], key_lsb);
+            write_channel_intel(ch_aes_enc_keymsb[e], key_msb);
+            keyed |= 1 << e;
+          }
+        }
+        write_channel_intel(ch_load2aes[e], datain);
         if (datain.last)
-          write_channel_intel(ch_header2aes[7], header);
-        break;
-#endif
+          write_channel_intel(ch_header2aes[e], header);
+      }
     }
 
     first = false;
@@ -134,7 +153,9 @@ void kernel aes_loadbalancer(
       gzip_engine_id++;
       first = true;
       setup.offset += mem_offset;
+      setup.page++;
     }
+#endif
 
     if (aes_engine_id == AES_ENGINES)
       aes_engine_id = 0;
@@ -1,3 +1,4 @@
 #include "gzip.cl"
 #include "aes.cl"
+#include "inflate.cl"
 #include "aes_load-balancer.cl"
@@ -29,27 +29,156 @@
 // choose 4 or 8 or 16 (LEN <= VEC)
 #define LEN VEC
 
-//depth of the dictionary buffers
-//can also go to depth 1024 which slightly improves quality
-//but must change hash function to take advantage of that
-#define DEPTH 512
+//depth of the dictionary buffers (DEPTH) and the hash (LZ_HASH, HASH_BITS wide)
+//are defined in compNcrypt.h, shared with the host model
+
+//Distance (in cycles) up to which histogram updates are forwarded from registers
+#define HIST_DIST 4
+
+//---------------------------------------------------------------------------------------
+// histogram
+//---------------------------------------------------------------------------------------
+
+// First pass over the input: byte histogram of every page, written to hist[page][256].
+// The host builds the Huffman table and marker of each page from it.
+__attribute__((max_global_work_dim(0)))
+void kernel histogram0 (
+    volatile global unsigned char  *restrict input,
+    global unsigned int            *restrict hist,
+    unsigned int insize,
+    unsigned int page_size) {
+
+  // one bank per byte lane, each lane updates its own bank every cycle
+  unsigned int __attribute__((singlepump,numbanks(VEC),numreadports(1),numwriteports(1))) count[HUFTABLESIZE][VEC];
+
+  // the last HIST_DIST updates of every lane, forwarded while they are still in flight
+  unsigned char recent_sym[HIST_DIST][VEC];
+  unsigned int recent_count[HIST_DIST][VEC];
+  bool recent_valid[HIST_DIST][VEC];
+
+  for (short b = 0; b < HUFTABLESIZE; b++) {
+    #pragma unroll
+    for (char l = 0; l < VEC; l++)
+      count[b][l] = 0;
+  }
+
+  unsigned int n_pages = insize / page_size;
+
+  for (unsigned int page = 0; page < n_pages; page++) {
+    #pragma unroll
+    for (char d = 0; d < HIST_DIST; d++) {
+      #pragma unroll
+      for (char l = 0; l < VEC; l++)
+        recent_valid[d][l] = false;
+    }
+
+    unsigned int inpos = page * page_size;
+
+    #pragma ivdep array(count) safelen(HIST_DIST)
+    for (unsigned int pagepos = 0; pagepos < page_size; pagepos += VEC) {
+      #pragma unroll
+      for (char l = 0; l < VEC; l++) {
+        unsigned char sym = input[inpos+pagepos+l];
+        unsigned int c = count[sym][l];
+
+        // the most recent update wins
+        #pragma unroll
+        for (char d = HIST_DIST - 1; d >= 0; d--)
+          c = (recent_valid[d][l] && recent_sym[d][l] == sym) ? recent_count[d][l] : c;
+        c++;
+        count[sym][l] = c;
+
+        #pragma unroll
+        for (char d = HIST_DIST - 1; d > 0; d--) {
+          recent_sym[d][l] = recent_sym[d-1][l];
+          recent_count[d][l] = recent_count[d-1][l];
+          recent_valid[d][l] = recent_valid[d-1][l];
+        }
+        recent_sym[0][l] = sym;
+        recent_count[0][l] = c;
+        recent_valid[0][l] = true;
+      }
+    }
+
+    // sum the lanes and clear them for the next page
+    for (short b = 0; b < HUFTABLESIZE; b++) {
+      unsigned int sum = 0;
+      #pragma unroll
+      for (char l = 0; l < VEC; l++) {
+        sum += count[b][l];
+        count[b][l] = 0;
+      }
+      hist[page*HUFTABLESIZE + b] = sum;
+    }
+  }
+}
 
 //---------------------------------------------------------------------------------------
 // load lz
 //---------------------------------------------------------------------------------------
+
+// CRC32C register after the first n of VEC more bytes, bit serial and fully unrolled
+// into an XOR tree
+unsigned int crc32c_vec(unsigned int crc, unsigned char *data, unsigned int n) {
+  #pragma unroll
+  for (char i = 0; i < VEC; i++) {
+    unsigned int c = crc ^ data[i];
+    #pragma unroll
+    for (char b = 0; b < 8; b++)
+      c = (c >> 1) ^ ((c & 1) ? CRC32C_POLY : 0);
+    crc = (i < n) ? c : crc;
+  }
+  return crc;
+}
+
 void load_lz_internal (
     volatile global unsigned char  *restrict input,
+    volatile global unsigned char  *restrict markers,
+    volatile global unsigned char  *restrict page_flags,
     unsigned int insize,
-    unsigned int page_size,
-    unsigned char marker) {
+    unsigned int page_size) {
 
   // Initialize input stream position
   unsigned int inpos = 0;
   unsigned int pagepos = 0;
+  unsigned int page = 0;
   unsigned int engine_id = 0;
   bool first = true;
+  bool stored = false;
+  unsigned char marker = 0;
+  unsigned int crc = 0xFFFFFFFF;
+  unsigned int page_bytes = 0;
+  unsigned int stored_size = 0;
+  struct gzip_to_aes_t line;
 
   do {
+    // every page has its own marker (the first byte of its LZ stream), stored
+    // pages go to store_huff as they are
+    if (first) {
+      marker = markers[page];
+      stored = (page_flags[page] & HDR_FLAG_STORED) != 0;
+
+      // the last page is padded up to page_size
+      page_bytes = (insize - inpos < page_size) ? insize - inpos : page_size;
+
+      // a stored page ends with the line that holds its last input byte, the padding
+      // behind it is not written
+      stored_size = (page_bytes + 63) / 64 * 64;
+      stored_size = !stored ? 0 : (stored_size < page_size) ? stored_size : page_size;
+      switch (engine_id) {
+        case 0: write_channel_intel(ch_stored_size[0], stored_size); break;
+#if GZIP_ENGINES > 1
+        case 1: write_channel_intel(ch_stored_size[1], stored_size); break;
+#endif
+#if GZIP_ENGINES > 2
+        case 2: write_channel_intel(ch_stored_size[2], stored_size); break;
+#endif
+#if GZIP_ENGINES > 3
+        case 3: write_channel_intel(ch_stored_size[3], stored_size); break;
+#endif
+      }
+    }
+
     struct lz_input_t in;
     #pragma unroll
     for (char i = 0; i < VEC; i++)
@@ -57,7 +186,38 @@ void load_lz_internal (
     in.last = ((pagepos + VEC) == page_size);
     in.marker = marker;
 
-    if (first) {
+    unsigned int valid = (page_bytes > pagepos) ? page_bytes - pagepos : 0;
+    crc = crc32c_vec(first ? 0xFFFFFFFF : crc, in.data, valid);
+
+    // a line holds STORED_SLOTS reads, each short is two input bytes in memory order
+    unsigned char slot = (pagepos / VEC) & (STORED_SLOTS - 1);
+    #pragma unroll
+    for (unsigned char s = 0; s < STORED_SLOTS; s++) {
+      #pragma unroll
+      for (char j = 0; j < VEC/2; j++) {
+        unsigned short value = in.data[2*j] | ((unsigned short)in.data[2*j+1] << 8);
+        line.data[s*(VEC/2) + j] = (slot == s) ? value : ((slot == 0) ? 0 : line.data[s*(VEC/2) + j]);
+      }
+    }
+    line.last = (pagepos + VEC) == stored_size;
+    bool write_line = ((slot == STORED_SLOTS - 1) || line.last) && pagepos < stored_size;
+
+    if (stored) {
+      if (write_line) {
+        switch (engine_id) {
+          case 0: write_channel_intel(ch_stored_in[0], line); break;
+#if GZIP_ENGINES > 1
+          case 1: write_channel_intel(ch_stored_in[1], line); break;
+#endif
+#if GZIP_ENGINES > 2
+          case 2: write_channel_intel(ch_stored_in[2], line); break;
+#endif
+#if GZIP_ENGINES > 3
+          case 3: write_channel_intel(ch_stored_in[3], line); break;
+#endif
+        }
+      }
+    } else if (first) {
       switch (engine_id) {
         case 0: write_channel_intel(ch_lz_in_first_value[0], in); break;
 #if GZIP_ENGINES > 1
@@ -85,12 +245,32 @@ void load_lz_internal (
       }
     }
 
+    if (in.last) {
+      struct page_info_t info;
+      info.crc32c = ~crc;
+      info.page_bytes = page_bytes;
+
+      switch (engine_id) {
+        case 0: write_channel_intel(ch_page_info[0], info); break;
+#if GZIP_ENGINES > 1
+        case 1: write_channel_intel(ch_page_info[1], info); break;
+#endif
+#if GZIP_ENGINES > 2
+        case 2: write_channel_intel(ch_page_info[2], info); break;
+#endif
+#if GZIP_ENGINES > 3
+        case 3: write_channel_intel(ch_page_info[3], info); break;
+#endif
+      }
+    }
+
     first = false;
     inpos += VEC;
     pagepos += VEC;
 
     if (pagepos == page_size) {
       pagepos = 0;
+      page++;
       first = true;
       engine_id++;
     }
@@ -98,17 +278,19 @@ void load_lz_internal (
     if (engine_id == GZIP_ENGINES)
       engine_id = 0;
 
-  } while (inpos < insize);
+    // the buffer holds whole pages, the last one is finished past insize
+  } while (inpos < insize || pagepos != 0);
 }
 
 __attribute__((max_global_work_dim(0)))
 void kernel load_lz0 (
     // Use volatile to prevent caching, which wastes area and hurts Fmax
     volatile global unsigned char  *restrict input,
-    unsigned int insize,
-    unsigned int page_size,
-    unsigned char marker) {
-  load_lz_internal(input, insize, page_size, marker);
+    volatile global unsigned char  *restrict markers,
+    volatile global unsigned char  *restrict page_flags,
+    unsigned int insize,      // input bytes, the buffer is padded with zeros to whole pages
+    unsigned int page_size) {
+  load_lz_internal(input, markers, page_flags, insize, page_size);
 }
 
 //---------------------------------------------------------------------------------------
@@ -119,6 +301,53 @@ struct dict_string {
   unsigned char s[LEN];
 };
 
+#if GZIP_DEFLATE
+//---------------------------------------------------------------------------------------
+// DEFLATE symbols (fixed Huffman codes, RFC 1951 3.2.6)
+//---------------------------------------------------------------------------------------
+
+// hufenc packs codes MSB first and store_huff reverses every short, so Huffman codes are
+// passed as they are and extra bits are passed reversed (they go LSB first).
+unsigned short bitrev16(unsigned short x) {
+  unsigned short r = 0;
+  #pragma unroll
+  for (char i = 0; i < 16; i++)
+    r |= ((x >> i) & 1) << (15 - i);
+  return r;
+}
+
+// code and extra bits of a match length (3..258), at most 8 + 5 bits
+unsigned short deflate_length(unsigned short length, unsigned char *bits) {
+  unsigned char l = length - 3;
+  char msb = 0;
+  #pragma unroll
+  for (char b = 1; b < 8; b++)
+    msb = (l >> b) ? b : msb;
+
+  unsigned char n_extra = (l < 8 || l == 255) ? 0 : msb - 2;
+  unsigned short sym = (l < 8) ? 257 + l : ((l == 255) ? 285 : 257 + 4 * (msb - 1) + ((l >> n_extra) & 3));
+  unsigned short code = (sym < 280) ? sym - 256 : sym - 280 + 0xC0;
+  unsigned short extra = bitrev16(l & ((1 << n_extra) - 1)) >> (16 - n_extra);
+
+  *bits = ((sym < 280) ? 7 : 8) + n_extra;
+  return (code << n_extra) | extra;
+}
+
+// 5-bit code of a match distance (1..32768), its extra bits (up to 13) are a separate symbol
+unsigned char deflate_distance(unsigned int distance, unsigned short *extra, unsigned char *extra_bits) {
+  unsigned short d = distance - 1;
+  char msb = 0;
+  #pragma unroll
+  for (char b = 1; b < 15; b++)
+    msb = (d >> b) ? b : msb;
+
+  unsigned char n_extra = (d < 4) ? 0 : msb - 1;
+  *extra = bitrev16(d & ((1 << n_extra) - 1)) >> (16 - n_extra);
+  *extra_bits = n_extra;
+  return (d < 4) ? d : 2 * msb + ((d >> n_extra) & 1);
+}
+#endif
+
 
 void lz_internal (unsigned int engine_id) {
   //-------------------------------------
@@ -163,10 +392,23 @@ void lz_internal (unsigned int engine_id) {
 
   // first_valid_pos is loop-carried, and tricky to compute.  So first compute it speculatively
   // in parallel for every possible value of the previous first_valid_pos.
-  char first_valid_pos_speculative[VEC];
+  char first_valid_pos_speculative[VEC+1];
   // don't need to speculatively compute first_valid_full for performance, but it's more
   // convenient to also do it for first_valid_full if doing it for first_valid_pos.
-  char first_valid_full_speculative[VEC];
+  char first_valid_full_speculative[VEC+1];
+  // same for the extension of the window's last match
+  bool extend_speculative[VEC+1];
+  unsigned char extend_offset_speculative[VEC+1];
+
+  // Match continuation: a LEN-byte match whose source lies within LZ_CONT_DIST bytes is carried
+  // into the next window(s) and emitted as an escape token (length nibble LZ_EXT_NIBBLE) whose
+  // extra length byte follows once the match ends (in DEFLATE mode the whole match is emitted
+  // then). The source bytes are always in current_window or previous_window, so no extra
+  // dictionary port is needed.
+  unsigned char previous_window[LZ_CONT_DIST];
+  bool cont_active = false;
+  unsigned char cont_offset = 1;
+  unsigned char cont_ext = 0;
 
   // Initialize history to empty.
   for (int i = 0; i < DEPTH; ++i) {
@@ -176,6 +418,10 @@ void lz_internal (unsigned int engine_id) {
     }
   }
 
+  #pragma unroll
+  for (char i = 0; i < LZ_CONT_DIST; i++)
+    previous_window[i] = 0;
+
   // Initialize input stream position
   unsigned int inposMinusVecDiv16 = 0;
   unsigned int outpos_lz = 0;
@@ -198,8 +444,13 @@ void lz_internal (unsigned int engine_id) {
 
     // shift current window
     #pragma unroll
-    for (char i = 0; i < VEC; i++)
+    for (char i = 0; i < LZ_CONT_DIST - VEC; i++)
+      previous_window[i] = previous_window[i+VEC];
+    #pragma unroll
+    for (char i = 0; i < VEC; i++) {
+      previous_window[LZ_CONT_DIST-VEC+i] = current_window[i];
       current_window[i] = current_window[i+VEC];
+    }
 
     // load in new data
     in = read_channel_intel(ch_lz_in[engine_id]);
@@ -213,8 +464,7 @@ void lz_internal (unsigned int engine_id) {
 
     #pragma unroll
     for (char i = 0; i < VEC; i++) {
-      unsigned short first_shifted  = current_window[i];
-      hash[i] = ((first_shifted << 1) ^ current_window[i+1] ^ (current_window[i+2])) & 0x1ff; // 9 bits
+      hash[i] = LZ_HASH(current_window[i], current_window[i+1], current_window[i+2]); // HASH_BITS bits
     }
 
     //-----------------------------
@@ -304,7 +554,7 @@ void lz_internal (unsigned int engine_id) {
       // check if this the best length
       #pragma unroll
       for (char m = 0; m < VEC; m++) {
-        bool updateBest = (length[m] > bestlength[m]) && (compare_offset[i][m] != 0) && (((inposMinusVecDiv16<<4)|(i&0xf))-(compare_offset[i][m]) < 0x40000);
+        bool updateBest = (length[m] > bestlength[m]) && (compare_offset[i][m] != 0) && (((inposMinusVecDiv16<<4)|(i&0xf))-(compare_offset[i][m]) < LZ_MAX_OFFSET);
         bestoffset[m] = (updateBest ? ((inposMinusVecDiv16<<4)|(m&0xf))-(compare_offset[i][m]) : bestoffset[m]) & 0x7ffff;  //19 bits is sufficient
         bestlength[m] = (updateBest ? length[m] : bestlength[m]) & 0x1f;    //5 bits is sufficient
       }
@@ -322,11 +572,46 @@ void lz_internal (unsigned int engine_id) {
     }
 
     //-----------------------------
-    // Assign first_valid_pos
+    // Match continuation
     //-----------------------------
 
+    // a full-length match can be extended if its source is within LZ_CONT_DIST bytes and the first
+    // byte past its reach (in the lookahead) still matches. Never start one in the last window.
+    bool extend[VEC];
+    #pragma unroll
+    for (char i = 0; i < VEC; i++) {
+      unsigned int offset = bestoffset[i] & 0x7ffff;
+      int q = i + LEN - (int)offset;
+      unsigned char src = (q >= 0) ? current_window[q & (VECX2-1)] : previous_window[(LZ_CONT_DIST + q) & (LZ_CONT_DIST-1)];
+      extend[i] = (bestlength[i] == LEN) && (offset <= LZ_CONT_DIST) && !in.last &&
+        (current_window[i+LEN] == src);
+    }
+
+    // bytes of this window (plus the first lookahead byte) that continue the active match
+    bool run[VEC+1];
+    #pragma unroll
+    for (char p = 0; p <= VEC; p++) {
+      unsigned char src = (p >= cont_offset) ? current_window[(p - cont_offset) & (VECX2-1)] :
+                                               previous_window[(LZ_CONT_DIST + p - cont_offset) & (LZ_CONT_DIST-1)];
+      run[p] = current_window[p] == src;
+    }
+
+    // for every possible first_valid_pos, the first byte the active match does not cover
+    char cont_end_speculative[VEC];
     #pragma unroll
     for (char guess = 0; guess < VEC; guess++) {
+      cont_end_speculative[guess] = VEC;
+      #pragma unroll
+      for (char p = 0; p < VEC; p++)
+        cont_end_speculative[guess] = (p >= guess && !run[p] && cont_end_speculative[guess] == VEC) ? p : cont_end_speculative[guess];
+    }
+
+    //-----------------------------
+    // Assign first_valid_pos
+    //-----------------------------
+
+    #pragma unroll
+    for (char guess = 0; guess <= VEC; guess++) {
       first_valid_pos_speculative[guess] = 0;
 
       // select the last index with a positive bestlength
@@ -339,6 +624,12 @@ void lz_internal (unsigned int engine_id) {
 
       first_valid_full_speculative[guess] = first_valid_pos_speculative[guess];
 
+      // the match reaching first_valid_full is the last one of the window. It is extended if it
+      // has full length (then it starts at first_valid_full - LEN).
+      char last_match = (first_valid_full_speculative[guess] - LEN) & (VEC-1);
+      extend_speculative[guess] = (first_valid_full_speculative[guess] >= LEN + guess) && extend[last_match];
+      extend_offset_speculative[guess] = bestoffset[last_match] & (2*LZ_CONT_DIST-1);
+
       // since first_valid_pos_speculative only needs 5 bits, >= VEC is the same at looking at bit 4, if true keep bits 3:0, else set to 0
       first_valid_pos_speculative[guess] = (first_valid_pos_speculative[guess] & 0x10) ? (first_valid_pos_speculative[guess] & 0xf) : 0;
 
@@ -349,15 +640,55 @@ void lz_internal (unsigned int engine_id) {
       first_valid_pos_speculative[guess] = __fpga_reg(first_valid_pos_speculative[guess]);
     }
 
+    // Fold the continuation into the speculation. For every (cont_active, first_valid_pos) pair,
+    // start is where the part of the window not covered by the previous match begins (VEC if
+    // all of it is covered). The active match goes on if it covers the whole window and the next
+    // byte, and its extra length byte can hold another window.
+    char start_speculative[2][VEC];
+    char next_valid_pos_speculative[2][VEC];
+    bool next_cont_speculative[2][VEC];
+    bool cont_continue_speculative[2][VEC];
+    #pragma unroll
+    for (char c = 0; c < 2; c++) {
+      #pragma unroll
+      for (char guess = 0; guess < VEC; guess++) {
+        char st = c ? cont_end_speculative[guess] : guess;
+        bool go_on = c && (st == VEC) && run[VEC] && !in.last && (cont_ext + VEC - guess <= LZ_EXT_MAX - VEC);
+        start_speculative[c][guess] = st;
+        cont_continue_speculative[c][guess] = go_on;
+        next_valid_pos_speculative[c][guess] = first_valid_pos_speculative[st];
+        next_cont_speculative[c][guess] = go_on || extend_speculative[st];
+      }
+    }
+
+    char previous_valid_pos = first_valid_pos & 0xf;
+    char start = start_speculative[cont_active][previous_valid_pos];
+    bool cont_continue = cont_continue_speculative[cont_active][previous_valid_pos];
+
     // remove matches covered by previous cycle.  We already did this speculatively to compute first_valid_pos,
     // but now do it for the actual first_valid_pos value for use in the rest of the loop
     #pragma unroll
     for(char i = 0; i < VEC; i++)
-      bestlength[i] = i < first_valid_pos ? -1 : bestlength[i];
+      bestlength[i] = i < start ? -1 : bestlength[i];
 
-    // for VEC=16 (the largest currently supported), this should be a 16:1 mux, which is 2 6LUTs deep.  For larger VEC, it will be worse.
-    first_valid_pos = first_valid_pos_speculative[ first_valid_pos & 0xf] & 0xf;    //first_valid_pos only needs 4 bits, make this explicit
-    char first_valid_full = first_valid_full_speculative[first_valid_pos];
+    // for VEC=16 (the largest currently supported), this should be a 32:1 mux (16 positions x continuation)
+    first_valid_pos = next_valid_pos_speculative[cont_active][previous_valid_pos] & 0xf;    //first_valid_pos only needs 4 bits, make this explicit
+    char first_valid_full = first_valid_full_speculative[start];
+
+    bool emit_ext = cont_active && !cont_continue;
+    unsigned char ext_byte = cont_ext + (start - previous_valid_pos);
+    unsigned char ext_offset = cont_offset;
+
+    bool extend_start = !cont_continue && extend_speculative[start];
+    char extend_index = (first_valid_full - LEN) & (VEC-1);
+
+    cont_active = next_cont_speculative[cont_active][previous_valid_pos];
+    if (cont_continue) {
+      cont_ext = ext_byte;
+    } else {
+      cont_offset = extend_offset_speculative[start];
+      cont_ext = 0;
+    }
 
     //-----------------------------
     // Filter matches "last-fit"
@@ -398,31 +729,94 @@ void lz_internal (unsigned int engine_id) {
     // Encode LZ bytes
     //-----------------------------
 
-    unsigned char output_buffer[VECX2];
+    huff_data_t output_buffer[VECX2];
     int output_buffer_size = 0;
 
     bool dontencode[VECX2];
+#if GZIP_DEFLATE
+    unsigned char output_bits[VECX2];
+#endif
 
     #pragma unroll
     for (int i = 0; i < VECX2; i++) {
       output_buffer[i] = 0;
       dontencode[i] = false;
+#if GZIP_DEFLATE
+      output_bits[i] = 0;
+#endif
     }
 
+#if GZIP_DEFLATE
+    if (first_iteration) {
+      // block header: BFINAL = 1, BTYPE = 01 (fixed Huffman codes)
+      dontencode[output_buffer_size] = true;
+      output_bits[output_buffer_size] = 3;
+      output_buffer[output_buffer_size++] = 0x6;
+      first_iteration = false;
+    }
+
+    if (emit_ext) {
+      // an extended match is emitted as a whole once it has ended
+      unsigned char length_bits, extra_bits;
+      unsigned short extra;
+      unsigned short length_code = deflate_length(VEC + ext_byte, &length_bits);
+      unsigned char distance_code = deflate_distance(ext_offset, &extra, &extra_bits);
+
+      dontencode[output_buffer_size] = true;
+      output_bits[output_buffer_size] = length_bits;
+      output_buffer[output_buffer_size++] = length_code;
+      dontencode[output_buffer_size] = true;
+      output_bits[output_buffer_size] = 5;
+      output_buffer[output_buffer_size++] = distance_code;
+      dontencode[output_buffer_size] = true;
+      output_bits[output_buffer_size] = extra_bits;
+      output_buffer[output_buffer_size++] = extra;
+    }
+
+    #pragma unroll
+    for (char i = 0; i < VEC; i++) {
+      if (bestlength[i] == 0) {
+        dontencode[output_buffer_size] = false;
+        output_buffer[output_buffer_size++] = current_window[i];
+      } else if (bestlength[i] > 0 && !(extend_start && i == extend_index)) {
+        unsigned char length_bits, extra_bits;
+        unsigned short extra;
+        unsigned short length_code = deflate_length(bestlength[i], &length_bits);
+        unsigned char distance_code = deflate_distance(bestoffset[i] & 0x7ffff, &extra, &extra_bits);
+
+        dontencode[output_buffer_size] = true;
+        output_bits[output_buffer_size] = length_bits;
+        output_buffer[output_buffer_size++] = length_code;
+        dontencode[output_buffer_size] = true;
+        output_bits[output_buffer_size] = 5;
+        output_buffer[output_buffer_size++] = distance_code;
+        dontencode[output_buffer_size] = true;
+        output_bits[output_buffer_size] = extra_bits;
+        output_buffer[output_buffer_size++] = extra;
+      }
+    }
+#else
     if (first_iteration) {
       // output marker byte at start
       output_buffer[output_buffer_size++] = marker;
       first_iteration = false;
     }
 
+    if (emit_ext) {
+      // extra length of the escape token, the match has ended
+      dontencode[output_buffer_size] = true;
+      output_buffer[output_buffer_size++] = ext_byte;
+    }
+
     #pragma unroll
     for (char i = 0; i < VEC; i++) {
       if (bestlength[i] == 0) {
         dontencode[output_buffer_size] = false;
         output_buffer[output_buffer_size++] = current_window[i];
 
+        // a literal marker is followed by a raw zero, read like a length byte
         if (current_window[i] == marker) {
-          dontencode[output_buffer_size] = 0;
+          dontencode[output_buffer_size] = true;
           output_buffer[output_buffer_size++] = 0;
         }
       } else if (bestlength[i] > 0) {
@@ -432,8 +826,8 @@ void lz_internal (unsigned int engine_id) {
 
         // 2-output bestlength
 
-        // fit b.l. in 4 bits and put in upper m.s.b's
-        unsigned char bestlength_byte = (bestlength[i] - 3) << 4;
+        // fit b.l. in 4 bits and put in upper m.s.b's, the escape nibble for an extended match
+        unsigned char bestlength_byte = (extend_start && i == extend_index) ? (LZ_EXT_NIBBLE << 4) : ((bestlength[i] - 3) << 4);
 
         // concat with lower 4 bestoffset bytes
         unsigned int offset = bestoffset[i] & 0x7ffff;  //19 bits
@@ -459,6 +853,7 @@ void lz_internal (unsigned int engine_id) {
         }
       }
     }
+#endif
     outpos_lz += output_buffer_size;
 
     //-----------------------------
@@ -470,13 +865,17 @@ void lz_internal (unsigned int engine_id) {
     for (char i = 0; i < VECX2; i++) {
       huff_data.data[i] = output_buffer[i];
       huff_data.dontencode[i] = dontencode[i];
+#if GZIP_DEFLATE
+      huff_data.bits[i] = output_bits[i];
+#endif
       // valid array contains '1' if there is data at this output_buffer position, zero otherwise
       if (i < output_buffer_size)
         huff_data.valid[i] = true;
       else
         huff_data.valid[i] = false;
     }
-    huff_data.last = in.last;
+    // the page ends with the tail below
+    huff_data.last = false;
 
     write_channel_intel(ch_huffman_input[engine_id], huff_data);
 
@@ -484,7 +883,52 @@ void lz_internal (unsigned int engine_id) {
     inposMinusVecDiv16++;
   } while (!in.last);
 
-  // have to output first_valid_pos to tell the host from where to start writing
+  // The last VEC bytes are only ever seen as lookahead. Emit the ones not covered by a
+  // match as literals (and the end of block in DEFLATE mode), so that each page is a
+  // complete stream.
+  {
+    struct huffman_input_t huff_data;
+    int output_buffer_size = 0;
+
+    #pragma unroll
+    for (char i = 0; i < VECX2; i++) {
+      huff_data.data[i] = 0;
+#if GZIP_DEFLATE
+      huff_data.bits[i] = 0;
+#endif
+      huff_data.dontencode[i] = false;
+      huff_data.valid[i] = false;
+    }
+
+    #pragma unroll
+    for (char i = 0; i < VEC; i++) {
+      if (i >= first_valid_pos) {
+        huff_data.valid[output_buffer_size] = true;
+        huff_data.data[output_buffer_size++] = current_window[VEC+i];
+#if !GZIP_DEFLATE
+        // up to VEC literal markers and their raw zeros still fit VECX2
+        if (current_window[VEC+i] == marker) {
+          huff_data.valid[output_buffer_size] = true;
+          huff_data.dontencode[output_buffer_size] = true;
+          huff_data.data[output_buffer_size++] = 0;
+        }
+#endif
+      }
+    }
+
+#if GZIP_DEFLATE
+    // end of block, symbol 256 is the 7-bit code 0
+    huff_data.valid[output_buffer_size] = true;
+    huff_data.dontencode[output_buffer_size] = true;
+    huff_data.bits[output_buffer_size++] = 7;
+#endif
+    huff_data.last = true;
+
+    write_channel_intel(ch_huffman_input[engine_id], huff_data);
+    outpos_lz += output_buffer_size;
+  }
+
+  // first_valid_pos of the tail, for the header
   write_channel_intel(ch_lz_out_first_valid_pos[engine_id], first_valid_pos);
 
   // return lz compressed size
@@ -524,13 +968,17 @@ void kernel lz77_3 () {
 
 void load_huff_coeff_internal (
     volatile global unsigned int   *restrict huftableOrig,
+    volatile global unsigned char  *restrict page_flags,
     unsigned int n_pages) {
 
   unsigned int engine_id = 0;
 
+  // one table per page, none for stored pages
   for (short p = 0; p < n_pages; p++) {
-    for (short i = 0; i < HUFTABLESIZE; i++) {
-      int huff_entry = huftableOrig[i];
+    bool stored = (page_flags[p] & HDR_FLAG_STORED) != 0;
+
+    for (short i = 0; i < HUFTABLESIZE && !stored; i++) {
+      int huff_entry = huftableOrig[p*HUFTABLESIZE + i];
       
       switch(engine_id) {
         case 0: write_channel_intel(ch_huffman_coeff[0], huff_entry); break;
@@ -556,8 +1004,9 @@ void load_huff_coeff_internal (
 __attribute__((max_global_work_dim(0)))
 void kernel load_huff_coeff0 (
     volatile global unsigned int   *restrict huftableOrig,
+    volatile global unsigned char  *restrict page_flags,
     unsigned int n_pages) {
-    load_huff_coeff_internal(huftableOrig, n_pages);
+    load_huff_coeff_internal(huftableOrig, page_flags, n_pages);
 }
 
 //---------------------------------------------------------------------------------------
@@ -566,16 +1015,25 @@ void kernel load_huff_coeff0 (
 
 // assembles up to VECX2 unsigned char values based on given huffman encoding
 // writes up to MAX_HUFFCODE_BITS * VECX2 bits to memory
+// symbols marked dontencode are written as they are: 8 bits, or bits[i] bits in DEFLATE mode
 bool hufenc(unsigned short huftable[HUFTABLESIZE], unsigned char huflen[HUFTABLESIZE],
-    unsigned char *data, bool *valid, bool *dontencode, unsigned short *outdata,
-    unsigned short *leftover, unsigned short *leftover_size) {
+    huff_data_t *data, bool *valid, bool *dontencode,
+#if GZIP_DEFLATE
+    unsigned char *bits,
+#endif
+    unsigned short *outdata, unsigned short *leftover, unsigned short *leftover_size) {
+#if GZIP_DEFLATE
+  #define RAW_BITS(i) bits[i]
+#else
+  #define RAW_BITS(i) 8
+#endif
 
   // array that contains the bit position of each symbol
   unsigned short bitpos[VECX2 + 1];
   bitpos[0] = 0;
   #pragma unroll
   for (char i = 0; i < VECX2 ; i++)  {
-    bitpos[i + 1] = bitpos[i] + (valid[i] ? (dontencode[i] ? 8 : huflen[data[i]]) : 0);
+    bitpos[i + 1] = bitpos[i] + (valid[i] ? (dontencode[i] ? RAW_BITS(i) : huflen[data[i]]) : 0);
   }
 
   // leftover is an array that carries huffman encoded data not yet written to memory
@@ -601,8 +1059,8 @@ bool hufenc(unsigned short huftable[HUFTABLESIZE], unsigned char huflen[HUFTABLE
   ushort2 code[VECX2];
   #pragma unroll
   for (char i = 0; i < VECX2; i++)  {
-    unsigned short curr_code = dontencode[i] ? data[i] : huftable[data[i]];
-    unsigned char curr_code_len = dontencode[i] ? 8 : huflen[data[i]];
+    unsigned short curr_code = dontencode[i] ? data[i] : huftable[data[i] & (HUFTABLESIZE - 1)];
+    unsigned char curr_code_len = dontencode[i] ? RAW_BITS(i) : huflen[data[i] & (HUFTABLESIZE - 1)];
     unsigned char bitpos_in_short = bitpos[i] & 0x0F;
 
     unsigned int temp = (unsigned int)curr_code << 16;
@@ -650,6 +1108,7 @@ bool hufenc(unsigned short huftable[HUFTABLESIZE], unsigned char huflen[HUFTABLE
       leftover[i] |= outdata[i];
   }
 
+  #undef RAW_BITS
   return write;
 }
 
@@ -686,7 +1145,11 @@ void huff_internal (unsigned int engine_id) {
       in = read_channel_intel(ch_huffman_input[engine_id]);
 
       struct huffman_output_t outdata;
-      outdata.write = hufenc(huftable, huflen, in.data, in.valid, in.dontencode, outdata.data, leftover, &leftover_size);
+      outdata.write = hufenc(huftable, huflen, in.data, in.valid, in.dontencode,
+#if GZIP_DEFLATE
+          in.bits,
+#endif
+          outdata.data, leftover, &leftover_size);
       outdata.last = in.last;
 
       outpos_huffman = outdata.write ? outpos_huffman + 1 : outpos_huffman;
@@ -703,11 +1166,9 @@ void huff_internal (unsigned int engine_id) {
       outdata.data[i] = leftover[i];
     write_channel_intel(ch_huffman_output_last_value[engine_id], outdata);
 
-    // change to count of shorts
-    outpos_huffman = outpos_huffman * VECX2;
-    outpos_huffman = outpos_huffman + (leftover_size >> 4) + ((leftover_size & 0x7) != 0);
-    // return compressed size as size of chars
-    write_channel_intel(ch_huffman_out_compsize_huffman[engine_id], outpos_huffman*2);
+    // return compressed size as size of chars, counting every started byte of the leftover
+    outpos_huffman = outpos_huffman * VECX2 * 2 + ((leftover_size + 7) >> 3);
+    write_channel_intel(ch_huffman_out_compsize_huffman[engine_id], outpos_huffman);
   }
 }
 
@@ -753,18 +1214,36 @@ void store_huff_internal (unsigned int engine_id) {
     bool previous_last = false;
     bool the_end = false;
 
+    // the lines of a stored page come straight from load_lz
+    unsigned int stored_size = read_channel_intel(ch_stored_size[engine_id]);
+    bool stored = stored_size != 0;
+
     do {
-      if (!previous_last)
+      if (stored) {
+        struct gzip_to_aes_t line = read_channel_intel(ch_stored_in[engine_id]);
+        #pragma unroll
+        for (unsigned int i=0; i<VECX2; i++) {
+          indata.data[i] = line.data[i];
+        }
+        indata.write = true;
+        indata.last = line.last;
+      } else if (!previous_last) {
         indata = read_channel_intel(ch_huffman_output[engine_id]);
-      else
+      } else {
         indata = read_channel_intel(ch_huffman_output_last_value[engine_id]);
+      }
 
-      the_end = indata.last && previous_last;
+      the_end = indata.last && (previous_last || stored);
       previous_last = indata.last;
 
+      // hufenc fills each short MSB first, DEFLATE streams fill each byte LSB first
       #pragma unroll
       for (unsigned int i=0; i<VECX2; i++) {
+#if GZIP_DEFLATE
+        outdata.data[i] = stored ? indata.data[i] : bitrev16(indata.data[i]);
+#else
         outdata.data[i] = indata.data[i];
+#endif
       }
 
       outdata.last = the_end;
@@ -775,9 +1254,20 @@ void store_huff_internal (unsigned int engine_id) {
     
     // Store summary values from lz and huffman
     struct gzip_header_t header;
-    header.first_valid_pos = read_channel_intel(ch_lz_out_first_valid_pos[engine_id]);
-    header.compsize_lz = read_channel_intel(ch_lz_out_compsize_lz[engine_id]);
-    header.compsize_huffman = read_channel_intel(ch_huffman_out_compsize_huffman[engine_id]);
+    if (stored) {
+      header.first_valid_pos = VEC;
+      header.compsize_lz = stored_size;
+      header.compsize_huffman = stored_size;
+    } else {
+      header.first_valid_pos = read_channel_intel(ch_lz_out_first_valid_pos[engine_id]);
+      header.compsize_lz = read_channel_intel(ch_lz_out_compsize_lz[engine_id]);
+      header.compsize_huffman = read_channel_intel(ch_huffman_out_compsize_huffman[engine_id]);
+    }
+    header.stored = stored;
+
+    struct page_info_t info = read_channel_intel(ch_page_info[engine_id]);
+    header.crc32c = info.crc32c;
+    header.page_bytes = info.page_bytes;
     write_channel_intel(ch_gzip2header[engine_id], header);
   }
 }
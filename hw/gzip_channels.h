@@ -33,6 +33,9 @@
 
 #define HUFTABLESIZE 256
 
+// Input reads of VEC bytes in a line (VECX2 shorts) of a stored page
+#define STORED_SLOTS (2 * VECX2 / VEC)
+
 //Maximum length of huffman codes
 #define MAX_HUFFCODE_BITS 16
 
@@ -42,8 +45,19 @@ struct lz_input_t {
   bool last;
 };
 
+#if GZIP_DEFLATE
+// literals are Huffman coded from the table, everything else (block header, lengths,
+// distances, end of block) comes as bits[i] raw bits, MSB first
+typedef unsigned short huff_data_t;
+#else
+typedef unsigned char huff_data_t;
+#endif
+
 struct huffman_input_t {
-  unsigned char data[VECX2];
+  huff_data_t data[VECX2];
+#if GZIP_DEFLATE
+  unsigned char bits[VECX2];
+#endif
   bool dontencode[VECX2];
   bool valid[VECX2];
   bool last;
@@ -59,6 +73,15 @@ struct gzip_header_t {
   unsigned int first_valid_pos;
   unsigned int compsize_lz;
   unsigned int compsize_huffman;
+  bool stored; // HDR_FLAG_STORED, compsize_huffman is then the page size
+  unsigned int crc32c;
+  unsigned int page_bytes;
+};
+
+// Sent by load_lz at the end of every page
+struct page_info_t {
+  unsigned int crc32c;
+  unsigned int page_bytes; // input bytes, the rest of the page is padding
 };
 
 struct gzip_to_aes_t {
@@ -67,10 +90,32 @@ struct gzip_to_aes_t {
 };
 
 struct aes_enc_setup_t {
-  int8 key;
   global long8 *restrict out;
   int8 config_data;
   unsigned int offset;
+  unsigned int page;
+  ulong2 iv;    // aes_page_iv of the page, zero in ECB and XTS
+#ifdef AES_MODE_XTS
+  ulong2 tweak; // E_K2(page), tweak of the first block of the page
+#endif
+  bool new_key; // the round keys follow on ch_aes_enc_key*, first setup of a launch
+};
+
+// Line of a page striped across the AES engines (AES_STRIPE)
+struct aes_line_t {
+  unsigned short data[VECX2];
+  unsigned int line;
+  bool first; // first line of the page seen by this engine
+  bool last;  // last line of the page
+};
+
+// Bit of the AES config word that marks the first line of a page
+#define AES_CONFIG_PAGE_START 0x80000000
+
+// Keystream/ciphertext lines from an AES engine to its GHASH unit
+struct gcm_line_t {
+  long8 data;
+  bool last;
 };
 
 channel struct lz_input_t ch_lz_in[GZIP_ENGINES]  __attribute__((depth(64)));
@@ -84,6 +129,14 @@ channel struct huffman_output_t ch_huffman_output[GZIP_ENGINES] __attribute__((d
 channel struct huffman_output_t ch_huffman_output_last_value[GZIP_ENGINES] __attribute__((depth(2)));
 channel unsigned int ch_huffman_coeff[GZIP_ENGINES];
 
+// Stored pages skip lz77 and huff: load_lz sends store_huff the size of every
+// stored page (0 for the others), then its lines as they are
+channel unsigned int ch_stored_size[GZIP_ENGINES] __attribute__((depth(2)));
+channel struct gzip_to_aes_t ch_stored_in[GZIP_ENGINES] __attribute__((depth(64)));
+
+// CRC32C and length of every page, computed by load_lz while it streams the page
+channel struct page_info_t ch_page_info[GZIP_ENGINES] __attribute__((depth(2)));
+
 // We write out a few integer values at the end of the compression
 channel unsigned int ch_lz_out_first_valid_pos[GZIP_ENGINES];
 channel unsigned int ch_lz_out_compsize_lz[GZIP_ENGINES];
@@ -92,7 +145,19 @@ channel struct gzip_header_t ch_gzip2header[GZIP_ENGINES] __attribute__((depth(2
 channel struct gzip_header_t ch_header2aes[AES_ENGINES] __attribute__((depth(2)));
 
 channel struct gzip_to_aes_t ch_gzip2load[GZIP_ENGINES] __attribute__((depth(64)));
+#if AES_STRIPE
+channel struct aes_line_t ch_load2aes[AES_ENGINES] __attribute__((depth(4096/VECX2)));
+#else
 channel struct gzip_to_aes_t ch_load2aes[AES_ENGINES] __attribute__((depth(4096/VECX2)));
+#endif
 
 channel struct aes_enc_setup_t ch_aes_enc_setup[AES_ENGINES] __attribute__((depth(2)));
+// Encryption round keys, expanded once per launch by the load balancer
+channel long16 ch_aes_enc_keylsb[AES_ENGINES];
+channel long16 ch_aes_enc_keymsb[AES_ENGINES];
+
+#ifdef AES_MODE_GCM
+channel struct gcm_line_t ch_aes2ghash[AES_ENGINES] __attribute__((depth(32)));
+channel ulong2 ch_ghash2aes[AES_ENGINES];
+#endif
 #endif
@@ -0,0 +1,354 @@
+// Read path: decrypt, Huffman decode and LZ decode of the pages back to plaintext
+
+#include "gzip_channels.h"
+
+#if !GZIP_DEFLATE
+
+// Forwarding distance of the LZ history, copies with a shorter offset read registers
+#define INFLATE_DIST 4
+
+// 32-bit words in a 512-bit line
+#define LINE_WORDS 16
+
+// Raw bytes that follow a marker in the Huffman stream
+#define RAW_NONE    0
+#define RAW_LENGTH  1 // length nibble and offset bits 0..3, 0 for a literal marker
+#define RAW_OFFSET  2 // offset bits 4..10, bit 7 set if a second offset byte follows
+#define RAW_OFFSET2 3 // offset bits 11..17
+#define RAW_EXT     4 // extra length of an extended match
+
+struct inflate_byte_t {
+  unsigned char data;
+  bool literal; // byte of a stored page
+  bool last;
+};
+
+union inflate_line_u {
+  unsigned short data[2*LINE_WORDS];
+  long8 datalong;
+};
+
+channel long16 ch_inflate_keylsb[2];
+channel long16 ch_inflate_keymsb[2];
+
+channel long8 ch_inflate_header __attribute__((depth(2)));
+channel long8 ch_inflate_lines __attribute__((depth(64)));
+channel struct inflate_byte_t ch_inflate_lz __attribute__((depth(64)));
+channel uint ch_inflate_page_bytes __attribute__((depth(2)));
+
+//---------------------------------------------------------------------------------------
+// Key schedules
+//---------------------------------------------------------------------------------------
+
+#ifdef AES_MODE_XTS
+__attribute__((max_global_work_dim(0)))
+void kernel inflate_keygen0(int8 key, int8 tweak_key)
+{
+  write_channel_intel(ch_inflate_keylsb[1], aes_key_256_decrypt(key, 0x01));
+  write_channel_intel(ch_inflate_keymsb[1], aes_key_256_decrypt(key, 0x02));
+  write_channel_intel(ch_inflate_keylsb[0], aes_key_256(tweak_key, 0x01));
+  write_channel_intel(ch_inflate_keymsb[0], aes_key_256(tweak_key, 0x02));
+}
+#else
+__attribute__((max_global_work_dim(0)))
+void kernel inflate_keygen0(int8 key)
+{
+  write_channel_intel(ch_inflate_keylsb[1], aes_key_256_decrypt(key, 0x01));
+  write_channel_intel(ch_inflate_keymsb[1], aes_key_256_decrypt(key, 0x02));
+}
+#endif
+
+//---------------------------------------------------------------------------------------
+// Decrypt
+//---------------------------------------------------------------------------------------
+
+// Same walk over the page slots as aes_decrypt0, the plaintext lines go to the
+// Huffman decoder instead of memory
+__attribute__((max_global_work_dim(0)))
+kernel void inflate_decrypt0 (
+  global long8 * restrict in,
+  int8 config_data,
+  unsigned int first_page,
+  unsigned int n_pages,
+  unsigned int mem_offset)
+{
+  long16 round_keys[2];
+  round_keys[0] = read_channel_intel(ch_inflate_keylsb[1]);
+  round_keys[1] = read_channel_intel(ch_inflate_keymsb[1]);
+#ifdef AES_MODE_XTS
+  long16 tweak_keys[2];
+  tweak_keys[0] = read_channel_intel(ch_inflate_keylsb[0]);
+  tweak_keys[1] = read_channel_intel(ch_inflate_keymsb[0]);
+#endif
+
+  unsigned int offset = first_page * mem_offset;
+
+  for (unsigned page = first_page; page < first_page + n_pages; page++) {
+    union header_u header;
+    header.datalong = in[offset];
+    write_channel_intel(ch_inflate_header, header.datalong);
+
+#ifdef AES_MODE_XTS
+    ulong2 tweak = xts_page_tweak(page, tweak_keys[0], tweak_keys[1]);
+#endif
+#if AES_PAGE_IV
+    ulong2 iv = aes_header_iv(header);
+#else
+    ulong2 iv = (ulong2)(0);
+#endif
+
+    for (unsigned int k = 0; k < header.values[HDR_N_LINES]; k++) {
+      long8 data = in[offset + 1 + k];
+      int8 config = aes_line_config(config_data, iv, k);
+#ifdef AES_MODE_XTS
+      long8 tw = xts_line_tweaks(tweak);
+      data = aes_256_decrypt(data ^ tw, config, round_keys[0], round_keys[1]) ^ tw;
+      tweak = xts_next_tweak(tw);
+#else
+      data = aes_256_decrypt(data, config, round_keys[0], round_keys[1]);
+#endif
+      write_channel_intel(ch_inflate_lines, data);
+    }
+
+    offset += mem_offset;
+  }
+}
+
+//---------------------------------------------------------------------------------------
+// Huffman decode
+//---------------------------------------------------------------------------------------
+
+// One LZ byte per cycle. The codes of the page table are compared in parallel with
+// the next 16 bits of the stream; the bytes after a marker are read raw, as hufenc
+// wrote them. Stored pages are read raw as a whole, in memory byte order.
+__attribute__((max_global_work_dim(0)))
+kernel void inflate_huffman0 (
+  global unsigned int * restrict huftable,
+  unsigned int first_page,
+  unsigned int n_pages)
+{
+  for (unsigned int page = first_page; page < first_page + n_pages; page++) {
+    union header_u header;
+    header.datalong = read_channel_intel(ch_inflate_header);
+    unsigned int n_lines = header.values[HDR_N_LINES];
+    unsigned int compsize_lz = header.values[HDR_COMPSIZE_LZ];
+    bool stored = (header.values[HDR_FLAGS] & HDR_FLAG_STORED) != 0;
+
+    // input bytes of the page, the zero padding behind them is dropped by inflate_lz0
+    write_channel_intel(ch_inflate_page_bytes, header.values[HDR_PAGE_BYTES]);
+
+    // codes left aligned to 16 bits with their masks, shifted in so that the
+    // tables stay in registers
+    unsigned short code[HUFTABLESIZE];
+    unsigned short mask[HUFTABLESIZE];
+    unsigned char len[HUFTABLESIZE];
+
+    for (short i = 0; i < HUFTABLESIZE; i++) {
+      unsigned int entry = huftable[page*HUFTABLESIZE + i];
+      unsigned char l = entry >> 16;
+
+      #pragma unroll
+      for (short j = 0; j < HUFTABLESIZE - 1; j++) {
+        code[j] = code[j+1];
+        mask[j] = mask[j+1];
+        len[j] = len[j+1];
+      }
+      code[HUFTABLESIZE-1] = (entry & 0xFFFF) << (MAX_HUFFCODE_BITS - l);
+      mask[HUFTABLESIZE-1] = (l == 0) ? 0 : (0xFFFF << (MAX_HUFFCODE_BITS - l));
+      len[HUFTABLESIZE-1] = l;
+    }
+
+    union inflate_line_u line;
+    unsigned char word = LINE_WORDS;
+    unsigned int lines_read = 0;
+
+    // next bits of the stream, MSB first
+    ulong window = 0;
+    unsigned char avail = 0;
+
+    unsigned int produced = 0;
+    unsigned char raw = RAW_NONE;
+    bool extended = false;
+    bool first = true;
+    unsigned char marker = 0;
+
+    while (produced < compsize_lz || lines_read < n_lines) {
+      bool decode = produced < compsize_lz;
+      bool need_word = decode && avail <= 32;
+
+      // lines past the end of the stream are drained
+      bool need_line = decode ? (need_word && word == LINE_WORDS) : true;
+      if (need_line && lines_read < n_lines) {
+        line.datalong = read_channel_intel(ch_inflate_lines);
+        lines_read++;
+        word = 0;
+      }
+
+      // the first stream byte is the high byte of every short, the low byte in a stored page
+      if (need_word && word < LINE_WORDS) {
+        unsigned short hi = line.data[2*word];
+        unsigned short lo = line.data[2*word+1];
+        if (stored) {
+          hi = (hi << 8) | (hi >> 8);
+          lo = (lo << 8) | (lo >> 8);
+        }
+        unsigned int w = ((unsigned int)hi << 16) | lo;
+        window |= (ulong)w << (32 - avail);
+        avail += 32;
+        word++;
+      }
+
+      if (decode) {
+        unsigned short peek = window >> 48;
+        unsigned char sym = 0;
+        unsigned char sym_len = 0;
+
+        #pragma unroll
+        for (short i = 0; i < HUFTABLESIZE; i++) {
+          bool hit = (len[i] != 0) && ((peek & mask[i]) == code[i]);
+          sym |= hit ? (unsigned char)i : 0;
+          sym_len |= hit ? len[i] : 0;
+        }
+
+        bool raw_byte = stored || (raw != RAW_NONE);
+        unsigned char byte = raw_byte ? (unsigned char)(window >> 56) : sym;
+        unsigned char used = raw_byte ? 8 : sym_len;
+        window <<= used;
+        avail -= used;
+
+        // the first symbol is the marker itself
+        if (first)
+          marker = byte;
+
+        unsigned char next = RAW_NONE;
+        if (raw == RAW_NONE)
+          next = (!first && byte == marker) ? RAW_LENGTH : RAW_NONE;
+        else if (raw == RAW_LENGTH)
+          next = (byte == 0) ? RAW_NONE : RAW_OFFSET;
+        else if (raw == RAW_OFFSET)
+          next = (byte & 0x80) ? RAW_OFFSET2 : (extended ? RAW_EXT : RAW_NONE);
+        else if (raw == RAW_OFFSET2)
+          next = extended ? RAW_EXT : RAW_NONE;
+
+        if (raw == RAW_LENGTH)
+          extended = (byte >> 4) == LZ_EXT_NIBBLE;
+
+        raw = next;
+        first = false;
+
+        struct inflate_byte_t out;
+        out.data = byte;
+        out.literal = stored;
+        out.last = (produced + 1 == compsize_lz);
+        write_channel_intel(ch_inflate_lz, out);
+        produced++;
+      }
+    }
+  }
+}
+
+//---------------------------------------------------------------------------------------
+// LZ decode
+//---------------------------------------------------------------------------------------
+
+// One output byte per cycle, the n-th page read goes to out[n * page_size]. Only the
+// HDR_PAGE_BYTES input bytes of a page are written, their number goes to page_bytes[n].
+// Bytes of stored pages are written as they are.
+__attribute__((max_global_work_dim(0)))
+kernel void inflate_lz0 (
+  global unsigned char * restrict out,
+  global unsigned int * restrict page_bytes,
+  unsigned int n_pages,
+  unsigned int page_size)
+{
+  unsigned char history[INFLATE_WINDOW];
+
+  for (unsigned int page = 0; page < n_pages; page++) {
+    unsigned int base = page * page_size;
+    unsigned int outpos = 0;
+    unsigned int n_bytes = read_channel_intel(ch_inflate_page_bytes);
+    if (n_bytes > page_size)
+      n_bytes = page_size;
+
+    // the last INFLATE_DIST bytes written, most recent first
+    unsigned char recent[INFLATE_DIST];
+    #pragma unroll
+    for (char d = 0; d < INFLATE_DIST; d++)
+      recent[d] = 0;
+
+    unsigned char marker = 0;
+    unsigned char raw = RAW_NONE;
+    bool extended = false;
+    bool first = true;
+    bool last = false;
+    bool done = false;
+    unsigned int length = 0;
+    unsigned int offset = 0;
+    unsigned int copy = 0;
+
+    #pragma ivdep array(history) safelen(INFLATE_DIST)
+    while (!done) {
+      bool write = false;
+      unsigned char byte = 0;
+
+      if (copy == 0) {
+        struct inflate_byte_t in = read_channel_intel(ch_inflate_lz);
+        unsigned char b = in.data;
+        last = in.last;
+
+        if (in.literal) {
+          write = true;
+          byte = b;
+        } else if (first) {
+          marker = b;
+        } else if (raw == RAW_NONE) {
+          raw = (b == marker) ? RAW_LENGTH : RAW_NONE;
+          write = (b != marker);
+          byte = b;
+        } else if (raw == RAW_LENGTH) {
+          // a zero after the marker is a literal marker
+          write = (b == 0);
+          byte = marker;
+          length = (b >> 4) + 3;
+          offset = b & 0xf;
+          extended = (b >> 4) == LZ_EXT_NIBBLE;
+          raw = (b == 0) ? RAW_NONE : RAW_OFFSET;
+        } else if (raw == RAW_OFFSET) {
+          offset |= (b & 0x7f) << 4;
+          raw = (b & 0x80) ? RAW_OFFSET2 : (extended ? RAW_EXT : RAW_NONE);
+          copy = (raw == RAW_NONE) ? length : 0;
+        } else if (raw == RAW_OFFSET2) {
+          offset |= (b & 0x7f) << 11;
+          raw = extended ? RAW_EXT : RAW_NONE;
+          copy = (raw == RAW_NONE) ? length : 0;
+        } else {
+          raw = RAW_NONE;
+          copy = VEC + b;
+        }
+        first = false;
+      } else {
+        byte = (offset <= INFLATE_DIST) ? recent[(offset - 1) & (INFLATE_DIST - 1)] :
+          history[(outpos - offset) & (INFLATE_WINDOW - 1)];
+        write = true;
+        copy--;
+      }
+
+      if (write && outpos < n_bytes) {
+        history[outpos & (INFLATE_WINDOW - 1)] = byte;
+        out[base + outpos] = byte;
+        outpos++;
+
+        #pragma unroll
+        for (char d = INFLATE_DIST - 1; d > 0; d--)
+          recent[d] = recent[d-1];
+        recent[0] = byte;
+      }
+
+      done = last && (copy == 0);
+    }
+
+    page_bytes[page] = outpos;
+  }
+}
+
+#endif
@@ -161,7 +161,7 @@ always @(posedge clk) begin
             s_data_in   <= 512'h4081b9e2f50007c1ef6fbf115bec9bfbd6047af9d15eee49c5fcd24ecacc74313129bad96e45f609e8e5b221fdbe806487bb170e6c82601dcf6b8d8c6c685640;
         
         s_elem_counter <= s_elem_counter + 1;  
-        s_config    <= {128'h0,32'h0,ELEMENTS,64'h00000000};
+        s_config    <= {128'h0,(s_elem_counter==0),31'h0,s_elem_counter,64'h00000000};
 
       end
 
@@ -0,0 +1,49 @@
+#ifndef AES_TOOLS_H
+#define AES_TOOLS_H
+
+#include "compNcrypt.h"
+
+// Key schedules and page parameters for decrypting single pages on the host
+struct aes_page_keys_t {
+  alignas(16) unsigned char enc[16*15];   // encryption schedule (CTR, GCM)
+  alignas(16) unsigned char dec[16*15];   // decryption schedule (ECB, CBC, XTS)
+  alignas(16) unsigned char tweak[16*15]; // XTS tweak key schedule
+  unsigned int salt[2];                   // file salt the page IVs are derived from
+};
+
+//---------------------------------------------------------------------------------------
+//  FUNCTION PROTOTYPES
+//---------------------------------------------------------------------------------------
+
+// Expands the schedules once, tweak_key is only used by AES_MODE_XTS.
+void aes_page_keys_init(aes_page_keys_t &keys, const unsigned int key[8],
+  const unsigned int tweak_key[8], const unsigned int salt[2]);
+
+// IV of page p as the load balancer derives it, in HDR_PAGE_IV layout (AES_PAGE_IV builds)
+void aes_page_iv(const aes_page_keys_t &keys, unsigned int page, unsigned int iv[4]);
+
+// Encrypts the N_LINES plaintext lines of page p as the FPGA does, with the AES_MODE of
+// the build. The IV of the page goes into its header, GCM also writes the tag there.
+void aes_encrypt_page(const aes_page_keys_t &keys, unsigned int page, unsigned int *header,
+  const unsigned char *in, unsigned char *out);
+
+// Decrypts the N_LINES ciphertext lines of page p behind its header line with the
+// AES_MODE of the build, using only that page and the IV in its header. GCM pages are
+// authenticated first.
+// Returns false if the tag does not match.
+bool aes_decrypt_page(const aes_page_keys_t &keys, unsigned int page, const unsigned int *header,
+  const unsigned char *in, unsigned char *out);
+
+// Recomputes the AES-GCM tag of every page with AES-NI/PCLMULQDQ, under the nonce in
+// the page header, and compares it to the tag stored there. Returns the number of pages
+// that do not match.
+int verify_gcm_tags(const unsigned int *output_aes, unsigned int n_pages,
+  unsigned int page_stride, const unsigned int key[8]);
+
+// Decrypts every AES-XTS page on the CPU, using only that page and its index, and compares
+// it to the FPGA decryption. Returns the number of pages that do not match.
+int verify_xts_pages(const unsigned int *output_aes, const unsigned int *decrypted,
+  unsigned int n_pages, unsigned int page_stride, const unsigned int key[8],
+  const unsigned int tweak_key[8]);
+
+#endif
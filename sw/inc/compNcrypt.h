@@ -12,10 +12,112 @@
 #define GZIP_ENGINES 1
 #endif
 
+// Entries per bank of the LZ77 dictionary. More entries find more matches
+// but cost M20Ks and DEPTH cycles per page to clear the dictionary.
+#ifndef DEPTH
+#define DEPTH 512
+#endif
+
+#if DEPTH == 512
+#define HASH_BITS 9
+#elif DEPTH == 1024
+#define HASH_BITS 10
+#elif DEPTH == 2048
+#define HASH_BITS 11
+#else
+#error "DEPTH must be 512, 1024 or 2048"
+#endif
+
+// Dictionary index of the 3 bytes starting at a window position. Multiplicative
+// (Fibonacci) hash, the top HASH_BITS bits of the 32-bit product.
+#define LZ_HASH(a, b, c) \
+  ((((unsigned int)(a) | ((unsigned int)(b) << 8) | ((unsigned int)(c) << 16)) * 2654435761u) >> (32 - HASH_BITS))
+
+// Length nibble of an extended LZ77 match. The token is followed by one extra length
+// byte once the match ends, the match is LEN (= VEC) + extra bytes long.
+#define LZ_EXT_NIBBLE 0xF
+
+// Emit standard DEFLATE (RFC 1951): one fixed-Huffman block per page instead of the
+// marker/nibble format and the file Huffman table. The host adds gzip or zlib framing.
+#ifndef GZIP_DEFLATE
+#define GZIP_DEFLATE 0
+#endif
+
+// Upper bounds of the extra length byte and of the match offset. DEFLATE matches are
+// at most 258 bytes long and reach back at most 32768 bytes (the offset is checked
+// per window, hence the VEC margin).
+#if GZIP_DEFLATE
+#define LZ_EXT_MAX    (258 - VEC)
+#define LZ_MAX_OFFSET (32768 - VEC)
+#else
+#define LZ_EXT_MAX    255
+#define LZ_MAX_OFFSET 0x40000
+#endif
+
+// Only matches with an offset up to LZ_CONT_DIST (power of 2, >= VEC) are extended, their
+// source bytes are kept in registers
+#ifndef LZ_CONT_DIST
+#define LZ_CONT_DIST (2 * VEC)
+#endif
+
+#if (LZ_CONT_DIST < VEC) || (LZ_CONT_DIST & (LZ_CONT_DIST - 1))
+#error "LZ_CONT_DIST must be a power of 2 and at least VEC"
+#endif
+
+// History of the device LZ decoder (inflate_lz0) in bytes, power of 2. Only pages up to
+// this size are inflated on the FPGA.
+#ifndef INFLATE_WINDOW
+#define INFLATE_WINDOW 65536
+#endif
+
 #ifndef AES_ENGINES
 #define AES_ENGINES 1
 #endif
 
+// Stripe the lines of each page across all AES engines instead of
+// handing whole pages to one engine. Only valid in CTR mode.
+#ifndef AES_STRIPE
+#define AES_STRIPE 0
+#endif
+
+#if AES_STRIPE && !defined(AES_MODE_CTR)
+#error "AES_STRIPE requires AES_MODE_CTR"
+#endif
+
+// Layout of the 512-bit header line in front of every page, in 32-bit words
+#define HDR_N_LINES          0
+#define HDR_FIRST_VALID_POS  1
+#define HDR_COMPSIZE_LZ      2
+#define HDR_COMPSIZE_HUFFMAN 3
+#define HDR_GCM_TAG          4  // 4 words, AES_MODE_GCM only
+#define HDR_FLAGS            8
+#define HDR_CRC32C           9  // CRC32C of the HDR_PAGE_BYTES input bytes
+#define HDR_PAGE_BYTES       10 // input bytes in the page, the rest up to page_size is zero padding
+#define HDR_PAGE_IV          11 // 4 words, CBC IV or CTR/GCM nonce (words 11..12) of the page
+#define HDR_TABLE_CRC32C     15 // CRC32C of the Huffman table a stream page carries, host only
+
+// HDR_FLAGS bits, also the per-page flags passed to load_lz0.
+// A stored page holds its input bytes as they are, without LZ or Huffman, up to the
+// line that holds the last input byte.
+#define HDR_FLAG_STORED      0x1
+
+// CRC32C (Castagnoli) polynomial, reflected
+#define CRC32C_POLY 0x82F63B78
+
+// Always set in the MS word of the GCM counter nonce, so that no counter
+// block equals the all-zero block that yields the GHASH key
+#define AES_GCM_NONCE_BIT 0x80000000
+
+// CBC, CTR and GCM pages get their own IV, E_K({4 * AES_PRF_LINE, salt ^ page})
+// with the file salt, and carry it in HDR_PAGE_IV. The PRF block is the CTR
+// counter block of a line no page reaches, so it never repeats a keystream block.
+#if !defined(AES_MODE_ECB) && !defined(AES_MODE_XTS)
+#define AES_PAGE_IV 1
+#else
+#define AES_PAGE_IV 0
+#endif
+#define AES_PRF_LINE 0xFFFFFFFF
+
 struct gzip_out_info_t {
   // location of first uncompressed byte from the input stream
   unsigned int fvp[GZIP_ENGINES];
@@ -0,0 +1,189 @@
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "compNcrypt.h"
+#include "aes_tools.h"
+
+//---------------------------------------------------------------------------------------
+//  Container file
+//---------------------------
+//  [container_header_t]
+//  [n_tables Huffman tables, 256 words each]
+//  [pages: the 64-byte header line of every page, in the clear, and its ciphertext lines]
+//  [n_pages container_index_t]
+//  [container_footer_t]
+//  All fields are little endian. A page is read with its index entry only, so a reader
+//  decrypts and decompresses just the pages of a byte range.
+//
+//  A stream container (CONTAINER_FLAG_STREAM) is written front to back without knowing
+//  the input size:
+//  [container_header_t, n_pages, insize and n_tables are 0]
+//  [pages: the header line, the Huffman table of the page (LZ/Huffman codec, not for
+//   HDR_FLAG_STORED pages, its CRC32C in HDR_TABLE_CRC32C), the ciphertext lines]
+//  [end line: 64 zero bytes]
+//  [container_footer_t, index_offset is the offset of the end line]
+//  The writer keeps no index, a reader rebuilds it from the clear header lines.
+//---------------------------------------------------------------------------------------
+
+#define CONTAINER_MAGIC   "CNCPAGES"
+#define CONTAINER_FOOTER  "CNCX"
+#define CONTAINER_VERSION 3
+
+// codec
+#define CONTAINER_CODEC_LZ_HUFFMAN 0 // marker/nibble LZ stream, Huffman table per page or file
+#define CONTAINER_CODEC_DEFLATE    1 // raw fixed-Huffman DEFLATE stream per page
+
+// cipher
+#define CONTAINER_AES_ECB 0
+#define CONTAINER_AES_CBC 1
+#define CONTAINER_AES_CTR 2
+#define CONTAINER_AES_GCM 3
+#define CONTAINER_AES_XTS 4
+
+// flags
+#define CONTAINER_FLAG_STREAM 0x1
+
+#if defined(AES_MODE_XTS)
+#define CONTAINER_AES CONTAINER_AES_XTS
+#elif defined(AES_MODE_GCM)
+#define CONTAINER_AES CONTAINER_AES_GCM
+#elif defined(AES_MODE_CTR)
+#define CONTAINER_AES CONTAINER_AES_CTR
+#elif defined(AES_MODE_ECB)
+#define CONTAINER_AES CONTAINER_AES_ECB
+#else
+#define CONTAINER_AES CONTAINER_AES_CBC
+#endif
+
+struct container_header_t {
+  char     magic[8];    // CONTAINER_MAGIC
+  uint32_t version;     // CONTAINER_VERSION
+  uint32_t codec;       // CONTAINER_CODEC_*
+  uint32_t cipher;      // CONTAINER_AES_*
+  uint32_t vec;         // VEC of the device that wrote the pages
+  uint32_t page_size;   // uncompressed bytes per page, the last page holds the rest
+  uint32_t n_pages;
+  uint64_t insize;      // uncompressed bytes
+  uint32_t n_tables;    // 0 (DEFLATE), 1 (one table for the file) or n_pages
+  uint32_t table_id;    // CRC32C of the tables
+  uint32_t key_id;      // id of the key, the key is not in the file
+  uint32_t flags;       // CONTAINER_FLAG_*
+  uint32_t salt[2];     // file salt, every page header holds the IV derived from it
+};
+
+struct container_index_t {
+  uint64_t in_offset;   // uncompressed offset of the page
+  uint64_t offset;      // file offset of the page header line
+  uint32_t in_bytes;    // uncompressed bytes (HDR_PAGE_BYTES)
+  uint32_t size;        // bytes in the file, header line and ciphertext lines
+  uint32_t crc32c;      // CRC32C of the uncompressed bytes
+  uint32_t table;       // Huffman table of the page
+};
+
+struct container_footer_t {
+  uint64_t index_offset;
+  uint32_t n_pages;
+  char     magic[4];    // CONTAINER_FOOTER
+};
+
+// What the writer stores besides the pages
+struct container_info_t {
+  unsigned int insize;
+  unsigned int page_size;
+  unsigned int n_tables;
+  const unsigned int *huftables; // n_tables * 256 words
+  unsigned int key_id;
+  unsigned int salt[2];
+  bool uring;                    // write with io_uring and O_DIRECT instead of a mapping
+};
+
+// Buffers to decode one page, used by one thread at a time
+struct container_decoder_t {
+  // lookup table of the last file table used
+  std::vector<unsigned short> lut;
+  int lut_table;
+  std::vector<unsigned char> plain;
+  std::vector<unsigned char> stream;
+  std::vector<unsigned char> lz;
+  std::vector<unsigned char> decoded;
+};
+
+// Open container, its index and the tables stay in memory
+struct container_t {
+  FILE *file;
+  bool own_file;
+  container_header_t header;
+  std::vector<container_index_t> index;
+  std::vector<unsigned int> huftables;
+  aes_page_keys_t keys;
+  // one page record
+  std::vector<unsigned char> page;
+  container_decoder_t decoder;
+  // pages read by container_next
+  unsigned int n_read;
+};
+
+// Stream container being written
+struct container_writer_t {
+  FILE *file;
+  unsigned long pos;
+  unsigned int n_pages;
+  bool ok;
+};
+
+//---------------------------------------------------------------------------------------
+//  FUNCTION PROTOTYPES
+//---------------------------------------------------------------------------------------
+
+// Packs the encrypted page slots (page_stride bytes apart, as written by the device)
+// into a container file. Returns the file size, 0 on error.
+unsigned long container_write(const char *filename, const unsigned int *output_aes,
+  unsigned int n_pages, unsigned int page_stride, const container_info_t &info);
+
+// Opens a container written by a build with the same format and AES_MODE. tweak_key
+// is only used by AES_MODE_XTS. Returns NULL on error.
+container_t *container_open(const char *filename, const unsigned int key[8],
+  const unsigned int tweak_key[8], unsigned int key_id);
+
+// Reads length uncompressed bytes at offset. Only the pages that intersect the range are
+// read, decrypted, decompressed and checked against their CRC32C. Returns the number of
+// pages that failed, -1 if the range is outside the file.
+int container_read(container_t *c, unsigned long offset, unsigned long length, unsigned char *out);
+
+void container_close(container_t *c);
+
+// Starts a stream container on file (stdout or a pipe). Only page_size, key_id and salt
+// of info are used. Returns NULL on error.
+container_writer_t *container_writer_open(FILE *file, const container_info_t &info);
+
+// Appends the next page: its header line and ciphertext lines (N_LINES) and, for the
+// LZ/Huffman codec, its Huffman table unless the page is stored. Returns false on a
+// write error.
+bool container_writer_page(container_writer_t *w, const unsigned int *page, const unsigned int *huftable);
+
+// Writes the end line and the footer. Returns false if any write failed.
+bool container_writer_close(container_writer_t *w);
+
+// Opens a container on file to be read front to back with container_next, file may be
+// a pipe. Returns NULL on error.
+container_t *container_open_stream(FILE *file, const unsigned int key[8],
+  const unsigned int tweak_key[8], unsigned int key_id);
+
+// Reads the record of the next page into record. Returns its size, 0 after the last page
+// and -1 on error.
+long container_next(container_t *c, std::vector<unsigned char> &record);
+
+// Sizes the buffers of a decoder for the pages of c.
+void container_decoder_init(const container_t *c, container_decoder_t &d);
+
+// Decrypts and decompresses the record of page p into d.decoded and checks its CRC32C,
+// the page holds HDR_PAGE_BYTES bytes. Only reads c, so threads with their own decoders
+// can decode pages of the same container. Returns false if the page fails any check.
+bool container_decode(const container_t *c, unsigned int p, const unsigned char *record,
+  unsigned int size, container_decoder_t &d);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef CRC_TOOLS_H
+#define CRC_TOOLS_H
+
+#include <stddef.h>
+
+#include "compNcrypt.h"
+
+//---------------------------------------------------------------------------------------
+//  FUNCTION PROTOTYPES
+//---------------------------------------------------------------------------------------
+
+// CRC32C of len bytes with SSE4.2, continuing from crc (0 for a new buffer).
+unsigned int crc32c(unsigned int crc, const unsigned char *buf, size_t len);
+
+// Computes the CRC32C of the HDR_PAGE_BYTES bytes of every plaintext page (page p at
+// pages + p * page_size) on n_threads threads (0: one per core) and compares it to the
+// CRC32C in the header of the decrypted page slot. Returns the number of pages that do not match.
+int verify_crc32c_pages(const unsigned char *pages, unsigned int page_size, unsigned int n_pages,
+  const unsigned int *output, unsigned int page_stride, unsigned int n_threads);
+
+#endif
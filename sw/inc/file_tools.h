@@ -0,0 +1,30 @@
+#ifndef FILE_TOOLS_H
+#define FILE_TOOLS_H
+
+#include <stddef.h>
+
+// A file mapped into memory, or a buffer from alignedMalloc if it could not be mapped
+struct file_map_t {
+  unsigned char *data;
+  size_t length;  // bytes mapped, 0 for an alignedMalloc buffer
+};
+
+//---------------------------------------------------------------------------------------
+//  FUNCTION PROTOTYPES
+//---------------------------------------------------------------------------------------
+
+// Size of the file in bytes, -1 if it cannot be opened.
+long long file_size(const char *filename);
+
+// Maps the size bytes of the file followed by zeros up to padded_size, populated and
+// read-ahead sequentially, with transparent huge pages where the kernel allows them. Falls
+// back to reading the file into an alignedMalloc buffer. Returns NULL on error.
+unsigned char *map_input_file(const char *filename, size_t size, size_t padded_size, file_map_t &map);
+
+// Creates the file with size bytes and maps it shared for writing. Returns NULL on error.
+unsigned char *map_output_file(const char *filename, size_t size, file_map_t &map);
+
+// Unmaps (the output is written back by the kernel) or frees the buffer.
+void unmap_file(file_map_t &map);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdio.h>
+
+#include "compNcrypt.h"
+
+// Settings of the stdin/stdout filter
+struct filter_config_t {
+  unsigned int page_size;        // bytes per page, a multiple of 2*VEC
+  unsigned int window;           // pages in flight
+  unsigned int n_threads;        // page workers, 0: one per core
+  unsigned int stored_threshold; // as --stored
+  unsigned int key_id;
+  unsigned int key[8];
+  unsigned int tweak_key[8];     // AES_MODE_XTS only
+  unsigned int salt[2];          // file salt of the page IVs
+  const char *uring_input;       // compression reads this file with io_uring instead of in, or NULL
+};
+
+//---------------------------------------------------------------------------------------
+//  FUNCTION PROTOTYPES
+//---------------------------------------------------------------------------------------
+
+// Reads in page by page, compresses and encrypts every page as the FPGA pipeline does (the
+// software model of the gzip kernels and AES-NI) with its own Huffman table, and writes a
+// stream container to out in page order. At most window pages are held at any time, plus
+// the chunks in flight when config.uring_input is read with io_uring.
+// Returns the number of pages, -1 on error.
+long filter_compress(FILE *in, FILE *out, const filter_config_t &config);
+
+// Reads a container from in front to back and writes the decrypted and decompressed
+// pages to out in order, with the same window. Returns the number of pages, -1 on error.
+long filter_decompress(FILE *in, FILE *out, const filter_config_t &config);
+
+#endif
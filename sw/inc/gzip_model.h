@@ -0,0 +1,52 @@
+#ifndef GZIP_MODEL_H
+#define GZIP_MODEL_H
+
+#include "compNcrypt.h"
+
+// Results of one page compressed by the model, same meaning as the page header
+struct gzip_model_page_t {
+  unsigned int first_valid_pos;
+  unsigned int compsize_lz;
+  unsigned int compsize_huffman;
+  unsigned long cycles;
+};
+
+//---------------------------------------------------------------------------------------
+//  FUNCTION PROTOTYPES
+//---------------------------------------------------------------------------------------
+
+// Bit-exact software model of lz_internal/huff_internal for one page. Writes the LZ
+// stream of the device (marker byte first, without the last VEC bytes) to lz_out,
+// which must hold 2 * page_size bytes. With GZIP_DEFLATE, lz_out gets the raw DEFLATE
+// stream of the page (compsize_huffman bytes) and compsize_lz counts LZ symbols.
+void gzip_model_page(const unsigned char *input, unsigned int page_size, unsigned char marker,
+  const unsigned int *huftable, unsigned char *lz_out, gzip_model_page_t &page);
+
+#if !GZIP_DEFLATE
+// Huffman stream of a page as the host reads it (high byte of every short first),
+// from the LZ stream written by gzip_model_page. Returns its size in bytes.
+unsigned int gzip_model_huffman_stream(const unsigned char *lz, unsigned int lz_size,
+  const unsigned int *huftable, unsigned char *out);
+
+// Model of inflate_huffman0/inflate_lz0 for one page. Writes at most page_size bytes
+// to out, adds the device cycles to cycles and returns the number of bytes written.
+unsigned int gzip_model_inflate_page(const unsigned char *huff, unsigned int compsize_huffman,
+  unsigned int compsize_lz, const unsigned int *huftable, unsigned char *out, unsigned int page_size,
+  unsigned long &cycles);
+#endif
+
+// Model of histogram0: byte counts of every page in hist[page][256].
+// Returns the device cycles of the pass.
+unsigned long gzip_model_histogram(const unsigned char *input, unsigned int page_size,
+  unsigned int n_pages, unsigned int *hist);
+
+// Runs the model over all pages, checks every page with LZ_Uncompress and reports
+// ratio and estimated device throughput. Page p is encoded with markers[p] and the
+// table at huftables[p*256], pages with HDR_FLAG_STORED in page_flags (may be NULL)
+// are stored as they are. One line per run is appended to
+// gzip_model.dat. Returns the number of errors.
+int run_gzip_model(const char *name, unsigned char *input, unsigned int insize,
+  unsigned int page_size, unsigned int n_pages, const unsigned char *markers,
+  const unsigned int *huftables, const unsigned char *page_flags);
+
+#endif
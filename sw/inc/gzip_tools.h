@@ -31,11 +31,22 @@
 
 int decompress_on_host(unsigned char *input, huff_encodenode_t *tree, unsigned int insize,
   unsigned int outsize, unsigned char marker, unsigned short *output_huffman,
-  struct gzip_out_info_t gzip_out_info, unsigned int remaining_bytes, double &time_decompress);
+  struct gzip_out_info_t gzip_out_info, double &time_decompress);
+int verify_inflated_pages(const unsigned char *input, unsigned int page_size, unsigned int n_pages,
+  const unsigned char *inflated, const unsigned int *inflated_bytes, const unsigned int *output,
+  unsigned int page_stride);
 
 unsigned char Compute_Huffman(unsigned char *input, unsigned int insize, unsigned int *huftable, huff_encodenode_t **root);
-int LZ_Uncompress(unsigned char *in, unsigned char *out, unsigned int insize);
+unsigned char Compute_Huffman_Hist(const unsigned int *hist, unsigned int insize, unsigned int *huftable, huff_encodenode_t **root);
+void Compute_Huffman_Pages(const unsigned int *hist, unsigned int page_size, unsigned int n_pages,
+  unsigned int *huftable, unsigned char *markers, huff_encodenode_t **root);
+unsigned int Select_Stored_Pages(const unsigned int *hist, unsigned int page_size, unsigned int n_pages,
+  const unsigned char *markers, unsigned int threshold, unsigned char *page_flags);
+int LZ_Uncompress(unsigned char *in, unsigned char *out, unsigned int insize, unsigned int outsize);
 void Huffman_Uncompress( unsigned char *in, unsigned char *out, huff_encodenode_t *root, unsigned int insize, unsigned int outsize, unsigned char marker);
+int Huffman_Decode_Table(const unsigned int *huftable, unsigned short *lut);
+int Huffman_Uncompress_Table(const unsigned char *in, unsigned int insize, unsigned char *out,
+  unsigned int outsize, const unsigned short *lut);
 void Print_Huffman(huff_encodenode_t *tree);
 
 static void _Huffman_InitBitstream( huff_bitstream_t *stream, unsigned char *buf);
@@ -52,4 +63,20 @@ huff_encodenode_t * _Huffman_MakeTree(huff_sym_t *sym, huff_encodenode_t *nodes,
 static huff_decodenode_t * _Huffman_RecoverTree(huff_decodenode_t *nodes, huff_bitstream_t *stream, unsigned int *nodenum);
 unsigned short reverse(unsigned short a, int n);
 
+// DEFLATE framing added by the host around the raw page streams
+enum deflate_frame_t {
+  DEFLATE_FRAME_GZIP = 0, // one gzip member per page (RFC 1952), a valid multi-member .gz
+  DEFLATE_FRAME_ZLIB,     // one zlib stream per page (RFC 1950)
+  DEFLATE_FRAME_FLATE     // size line + raw stream per page, as RawInflater::inflate_file
+};
+
+void Deflate_Fixed_Table(unsigned int *huftable);
+int Deflate_Uncompress(const unsigned char *in, unsigned int insize, unsigned char *out, unsigned int outsize);
+unsigned int Deflate_Stored(unsigned char *out, const unsigned char *in, unsigned int insize);
+unsigned int Deflate_Frame(unsigned char *out, const unsigned char *deflate, unsigned int size,
+  const unsigned char *raw, unsigned int raw_size, int frame);
+int deflate_pages_on_host(unsigned char *input, unsigned int page_size, unsigned int n_pages,
+  const unsigned int *output, unsigned int page_stride, const char *out_filename, int frame,
+  unsigned long &framed_size, double &time_decompress);
+
 #endif
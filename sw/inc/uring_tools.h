@@ -0,0 +1,58 @@
+#ifndef URING_TOOLS_H
+#define URING_TOOLS_H
+
+#include <stddef.h>
+
+//---------------------------------------------------------------------------------------
+//  io_uring file streams
+//---------------------------
+//  The reader keeps depth chunks of chunk_size bytes in flight ahead of the consumer,
+//  read with O_DIRECT into a pool of registered buffers. Chunks are handed out in file
+//  order as they land and go back to the pool in the same order. The writer appends
+//  through its own pool and keeps depth writes in flight. Both fall back to buffered
+//  I/O where O_DIRECT is refused and to pread/pwrite where io_uring is not available.
+//---------------------------------------------------------------------------------------
+
+// O_DIRECT alignment of buffers, offsets and chunk sizes
+#define URING_ALIGN 4096
+
+// Default chunk size and chunks in flight of the host streams
+#define URING_CHUNK (1 << 20)
+#define URING_DEPTH 8
+
+struct uring_reader_t;
+struct uring_writer_t;
+
+//---------------------------------------------------------------------------------------
+//  FUNCTION PROTOTYPES
+//---------------------------------------------------------------------------------------
+
+// Opens the file and starts reading the first depth chunks. chunk_size is rounded up to
+// URING_ALIGN. Returns NULL on error.
+uring_reader_t *uring_reader_open(const char *filename, size_t chunk_size, unsigned int depth);
+
+// Size of the file being read.
+size_t uring_reader_size(const uring_reader_t *r);
+
+// Waits for the next chunk in file order and returns it, bytes is the number of valid
+// bytes (less than chunk_size for the last chunk). Returns NULL at the end of the file,
+// on a read error or if all depth chunks are held by the consumer.
+const unsigned char *uring_reader_next(uring_reader_t *r, size_t &bytes);
+
+// Returns the oldest chunk handed out to the pool and starts the next read into it.
+void uring_reader_release(uring_reader_t *r);
+
+// Returns false if a read failed.
+bool uring_reader_close(uring_reader_t *r);
+
+// Creates the file. Returns NULL on error.
+uring_writer_t *uring_writer_open(const char *filename, size_t chunk_size, unsigned int depth);
+
+// Appends size bytes, full chunks are submitted as they fill. Returns false on a write error.
+bool uring_writer_write(uring_writer_t *w, const void *data, size_t size);
+
+// Writes the last chunk, waits for all writes and sets the file size. Returns false if a
+// write failed.
+bool uring_writer_close(uring_writer_t *w);
+
+#endif
@@ -0,0 +1,222 @@
+//--------------------------------------------------------------------------------------------------
+//  Host side AES helpers
+//---------------------------
+// Uses the AES-NI/PCLMULQDQ primitives of the CPU baseline (baselines/bench_aes/inc/aes.h).
+// The 256-bit key and the 128-bit counter blocks of the FPGA core map to memory byte
+// order as-is: key[0] holds key bytes 0..3, and a CTR block {nonce, counter} has the
+// counter in bytes 0..7 and the nonce in bytes 8..15. The XTS tweak of page p is the
+// block holding p in bytes 0..7. The IV of page p is the CTR block {salt ^ p, 4 * AES_PRF_LINE}
+// encrypted under the key, with the 64-bit salt in bytes 8..15.
+//--------------------------------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aes.h"
+#include "aes_tools.h"
+
+//--------------------------------------------------------------------------------------------------
+//  Single page encryption and decryption
+//---------------------------
+// CTR and GCM run the counter blocks of the FPGA core under the page nonce, GCM starts with
+// line slot 1. CBC starts every page from its own IV.
+//--------------------------------------------------------------------------------------------------
+
+#if !defined(AES_MODE_XTS) && !defined(AES_MODE_ECB) && !defined(AES_MODE_CBC)
+// Key stream of the counter blocks {page_nonce, first + b}, four blocks (one line) at a time
+static void aes_ctr_lines(const aes_page_keys_t &keys, uint64_t page_nonce, uint64_t first,
+  const unsigned char *in, unsigned char *out, unsigned long cbytes)
+{
+  __m128i rk[15], ks[4];
+  AES_LOAD_KEYS(rk, keys.enc, 14);
+
+  for (unsigned long b = 0; b < cbytes / 16; b += 4) {
+    for (int k = 0; k < 4; k++)
+      ks[k] = _mm_set_epi64x(page_nonce, first + b + k);
+    AES_ENC_N<4>(ks, rk, 14);
+    for (int k = 0; k < 4; k++) {
+      __m128i c = _mm_loadu_si128((const __m128i *)(in + 16 * (b + k)));
+      _mm_storeu_si128((__m128i *)(out + 16 * (b + k)), _mm_xor_si128(c, ks[k]));
+    }
+  }
+}
+#endif
+
+void aes_page_keys_init(aes_page_keys_t &keys, const unsigned int key[8],
+  const unsigned int tweak_key[8], const unsigned int salt[2])
+{
+  AES_256_Key_Expansion((const unsigned char *)key, keys.enc);
+  AES_256_Decryption_Keys(keys.enc, keys.dec);
+  AES_256_Key_Expansion((const unsigned char *)tweak_key, keys.tweak);
+  memcpy(keys.salt, salt, sizeof(keys.salt));
+}
+
+void aes_page_iv(const aes_page_keys_t &keys, unsigned int page, unsigned int iv[4])
+{
+  uint64_t nonce = (((uint64_t)keys.salt[1] << 32) | keys.salt[0]) ^ page;
+  __m128i y = AES_encrypt_block(_mm_set_epi64x(nonce, 4 * (uint64_t)AES_PRF_LINE), keys.enc, 14);
+
+  _mm_storeu_si128((__m128i *)iv, y);
+#if !defined(AES_MODE_CBC)
+  // CTR and GCM keep bytes 0..7 as the page nonce
+  iv[2] = 0;
+  iv[3] = 0;
+#endif
+#if defined(AES_MODE_GCM)
+  iv[1] |= AES_GCM_NONCE_BIT;
+#endif
+}
+
+#if !defined(AES_MODE_XTS) && !defined(AES_MODE_ECB) && !defined(AES_MODE_CBC)
+static uint64_t aes_header_nonce(const unsigned int *header)
+{
+  return ((uint64_t)header[HDR_PAGE_IV + 1] << 32) | header[HDR_PAGE_IV];
+}
+#endif
+
+bool aes_decrypt_page(const aes_page_keys_t &keys, unsigned int page, const unsigned int *header,
+  const unsigned char *in, unsigned char *out)
+{
+  unsigned long cbytes = (unsigned long)header[HDR_N_LINES] * 64;
+
+#if defined(AES_MODE_XTS)
+  AES_XTS_decrypt(in, out, cbytes, page, keys.dec, keys.tweak, 14);
+#elif defined(AES_MODE_ECB)
+  AES_ECB_decrypt_x<8>(in, out, cbytes, keys.dec, 14);
+#elif defined(AES_MODE_CBC)
+  unsigned char iv[16];
+  memcpy(iv, &header[HDR_PAGE_IV], 16);
+  AES_CBC_decrypt_x<8>(in, out, iv, cbytes, (unsigned char *)keys.dec, 14);
+#else
+  uint64_t page_nonce = aes_header_nonce(header);
+  uint64_t first = 0;
+#if defined(AES_MODE_GCM)
+  first = 4;
+
+  __m128i H[4];
+  GHASH_init(keys.enc, 14, H);
+  __m128i ej0 = AES_encrypt_block(_mm_set_epi64x(page_nonce, 0), keys.enc, 14);
+  __m128i X = GHASH_update(_mm_setzero_si128(), H, in, cbytes);
+  X = GHASH_final(X, H, 0, cbytes, ej0);
+  X = _mm_xor_si128(X, _mm_loadu_si128((const __m128i *)&header[HDR_GCM_TAG]));
+  if (!_mm_testz_si128(X, X))
+    return false;
+#endif
+  aes_ctr_lines(keys, page_nonce, first, in, out, cbytes);
+#endif
+
+  return true;
+}
+
+// Same page layout as the aes_encrypt kernels: the ciphertext lines follow the header line, the
+// header holds the IV of the page and the GCM tag
+void aes_encrypt_page(const aes_page_keys_t &keys, unsigned int page, unsigned int *header,
+  const unsigned char *in, unsigned char *out)
+{
+  unsigned long cbytes = (unsigned long)header[HDR_N_LINES] * 64;
+
+#if AES_PAGE_IV
+  aes_page_iv(keys, page, &header[HDR_PAGE_IV]);
+#endif
+
+#if defined(AES_MODE_XTS)
+  AES_XTS_encrypt(in, out, cbytes, page, keys.enc, keys.tweak, 14);
+#elif defined(AES_MODE_ECB)
+  AES_ECB_encrypt_x<8>(in, out, cbytes, keys.enc, 14);
+#elif defined(AES_MODE_CBC)
+  unsigned char iv[16];
+  memcpy(iv, &header[HDR_PAGE_IV], 16);
+  AES_CBC_encrypt(in, out, iv, cbytes, (unsigned char *)keys.enc, 14);
+#else
+  uint64_t page_nonce = aes_header_nonce(header);
+  uint64_t first = 0;
+#if defined(AES_MODE_GCM)
+  first = 4;
+#endif
+  aes_ctr_lines(keys, page_nonce, first, in, out, cbytes);
+#if defined(AES_MODE_GCM)
+  __m128i H[4];
+  GHASH_init(keys.enc, 14, H);
+  __m128i ej0 = AES_encrypt_block(_mm_set_epi64x(page_nonce, 0), keys.enc, 14);
+  __m128i X = GHASH_update(_mm_setzero_si128(), H, out, cbytes);
+  X = GHASH_final(X, H, 0, cbytes, ej0);
+  _mm_storeu_si128((__m128i *)&header[HDR_GCM_TAG], X);
+#endif
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+//  GCM tag verification
+//---------------------------
+// Counter blocks of a page are {page nonce, 4 * line + k}, with line 0 reserved for J0 and
+// the page nonce in its header. The tag covers the ciphertext lines of the page, there is no AAD.
+//--------------------------------------------------------------------------------------------------
+
+int verify_gcm_tags(const unsigned int *output_aes, unsigned int n_pages,
+  unsigned int page_stride, const unsigned int key[8])
+{
+  alignas(16) unsigned char key_schedule[16*15];
+  __m128i H[4];
+
+  AES_256_Key_Expansion((const unsigned char *)key, key_schedule);
+  GHASH_init(key_schedule, 14, H);
+
+  int numerrors = 0;
+  for (unsigned int p = 0; p < n_pages; p++) {
+    const unsigned char *page = (const unsigned char *)output_aes + (size_t)p * page_stride;
+    const unsigned int *header = (const unsigned int *)page;
+    unsigned long cbytes = (unsigned long)header[HDR_N_LINES] * 64;
+
+    uint64_t page_nonce = ((uint64_t)header[HDR_PAGE_IV + 1] << 32) | header[HDR_PAGE_IV];
+    __m128i ej0 = AES_encrypt_block(_mm_set_epi64x(page_nonce, 0), key_schedule, 14);
+
+    __m128i X = GHASH_update(_mm_setzero_si128(), H, page + 64, cbytes);
+    X = GHASH_final(X, H, 0, cbytes, ej0);
+    X = _mm_xor_si128(X, _mm_loadu_si128((const __m128i *)&header[HDR_GCM_TAG]));
+
+    if (!_mm_testz_si128(X, X))
+      numerrors++;
+  }
+
+  return numerrors;
+}
+
+//--------------------------------------------------------------------------------------------------
+//  XTS page verification
+//---------------------------
+// Decrypts every page on its own with its page index as tweak and compares the result with
+// the pages decrypted by the FPGA. Headers are stored in the clear.
+//--------------------------------------------------------------------------------------------------
+
+int verify_xts_pages(const unsigned int *output_aes, const unsigned int *decrypted,
+  unsigned int n_pages, unsigned int page_stride, const unsigned int key[8],
+  const unsigned int tweak_key[8])
+{
+  alignas(16) unsigned char key_schedule[16*15];
+  alignas(16) unsigned char dec_schedule[16*15];
+  alignas(16) unsigned char tweak_schedule[16*15];
+
+  AES_256_Key_Expansion((const unsigned char *)key, key_schedule);
+  AES_256_Decryption_Keys(key_schedule, dec_schedule);
+  AES_256_Key_Expansion((const unsigned char *)tweak_key, tweak_schedule);
+
+  unsigned char *plain = (unsigned char *)malloc(page_stride);
+
+  int numerrors = 0;
+  for (unsigned int p = 0; p < n_pages; p++) {
+    const unsigned char *page = (const unsigned char *)output_aes + (size_t)p * page_stride;
+    const unsigned char *ref = (const unsigned char *)decrypted + (size_t)p * page_stride;
+    const unsigned int *header = (const unsigned int *)page;
+    unsigned long cbytes = (unsigned long)header[HDR_N_LINES] * 64;
+
+    AES_XTS_decrypt(page + 64, plain, cbytes, p, dec_schedule, tweak_schedule, 14);
+
+    if (memcmp(plain, ref + 64, cbytes) != 0)
+      numerrors++;
+  }
+
+  free(plain);
+
+  return numerrors;
+}
@@ -11,8 +11,15 @@
 #include "CL/opencl.h"
 #include "AOCLUtils/aocl_utils.h"
 
+#include "aes_tools.h"
+#include "container.h"
+#include "crc_tools.h"
+#include "file_tools.h"
+#include "filter.h"
+#include "gzip_model.h"
 #include "gzip_tools.h"
 #include "helpers.h"
+#include "uring_tools.h"
 
 static unsigned int HUFFTABLE_SIZE = 1024;
 
@@ -44,7 +51,16 @@ const char *kernel_name[] = {
   // AES
   "aes_loadbalancer",
   "aes_decrypt0",
-  "aes_keygen_dec0"
+  "aes_keygen_dec0",
+  // GZIP first pass
+  "histogram0",
+#if !GZIP_DEFLATE
+  // Read path
+  "inflate_keygen0",
+  "inflate_decrypt0",
+  "inflate_huffman0",
+  "inflate_lz0"
+#endif
 };
 
 enum Kernels {
@@ -65,6 +81,15 @@ enum Kernels {
   AES_LOAD_BALANCER,
   AES_DECRYPT,
   AES_DECRYPT_KEY,
+  // GZIP first pass, kept last so the events of the other kernels keep their index
+  GZIP_HISTOGRAM,
+#if !GZIP_DEFLATE
+  // Read path
+  INFLATE_KEY,
+  INFLATE_DECRYPT,
+  INFLATE_HUFF,
+  INFLATE_LZ,
+#endif
   NUM_KERNELS
 };
 
@@ -85,9 +110,15 @@ static cl_kernel kernel[NUM_KERNELS];
 // GZIP
 static cl_mem input_buf          = NULL;
 static cl_mem huftable_buf       = NULL;
+static cl_mem markers_buf        = NULL;
+static cl_mem page_flags_buf     = NULL;
+static cl_mem hist_buf           = NULL;
 // AES
 static cl_mem output_aes_enc_buf = NULL;
 static cl_mem output_aes_dec_buf = NULL;
+// Read path
+static cl_mem inflate_buf        = NULL;
+static cl_mem inflate_bytes_buf  = NULL;
 
 //--------------------------------------------------------------------------------------------------
 //  FUNCTION PROTOTYPES
@@ -96,15 +127,24 @@ static cl_mem output_aes_dec_buf = NULL;
 bool init(bool use_emulator);
 void cleanup();
 
-void compress_and_encrypt(const char *filename, unsigned int n_pages);
+static void run_keys(aes_config &aes_config_run, key_config &key_config_run, key_config &tweak_key_run);
+static int run_filter(bool decompress, unsigned int page_size, unsigned int window, unsigned int n_threads,
+  unsigned int stored_threshold, unsigned int key_id, const char *uring_input);
+
+void compress_and_encrypt(const char *filename, unsigned int n_pages, unsigned int page_size,
+  bool use_model, const char *out_filename, int frame, bool page_tables, unsigned int stored_threshold,
+  const char *container_filename, unsigned int key_id, bool use_uring);
 
-time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable,
-  unsigned int insize, unsigned int n_pages, unsigned int outsize, unsigned char marker,
-  unsigned int *output_aes, gzip_out_info_t &gzip_out_info);
+time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable, unsigned char *markers,
+  huff_encodenode_t **root, bool page_tables, unsigned char *page_flags, unsigned int stored_threshold,
+  unsigned int insize, unsigned int page_size, unsigned int n_pages, unsigned int outsize,
+  unsigned int *output_aes, gzip_out_info_t &gzip_out_info, unsigned char *inflated,
+  unsigned int *inflated_bytes, const char *container_filename, unsigned int key_id, bool use_uring,
+  int &numerrors);
 
 int decompress_on_host(unsigned char *input, huff_encodenode_t *tree, unsigned int insize,
   unsigned int outsize, unsigned char marker, unsigned short *output_huffman,
-  gzip_out_info_t gzip_out_info, unsigned int remaining_bytes, double &time_decompress);
+  gzip_out_info_t gzip_out_info, double &time_decompress);
 
 //--------------------------------------------------------------------------------------------------
 //  MAIN FUNCTION
@@ -117,18 +157,84 @@ int main(int argc, char **argv)
   std::string input_filename = options.has("input") ? options.get("input") : "input.txt";
   unsigned int n_pages = options.has("n_pages") ? std::stoul(options.get("n_pages")) : 1;
 
+  // Optional page size in bytes instead of n_pages, rounded up to a multiple of 2*VEC
+  unsigned int page_size = options.has("page_size") ? std::stoul(options.get("page_size")) : 0;
+
   // Optional argument to specify whether the emulator should be used.
   bool use_emulator = options.has("emulator");
 
-  if (!init(use_emulator))
+  // Optional argument to run the software model of the gzip kernels instead of the FPGA.
+  bool use_model = options.has("model");
+
+  // Optional arguments to write the DEFLATE output (GZIP_DEFLATE builds) to a file,
+  // framed as gzip (default), zlib or the bench_flate page layout.
+  std::string out_filename = options.has("output") ? options.get("output") : "";
+  std::string frame_name = options.has("frame") ? options.get("frame") : "gzip";
+  int frame = DEFLATE_FRAME_GZIP;
+  if (frame_name == "zlib")
+    frame = DEFLATE_FRAME_ZLIB;
+  else if (frame_name == "flate")
+    frame = DEFLATE_FRAME_FLATE;
+  else if (frame_name != "gzip") {
+    std::cerr << "[ERROR] --frame must be gzip, zlib or flate" << std::endl;
+    return -1;
+  }
+
+  // Huffman tables built per page from the device histogram (default), or one table
+  // for the whole file computed on the host
+  std::string huffman_name = options.has("huffman") ? options.get("huffman") : "page";
+  if (huffman_name != "page" && huffman_name != "file") {
+    std::cerr << "[ERROR] --huffman must be page or file" << std::endl;
+    return -1;
+  }
+  bool page_tables = (huffman_name == "page");
+
+  // Pages whose Huffman size is estimated at this percentage of the page or more are
+  // stored as they are (0: compress every page)
+  unsigned int stored_threshold = options.has("stored") ? std::stoul(options.get("stored")) : 97;
+
+  // Optional container file with the encrypted pages and a page index, and the id
+  // of the key recorded in it
+  std::string container_filename = options.has("container") ? options.get("container") : "";
+  unsigned int key_id = options.has("key_id") ? std::stoul(options.get("key_id")) : 0;
+
+  // Input and container file I/O: memory mapped (default), or streamed with io_uring and
+  // O_DIRECT, the input read ahead in chunks that are consumed as they land
+  std::string io_name = options.has("io") ? options.get("io") : "mmap";
+  if (io_name != "mmap" && io_name != "uring") {
+    std::cerr << "[ERROR] --io must be mmap or uring" << std::endl;
+    return -1;
+  }
+  bool use_uring = (io_name == "uring");
+
+  // Filter mode: stdin to a stream container on stdout, or back with -d. Pages of --page_size
+  // bytes (default 64 KiB), --window pages in flight on --threads workers (0: one per core).
+  // With --io=uring and --input the input file is streamed with io_uring instead of stdin
+  if (options.has("filter")) {
+    unsigned int window = options.has("window") ? std::stoul(options.get("window")) : 64;
+    unsigned int n_threads = options.has("threads") ? std::stoul(options.get("threads")) : 0;
+    return run_filter(options.has("d"), page_size ? page_size : 65536, window, n_threads,
+      stored_threshold, key_id, (use_uring && options.has("input")) ? input_filename.c_str() : NULL);
+  }
+
+  // the model checks its pages in memory, it has no output to write
+  if (use_model && !out_filename.empty()) {
+    std::cerr << "[ERROR] --output needs the FPGA output, it does not work with --model" << std::endl;
+    return -1;
+  }
+
+  if (!use_model && !init(use_emulator))
     return -1;
 
   if (n_pages == 0)
     return -1;
 
-  compress_and_encrypt(input_filename.c_str(), n_pages);
+  compress_and_encrypt(input_filename.c_str(), n_pages, page_size, use_model,
+    out_filename.empty() ? NULL : out_filename.c_str(), frame, page_tables, stored_threshold,
+    container_filename.empty() ? NULL : container_filename.c_str(), key_id, use_uring);
 
-  cleanup();
+  if (!use_model)
+    cleanup();
   return 0;
 }
 
@@ -140,7 +246,7 @@ time_profiles_s computeTimeProfiles(std::vector<cl_event> &vec)
   std::vector<cl_event*> events;
 
   for (unsigned int e = 0; e < vec.size(); ++e) {
-    if (e == GZIP_LZ770)
+    if (e == GZIP_LZ770 || e >= GZIP_HISTOGRAM)
       continue;
     events.push_back(&(vec.at(e)));
   }
@@ -155,62 +261,176 @@ time_profiles_s computeTimeProfiles(std::vector<cl_event> &vec)
   return profiles;
 }
 
+//--------------------------------------------------------------------------------------------------
+//  STREAMED INPUT
+//---------------------------
+// Reads the file with io_uring into a zero padded buffer, one chunk at a time in file order
+// while the next chunks are in flight, and counts the bytes of every chunk into hist (if not
+// NULL) as it lands.
+//--------------------------------------------------------------------------------------------------
+
+static unsigned char *stream_input_file(const char *filename, unsigned int insize,
+  unsigned int padded_size, file_map_t &map, unsigned int *hist)
+{
+  uring_reader_t *reader = uring_reader_open(filename, URING_CHUNK, URING_DEPTH);
+  if (reader == NULL || uring_reader_size(reader) != insize) {
+    if (reader != NULL)
+      uring_reader_close(reader);
+    return NULL;
+  }
+
+  unsigned char *input = (unsigned char *)aocl_utils::alignedMalloc(padded_size);
+  unsigned int pos = 0;
+  size_t bytes;
+  const unsigned char *chunk;
+
+  while ((chunk = uring_reader_next(reader, bytes)) != NULL) {
+    memcpy(input + pos, chunk, bytes);
+    uring_reader_release(reader);
+    if (hist != NULL)
+      for (size_t k = 0; k < bytes; k++)
+        hist[input[pos + k]]++;
+    pos += bytes;
+  }
+
+  if (!uring_reader_close(reader) || pos != insize) {
+    aocl_utils::alignedFree(input);
+    return NULL;
+  }
+  memset(input + insize, 0, padded_size - insize);
+
+  map.data = input;
+  map.length = 0;
+  return input;
+}
+
+//--------------------------------------------------------------------------------------------------
+//  FILTER
+//---------------------------
+// Pages are encoded on the host with the software model of the gzip kernels and AES-NI, the
+// stream container can be read with container_open like the device output. Only errors are
+// printed, to stderr.
+//--------------------------------------------------------------------------------------------------
+
+static int run_filter(bool decompress, unsigned int page_size, unsigned int window, unsigned int n_threads,
+  unsigned int stored_threshold, unsigned int key_id, const char *uring_input)
+{
+  aes_config aes_config_run;
+  key_config key_config_run;
+  key_config tweak_key_run;
+  run_keys(aes_config_run, key_config_run, tweak_key_run);
+
+  filter_config_t config;
+  config.page_size = (page_size + 2*VEC - 1) / (2*VEC) * (2*VEC);
+  if (config.page_size < 64)
+    config.page_size = 64;
+  config.window = window > 0 ? window : 1;
+  config.n_threads = n_threads;
+  config.stored_threshold = stored_threshold;
+  config.key_id = key_id;
+  memcpy(config.key, key_config_run.key, sizeof(config.key));
+  memcpy(config.tweak_key, tweak_key_run.key, sizeof(config.tweak_key));
+  memcpy(config.salt, aes_config_run.salt, sizeof(config.salt));
+  config.uring_input = uring_input;
+
+  long n_pages = decompress ? filter_decompress(stdin, stdout, config) : filter_compress(stdin, stdout, config);
+  if (n_pages < 0) {
+    std::cerr << "[ERROR] " << (decompress ? "decompression" : "compression") << " filter failed" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
 //--------------------------------------------------------------------------------------------------
 //  COMPRESS AND ENCRYPT
 //---------------------------
-//  1- Create huffman tree and select marker on host
-//  2- Deflate input file on *FPGA*
+//  1- Create huffman tables and select markers, per page from the device histogram
+//     or for the whole file on host
+//  2- Deflate input file on *FPGA* (or the software model with --model)
 //  3- Inflate FPGA output on host and compare to input for verification
 //  4- Print result and cleanup
 //--------------------------------------------------------------------------------------------------
 
-void compress_and_encrypt(const char *filename, unsigned int n_pages)
+void compress_and_encrypt(const char *filename, unsigned int n_pages, unsigned int page_size,
+  bool use_model, const char *out_filename, int frame, bool page_tables, unsigned int stored_threshold,
+  const char *container_filename, unsigned int key_id, bool use_uring)
 {
   //------------------------------------------------------------------------------------------------
   // 0- Input file
   //------------------------------------------------------------------------------------------------
 
   unsigned int insize, outsize;
-  FILE *f;
 
-  f = fopen(filename, "rb");
-  if (f == NULL) {
+  long long filesize = file_size(filename);
+  if (filesize < 0) {
     std::cerr << "Unable to open " << filename << std::endl;
     exit(1);
   }
 
-  insize = get_filesize(f);
+  insize = filesize;
   if (insize < 1) {
     std::cerr << "File "<< filename << " is empty" << std::endl;
-    fclose(f);
     exit(1);
   }
 
-  // Worst case output_huff buffer size (too pessimistic for now)
-  outsize = insize * 2;
-
-  // Host Buffers
-  unsigned char  *input          = (unsigned char *)aocl_utils::alignedMalloc(insize);
-  unsigned int   *output_aes     = (unsigned int *)aocl_utils::alignedMalloc(outsize);
+  // [BATCH] Split input into independent pages, a multiple of 2*VEC bytes each. The
+  // last page is padded with zeros, its header holds the number of input bytes
+  if (page_size == 0)
+    page_size = (insize + n_pages - 1) / n_pages;
+  page_size = (page_size + 2*VEC - 1) / (2*VEC) * (2*VEC);
+  // the page slot holds the header line and at least one data line
+  if (page_size < 64)
+    page_size = 64;
+  n_pages = (insize + page_size - 1) / page_size;
+  unsigned int padded_size = n_pages * page_size;
+  unsigned int last_page_bytes = insize - (n_pages - 1) * page_size;
 
-  // Read and close input file
-  if (fseek(f, 0, SEEK_SET) != 0)
-    exit(1);
-  if (fread(input, 1, insize, f) != insize)
+  // Worst case output_huff buffer size (too pessimistic for now)
+  outsize = padded_size * 2;
+
+  // Host Buffers, the input file is mapped over the padded buffer or streamed into it. The
+  // streamed chunks are counted into the file histogram as they land
+  file_map_t input_map;
+  unsigned int file_hist[256] = {0};
+  bool count_hist = use_uring && !page_tables && !GZIP_DEFLATE;
+  double map_start = aocl_utils::getCurrentTimestamp();
+  unsigned char  *input          = use_uring ?
+    stream_input_file(filename, insize, padded_size, input_map, count_hist ? file_hist : NULL) :
+    map_input_file(filename, insize, padded_size, input_map);
+  double time_map = aocl_utils::getCurrentTimestamp() - map_start;
+  if (input == NULL) {
+    std::cerr << "Unable to read " << filename << std::endl;
     exit(1);
-  fclose(f);
-
-  // here truncate the file so that the number of chars is a multiple of VEC
-  int remaining_bytes = insize % (2*VEC); // TODO padding 0
-  insize -= remaining_bytes;
+  }
+  unsigned int   *output_aes     = (unsigned int *)aocl_utils::alignedMalloc(outsize);
 
   //------------------------------------------------------------------------------------------------
-  // 1- Create Huffman Tree on host
+  // 1- Create Huffman Tables, one per page
   //------------------------------------------------------------------------------------------------
-  unsigned int *huftable   = (unsigned int *)aocl_utils::alignedMalloc(HUFFTABLE_SIZE);
-  huff_encodenode_t *tree  = (huff_encodenode_t *)malloc(MAX_TREE_NODES * sizeof(huff_encodenode_t));
+  unsigned int *huftable   = (unsigned int *)aocl_utils::alignedMalloc(n_pages * HUFFTABLE_SIZE);
+  unsigned char *markers   = (unsigned char *)aocl_utils::alignedMalloc(n_pages);
+  unsigned char *page_flags = (unsigned char *)aocl_utils::alignedMalloc(n_pages);
+  huff_encodenode_t *tree  = NULL;
   huff_encodenode_t **root = &tree;
-  unsigned char marker     = Compute_Huffman(input, insize, huftable, root);
+#if GZIP_DEFLATE
+  // literal codes of the fixed-Huffman block, there is no marker
+  page_tables = false;
+  Deflate_Fixed_Table(huftable);
+  markers[0] = 0;
+#else
+  // the padding is encoded as well, the table needs a code for zero
+  if (!page_tables && count_hist) {
+    file_hist[0] += padded_size - insize;
+    markers[0] = Compute_Huffman_Hist(file_hist, padded_size, huftable, root);
+  } else if (!page_tables)
+    markers[0] = Compute_Huffman(input, padded_size, huftable, root);
+#endif
+  // the file table is used by every page, page tables come from the histogram pass
+  for (unsigned int p = 1; p < n_pages && !page_tables; p++) {
+    memcpy(&huftable[p * HUFFTABLE_SIZE / 4], huftable, HUFFTABLE_SIZE);
+    markers[p] = markers[0];
+  }
 
   //------------------------------------------------------------------------------------------------
   // 2- Send input file on *FPGA* for Compresion and Encryption
@@ -221,22 +441,69 @@ void compress_and_encrypt(const char *filename, unsigned int n_pages)
   std::cout << "AES_ENGINES   : " << AES_ENGINES << std::endl;
   std::cout << "input size [B]: " << insize << std::endl;
   std::cout << "pages         : " << n_pages << std::endl;
-  std::cout << "page size [B] : " << insize / n_pages << std::endl;
-  std::cout << "Remaining [B] : " << remaining_bytes << std::endl;
-  std::cout << "Marker        : " << static_cast<unsigned>(marker) << std::endl;
-
-  // [BATCH] Split input into independent pages
-  unsigned int page_size = insize / n_pages;
-  if ((page_size % (2*VEC)) != 0) {
-    std::cerr << "[ERROR] page_size must be divisible by 2*VEC" << std::endl;
-    exit(1);
+  std::cout << "page size [B] : " << page_size << std::endl;
+  std::cout << "Last page [B] : " << last_page_bytes << std::endl;
+  std::cout << "Input         : " << (use_uring ? "io_uring" : (input_map.length ? "mapped" : "read")) << ", " << time_map * 1e3 << " ms" << std::endl;
+  std::cout << "Format        : " << (GZIP_DEFLATE ? "deflate" : "lz+huffman") << std::endl;
+  std::cout << "Huffman       : " << (GZIP_DEFLATE ? "fixed" : (page_tables ? "page" : "file")) << std::endl;
+  if (!page_tables)
+    std::cout << "Marker        : " << static_cast<unsigned>(markers[0]) << std::endl;
+
+  memset(page_flags, 0, n_pages);
+#if GZIP_DEFLATE
+  // a DEFLATE page would inflate to its padding as well, the input bytes are stored
+  if (last_page_bytes != page_size)
+    page_flags[n_pages - 1] |= HDR_FLAG_STORED;
+#endif
+
+  if (use_model) {
+    if (page_tables || stored_threshold) {
+      unsigned int *hist = (unsigned int *)aocl_utils::alignedMalloc(n_pages * HUFFTABLE_SIZE);
+      unsigned long hist_cycles = gzip_model_histogram(input, page_size, n_pages, hist);
+      if (page_tables)
+        Compute_Huffman_Pages(hist, page_size, n_pages, huftable, markers, NULL);
+      unsigned int n_stored = Select_Stored_Pages(hist, page_size, n_pages, markers, stored_threshold,
+        page_flags);
+      printf("Model histogram bytes/cycle = %.3f \n", (double)insize / hist_cycles);
+      std::cout << "Stored pages  : " << n_stored << std::endl;
+      aocl_utils::alignedFree(hist);
+    }
+
+    int numerrors = run_gzip_model(filename, input, insize, page_size, n_pages, markers, huftable,
+      page_flags);
+    if (numerrors == 0)
+      std::cout << "PASSED, no errors" << std::endl;
+    else
+      std::cerr << "FAILED, " << numerrors << " errors" << std::endl;
+
+    unmap_file(input_map);
+    aocl_utils::alignedFree(output_aes);
+    aocl_utils::alignedFree(huftable);
+    aocl_utils::alignedFree(markers);
+    aocl_utils::alignedFree(page_flags);
+    return;
   }
 
   gzip_out_info_t gzip_out_info;
   memset(output_aes, 0, outsize);
 
-  time_profiles_s profiles = offload_to_FPGA(input, huftable, insize, n_pages, outsize, marker,
-    output_aes, gzip_out_info);
+  // Pages that fit the history of inflate_lz0 are also read back through the FPGA
+  unsigned char *inflated        = NULL;
+  unsigned int  *inflated_bytes  = NULL;
+  if (!GZIP_DEFLATE && page_size <= INFLATE_WINDOW) {
+    inflated       = (unsigned char *)aocl_utils::alignedMalloc(padded_size);
+    inflated_bytes = (unsigned int *)aocl_utils::alignedMalloc(n_pages * sizeof(unsigned int));
+  }
+
+  int numerrors = 0;
+  time_profiles_s profiles = offload_to_FPGA(input, huftable, markers, root, page_tables, page_flags,
+    stored_threshold, insize, page_size, n_pages, outsize, output_aes, gzip_out_info, inflated,
+    inflated_bytes, container_filename, key_id, use_uring, numerrors);
+
+  unsigned int n_stored = 0;
+  for (unsigned int p = 0; p < n_pages; p++)
+    n_stored += (page_flags[p] & HDR_FLAG_STORED) != 0;
+  std::cout << "Stored pages  : " << n_stored << std::endl;
 
   //------------------------------------------------------------------------------------------------
   // 3- Decrypt data on *host* and compare to compressed data for verification
@@ -246,7 +513,6 @@ void compress_and_encrypt(const char *filename, unsigned int n_pages)
   //------------------------------------------------------------------------------------------------
   // 4- Decrypt and decompress FPGA output on host and compare to input for verification
   //------------------------------------------------------------------------------------------------
-  unsigned short* output_aes_short = (unsigned short*) &output_aes[16]; // skip first line, header
   union header_u header;
   memcpy(header.values, output_aes, 64); // 512 bits
   unsigned int compressed_size = gzip_out_info.compsize_huffman[0] * n_pages;
@@ -255,15 +521,55 @@ void compress_and_encrypt(const char *filename, unsigned int n_pages)
   gzip_out_info.compsize_lz[0] = header.values[2];
   gzip_out_info.compsize_huffman[0] = header.values[3];
 
-  int numerrors = 0;
   double time_x_profile_decompress = 0.0;
 
+  // the CRC32C that load_lz0 stored in every header must match the input page
+  double crc_start = aocl_utils::getCurrentTimestamp();
+  int crc_errors = verify_crc32c_pages(input, page_size, n_pages, output_aes, (page_size * 2) / 64 * 64, 0);
+  double time_crc = aocl_utils::getCurrentTimestamp() - crc_start;
+  if (crc_errors != 0)
+    std::cerr << "[ERROR] CRC32C mismatch on " << crc_errors << " pages" << std::endl;
+  else
+    std::cout << "CRC32C: " << n_pages << " pages verified" << std::endl;
+  numerrors += crc_errors;
+
+#if GZIP_DEFLATE
+  // every page is a raw DEFLATE stream, inflate them all with zlib
+  unsigned long framed_size = 0;
+  unsigned int page_stride = (page_size * 2) / 64 * 64;
+  numerrors += deflate_pages_on_host(input, page_size, n_pages, output_aes, page_stride,
+    out_filename, frame, framed_size, time_x_profile_decompress);
+
+  compressed_size = 0;
+  for (unsigned int p = 0; p < n_pages; p++)
+    compressed_size += output_aes[p * page_stride / 4 + HDR_COMPSIZE_HUFFMAN];
+  printf("Framed size (%s) = %lu \n", frame == DEFLATE_FRAME_GZIP ? "gzip" :
+    (frame == DEFLATE_FRAME_ZLIB ? "zlib" : "flate"), framed_size);
+#else
   // TODO fpga works, but here we should take all the headers, decrypt and decompress individually,
   //      and then compare the result with input 
-  if (n_pages == 1) {
-    numerrors = decompress_on_host(input, tree, insize, outsize, marker, output_aes_short,
-      gzip_out_info, remaining_bytes, time_x_profile_decompress);
+  unsigned short* output_aes_short = (unsigned short*) &output_aes[16]; // skip first line, header
+  if (n_pages == 1 && (header.values[HDR_FLAGS] & HDR_FLAG_STORED)) {
+    // the page is the input as it is
+    numerrors += memcmp(output_aes_short, input, insize) != 0;
+  } else if (n_pages == 1) {
+    numerrors += decompress_on_host(input, tree, insize, outsize, markers[0], output_aes_short,
+      gzip_out_info, time_x_profile_decompress);
+  }
+
+  // every page inflated on the FPGA is compared with the input
+  if (inflated) {
+    int inflate_errors = verify_inflated_pages(input, page_size, n_pages, inflated, inflated_bytes,
+      output_aes, (page_size * 2) / 64 * 64);
+    if (inflate_errors != 0)
+      std::cerr << "[ERROR] FPGA inflate mismatch on " << inflate_errors << " pages" << std::endl;
+    else
+      std::cout << "FPGA inflate: " << n_pages << " pages verified" << std::endl;
+    numerrors += inflate_errors;
+  } else {
+    std::cout << "FPGA inflate: skipped, page size > INFLATE_WINDOW" << std::endl;
   }
+#endif
 
   //------------------------------------------------------------------------------------------------
   // 5- Print result and cleanup
@@ -286,10 +592,14 @@ void compress_and_encrypt(const char *filename, unsigned int n_pages)
   std::cout << "Compsize huffman[0]: " << header.values[3] << " bytes"<< std::endl;
 
   printf("Compsize huffman = %u \n", compressed_size);
+  if (page_tables || stored_threshold)
+    printf("Exec time histogram         = %.2f ns \n", double(profiles.gzip_hist));
   printf("Exec time compNcrypt        = %.2f ns \n", double(profiles.gzip_com));
   printf("Exec time aes_enc           = %.2f ns \n", double(profiles.aes_enc));
   printf("Exec time aes decryption    = %.2f ns \n", double(profiles.aes_dec));
   printf("Exec time gzip decompress   = %.2f ns \n", double(profiles.compNcrypt));
+  if (inflated)
+    printf("Exec time inflate (FPGA)    = %.2f ns \n", double(profiles.gzip_dec));
 
   printf("Compression Ratio = %.2f %% \n", compression_ratio);
   printf("Throughput compNcrypt       = %.5f GB/s \n", throughput_compNcrypt);
@@ -297,10 +607,20 @@ void compress_and_encrypt(const char *filename, unsigned int n_pages)
   printf("Throughput aes encryption   = %.5f GB/s \n", throughput_aes_enc);
   printf("Throughput aes decryption   = %.5f GB/s \n", throughput_aes_dec);
   printf("Throughput gzip decompress  = %.5f GB/s \n", throughput_gzip_dec);
+  printf("Throughput CRC32C (host)    = %.5f GB/s \n", (double)insize / (time_crc*1.0e+9));
+  if (inflated)
+    printf("Throughput inflate (FPGA)   = %.5f GB/s \n", (double)insize / double(profiles.gzip_dec));
 
   //free buffers
-  aocl_utils::alignedFree(input);
+  unmap_file(input_map);
   aocl_utils::alignedFree(output_aes);
+  aocl_utils::alignedFree(huftable);
+  aocl_utils::alignedFree(markers);
+  aocl_utils::alignedFree(page_flags);
+  if (inflated) {
+    aocl_utils::alignedFree(inflated);
+    aocl_utils::alignedFree(inflated_bytes);
+  }
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -394,33 +714,42 @@ void cleanup()
     clReleaseMemObject(input_buf);
   if (huftable_buf)
     clReleaseMemObject(huftable_buf);
+  if (markers_buf)
+    clReleaseMemObject(markers_buf);
+  if (page_flags_buf)
+    clReleaseMemObject(page_flags_buf);
+  if (hist_buf)
+    clReleaseMemObject(hist_buf);
   if (output_aes_enc_buf)
     clReleaseMemObject(output_aes_enc_buf);
   if(output_aes_dec_buf)
     clReleaseMemObject(output_aes_dec_buf);
+  if (inflate_buf)
+    clReleaseMemObject(inflate_buf);
+  if (inflate_bytes_buf)
+    clReleaseMemObject(inflate_bytes_buf);
 }
 
 //--------------------------------------------------------------------------------------------------
-//  Offload to FPGA
+//  Keys
 //---------------------------
-//
+// Key and file salt of a run, shared by the device pipeline and the filter. The salt is new
+// for every run, the IV of every page is derived from it and the page index (aes_page_iv).
 //--------------------------------------------------------------------------------------------------
 
-time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable,
-  unsigned int insize, unsigned int n_pages, unsigned int outsize, unsigned char marker,
-  unsigned int *output_aes, gzip_out_info_t &gzip_out_info)
+static void run_keys(aes_config &aes_config_run, key_config &key_config_run, key_config &tweak_key_run)
 {
-  aes_config aes_config_run;
-  aes_config_run.elements[0] = insize/4;// N is number of lines, one line = 512b=64B
-  aes_config_run.elements[1] = 0;
-  aes_config_run.cntr_nonce[0] = 0x00000000; //rand(); // LS uint nonce
-  aes_config_run.cntr_nonce[1] = 0x00000000; //rand(); // MS uint nonce
-  aes_config_run.iv[0] = 0x00000000;//rand(); // LS uint iv
-  aes_config_run.iv[1] = 0x00000000;//rand(); // uint iv
-  aes_config_run.iv[2] = 0x00000000;//rand(); // uint iv
-  aes_config_run.iv[3] = 0x00000000;//rand(); // MS uint iv
+  aes_config_run.elements[0] = 0; // line index, set per line by the kernels
+  aes_config_run.elements[1] = 0; // page start flag, set per line by the kernels
+  memset(aes_config_run.iv, 0, sizeof(aes_config_run.iv)); // set per page by the kernels
+
+  FILE *urandom = fopen("/dev/urandom", "rb");
+  if (urandom == NULL || fread(aes_config_run.salt, sizeof(aes_config_run.salt), 1, urandom) != 1) {
+    std::cerr << "Unable to read a salt from /dev/urandom" << std::endl;
+    exit(1);
+  }
+  fclose(urandom);
 
-  key_config key_config_run;
   key_config_run.key[0] = 0x00000000; // LS uint
   key_config_run.key[1] = 0xFFFFFFFF;
   key_config_run.key[2] = 0xFFFFFFFF;
@@ -430,13 +759,48 @@ time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable,
   key_config_run.key[6] = 0x00000001;
   key_config_run.key[7] = 0x00000001; // MS uint
 
+  // Second XTS key (AES_MODE_XTS), encrypts the page index into the tweak
+  for (unsigned int i = 0; i < 8; i++)
+    tweak_key_run.key[i] = 0x01010101 * (i + 1);
+}
+
+//--------------------------------------------------------------------------------------------------
+//  Offload to FPGA
+//---------------------------
+//
+//--------------------------------------------------------------------------------------------------
+
+time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable, unsigned char *markers,
+  huff_encodenode_t **root, bool page_tables, unsigned char *page_flags, unsigned int stored_threshold,
+  unsigned int insize, unsigned int page_size, unsigned int n_pages, unsigned int outsize,
+  unsigned int *output_aes, gzip_out_info_t &gzip_out_info, unsigned char *inflated,
+  unsigned int *inflated_bytes, const char *container_filename, unsigned int key_id, bool use_uring,
+  int &numerrors)
+{
+  // the input buffer holds whole pages, padded with zeros past insize
+  unsigned int padded_size = n_pages * page_size;
+
+  aes_config aes_config_run;
+  key_config key_config_run;
+  key_config tweak_key_run;
+  run_keys(aes_config_run, key_config_run, tweak_key_run);
+
   // Input buffers
-  input_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, insize, NULL, &status);
+  input_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, padded_size, NULL, &status);
   checkError(status, "Failed to create buffer for input");
 
-  huftable_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, HUFFTABLE_SIZE, NULL, NULL);
+  huftable_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, n_pages * HUFFTABLE_SIZE, NULL, &status);
   checkError(status, "Failed to create buffer for huftable");
 
+  markers_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, n_pages, NULL, &status);
+  checkError(status, "Failed to create buffer for markers");
+
+  page_flags_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, n_pages, NULL, &status);
+  checkError(status, "Failed to create buffer for page flags");
+
+  hist_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, n_pages * HUFFTABLE_SIZE, NULL, &status);
+  checkError(status, "Failed to create buffer for histogram");
+
   // Output buffers
   output_aes_enc_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, outsize, NULL, &status);
   checkError(status, "Failed to create buffer for output_aes_encryption");
@@ -444,41 +808,93 @@ time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable,
   output_aes_dec_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY, outsize, NULL, &status);
   checkError(status, "Failed to create buffer for output_aes_decryption");
 
-  cl_event write_event[2];
+  cl_event write_event[4];
+  cl_event hist_event;
 
   // Input data
-  status = clEnqueueWriteBuffer(queue[GZIP_LOAD_LZ77], input_buf, CL_FALSE, 0, insize, input, 0,
+  status = clEnqueueWriteBuffer(queue[GZIP_LOAD_LZ77], input_buf, CL_FALSE, 0, padded_size, input, 0,
      NULL, &write_event[0]);
   checkError(status, "Failed to transfer raw input");
 
-  // Huffman table
-  status = clEnqueueWriteBuffer(queue[GZIP_LOAD_HUFF], huftable_buf, CL_TRUE, 0, HUFFTABLE_SIZE,
-    huftable, 0, NULL, &write_event[1]);
+  unsigned argi, k;
+
+  unsigned int mem_offset = (page_size * 2) / 64; // page slot in 512-bit lines
+
+  //------------------------------------------------------------------------------------------------
+  // [openCL] First pass: page histograms on the device, Huffman tables and stored pages
+  //          on host
+  //------------------------------------------------------------------------------------------------
+  bool hist_pass = page_tables || stored_threshold != 0;
+  if (hist_pass) {
+    argi = 0;
+    k = GZIP_HISTOGRAM;
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &input_buf);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &hist_buf);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &padded_size);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &page_size);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+
+    const size_t one = 1;
+    std::cout << kernel_name[GZIP_HISTOGRAM] << std::endl;
+    clEnqueueNDRangeKernel(queue[GZIP_HISTOGRAM], kernel[GZIP_HISTOGRAM], 1, NULL, &one, &one, 1,
+      write_event, &hist_event);
+
+    // tables are built from the histograms only, the host does not scan the input
+    unsigned int *hist = (unsigned int *)aocl_utils::alignedMalloc(n_pages * HUFFTABLE_SIZE);
+    status = clEnqueueReadBuffer(queue[GZIP_HISTOGRAM], hist_buf, CL_TRUE, 0,
+      n_pages * HUFFTABLE_SIZE, hist, 1, &hist_event, NULL);
+    checkError(status, "Failed to read histogram");
+
+    if (page_tables)
+      Compute_Huffman_Pages(hist, page_size, n_pages, huftable, markers, root);
+    Select_Stored_Pages(hist, page_size, n_pages, markers, stored_threshold, page_flags);
+    aocl_utils::alignedFree(hist);
+  }
+  unsigned int n_compressed = 0;
+  for (unsigned int p = 0; p < n_pages; p++)
+    n_compressed += (page_flags[p] & HDR_FLAG_STORED) == 0;
+
+  // Huffman tables
+  status = clEnqueueWriteBuffer(queue[GZIP_LOAD_HUFF], huftable_buf, CL_TRUE, 0,
+    n_pages * HUFFTABLE_SIZE, huftable, 0, NULL, &write_event[1]);
   checkError(status, "Failed to transfer huftable");
 
+  // Markers
+  status = clEnqueueWriteBuffer(queue[GZIP_LOAD_LZ77], markers_buf, CL_TRUE, 0, n_pages, markers,
+    0, NULL, &write_event[2]);
+  checkError(status, "Failed to transfer markers");
+
+  // Stored pages
+  status = clEnqueueWriteBuffer(queue[GZIP_LOAD_LZ77], page_flags_buf, CL_TRUE, 0, n_pages,
+    page_flags, 0, NULL, &write_event[3]);
+  checkError(status, "Failed to transfer page flags");
+
   //------------------------------------------------------------------------------------------------
   // [openCL] Set kernel arguments and enqueue commands into kernel
   //------------------------------------------------------------------------------------------------
-  unsigned argi, k;
-
-  unsigned int page_size = insize / n_pages;
-  unsigned int mem_offset = page_size * 2;
 
   argi = 0;
   k = GZIP_LOAD_LZ77;
   status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &input_buf);
   checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+  status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &markers_buf);
+  checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+  status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &page_flags_buf);
+  checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
   status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &insize);
   checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
   status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &page_size);
   checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
-  status = clSetKernelArg(kernel[k], argi++, sizeof(cl_char), (void *) &marker);
-  checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
 
   argi = 0;
   k = GZIP_LOAD_HUFF;
   status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &huftable_buf);
   checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+  status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &page_flags_buf);
+  checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
   status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &n_pages);
   checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
 
@@ -495,13 +911,17 @@ time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable,
   checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
   status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &mem_offset);
   checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+#ifdef AES_MODE_XTS
+  status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int8), &tweak_key_run);
+  checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+#endif
 
   //------------------------------------------------------------------------------------------------
   // [openCL] Launch kernels
   //------------------------------------------------------------------------------------------------
   std::cout << "=====> Launch kernels" << std::endl;
   std::vector<cl_event> kernel_event(NUM_KERNELS);
-  std::vector<cl_event> lz77_events(n_pages);
+  std::vector<cl_event> lz77_events(n_compressed);
   cl_event finish_event[2];
 
   const size_t global_work_size = 1;
@@ -510,16 +930,16 @@ time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable,
   // gzip load data
   std::cout << kernel_name[GZIP_LOAD_LZ77] << std::endl;
   clEnqueueNDRangeKernel(queue[GZIP_LOAD_LZ77], kernel[GZIP_LOAD_LZ77], 1, NULL, &global_work_size,
-    &local_work_size, 2, write_event, &kernel_event.at(GZIP_LOAD_LZ77));
+    &local_work_size, 4, write_event, &kernel_event.at(GZIP_LOAD_LZ77));
 
   // gzip load tree
   std::cout << kernel_name[GZIP_LOAD_HUFF] << std::endl;
   clEnqueueNDRangeKernel(queue[GZIP_LOAD_HUFF], kernel[GZIP_LOAD_HUFF], 1, NULL, &global_work_size,
-    &local_work_size, 2, write_event, &kernel_event.at(GZIP_LOAD_HUFF));
+    &local_work_size, 4, write_event, &kernel_event.at(GZIP_LOAD_HUFF));
 
-  // lz77
-  std::cout << kernel_name[GZIP_LZ770] << " x" << n_pages << std::endl;
-  for (int n=0; n < n_pages; ++n) {
+  // lz77, one launch per compressed page
+  std::cout << kernel_name[GZIP_LZ770] << " x" << n_compressed << std::endl;
+  for (int n=0; n < n_compressed; ++n) {
     clEnqueueNDRangeKernel(queue[GZIP_LZ770], kernel[GZIP_LZ770], 1, NULL, &global_work_size,
       &local_work_size, 0, NULL, &lz77_events.at(n));
   }
@@ -547,8 +967,9 @@ time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable,
   std::cout << "Finished: " << kernel_name[GZIP_LOAD_HUFF] << std::endl;
 
   // lz77
-  clWaitForEvents(1, &lz77_events.at(n_pages-1));
-  std::cout << "Finished: " << kernel_name[GZIP_LZ770] << " x" << n_pages << std::endl;
+  if (n_compressed > 0)
+    clWaitForEvents(1, &lz77_events.at(n_compressed-1));
+  std::cout << "Finished: " << kernel_name[GZIP_LZ770] << " x" << n_compressed << std::endl;
 
   // aes load balancer
   clWaitForEvents(1, &kernel_event.at(AES_LOAD_BALANCER));
@@ -558,24 +979,69 @@ time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable,
   clWaitForEvents(1, finish_event);
 
   //------------------------------------------------------------------------------------------------
-  // [DEBUG] Save compressed and encrypted data to a file 
+  // Save the compressed and encrypted pages to a container file, read them back on host
   //------------------------------------------------------------------------------------------------
-  /*std::fstream file;
-  file.open("file_encrypted_results.txt", std::ios::out);
-
-  unsigned char *ptr_compressedNencrypted = (unsigned char*) out_aes_encr;
-  for (unsigned int i=0; i<(2*gzip_out_info.compsize_huffman[0]); i++) {
-    file << *ptr_compressedNencrypted;
-    ptr_compressedNencrypted++;
+  if (container_filename != NULL) {
+    container_info_t info;
+    info.insize = insize;
+    info.page_size = page_size;
+    info.n_tables = GZIP_DEFLATE ? 0 : (page_tables ? n_pages : 1);
+    info.huftables = huftable;
+    info.key_id = key_id;
+    info.uring = use_uring;
+    memcpy(info.salt, aes_config_run.salt, sizeof(info.salt));
+
+    unsigned long container_size = container_write(container_filename, out_aes_encr, n_pages,
+      mem_offset * 64, info);
+    std::cout << "Container [B] : " << container_size << std::endl;
+
+#ifdef AES_MODE_XTS
+    container_t *c = container_open(container_filename, key_config_run.key, tweak_key_run.key, key_id);
+#else
+    container_t *c = container_open(container_filename, key_config_run.key, key_config_run.key, key_id);
+#endif
+    if (c == NULL) {
+      numerrors++;
+    } else {
+      // a point read in the middle page, then the whole file
+      unsigned char *readback = (unsigned char *)aocl_utils::alignedMalloc(insize);
+      double read_start = aocl_utils::getCurrentTimestamp();
+      int read_errors = container_read(c, insize / 2, 1, readback);
+      double time_point = aocl_utils::getCurrentTimestamp() - read_start;
+      read_errors += readback[0] != input[insize / 2];
+
+      read_start = aocl_utils::getCurrentTimestamp();
+      read_errors += container_read(c, 0, insize, readback);
+      double time_read = aocl_utils::getCurrentTimestamp() - read_start;
+      read_errors += memcmp(readback, input, insize) != 0;
+
+      if (read_errors != 0)
+        std::cerr << "[ERROR] container read back: " << read_errors << " errors" << std::endl;
+      else
+        std::cout << "Container: " << n_pages << " pages read back" << std::endl;
+      printf("Container point read (host) = %.2f us \n", time_point * 1.0e+6);
+      printf("Container read (host)       = %.5f GB/s \n", (double)insize / (time_read * 1.0e+9));
+      numerrors += read_errors;
+
+      aocl_utils::alignedFree(readback);
+      container_close(c);
+    }
   }
 
-  file.close();*/
-  aocl_utils::alignedFree(out_aes_encr);
+#ifdef AES_MODE_GCM
+  int tag_errors = verify_gcm_tags(out_aes_encr, n_pages, mem_offset * 64, key_config_run.key);
+  if (tag_errors != 0)
+    std::cerr << "[ERROR] GCM tag mismatch on " << tag_errors << " pages" << std::endl;
+  else
+    std::cout << "GCM tags verified" << std::endl;
+#endif
 
   //------------------------------------------------------------------------------------------------
   // [AES] Decryption
   //------------------------------------------------------------------------------------------------
 
+  unsigned int first_page = 0; // any page range can be decrypted on its own
+
   argi = 0;
   k = AES_DECRYPT;
   status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &output_aes_enc_buf);
@@ -584,6 +1050,8 @@ time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable,
   checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
   status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int8), &aes_config_run);
   checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+  status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &first_page);
+  checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
   status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &n_pages);
   checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
   status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &mem_offset);
@@ -593,6 +1061,10 @@ time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable,
   k = AES_DECRYPT_KEY;
   status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int8), &key_config_run);
   checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+#ifdef AES_MODE_XTS
+  status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int8), &tweak_key_run);
+  checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+#endif
 
   // Launch aes_key kernel
   clEnqueueNDRangeKernel(queue[AES_DECRYPT_KEY], kernel[AES_DECRYPT_KEY], 1, NULL,
@@ -610,20 +1082,127 @@ time_profiles_s offload_to_FPGA(unsigned char *input, unsigned int *huftable,
   clWaitForEvents(1, &finish_event[1]);
   std::cout << "Finished: decryption" << std::endl;
 
+#ifdef AES_MODE_XTS
+  int xts_errors = verify_xts_pages(out_aes_encr, output_aes, n_pages, mem_offset * 64,
+    key_config_run.key, tweak_key_run.key);
+  if (xts_errors != 0)
+    std::cerr << "[ERROR] XTS decryption mismatch on " << xts_errors << " pages" << std::endl;
+  else
+    std::cout << "XTS pages verified" << std::endl;
+#endif
+
+  aocl_utils::alignedFree(out_aes_encr);
+
+  //------------------------------------------------------------------------------------------------
+  // [Read path] Decrypt, Huffman and LZ decode on the FPGA
+  //------------------------------------------------------------------------------------------------
+  cl_ulong inflate_time = 0;
+#if !GZIP_DEFLATE
+  if (inflated) {
+    inflate_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY, padded_size, NULL, &status);
+    checkError(status, "Failed to create buffer for inflate");
+
+    inflate_bytes_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY, n_pages * sizeof(cl_uint), NULL,
+      &status);
+    checkError(status, "Failed to create buffer for inflate_bytes");
+
+    argi = 0;
+    k = INFLATE_KEY;
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int8), &key_config_run);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+#ifdef AES_MODE_XTS
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int8), &tweak_key_run);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+#endif
+
+    argi = 0;
+    k = INFLATE_DECRYPT;
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &output_aes_enc_buf);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int8), &aes_config_run);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &first_page);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &n_pages);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &mem_offset);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+
+    argi = 0;
+    k = INFLATE_HUFF;
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &huftable_buf);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &first_page);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &n_pages);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+
+    argi = 0;
+    k = INFLATE_LZ;
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &inflate_buf);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_mem), &inflate_bytes_buf);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &n_pages);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+    status = clSetKernelArg(kernel[k], argi++, sizeof(cl_int), (void *) &page_size);
+    checkError(status, "Failed to set argument %d on kernel %s", argi - 1, kernel_name[k]);
+
+    std::cout << "=====> Launch inflate" << std::endl;
+    cl_event inflate_event[3];
+    cl_event inflate_read[2];
+
+    clEnqueueNDRangeKernel(queue[INFLATE_KEY], kernel[INFLATE_KEY], 1, NULL,
+      &global_work_size, &local_work_size, 0, NULL, NULL);
+    clEnqueueNDRangeKernel(queue[INFLATE_DECRYPT], kernel[INFLATE_DECRYPT], 1, NULL,
+      &global_work_size, &local_work_size, 0, NULL, &inflate_event[0]);
+    clEnqueueNDRangeKernel(queue[INFLATE_HUFF], kernel[INFLATE_HUFF], 1, NULL,
+      &global_work_size, &local_work_size, 0, NULL, &inflate_event[1]);
+    clEnqueueNDRangeKernel(queue[INFLATE_LZ], kernel[INFLATE_LZ], 1, NULL,
+      &global_work_size, &local_work_size, 0, NULL, &inflate_event[2]);
+
+    clEnqueueReadBuffer(queue[INFLATE_LZ], inflate_buf, CL_FALSE, 0, padded_size, inflated, 1,
+      &inflate_event[2], &inflate_read[0]);
+    clEnqueueReadBuffer(queue[INFLATE_LZ], inflate_bytes_buf, CL_FALSE, 0,
+      n_pages * sizeof(cl_uint), inflated_bytes, 1, &inflate_event[2], &inflate_read[1]);
+    clWaitForEvents(2, inflate_read);
+    std::cout << "Finished: inflate" << std::endl;
+
+    std::vector<cl_event*> events;
+    for (unsigned int e = 0; e < 3; e++)
+      events.push_back(&inflate_event[e]);
+    inflate_time = getStartEndTime(events, 0, 3);
+
+    for (unsigned int e = 0; e < 3; e++)
+      clReleaseEvent(inflate_event[e]);
+    clReleaseEvent(inflate_read[0]);
+    clReleaseEvent(inflate_read[1]);
+  }
+#endif
+
   //------------------------------------------------------------------------------------------------
   // [openCL] Time profiles
   //------------------------------------------------------------------------------------------------
   time_profiles_s profiles  = computeTimeProfiles(kernel_event);
+  profiles.gzip_dec = inflate_time;
+  profiles.gzip_hist = 0;
+  if (hist_pass) {
+    std::vector<cl_event*> hist_events(1, &hist_event);
+    profiles.gzip_hist = getStartEndTime(hist_events, 0, 1);
+    clReleaseEvent(hist_event);
+  }
 
   // Release all events
   for (unsigned int k = 0; k < kernel_event.size(); ++k) {
-    if (k == GZIP_LZ770)
+    if (k == GZIP_LZ770 || k >= GZIP_HISTOGRAM)
       continue;
     clReleaseEvent(kernel_event.at(k));
   }
 
   clReleaseEvent(write_event[0]);
   clReleaseEvent(write_event[1]);
+  clReleaseEvent(write_event[2]);
+  clReleaseEvent(write_event[3]);
   clReleaseEvent(finish_event[0]);
   clReleaseEvent(finish_event[1]);
 
@@ -0,0 +1,486 @@
+//--------------------------------------------------------------------------------------------------
+//  Container file with a page index
+//---------------------------
+// The device output is a buffer of fixed page slots. The writer packs every page (its header
+// line and ciphertext lines) behind the file header and the Huffman tables, and appends an
+// index with one entry per page. The file size is known up front, so the file is mapped and
+// the pages are copied straight into the page cache, or it is streamed out with io_uring. The
+// reader keeps the index in memory and only touches the pages of the requested range.
+//--------------------------------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "container.h"
+#include "crc_tools.h"
+#include "file_tools.h"
+#include "gzip_tools.h"
+#include "uring_tools.h"
+
+static_assert(sizeof(container_header_t) == 64, "container header layout");
+static_assert(sizeof(container_index_t) == 32, "container index layout");
+static_assert(sizeof(container_footer_t) == 16, "container footer layout");
+
+//--------------------------------------------------------------------------------------------------
+//  Writer
+//--------------------------------------------------------------------------------------------------
+
+unsigned long container_write(const char *filename, const unsigned int *output_aes,
+  unsigned int n_pages, unsigned int page_stride, const container_info_t &info)
+{
+  // the pages are packed, so the file size is known before anything is written
+  unsigned long total = sizeof(container_header_t) + info.n_tables * 256 * 4 +
+    n_pages * sizeof(container_index_t) + sizeof(container_footer_t);
+  for (unsigned int p = 0; p < n_pages; p++) {
+    const unsigned int *page = output_aes + (size_t)p * page_stride / 4;
+    unsigned int size = 64 + page[HDR_N_LINES] * 64;
+
+    if (size > page_stride) {
+      printf("Page %u: %u lines do not fit the page slot \n", p, page[HDR_N_LINES]);
+      return 0;
+    }
+    total += size;
+  }
+
+  file_map_t map;
+  unsigned char *file = NULL;
+  uring_writer_t *writer = NULL;
+  if (info.uring)
+    writer = uring_writer_open(filename, URING_CHUNK, URING_DEPTH);
+  else
+    file = map_output_file(filename, total, map);
+  if (file == NULL && writer == NULL) {
+    printf("Unable to write %s \n", filename);
+    return 0;
+  }
+
+  // the file is written front to back, into the mapping or the io_uring stream
+  unsigned long pos = 0;
+  bool ok = true;
+  auto emit = [&](const void *data, size_t size) {
+    if (size == 0)
+      return;
+    if (writer != NULL)
+      ok = ok && uring_writer_write(writer, data, size);
+    else
+      memcpy(file + pos, data, size);
+    pos += size;
+  };
+
+  container_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CONTAINER_MAGIC, sizeof(header.magic));
+  header.version = CONTAINER_VERSION;
+  header.codec = GZIP_DEFLATE ? CONTAINER_CODEC_DEFLATE : CONTAINER_CODEC_LZ_HUFFMAN;
+  header.cipher = CONTAINER_AES;
+  header.vec = VEC;
+  header.page_size = info.page_size;
+  header.n_pages = n_pages;
+  header.insize = info.insize;
+  header.n_tables = info.n_tables;
+  header.table_id = crc32c(0, (const unsigned char *)info.huftables, info.n_tables * 256 * 4);
+  header.key_id = info.key_id;
+  memcpy(header.salt, info.salt, sizeof(header.salt));
+
+  emit(&header, sizeof(header));
+  emit(info.huftables, info.n_tables * 256 * 4);
+
+  std::vector<container_index_t> index(n_pages);
+  for (unsigned int p = 0; p < n_pages; p++) {
+    const unsigned int *page = output_aes + (size_t)p * page_stride / 4;
+    unsigned int size = 64 + page[HDR_N_LINES] * 64;
+
+    index[p].in_offset = (uint64_t)p * info.page_size;
+    index[p].offset = pos;
+    index[p].in_bytes = page[HDR_PAGE_BYTES];
+    index[p].size = size;
+    index[p].crc32c = page[HDR_CRC32C];
+    index[p].table = (info.n_tables > 1) ? p : 0;
+
+    emit(page, size);
+  }
+
+  container_footer_t footer;
+  footer.index_offset = pos;
+  footer.n_pages = n_pages;
+  memcpy(footer.magic, CONTAINER_FOOTER, sizeof(footer.magic));
+
+  emit(index.data(), n_pages * sizeof(container_index_t));
+  emit(&footer, sizeof(footer));
+
+  if (writer != NULL)
+    ok = uring_writer_close(writer) && ok;
+  else
+    unmap_file(map);
+  if (!ok) {
+    printf("Unable to write %s \n", filename);
+    return 0;
+  }
+
+  return pos;
+}
+
+//--------------------------------------------------------------------------------------------------
+//  Stream writer
+//---------------------------
+// Only the position and the page count are kept, the index is rebuilt by the reader.
+//--------------------------------------------------------------------------------------------------
+
+// Bytes of the Huffman table stored in front of the ciphertext of the stream page with header
+// line page, none for a stored page. Without page, the most any page has.
+static unsigned int inline_table_bytes(const container_header_t &header, const unsigned int *page)
+{
+  bool inline_table = (header.flags & CONTAINER_FLAG_STREAM) && header.codec == CONTAINER_CODEC_LZ_HUFFMAN &&
+    (page == NULL || (page[HDR_FLAGS] & HDR_FLAG_STORED) == 0);
+  return inline_table ? 256 * 4 : 0;
+}
+
+container_writer_t *container_writer_open(FILE *file, const container_info_t &info)
+{
+  container_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CONTAINER_MAGIC, sizeof(header.magic));
+  header.version = CONTAINER_VERSION;
+  header.codec = GZIP_DEFLATE ? CONTAINER_CODEC_DEFLATE : CONTAINER_CODEC_LZ_HUFFMAN;
+  header.cipher = CONTAINER_AES;
+  header.vec = VEC;
+  header.page_size = info.page_size;
+  header.key_id = info.key_id;
+  header.flags = CONTAINER_FLAG_STREAM;
+  memcpy(header.salt, info.salt, sizeof(header.salt));
+
+  if (fwrite(&header, sizeof(header), 1, file) != 1)
+    return NULL;
+
+  container_writer_t *w = new container_writer_t;
+  w->file = file;
+  w->pos = sizeof(header);
+  w->n_pages = 0;
+  w->ok = true;
+  return w;
+}
+
+bool container_writer_page(container_writer_t *w, const unsigned int *page, const unsigned int *huftable)
+{
+  unsigned int size = page[HDR_N_LINES] * 64;
+  // a stored page does not use the table
+  bool table = !GZIP_DEFLATE && (page[HDR_FLAGS] & HDR_FLAG_STORED) == 0;
+
+  w->ok = w->ok && page[HDR_N_LINES] > 0 && fwrite(page, 64, 1, w->file) == 1;
+  if (table)
+    w->ok = w->ok && fwrite(huftable, 256 * 4, 1, w->file) == 1;
+  w->ok = w->ok && fwrite(page + 16, 1, size, w->file) == size;
+
+  w->pos += 64 + (table ? 256 * 4 : 0) + size;
+  w->n_pages++;
+  return w->ok;
+}
+
+bool container_writer_close(container_writer_t *w)
+{
+  unsigned char end[64];
+  memset(end, 0, sizeof(end));
+
+  container_footer_t footer;
+  footer.index_offset = w->pos;
+  footer.n_pages = w->n_pages;
+  memcpy(footer.magic, CONTAINER_FOOTER, sizeof(footer.magic));
+
+  bool ok = w->ok && fwrite(end, sizeof(end), 1, w->file) == 1 &&
+    fwrite(&footer, sizeof(footer), 1, w->file) == 1 && fflush(w->file) == 0;
+  delete w;
+  return ok;
+}
+
+//--------------------------------------------------------------------------------------------------
+//  Reader
+//--------------------------------------------------------------------------------------------------
+
+// Reads and checks the header and the file tables. Returns an error message or NULL.
+static const char *read_header(container_t *c, unsigned int key_id)
+{
+  FILE *file = c->file;
+
+  if (fread(&c->header, sizeof(c->header), 1, file) != 1 ||
+      memcmp(c->header.magic, CONTAINER_MAGIC, sizeof(c->header.magic)) != 0)
+    return "not a container";
+  if (c->header.version != CONTAINER_VERSION)
+    return "unknown version";
+  if (c->header.codec != (GZIP_DEFLATE ? CONTAINER_CODEC_DEFLATE : CONTAINER_CODEC_LZ_HUFFMAN))
+    return "codec of another build (GZIP_DEFLATE)";
+  if (c->header.cipher != CONTAINER_AES)
+    return "cipher of another build (AES_MODE)";
+  if (c->header.key_id != key_id)
+    return "written with another key";
+  if (c->header.page_size == 0 || c->header.n_tables > c->header.n_pages)
+    return "bad header";
+
+  c->huftables.resize((size_t)c->header.n_tables * 256);
+  if (c->header.n_tables > 0 &&
+      fread(c->huftables.data(), 256 * 4, c->header.n_tables, file) != c->header.n_tables)
+    return "truncated tables";
+  if (crc32c(0, (const unsigned char *)c->huftables.data(), c->huftables.size() * 4) !=
+      c->header.table_id)
+    return "table id mismatch";
+
+  return NULL;
+}
+
+// Rebuilds the index of a stream container from the header lines of its pages
+static const char *scan_pages(container_t *c, const container_footer_t &footer)
+{
+  unsigned int stride = (c->header.page_size * 2) / 64 * 64;
+  unsigned long pos = sizeof(container_header_t);
+  unsigned int header[16];
+
+  c->index.clear();
+  c->index.reserve(footer.n_pages);
+  for (;;) {
+    if (fseek(c->file, pos, SEEK_SET) != 0 || fread(header, 64, 1, c->file) != 1)
+      return "truncated pages";
+    if (header[HDR_N_LINES] == 0)
+      break;
+    if (header[HDR_N_LINES] * 64 > stride || c->index.size() == footer.n_pages)
+      return "bad page";
+
+    container_index_t entry;
+    entry.in_offset = (uint64_t)c->index.size() * c->header.page_size;
+    entry.offset = pos;
+    entry.in_bytes = header[HDR_PAGE_BYTES];
+    entry.size = 64 + inline_table_bytes(c->header, header) + header[HDR_N_LINES] * 64;
+    entry.crc32c = header[HDR_CRC32C];
+    entry.table = c->index.size();
+    c->index.push_back(entry);
+    pos += entry.size;
+  }
+
+  if (c->index.size() != footer.n_pages || pos != footer.index_offset)
+    return "bad footer";
+
+  c->header.n_pages = footer.n_pages;
+  c->header.insize = 0;
+  if (footer.n_pages > 0)
+    c->header.insize = c->index.back().in_offset + c->index.back().in_bytes;
+  return NULL;
+}
+
+void container_decoder_init(const container_t *c, container_decoder_t &d)
+{
+  unsigned int page_size = c->header.page_size;
+  unsigned int stride = (page_size * 2) / 64 * 64;
+  d.plain.resize(stride);
+  d.stream.resize(stride);
+  d.lz.resize(2 * page_size + 2 * VEC);
+  d.decoded.resize(page_size + 2 * VEC);
+  if (c->header.codec == CONTAINER_CODEC_LZ_HUFFMAN)
+    d.lut.resize(1 << MAX_HUFFCODE_BITS);
+  d.lut_table = -1;
+}
+
+static container_t *open_file(FILE *file, const char *filename, const unsigned int key[8],
+  const unsigned int tweak_key[8], unsigned int key_id, bool random_access)
+{
+  container_t *c = new container_t;
+  c->file = file;
+  // the file of a stream is owned by the caller
+  c->own_file = random_access;
+  c->n_read = 0;
+
+  container_footer_t footer;
+  const char *error = read_header(c, key_id);
+  bool stream = (c->header.flags & CONTAINER_FLAG_STREAM) != 0;
+
+  if (error == NULL && random_access) {
+    if (fseek(file, -(long)sizeof(footer), SEEK_END) != 0 || fread(&footer, sizeof(footer), 1, file) != 1 ||
+        memcmp(footer.magic, CONTAINER_FOOTER, sizeof(footer.magic)) != 0 ||
+        (!stream && footer.n_pages != c->header.n_pages))
+      error = "bad footer";
+  }
+
+  if (error == NULL && random_access && stream) {
+    error = scan_pages(c, footer);
+  } else if (error == NULL && random_access) {
+    c->index.resize(footer.n_pages);
+    if (fseek(file, footer.index_offset, SEEK_SET) != 0 ||
+        fread(c->index.data(), sizeof(container_index_t), footer.n_pages, file) != footer.n_pages)
+      error = "truncated index";
+  }
+
+  if (error != NULL) {
+    fprintf(stderr, "%s: %s \n", filename, error);
+    container_close(c);
+    return NULL;
+  }
+
+  c->page.resize(64 + inline_table_bytes(c->header, NULL) + (c->header.page_size * 2) / 64 * 64);
+  container_decoder_init(c, c->decoder);
+
+  aes_page_keys_init(c->keys, key, tweak_key, c->header.salt);
+
+  return c;
+}
+
+container_t *container_open(const char *filename, const unsigned int key[8],
+  const unsigned int tweak_key[8], unsigned int key_id)
+{
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) {
+    printf("Unable to open %s \n", filename);
+    return NULL;
+  }
+
+  return open_file(file, filename, key, tweak_key, key_id, true);
+}
+
+container_t *container_open_stream(FILE *file, const unsigned int key[8],
+  const unsigned int tweak_key[8], unsigned int key_id)
+{
+  return open_file(file, "container stream", key, tweak_key, key_id, false);
+}
+
+long container_next(container_t *c, std::vector<unsigned char> &record)
+{
+  bool stream = (c->header.flags & CONTAINER_FLAG_STREAM) != 0;
+  if (!stream && c->n_read == c->header.n_pages)
+    return 0;
+
+  record.resize(c->page.size());
+  const unsigned int *header = (const unsigned int *)record.data();
+  if (fread(record.data(), 64, 1, c->file) != 1)
+    return -1;
+
+  if (stream && header[HDR_N_LINES] == 0) {
+    container_footer_t footer;
+    if (fread(&footer, sizeof(footer), 1, c->file) != 1 ||
+        memcmp(footer.magic, CONTAINER_FOOTER, sizeof(footer.magic)) != 0 || footer.n_pages != c->n_read)
+      return -1;
+    return 0;
+  }
+
+  unsigned long size = 64 + inline_table_bytes(c->header, header) + (unsigned long)header[HDR_N_LINES] * 64;
+  if (header[HDR_N_LINES] == 0 || size > record.size() ||
+      fread(record.data() + 64, 1, size - 64, c->file) != size - 64)
+    return -1;
+
+  c->n_read++;
+  return size;
+}
+
+bool container_decode(const container_t *c, unsigned int p, const unsigned char *record,
+  unsigned int size, container_decoder_t &d)
+{
+  unsigned int page_size = c->header.page_size;
+  const unsigned int *header = (const unsigned int *)record;
+  unsigned int table_bytes = inline_table_bytes(c->header, header);
+
+  if (size < 64 + table_bytes || size - 64 - table_bytes != header[HDR_N_LINES] * 64 ||
+      size - 64 - table_bytes > d.plain.size())
+    return false;
+
+  unsigned int in_bytes = header[HDR_PAGE_BYTES];
+  unsigned int compsize_lz = header[HDR_COMPSIZE_LZ];
+  unsigned int compsize_huffman = header[HDR_COMPSIZE_HUFFMAN];
+  if (in_bytes > page_size || compsize_huffman > size - 64 - table_bytes)
+    return false;
+
+  if (!aes_decrypt_page(c->keys, p, header, record + 64 + table_bytes, d.plain.data()))
+    return false;
+
+  unsigned char *out = d.decoded.data();
+  const unsigned char *data = d.plain.data();
+
+  if (header[HDR_FLAGS] & HDR_FLAG_STORED) {
+    // the page bytes in memory order
+    memcpy(out, data, in_bytes);
+  } else if (c->header.codec == CONTAINER_CODEC_DEFLATE) {
+    if (Deflate_Uncompress(data, compsize_huffman, out, page_size) < (int)in_bytes)
+      return false;
+  } else {
+    if (compsize_lz > d.lz.size())
+      return false;
+    if (table_bytes > 0) {
+      // every stream page has its own table, checked before it is decoded
+      d.lut_table = -1;
+      if (crc32c(0, record + 64, table_bytes) != header[HDR_TABLE_CRC32C])
+        return false;
+      if (Huffman_Decode_Table((const unsigned int *)(record + 64), d.lut.data()) != 0)
+        return false;
+    } else {
+      unsigned int table = (c->header.n_tables > 1) ? p : 0;
+      if (table >= c->header.n_tables)
+        return false;
+      if (d.lut_table != (int)table) {
+        d.lut_table = -1;
+        if (Huffman_Decode_Table(&c->huftables[(size_t)table * 256], d.lut.data()) != 0)
+          return false;
+        d.lut_table = table;
+      }
+    }
+
+    // the stream is read high byte of every short first
+    unsigned char *stream = d.stream.data();
+    for (unsigned int i = 0; i < compsize_huffman; i++)
+      stream[i] = (i % 2 == 0) ? data[i + 1] : data[i - 1];
+
+    if (Huffman_Uncompress_Table(stream, compsize_huffman, d.lz.data(), compsize_lz, d.lut.data()) != 0)
+      return false;
+    if (LZ_Uncompress(d.lz.data(), out, compsize_lz, d.decoded.size()) != 0)
+      return false;
+  }
+
+  return crc32c(0, out, in_bytes) == header[HDR_CRC32C];
+}
+
+// Reads and decodes page p into c->decoder.decoded. Returns false if it fails any check.
+static bool container_page(container_t *c, unsigned int p)
+{
+  const container_index_t &entry = c->index[p];
+
+  if (entry.size < 64 || entry.size > c->page.size())
+    return false;
+  if (fseek(c->file, entry.offset, SEEK_SET) != 0 ||
+      fread(c->page.data(), 1, entry.size, c->file) != entry.size)
+    return false;
+
+  const unsigned int *header = (const unsigned int *)c->page.data();
+  if (header[HDR_PAGE_BYTES] != entry.in_bytes || header[HDR_CRC32C] != entry.crc32c)
+    return false;
+
+  return container_decode(c, p, c->page.data(), entry.size, c->decoder);
+}
+
+int container_read(container_t *c, unsigned long offset, unsigned long length, unsigned char *out)
+{
+  if (offset > c->header.insize || length > c->header.insize - offset)
+    return -1;
+  if (length == 0)
+    return 0;
+
+  unsigned int page_size = c->header.page_size;
+  unsigned int first = offset / page_size;
+  unsigned int last = (offset + length - 1) / page_size;
+  int err_count = 0;
+
+  for (unsigned int p = first; p <= last; p++) {
+    unsigned long page_start = (unsigned long)p * page_size;
+    unsigned long from = (offset > page_start) ? offset - page_start : 0;
+    unsigned long to = (offset + length < page_start + page_size) ? offset + length - page_start : page_size;
+
+    if (p >= c->index.size() || c->index[p].in_offset != page_start || to > c->index[p].in_bytes ||
+        !container_page(c, p)) {
+      memset(out + page_start + from - offset, 0, to - from);
+      err_count++;
+      continue;
+    }
+
+    memcpy(out + page_start + from - offset, c->decoder.decoded.data() + from, to - from);
+  }
+
+  return err_count;
+}
+
+void container_close(container_t *c)
+{
+  if (c->file != NULL && c->own_file)
+    fclose(c->file);
+  delete c;
+}
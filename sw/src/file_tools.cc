@@ -0,0 +1,117 @@
+//--------------------------------------------------------------------------------------------------
+//  Memory-mapped files
+//---------------------------
+// The input is mapped over an anonymous reservation of the padded size, so the zero padding of
+// the last page comes for free and a file in the page cache is used without a copy. Bytes past
+// the end of the file in its last page read as zero.
+//--------------------------------------------------------------------------------------------------
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "AOCLUtils/aocl_utils.h"
+#include "file_tools.h"
+
+long long file_size(const char *filename)
+{
+  struct stat st;
+  if (stat(filename, &st) != 0)
+    return -1;
+  return st.st_size;
+}
+
+// Reads the file into an alignedMalloc buffer padded with zeros
+static unsigned char *read_input_file(const char *filename, size_t size, size_t padded_size,
+  file_map_t &map)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return NULL;
+
+  unsigned char *data = (unsigned char *)aocl_utils::alignedMalloc(padded_size);
+  if (data == NULL || fread(data, 1, size, f) != size) {
+    fclose(f);
+    if (data != NULL)
+      aocl_utils::alignedFree(data);
+    return NULL;
+  }
+  fclose(f);
+  memset(data + size, 0, padded_size - size);
+
+  map.data = data;
+  map.length = 0;
+  return data;
+}
+
+unsigned char *map_input_file(const char *filename, size_t size, size_t padded_size, file_map_t &map)
+{
+  map.data = NULL;
+  map.length = 0;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  // anonymous zero pages for the whole padded buffer, the file is mapped over its start
+  void *base = mmap(NULL, padded_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    return read_input_file(filename, size, padded_size, map);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(base, padded_size, MADV_HUGEPAGE);
+#endif
+
+  void *data = mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    // not mappable (a pipe or a special file)
+    munmap(base, padded_size);
+    return read_input_file(filename, size, padded_size, map);
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  map.data = (unsigned char *)base;
+  map.length = padded_size;
+  return map.data;
+}
+
+unsigned char *map_output_file(const char *filename, size_t size, file_map_t &map)
+{
+  map.data = NULL;
+  map.length = 0;
+
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return NULL;
+
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  map.data = (unsigned char *)data;
+  map.length = size;
+  return map.data;
+}
+
+void unmap_file(file_map_t &map)
+{
+  if (map.data == NULL)
+    return;
+  if (map.length > 0)
+    munmap(map.data, map.length);
+  else
+    aocl_utils::alignedFree(map.data);
+  map.data = NULL;
+  map.length = 0;
+}
@@ -0,0 +1,388 @@
+//--------------------------------------------------------------------------------------------------
+//  Stream filter
+//---------------------------
+// The window holds a fixed number of page slots, page k uses slot k % window. The calling thread
+// reads pages into free slots, the workers take them in page order and the writer thread drains
+// the finished slots in page order. Memory is the window and the per-thread buffers, whatever
+// the length of the stream.
+//--------------------------------------------------------------------------------------------------
+
+#include <string.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "aes_tools.h"
+#include "container.h"
+#include "crc_tools.h"
+#include "filter.h"
+#include "gzip_model.h"
+#include "gzip_tools.h"
+#include "uring_tools.h"
+
+enum filter_state_t {
+  SLOT_FREE = 0,
+  SLOT_READ,   // holds an input page or record, not taken by a worker yet
+  SLOT_BUSY,
+  SLOT_DONE
+};
+
+struct filter_slot_t {
+  std::vector<unsigned char> in;
+  unsigned long in_bytes;
+  std::vector<unsigned char> out;
+  unsigned long out_bytes;
+  std::vector<unsigned int> huftable;
+  filter_state_t state;
+  bool ok;
+};
+
+//--------------------------------------------------------------------------------------------------
+//  Window
+//--------------------------------------------------------------------------------------------------
+
+// read: 1 if a page was read into the slot, 0 at the end, -1 on error
+// work: page, slot and thread index, false on error
+// write: false on error
+static long run_window(std::vector<filter_slot_t> &slots, unsigned int n_threads,
+  std::function<int(filter_slot_t &)> read,
+  std::function<bool(unsigned long, filter_slot_t &, unsigned int)> work,
+  std::function<bool(filter_slot_t &)> write)
+{
+  const unsigned long window = slots.size();
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned long n_read = 0;
+  unsigned long next_work = 0;
+  unsigned long n_written = 0;
+  bool eof = false;
+  bool error = false;
+
+  std::vector<std::thread> workers;
+  for (unsigned int t = 0; t < n_threads; t++) {
+    workers.emplace_back([&, t]() {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+        cv.wait(lock, [&]() { return error || next_work < n_read || eof; });
+        if (error || next_work == n_read)
+          return;
+
+        unsigned long k = next_work++;
+        filter_slot_t &slot = slots[k % window];
+        slot.state = SLOT_BUSY;
+        lock.unlock();
+        slot.ok = work(k, slot, t);
+        lock.lock();
+        slot.state = SLOT_DONE;
+        cv.notify_all();
+      }
+    });
+  }
+
+  std::thread writer([&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      filter_slot_t &slot = slots[n_written % window];
+      cv.wait(lock, [&]() {
+        return error || (n_written < n_read && slot.state == SLOT_DONE) || (eof && n_written == n_read);
+      });
+      if (error || n_written == n_read)
+        return;
+
+      lock.unlock();
+      bool ok = slot.ok && write(slot);
+      lock.lock();
+      if (!ok)
+        error = true;
+      slot.state = SLOT_FREE;
+      n_written++;
+      cv.notify_all();
+    }
+  });
+
+  for (;;) {
+    filter_slot_t &slot = slots[n_read % window];
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() { return error || slot.state == SLOT_FREE; });
+      if (error)
+        break;
+    }
+
+    int res = read(slot);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (res <= 0) {
+      error = error || res < 0;
+      eof = true;
+      cv.notify_all();
+      break;
+    }
+    slot.state = SLOT_READ;
+    n_read++;
+    cv.notify_all();
+  }
+
+  for (unsigned int t = 0; t < n_threads; t++)
+    workers[t].join();
+  writer.join();
+
+  return error ? -1 : (long)n_written;
+}
+
+static unsigned int filter_threads(const filter_config_t &config)
+{
+  unsigned int n_threads = config.n_threads;
+  if (n_threads == 0)
+    n_threads = std::thread::hardware_concurrency();
+  if (n_threads == 0)
+    n_threads = 1;
+  return n_threads;
+}
+
+//--------------------------------------------------------------------------------------------------
+//  Compression
+//---------------------------
+// A page is encoded as the device pipeline encodes it: histogram, table and marker of the
+// page, stored selection, the bit-exact model of lz_internal/huff_internal, then the lines of
+// the store_huff output encrypted behind the header line.
+//--------------------------------------------------------------------------------------------------
+
+// Buffers of one worker
+struct filter_encoder_t {
+  std::vector<unsigned char> lz;
+  std::vector<unsigned char> huff;
+  std::vector<unsigned char> plain;
+};
+
+static bool encode_page(const filter_config_t &config, const aes_page_keys_t &keys, unsigned long p,
+  filter_slot_t &slot, filter_encoder_t &e)
+{
+  unsigned int page_size = config.page_size;
+  const unsigned char *in = slot.in.data();
+  unsigned int *header = (unsigned int *)slot.out.data();
+  unsigned int *huftable = slot.huftable.data();
+  unsigned char marker = 0;
+  unsigned char flags = 0;
+  unsigned int hist[256];
+
+  memset(header, 0, 64);
+  memset(e.plain.data(), 0, e.plain.size());
+
+  gzip_model_histogram(in, page_size, 1, hist);
+#if GZIP_DEFLATE
+  // a DEFLATE page would inflate to its padding as well, the input bytes are stored
+  Deflate_Fixed_Table(huftable);
+  if (slot.in_bytes != page_size)
+    flags |= HDR_FLAG_STORED;
+#else
+  Compute_Huffman_Pages(hist, page_size, 1, huftable, &marker, NULL);
+#endif
+  Select_Stored_Pages(hist, page_size, 1, &marker, config.stored_threshold, &flags);
+
+  unsigned int compsize_huffman;
+  if (flags & HDR_FLAG_STORED) {
+    // as load_lz0, up to the line that holds the last input byte
+    compsize_huffman = (slot.in_bytes + 63) / 64 * 64;
+    if (compsize_huffman > page_size)
+      compsize_huffman = page_size;
+    memcpy(e.plain.data(), in, compsize_huffman);
+    header[HDR_FIRST_VALID_POS] = VEC;
+    header[HDR_COMPSIZE_LZ] = compsize_huffman;
+    header[HDR_FLAGS] = HDR_FLAG_STORED;
+  } else {
+    gzip_model_page_t page;
+    gzip_model_page(in, page_size, marker, huftable, e.lz.data(), page);
+#if GZIP_DEFLATE
+    compsize_huffman = page.compsize_huffman;
+    memcpy(e.plain.data(), e.lz.data(), compsize_huffman);
+#else
+    // back to the memory order of the shorts written by store_huff
+    compsize_huffman = gzip_model_huffman_stream(e.lz.data(), page.compsize_lz, huftable, e.huff.data());
+    for (unsigned int i = 0; i < compsize_huffman; i++)
+      e.plain[(i % 2 == 0) ? i + 1 : i - 1] = e.huff[i];
+#endif
+    header[HDR_FIRST_VALID_POS] = page.first_valid_pos;
+    header[HDR_COMPSIZE_LZ] = page.compsize_lz;
+  }
+
+  unsigned int n_lines = (compsize_huffman + 63) / 64;
+  if (64 + n_lines * 64 > slot.out.size())
+    return false;
+
+  header[HDR_N_LINES] = n_lines;
+  header[HDR_COMPSIZE_HUFFMAN] = compsize_huffman;
+  header[HDR_CRC32C] = crc32c(0, in, slot.in_bytes);
+  header[HDR_PAGE_BYTES] = slot.in_bytes;
+  // the table goes into the stream in the clear next to the header line
+  if (!GZIP_DEFLATE && !(flags & HDR_FLAG_STORED))
+    header[HDR_TABLE_CRC32C] = crc32c(0, (const unsigned char *)huftable, 256 * 4);
+  aes_encrypt_page(keys, p, header, e.plain.data(), slot.out.data() + 64);
+
+  return true;
+}
+
+long filter_compress(FILE *in, FILE *out, const filter_config_t &config)
+{
+  unsigned int page_size = config.page_size;
+  unsigned int stride = (page_size * 2) / 64 * 64;
+  unsigned int n_threads = filter_threads(config);
+
+  aes_page_keys_t keys;
+  aes_page_keys_init(keys, config.key, config.tweak_key, config.salt);
+
+  // the chunks are copied into the pages as they land, the next reads are in flight
+  // while the workers encode
+  uring_reader_t *reader = NULL;
+  if (config.uring_input != NULL) {
+    reader = uring_reader_open(config.uring_input, URING_CHUNK, URING_DEPTH);
+    if (reader == NULL)
+      return -1;
+  }
+
+  container_info_t info;
+  memset(&info, 0, sizeof(info));
+  info.page_size = page_size;
+  info.key_id = config.key_id;
+  memcpy(info.salt, config.salt, sizeof(info.salt));
+  container_writer_t *w = container_writer_open(out, info);
+  if (w == NULL) {
+    if (reader != NULL)
+      uring_reader_close(reader);
+    return -1;
+  }
+
+  std::vector<filter_slot_t> slots(config.window);
+  for (filter_slot_t &slot : slots) {
+    slot.in.resize(page_size);
+    slot.out.resize(64 + stride);
+    slot.huftable.resize(256);
+    slot.state = SLOT_FREE;
+  }
+
+  std::vector<filter_encoder_t> encoders(n_threads);
+  for (filter_encoder_t &e : encoders) {
+    e.lz.resize(2 * page_size + 2 * VEC);
+    e.huff.resize(2 * page_size + 2 * VEC);
+    e.plain.resize(stride);
+  }
+
+  // chunk of the reader being copied out, held until it is used up
+  const unsigned char *chunk = NULL;
+  size_t chunk_bytes = 0;
+  size_t chunk_pos = 0;
+  unsigned long long consumed = 0;
+
+  // page_size bytes or up to the end of the input, -1 on error
+  auto fill = [&](unsigned char *page) -> long {
+    size_t bytes = 0;
+    if (reader == NULL) {
+      while (bytes < page_size) {
+        size_t n = fread(page + bytes, 1, page_size - bytes, in);
+        if (n == 0)
+          break;
+        bytes += n;
+      }
+      return ferror(in) ? -1 : (long)bytes;
+    }
+
+    while (bytes < page_size) {
+      if (chunk_pos == chunk_bytes) {
+        if (chunk != NULL)
+          uring_reader_release(reader);
+        chunk = uring_reader_next(reader, chunk_bytes);
+        chunk_pos = 0;
+        if (chunk == NULL)
+          return (consumed == uring_reader_size(reader)) ? (long)bytes : -1;
+      }
+      size_t n = (chunk_bytes - chunk_pos < page_size - bytes) ? chunk_bytes - chunk_pos : page_size - bytes;
+      memcpy(page + bytes, chunk + chunk_pos, n);
+      chunk_pos += n;
+      consumed += n;
+      bytes += n;
+    }
+    return bytes;
+  };
+
+  bool end = false;
+  auto read = [&](filter_slot_t &slot) {
+    if (end)
+      return 0;
+    long filled = fill(slot.in.data());
+    if (filled < 0)
+      return -1;
+    size_t bytes = filled;
+    // the last page is padded with zeros
+    end = bytes < page_size;
+    memset(slot.in.data() + bytes, 0, page_size - bytes);
+    slot.in_bytes = bytes;
+    return bytes > 0 ? 1 : 0;
+  };
+
+  auto work = [&](unsigned long p, filter_slot_t &slot, unsigned int t) {
+    return encode_page(config, keys, p, slot, encoders[t]);
+  };
+
+  auto write = [&](filter_slot_t &slot) {
+    return container_writer_page(w, (const unsigned int *)slot.out.data(), slot.huftable.data());
+  };
+
+  long n_pages = run_window(slots, n_threads, read, work, write);
+
+  if (reader != NULL && !uring_reader_close(reader))
+    n_pages = -1;
+  if (!container_writer_close(w))
+    return -1;
+  return n_pages;
+}
+
+//--------------------------------------------------------------------------------------------------
+//  Decompression
+//--------------------------------------------------------------------------------------------------
+
+long filter_decompress(FILE *in, FILE *out, const filter_config_t &config)
+{
+  unsigned int n_threads = filter_threads(config);
+
+  container_t *c = container_open_stream(in, config.key, config.tweak_key, config.key_id);
+  if (c == NULL)
+    return -1;
+
+  std::vector<filter_slot_t> slots(config.window);
+  for (filter_slot_t &slot : slots) {
+    slot.out.resize(c->header.page_size);
+    slot.state = SLOT_FREE;
+  }
+
+  std::vector<container_decoder_t> decoders(n_threads);
+  for (container_decoder_t &d : decoders)
+    container_decoder_init(c, d);
+
+  auto read = [&](filter_slot_t &slot) {
+    long size = container_next(c, slot.in);
+    slot.in_bytes = size > 0 ? size : 0;
+    return size > 0 ? 1 : (int)size;
+  };
+
+  auto work = [&](unsigned long p, filter_slot_t &slot, unsigned int t) {
+    container_decoder_t &d = decoders[t];
+    if (!container_decode(c, p, slot.in.data(), slot.in_bytes, d))
+      return false;
+    slot.out_bytes = ((const unsigned int *)slot.in.data())[HDR_PAGE_BYTES];
+    memcpy(slot.out.data(), d.decoded.data(), slot.out_bytes);
+    return true;
+  };
+
+  auto write = [&](filter_slot_t &slot) {
+    return fwrite(slot.out.data(), 1, slot.out_bytes, out) == slot.out_bytes;
+  };
+
+  long n_pages = run_window(slots, n_threads, read, work, write);
+
+  container_close(c);
+  if (fflush(out) != 0)
+    return -1;
+  return n_pages;
+}
@@ -0,0 +1,718 @@
+//--------------------------------------------------------------------------------------------------
+//  GZIP software model
+//---------------------------
+// Cycle-free, bit-exact C++ model of the lz77/huffman kernels in hw/gzip.cl. It shares
+// VEC, DEPTH and LZ_HASH with the kernels through compNcrypt.h, so a host built with the
+// same flags as the bitstream predicts its output sizes. Keep in sync with lz_internal.
+//--------------------------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "gzip_model.h"
+#include "gzip_tools.h"
+
+#define LEN VEC
+#define VECX2 (2 * VEC)
+
+struct dict_string {
+  unsigned char s[LEN];
+};
+
+#if GZIP_DEFLATE
+//--------------------------------------------------------------------------------------------------
+//  DEFLATE symbols, same as deflate_length/deflate_distance in gzip.cl
+//--------------------------------------------------------------------------------------------------
+
+static unsigned short reverse_bits(unsigned short x, unsigned int n)
+{
+  unsigned short r = 0;
+  for (unsigned int i = 0; i < n; i++)
+    r |= ((x >> i) & 1) << (n - 1 - i);
+  return r;
+}
+
+static unsigned short deflate_length(unsigned int length, unsigned char *bits)
+{
+  unsigned int l = length - 3;
+  int msb = 0;
+  for (int b = 1; b < 8; b++)
+    msb = (l >> b) ? b : msb;
+
+  unsigned int n_extra = (l < 8 || l == 255) ? 0 : msb - 2;
+  unsigned int sym = (l < 8) ? 257 + l : ((l == 255) ? 285 : 257 + 4 * (msb - 1) + ((l >> n_extra) & 3));
+  unsigned int code = (sym < 280) ? sym - 256 : sym - 280 + 0xC0;
+
+  *bits = ((sym < 280) ? 7 : 8) + n_extra;
+  return (code << n_extra) | reverse_bits(l & ((1 << n_extra) - 1), n_extra);
+}
+
+static unsigned char deflate_distance(unsigned int distance, unsigned short *extra, unsigned char *extra_bits)
+{
+  unsigned int d = distance - 1;
+  int msb = 0;
+  for (int b = 1; b < 15; b++)
+    msb = (d >> b) ? b : msb;
+
+  unsigned int n_extra = (d < 4) ? 0 : msb - 1;
+  *extra = reverse_bits(d & ((1 << n_extra) - 1), n_extra);
+  *extra_bits = n_extra;
+  return (d < 4) ? d : 2 * msb + ((d >> n_extra) & 1);
+}
+
+// length, distance code and distance extra bits of one match, all raw
+static void deflate_match(unsigned short *buffer, unsigned char *bits, bool *dontencode, int &size,
+  unsigned int length, unsigned int distance)
+{
+  unsigned short extra;
+  unsigned char extra_bits;
+
+  dontencode[size] = true;
+  buffer[size] = deflate_length(length, &bits[size]);
+  size++;
+  dontencode[size] = true;
+  buffer[size] = deflate_distance(distance, &extra, &extra_bits);
+  bits[size++] = 5;
+  dontencode[size] = true;
+  buffer[size] = extra;
+  bits[size++] = extra_bits;
+}
+
+// appends a code MSB first to an LSB-first bit stream, what hufenc + store_huff produce
+static void put_bits(unsigned char *out, unsigned long &bitpos, unsigned int code, unsigned int bits)
+{
+  for (int b = bits - 1; b >= 0; b--, bitpos++) {
+    if ((bitpos & 7) == 0)
+      out[bitpos >> 3] = 0;
+    out[bitpos >> 3] |= ((code >> b) & 1) << (bitpos & 7);
+  }
+}
+#endif
+
+//--------------------------------------------------------------------------------------------------
+//  LZ77 + Huffman size of one page
+//--------------------------------------------------------------------------------------------------
+
+void gzip_model_page(const unsigned char *input, unsigned int page_size, unsigned char marker,
+  const unsigned int *huftable, unsigned char *lz_out, gzip_model_page_t &page)
+{
+  // one dictionary per thread, the filter encodes pages on several threads
+  static thread_local dict_string dictionary[DEPTH][VEC];
+  static thread_local unsigned int dictionary_offset[DEPTH][VEC];
+
+  unsigned char current_window[VECX2];
+  unsigned char compare_window[LEN][VEC][VEC];
+  unsigned int compare_offset[VEC][VEC];
+  unsigned int hash[VEC];
+
+  unsigned char length[VEC];
+  bool done[VEC];
+  signed char bestlength[VEC];
+  unsigned int bestoffset[VEC];
+  signed char first_valid_pos_speculative[VEC+1];
+  signed char first_valid_full_speculative[VEC+1];
+  bool extend_speculative[VEC+1];
+  unsigned char extend_offset_speculative[VEC+1];
+
+  unsigned char previous_window[LZ_CONT_DIST];
+  bool extend[VEC];
+  bool run[VEC+1];
+  bool cont_active = false;
+  unsigned char cont_offset = 1;
+  unsigned char cont_ext = 0;
+
+  memset(dictionary, 0, sizeof(dictionary));
+  memset(dictionary_offset, 0, sizeof(dictionary_offset));
+  memset(previous_window, 0, sizeof(previous_window));
+
+  unsigned int inposMinusVecDiv16 = 0;
+  unsigned int outpos_lz = 0;
+  unsigned long huffman_bits = 0;
+  signed char first_valid_pos = 0;
+  bool first_iteration = true;
+
+  for (int i = 0; i < VEC; i++)
+    current_window[i+VEC] = input[i];
+
+  for (unsigned int inpos = VEC; inpos < page_size; inpos += VEC) {
+    bool last = (inpos + VEC) == page_size;
+
+    for (int i = 0; i < LZ_CONT_DIST - VEC; i++)
+      previous_window[i] = previous_window[i+VEC];
+    for (int i = 0; i < VEC; i++) {
+      previous_window[LZ_CONT_DIST-VEC+i] = current_window[i];
+      current_window[i] = current_window[i+VEC];
+    }
+    for (int i = 0; i < VEC; i++)
+      current_window[VEC+i] = input[inpos+i];
+
+    // hash, look-up and update (reads see the dictionary of the previous cycle)
+    for (int i = 0; i < VEC; i++)
+      hash[i] = LZ_HASH(current_window[i], current_window[i+1], current_window[i+2]);
+
+    for (int i = 0; i < VEC; i++)
+      for (int j = 0; j < LEN; j++)
+        for (int k = 0; k < VEC; k++)
+          compare_window[j][k][i] = dictionary[hash[i]][k].s[j];
+
+    for (int i = 0; i < VEC; i++)
+      for (int k = 0; k < VEC; k++)
+        compare_offset[k][i] = dictionary_offset[hash[i]][k];
+
+    for (int i = 0; i < LEN; i++)
+      for (int k = 0; k < VEC; k++)
+        dictionary[hash[k]][k].s[i] = current_window[i+k];
+
+    for (int k = 0; k < VEC; k++)
+      dictionary_offset[hash[k]][k] = (inposMinusVecDiv16 << 4) | k;
+
+    // match search
+    for (int i = 0; i < VEC; i++) {
+      bestlength[i] = 0;
+      bestoffset[i] = 0;
+    }
+
+    for (int i = 0; i < VEC; i++) {
+      for (int l = 0; l < VEC; l++) {
+        length[l] = 0;
+        done[l] = 0;
+      }
+
+      for (int j = 0; j < VEC; j++) {
+        for (int k = 0; k < LEN; k++) {
+          bool comp = current_window[k+j] == compare_window[k][i][j] && !done[j];
+          length[j] += comp;
+          done[j] = !comp;
+        }
+      }
+
+      for (int m = 0; m < VEC; m++) {
+        bool updateBest = (length[m] > bestlength[m]) && (compare_offset[i][m] != 0) &&
+          (((inposMinusVecDiv16<<4)|(i&0xf))-(compare_offset[i][m]) < LZ_MAX_OFFSET);
+        bestoffset[m] = (updateBest ? ((inposMinusVecDiv16<<4)|(m&0xf))-(compare_offset[i][m]) : bestoffset[m]) & 0x7ffff;
+        bestlength[m] = (updateBest ? length[m] : bestlength[m]) & 0x1f;
+      }
+    }
+
+    // filter matches step 1
+    for (int i = 0; i < VEC; i++) {
+      bestlength[i] = (( ((bestlength[i]&0x1f) >= 5) || (((bestlength[i]&0x1f) == 4) &&
+        ((bestoffset[i]&0x7ffff) < 0x800))) ? bestlength[i] : 0) & 0x1f;
+    }
+
+    // match continuation
+    for (int i = 0; i < VEC; i++) {
+      unsigned int offset = bestoffset[i] & 0x7ffff;
+      int q = i + LEN - (int)offset;
+      unsigned char src = (q >= 0) ? current_window[q] : previous_window[(LZ_CONT_DIST + q) & (LZ_CONT_DIST-1)];
+      extend[i] = (bestlength[i] == LEN) && (offset <= LZ_CONT_DIST) && !last &&
+        (current_window[i+LEN] == src);
+    }
+
+    for (int p = 0; p <= VEC; p++) {
+      unsigned char src = (p >= cont_offset) ? current_window[p - cont_offset] :
+                                               previous_window[(LZ_CONT_DIST + p - cont_offset) & (LZ_CONT_DIST-1)];
+      run[p] = current_window[p] == src;
+    }
+
+    // first_valid_pos
+    for (int guess = 0; guess <= VEC; guess++) {
+      first_valid_pos_speculative[guess] = 0;
+      for (int i = 0; i < VEC; i++) {
+        first_valid_pos_speculative[guess] = ((i < guess || (bestlength[i]&0x1f)==0) ?
+          first_valid_pos_speculative[guess] : i + bestlength[i]) & 0x1f;
+      }
+      first_valid_full_speculative[guess] = first_valid_pos_speculative[guess];
+
+      int last_match = (first_valid_full_speculative[guess] - LEN) & (VEC-1);
+      extend_speculative[guess] = (first_valid_full_speculative[guess] >= LEN + guess) && extend[last_match];
+      extend_offset_speculative[guess] = bestoffset[last_match] & (2*LZ_CONT_DIST-1);
+
+      first_valid_pos_speculative[guess] = (first_valid_pos_speculative[guess] & 0x10) ?
+        (first_valid_pos_speculative[guess] & 0xf) : 0;
+    }
+
+    // start of the part of the window not covered by the previous match
+    int previous_valid_pos = first_valid_pos & 0xf;
+    int start = previous_valid_pos;
+    if (cont_active) {
+      start = VEC;
+      for (int p = VEC-1; p >= previous_valid_pos; p--)
+        if (!run[p])
+          start = p;
+    }
+    bool cont_continue = cont_active && (start == VEC) && run[VEC] && !last &&
+      (cont_ext + VEC - previous_valid_pos <= LZ_EXT_MAX - VEC);
+
+    for (int i = 0; i < VEC; i++)
+      bestlength[i] = i < start ? -1 : bestlength[i];
+
+    first_valid_pos = first_valid_pos_speculative[start] & 0xf;
+    signed char first_valid_full = first_valid_full_speculative[start];
+
+    bool emit_ext = cont_active && !cont_continue;
+    unsigned char ext_byte = cont_ext + (start - previous_valid_pos);
+#if GZIP_DEFLATE
+    // the extension is emitted after cont_offset moved on to the next match
+    unsigned char ext_offset = cont_offset;
+#endif
+
+    bool extend_start = !cont_continue && extend_speculative[start];
+    int extend_index = (first_valid_full - LEN) & (VEC-1);
+
+    cont_active = cont_continue || extend_speculative[start];
+    if (cont_continue) {
+      cont_ext = ext_byte;
+    } else {
+      cont_offset = extend_offset_speculative[start];
+      cont_ext = 0;
+    }
+
+    // filter matches "last-fit"
+    for (int i = 0; i < VEC-1; i++)
+      for (int j = 1; j < VEC; j++)
+        bestlength[j] = ((bestlength[i] + i) == (bestlength[j] + j)) && i < j && bestlength[j] > 0 &&
+          bestlength[i] > 0 ? 0 : bestlength[j];
+
+    int golden_matcher = 0;
+    for (int i = 0; i < VEC; i++)
+      golden_matcher = (bestlength[i]+i == first_valid_full) ? i : golden_matcher;
+
+    for (int i = 0; i < VEC; i++)
+      bestlength[i] = ((bestlength[i] + i) > golden_matcher) && i < golden_matcher &&
+        bestlength[i] != -1 ? 0 : bestlength[i];
+
+    for (int i = 0; i < VEC-1; i++)
+      for (int j = 1; j < VEC; j++)
+        if (i+j < VEC && bestlength[i] > j)
+          bestlength[i+j] = -1;
+
+#if GZIP_DEFLATE
+    // DEFLATE symbols: literals are coded from the table, the rest are raw bits
+    unsigned short output_buffer[VECX2 + 1];
+    unsigned char output_bits[VECX2 + 1];
+    bool dontencode[VECX2 + 1];
+    int output_buffer_size = 0;
+
+    if (first_iteration) {
+      // BFINAL = 1, BTYPE = 01
+      dontencode[output_buffer_size] = true;
+      output_bits[output_buffer_size] = 3;
+      output_buffer[output_buffer_size++] = 0x6;
+      first_iteration = false;
+    }
+
+    if (emit_ext)
+      deflate_match(output_buffer, output_bits, dontencode, output_buffer_size, VEC + ext_byte, ext_offset);
+
+    for (int i = 0; i < VEC; i++) {
+      if (bestlength[i] == 0) {
+        dontencode[output_buffer_size] = false;
+        output_buffer[output_buffer_size++] = current_window[i];
+      } else if (bestlength[i] > 0 && !(extend_start && i == extend_index)) {
+        deflate_match(output_buffer, output_bits, dontencode, output_buffer_size, bestlength[i],
+          bestoffset[i] & 0x7ffff);
+      }
+    }
+
+    for (int i = 0; i < output_buffer_size; i++) {
+      if (dontencode[i])
+        put_bits(lz_out, huffman_bits, output_buffer[i], output_bits[i]);
+      else
+        put_bits(lz_out, huffman_bits, huftable[output_buffer[i]] & 0xFFFF, huftable[output_buffer[i]] >> 16);
+    }
+#else
+    // encode LZ bytes, count the Huffman bits
+    unsigned char output_buffer[VECX2 + 1];
+    bool dontencode[VECX2 + 1];
+    int output_buffer_size = 0;
+
+    if (first_iteration) {
+      dontencode[output_buffer_size] = false;
+      output_buffer[output_buffer_size++] = marker;
+      first_iteration = false;
+    }
+
+    if (emit_ext) {
+      dontencode[output_buffer_size] = true;
+      output_buffer[output_buffer_size++] = ext_byte;
+    }
+
+    for (int i = 0; i < VEC; i++) {
+      if (bestlength[i] == 0) {
+        dontencode[output_buffer_size] = false;
+        output_buffer[output_buffer_size++] = current_window[i];
+        if (current_window[i] == marker) {
+          dontencode[output_buffer_size] = true;
+          output_buffer[output_buffer_size++] = 0;
+        }
+      } else if (bestlength[i] > 0) {
+        unsigned int offset = bestoffset[i] & 0x7ffff;
+
+        dontencode[output_buffer_size] = false;
+        output_buffer[output_buffer_size++] = marker;
+        dontencode[output_buffer_size] = true;
+        unsigned char length_nibble = (extend_start && i == extend_index) ? LZ_EXT_NIBBLE : (bestlength[i] - 3);
+        output_buffer[output_buffer_size++] = (length_nibble << 4) | (offset & 0xf);
+        if (offset < 0x800) {
+          dontencode[output_buffer_size] = true;
+          output_buffer[output_buffer_size++] = (offset >> 4) & 0x7f;
+        } else {
+          dontencode[output_buffer_size] = true;
+          output_buffer[output_buffer_size++] = (offset >> 4) | 0x80;
+          dontencode[output_buffer_size] = true;
+          output_buffer[output_buffer_size++] = (offset >> 11) & 0x7f;
+        }
+      }
+    }
+
+    for (int i = 0; i < output_buffer_size; i++) {
+      lz_out[outpos_lz + i] = output_buffer[i];
+      huffman_bits += dontencode[i] ? 8 : (huftable[output_buffer[i]] >> 16);
+    }
+#endif
+    outpos_lz += output_buffer_size;
+
+    inposMinusVecDiv16++;
+  }
+
+  // tail literals not covered by a match (and the end of block)
+  for (unsigned int i = first_valid_pos; i < VEC; i++) {
+    unsigned char literal = current_window[VEC+i];
+#if GZIP_DEFLATE
+    put_bits(lz_out, huffman_bits, huftable[literal] & 0xFFFF, huftable[literal] >> 16);
+    outpos_lz++;
+#else
+    lz_out[outpos_lz++] = literal;
+    huffman_bits += huftable[literal] >> 16;
+    if (literal == marker) {
+      lz_out[outpos_lz++] = 0;
+      huffman_bits += 8;
+    }
+#endif
+  }
+#if GZIP_DEFLATE
+  put_bits(lz_out, huffman_bits, 0, 7);
+  outpos_lz++;
+#endif
+
+  // huff_internal counts every started byte
+  unsigned int outpos_huffman = (huffman_bits + 7) >> 3;
+
+  page.first_valid_pos = first_valid_pos;
+  page.compsize_lz = outpos_lz;
+  page.compsize_huffman = outpos_huffman;
+  // the dictionary is cleared in DEPTH cycles, then one VEC window per cycle and the tail
+  page.cycles = DEPTH + page_size / VEC;
+}
+
+#if !GZIP_DEFLATE
+//--------------------------------------------------------------------------------------------------
+//  Huffman stream of a page and model of the inflate kernels
+//--------------------------------------------------------------------------------------------------
+
+// raw bytes that follow a marker, as in inflate.cl
+enum { RAW_NONE = 0, RAW_LENGTH, RAW_OFFSET, RAW_OFFSET2, RAW_EXT };
+
+// next raw state after byte, the same token parse in hufenc order and in both decoders
+static unsigned char next_raw(unsigned char raw, unsigned char byte, unsigned char marker, bool first,
+  bool &extended)
+{
+  unsigned char next = RAW_NONE;
+  if (raw == RAW_NONE)
+    next = (!first && byte == marker) ? RAW_LENGTH : RAW_NONE;
+  else if (raw == RAW_LENGTH)
+    next = (byte == 0) ? RAW_NONE : RAW_OFFSET;
+  else if (raw == RAW_OFFSET)
+    next = (byte & 0x80) ? RAW_OFFSET2 : (extended ? RAW_EXT : RAW_NONE);
+  else if (raw == RAW_OFFSET2)
+    next = extended ? RAW_EXT : RAW_NONE;
+
+  if (raw == RAW_LENGTH)
+    extended = (byte >> 4) == LZ_EXT_NIBBLE;
+  return next;
+}
+
+unsigned int gzip_model_huffman_stream(const unsigned char *lz, unsigned int lz_size,
+  const unsigned int *huftable, unsigned char *out)
+{
+  unsigned long bitpos = 0;
+  unsigned char raw = RAW_NONE;
+  bool extended = false;
+
+  for (unsigned int i = 0; i < lz_size; i++) {
+    unsigned int code = (raw != RAW_NONE) ? lz[i] : (huftable[lz[i]] & 0xFFFF);
+    unsigned int bits = (raw != RAW_NONE) ? 8 : (huftable[lz[i]] >> 16);
+
+    // MSB first, as the host reads the shorts of store_huff high byte first
+    for (int b = bits - 1; b >= 0; b--, bitpos++) {
+      if ((bitpos & 7) == 0)
+        out[bitpos >> 3] = 0;
+      out[bitpos >> 3] |= ((code >> b) & 1) << (7 - (bitpos & 7));
+    }
+
+    raw = next_raw(raw, lz[i], lz[0], i == 0, extended);
+  }
+
+  return (bitpos + 7) >> 3;
+}
+
+unsigned int gzip_model_inflate_page(const unsigned char *huff, unsigned int compsize_huffman,
+  unsigned int compsize_lz, const unsigned int *huftable, unsigned char *out, unsigned int page_size,
+  unsigned long &cycles)
+{
+  // inflate_huffman0: one LZ byte per cycle, compare against all codes
+  unsigned char *lz = (unsigned char *)malloc(compsize_lz);
+  unsigned long bitpos = 0;
+  unsigned char raw = RAW_NONE;
+  bool extended = false;
+
+  for (unsigned int k = 0; k < compsize_lz; k++) {
+    unsigned int peek = 0;
+    for (unsigned int b = 0; b < 16; b++) {
+      unsigned long p = bitpos + b;
+      unsigned int bit = (p >> 3) < compsize_huffman ? (huff[p >> 3] >> (7 - (p & 7))) & 1 : 0;
+      peek = (peek << 1) | bit;
+    }
+
+    unsigned char byte = peek >> 8;
+    unsigned int used = 8;
+    if (raw == RAW_NONE) {
+      used = 0;
+      for (unsigned int i = 0; i < 256; i++) {
+        unsigned int len = huftable[i] >> 16;
+        if (len != 0 && (peek >> (16 - len)) == (huftable[i] & 0xFFFF)) {
+          byte = i;
+          used = len;
+        }
+      }
+    }
+    bitpos += used;
+
+    lz[k] = byte;
+    raw = next_raw(raw, byte, lz[0], k == 0, extended);
+  }
+
+  // inflate_lz0: one cycle per LZ byte and one per copied byte
+  unsigned int outpos = 0;
+  unsigned int inpos = 1;
+  unsigned char marker = lz[0];
+  cycles += 256 + compsize_lz;
+
+  while (inpos < compsize_lz && outpos < page_size) {
+    unsigned char symbol = lz[inpos++];
+    if (symbol != marker) {
+      out[outpos++] = symbol;
+      continue;
+    }
+    if (inpos >= compsize_lz)
+      break;
+    if (lz[inpos] == 0) {
+      out[outpos++] = marker;
+      inpos++;
+      continue;
+    }
+
+    unsigned int length = (lz[inpos] >> 4) + 3;
+    unsigned int offset = lz[inpos] & 0xf;
+    bool ext = (lz[inpos] >> 4) == LZ_EXT_NIBBLE;
+    inpos++;
+    offset |= (lz[inpos] & 0x7f) << 4;
+    if (lz[inpos++] & 0x80)
+      offset |= (lz[inpos++] & 0x7f) << 11;
+    if (ext)
+      length = VEC + lz[inpos++];
+
+    for (unsigned int i = 0; i < length && outpos < page_size; i++, outpos++)
+      out[outpos] = (offset <= outpos && offset <= INFLATE_WINDOW) ? out[outpos - offset] : 'x';
+    cycles += length;
+  }
+
+  free(lz);
+  return outpos;
+}
+#endif
+
+//--------------------------------------------------------------------------------------------------
+//  Model of histogram0
+//--------------------------------------------------------------------------------------------------
+
+unsigned long gzip_model_histogram(const unsigned char *input, unsigned int page_size,
+  unsigned int n_pages, unsigned int *hist)
+{
+  memset(hist, 0, (size_t)n_pages * 256 * sizeof(unsigned int));
+
+  for (unsigned int p = 0; p < n_pages; p++) {
+    const unsigned char *page_in = input + (size_t)p * page_size;
+    for (unsigned int i = 0; i < page_size; i++)
+      hist[p*256 + page_in[i]]++;
+  }
+
+  // VEC bytes per cycle, then one cycle per bin to sum the lanes
+  return 256 + (unsigned long)n_pages * (page_size / VEC + 256);
+}
+
+//--------------------------------------------------------------------------------------------------
+//  Model of the stored path of load_lz0/store_huff
+//--------------------------------------------------------------------------------------------------
+
+// Bytes of a stored page: up to the line that holds its last input byte
+static unsigned int gzip_model_stored_size(unsigned int page_bytes, unsigned int page_size)
+{
+  unsigned int size = (page_bytes + 63) / 64 * 64;
+  return (size < page_size) ? size : page_size;
+}
+
+// A 512-bit line collects 64 / VEC reads of the page, the last line is written as soon
+// as its reads are in, zero behind them. Returns the bytes written.
+static unsigned int gzip_model_stored_page(const unsigned char *input, unsigned int stored_size,
+  unsigned char *out)
+{
+  const unsigned int slots = 64 / VEC;
+  unsigned int size = 0;
+
+  for (unsigned int pagepos = 0; pagepos < stored_size; pagepos += VEC) {
+    unsigned int slot = (pagepos / VEC) & (slots - 1);
+    if (slot == 0)
+      memset(out + size, 0, 64);
+    memcpy(out + size + slot * VEC, input + pagepos, VEC);
+    if (slot == slots - 1 || pagepos + VEC == stored_size)
+      size += 64;
+  }
+  return size;
+}
+
+//--------------------------------------------------------------------------------------------------
+//  Model run over a file
+//--------------------------------------------------------------------------------------------------
+
+int run_gzip_model(const char *name, unsigned char *input, unsigned int insize,
+  unsigned int page_size, unsigned int n_pages, const unsigned char *markers,
+  const unsigned int *huftables, const unsigned char *page_flags)
+{
+  unsigned char *lz_out = (unsigned char *)malloc(2 * page_size + 2 * VEC);
+  unsigned char *decompressed = (unsigned char *)malloc(page_size + LEN);
+
+  unsigned long compsize_lz = 0;
+  unsigned long compsize_huffman = 0;
+  unsigned long cycles = 0;
+  unsigned int n_stored = 0;
+  int numerrors = 0;
+#if GZIP_DEFLATE
+  // stored blocks add 5 bytes per 64K
+  unsigned char *stored_out = (unsigned char *)malloc(page_size + 5 * (page_size / 65535 + 1));
+#else
+  unsigned char *huff_out = (unsigned char *)malloc(2 * page_size + 2 * VEC);
+  unsigned char *inflated = (unsigned char *)malloc(page_size);
+  unsigned long inflate_cycles = 0;
+#endif
+
+  auto const t0 = std::chrono::steady_clock::now();
+
+  for (unsigned int p = 0; p < n_pages; p++) {
+    const unsigned char *page_in = input + (size_t)p * page_size;
+    const unsigned char marker = markers[p];
+    unsigned int page_bytes = (insize - p * page_size < page_size) ? insize - p * page_size : page_size;
+    gzip_model_page_t page;
+
+    // stored pages are only read by load_lz, VEC bytes per cycle, and written out
+    // one byte per cycle by inflate_lz0
+    if (page_flags != NULL && (page_flags[p] & HDR_FLAG_STORED)) {
+      unsigned int stored_size = gzip_model_stored_size(page_bytes, page_size);
+      unsigned int stored_written = gzip_model_stored_page(page_in, stored_size, lz_out);
+      compsize_lz += stored_size;
+      compsize_huffman += stored_size;
+      cycles += page_size / VEC;
+#if GZIP_DEFLATE
+      // the host frames the input bytes of the page as stored blocks
+      unsigned int size = Deflate_Stored(stored_out, lz_out, page_bytes);
+      if (Deflate_Uncompress(stored_out, size, decompressed, page_size) != (int)page_bytes)
+        numerrors++;
+#else
+      // inflate_lz0 copies the input bytes of the page and drops the padding
+      memcpy(decompressed, lz_out, page_bytes);
+      inflate_cycles += stored_size;
+#endif
+      if (stored_written < stored_size || memcmp(decompressed, page_in, page_bytes) != 0)
+        numerrors++;
+      n_stored++;
+      continue;
+    }
+
+    gzip_model_page(page_in, page_size, marker, &huftables[p*256], lz_out, page);
+
+    compsize_lz += page.compsize_lz;
+    compsize_huffman += page.compsize_huffman;
+    cycles += page.cycles;
+
+#if GZIP_DEFLATE
+    // every page is a complete DEFLATE stream
+    if (Deflate_Uncompress(lz_out, page.compsize_huffman, decompressed, page_size) != (int)page_size)
+      numerrors++;
+#else
+    numerrors += LZ_Uncompress(lz_out, decompressed, page.compsize_lz, page_size + LEN);
+
+    // the Huffman stream must have the size counted by the kernel, and the inflate
+    // kernels rebuild the page without its padding (pages up to INFLATE_WINDOW)
+    const unsigned int *page_table = &huftables[p*256];
+    unsigned int huff_size = gzip_model_huffman_stream(lz_out, page.compsize_lz, page_table, huff_out);
+    if (huff_size != page.compsize_huffman)
+      numerrors++;
+    if (page_size <= INFLATE_WINDOW) {
+      unsigned int inflated_size = gzip_model_inflate_page(huff_out, huff_size, page.compsize_lz,
+        page_table, inflated, page_bytes, inflate_cycles);
+      if (inflated_size != page_bytes || memcmp(inflated, page_in, inflated_size) != 0)
+        numerrors++;
+    }
+#endif
+    if (memcmp(decompressed, page_in, page_bytes) != 0)
+      numerrors++;
+  }
+
+  auto const t1 = std::chrono::steady_clock::now();
+  double const seconds = std::chrono::duration<double>(t1 - t0).count();
+
+  // engines work on different pages in parallel
+  double const engine_cycles = (double)cycles / (n_pages < GZIP_ENGINES ? n_pages : GZIP_ENGINES);
+  double const bytes_per_cycle = (double)insize / engine_cycles;
+  double const ratio = (double)compsize_huffman / insize * 100;
+
+  printf("Model DEPTH/HASH_BITS       = %u/%u \n", DEPTH, HASH_BITS);
+  printf("Model compsize lz           = %lu \n", compsize_lz);
+  printf("Model compsize huffman      = %lu \n", compsize_huffman);
+  printf("Model compression ratio     = %.2f %% \n", ratio);
+  printf("Model stored pages          = %u \n", n_stored);
+  printf("Model device bytes/cycle    = %.3f \n", bytes_per_cycle);
+  printf("Model dictionary [B/engine] = %u \n", DEPTH * VEC * (LEN + 4));
+#if !GZIP_DEFLATE
+  if (page_size <= INFLATE_WINDOW)
+    printf("Model inflate bytes/cycle   = %.3f \n", (double)insize / inflate_cycles);
+  else
+    printf("Model inflate               = pages larger than INFLATE_WINDOW (%u) \n", INFLATE_WINDOW);
+#endif
+  printf("Model time                  = %.3f s \n", seconds);
+
+  FILE *file = fopen("gzip_model.dat", "a");
+  if (file != NULL) {
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0)
+      fprintf(file, "file depth hash_bits vec engines deflate insize pages compsize_lz compsize_huffman ratio bytes_per_cycle dict_bytes errors\n");
+    fprintf(file, "%s %u %u %u %u %u %u %u %lu %lu %.2f %.3f %u %d\n", name, DEPTH, HASH_BITS, VEC,
+      GZIP_ENGINES, GZIP_DEFLATE, insize, n_pages, compsize_lz, compsize_huffman, ratio, bytes_per_cycle,
+      DEPTH * VEC * (LEN + 4), numerrors);
+    fclose(file);
+  }
+
+  free(lz_out);
+  free(decompressed);
+#if GZIP_DEFLATE
+  free(stored_out);
+#else
+  free(huff_out);
+  free(inflated);
+#endif
+
+  return numerrors;
+}
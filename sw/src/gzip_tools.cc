@@ -34,6 +34,8 @@
 #include <string.h>
 #include <math.h>
 #include <stack>
+#include <string>
+#include <zlib.h>
 
 #include "gzip_tools.h"
 #include "AOCLUtils/aocl_utils.h"
@@ -50,14 +52,41 @@
 
 unsigned char Compute_Huffman(unsigned char *input, unsigned int insize, unsigned int *huftable, huff_encodenode_t **root) {
 
+  unsigned int hist[256] = {0};
+
+  for (unsigned int k = 0; k < insize; k++)
+    hist[input[k]]++;
+
+  return Compute_Huffman_Hist(hist, insize, huftable, root);
+}
+
+//---------------------------------------------------------------------------------------
+//  HELPER FUNCTION: Compute_Huffman_Hist() - Huffman Tree computation from a histogram
+//---------------------------
+//  hist     - byte counts of the data (e.g. one page, as produced by the histogram kernel)
+//  insize   - number of bytes counted in hist
+//  root     - tree used by the host decoder, or NULL if it is not needed
+//  returns the marker, the least frequent byte
+//----------------------------------------------------------------------------------------
+
+unsigned char Compute_Huffman_Hist(const unsigned int *hist, unsigned int insize, unsigned int *huftable, huff_encodenode_t **root) {
+
   huff_sym_t sym[256];
   unsigned int k;
 
-  // Calculate and sort histogram for input data
-  unsigned char marker = _Huffman_Hist(input, sym, insize);
+  unsigned char marker = 0;
+  for (k = 0; k < 256; k++)
+  {
+    sym[k].Symbol = k;
+    sym[k].Count  = hist[k];
+    sym[k].Code   = 0;
+    sym[k].Bits   = 0;
+    if (sym[k].Count < sym[marker].Count)
+      marker = (unsigned char)k;
+  }
 
   //inject marker into histogram to improve its encoding
-  //set marker count to half the file size
+  //set marker count to a third of the input size
 
   sym[marker].Count = insize/3;
 
@@ -84,7 +113,7 @@ unsigned char Compute_Huffman(unsigned char *input, unsigned int insize, unsigne
   }
 
   // Build Huffman tree
-  *root = _Huffman_MakeTree(sym, nodes, num_symbols); 
+  huff_encodenode_t *tree = _Huffman_MakeTree(sym, nodes, num_symbols);
 
   //_Tree_Debug_Print(tree);
 
@@ -109,9 +138,77 @@ unsigned char Compute_Huffman(unsigned char *input, unsigned int insize, unsigne
     printf("%d - %c: %x (%d)\n",k,k,cod,len);
   }
 #endif
+
+  if (root)
+    *root = tree;
+  else
+    free(nodes);
+
   return marker;
 }
 
+//---------------------------------------------------------------------------------------
+//  HELPER FUNCTION: Compute_Huffman_Pages() - one Huffman table and marker per page
+//---------------------------
+//  hist     - n_pages histograms of 256 counts
+//  huftable - n_pages tables of HUFFTABLE_SIZE bytes
+//  root     - tree of the first page, or NULL
+//----------------------------------------------------------------------------------------
+
+void Compute_Huffman_Pages(const unsigned int *hist, unsigned int page_size, unsigned int n_pages,
+  unsigned int *huftable, unsigned char *markers, huff_encodenode_t **root) {
+
+  for (unsigned int p = 0; p < n_pages; p++)
+    markers[p] = Compute_Huffman_Hist(&hist[p*256], page_size, &huftable[p*256], p == 0 ? root : NULL);
+}
+
+
+//---------------------------------------------------------------------------------------
+//  HELPER FUNCTION: Select_Stored_Pages() - Flag the pages that are not worth compressing
+//---------------------------
+//  The compressed size of a page is estimated from the order-0 entropy of its histogram
+//  (every literal marker also costs its raw 0 byte). Encrypted or already compressed
+//  pages come close to 8 bits per byte and are stored when the estimate is at least
+//  threshold percent of page_size. The fixed DEFLATE code spends 8 bits on literals
+//  0..143 and 9 bits on 144..255 instead of 8, so with GZIP_DEFLATE the entropy of
+//  every byte is scaled by its code length over 8 and random pages come out at 105%.
+//  threshold   - percent of page_size, 0 compresses every page
+//  page_flags  - HDR_FLAG_STORED is set on the selected pages, flags set by the caller
+//                (a padded last page) are kept
+//  returns the number of stored pages
+//----------------------------------------------------------------------------------------
+
+unsigned int Select_Stored_Pages(const unsigned int *hist, unsigned int page_size, unsigned int n_pages,
+  const unsigned char *markers, unsigned int threshold, unsigned char *page_flags) {
+
+  unsigned int n_stored = 0;
+
+  for (unsigned int p = 0; p < n_pages; p++) {
+    const unsigned int *page_hist = &hist[p*256];
+    double bits = 0;
+
+    for (unsigned int k = 0; k < 256; k++) {
+      if (page_hist[k] > 0) {
+#if GZIP_DEFLATE
+        double code_bits = (k < 144) ? 8.0 : 9.0;
+#else
+        double code_bits = 8.0;
+#endif
+        bits += page_hist[k] * log2((double)page_size / page_hist[k]) * code_bits / 8;
+      }
+    }
+#if !GZIP_DEFLATE
+    bits += page_hist[markers[p]] * 8.0;
+#endif
+
+    if (threshold != 0 && bits / 8 * 100 >= (double)page_size * threshold)
+      page_flags[p] |= HDR_FLAG_STORED;
+    n_stored += (page_flags[p] & HDR_FLAG_STORED) != 0;
+  }
+
+  return n_stored;
+}
+
 
 //---------------------------------------------------------------------------------------
 //  HELPER FUNCTION: LZ_Uncompress() - Uncompress a block of data using an LZ77 decoder.
@@ -120,9 +217,10 @@ unsigned char Compute_Huffman(unsigned char *input, unsigned int insize, unsigne
 //  out     - Output (uncompressed) buffer. This buffer must be large
 //            enough to hold the uncompressed data.
 //  insize  - Number of input bytes.
+//  outsize - Size of the output buffer, a stream that would write past it is an error.
 //----------------------------------------------------------------------------------------
 
-int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize )
+int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize, unsigned int outsize )
 {	
   unsigned char marker, symbol;
   unsigned int  i, inpos, outpos, length, offset;
@@ -156,6 +254,8 @@ int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize )
       if( in[ inpos ] == 0 )
       {
         // It was a single occurrence of the marker byte 
+        if( outpos >= outsize )
+          return err_count + 1;
         out[ outpos ++ ] = marker;
         ++ inpos;
       }
@@ -164,6 +264,7 @@ int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize )
         // Extract true length and offset 
         length = (in[ inpos ] >> 4) + 3;
         offset = in[ inpos ] & 0xf;
+        bool extended = (in[ inpos ] >> 4) == LZ_EXT_NIBBLE;
         inpos++;
 
         offset |= (in[ inpos ] & 0x7f) << 4;
@@ -177,7 +278,15 @@ int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize )
 
         inpos++;
 
-        if (length > 18) exit(1);
+        // extended match: the extra length byte follows the offset
+        if (extended)
+        {
+          length = VEC + in[ inpos ];
+          inpos++;
+        }
+
+        if (length > VEC + 255 || length > outsize - outpos)
+          return err_count + 1;
         // Copy corresponding data from history window 
         for( i = 0; i < length; ++ i )
         {
@@ -198,6 +307,8 @@ int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize )
     else
     {
       // No marker, plain copy 
+      if( outpos >= outsize )
+        return err_count + 1;
       out[ outpos ++ ] = symbol;
     }
   }
@@ -799,8 +910,120 @@ void Huffman_Uncompress( unsigned char *in, unsigned char *out, huff_encodenode_
         *buf ++ = second_offset_byte;
         k++;
       }
+
+      //extended match, the extra length byte is not encoded either
+      if((match_length >> 4) == LZ_EXT_NIBBLE)
+      {
+        *buf ++ = _Huffman_Read8Bits( &stream );
+        k++;
+      }
+    }
+  }
+}
+
+//---------------------------------------------------------------------------------------
+//  HELPER FUNCTION: Huffman_Decode_Table() - Lookup table of a code table
+//---------------------------
+//  huftable  - 256 entries of length << 16 | code, as sent to the device
+//  lut       - 1 << MAX_HUFFCODE_BITS entries, indexed by the next 16 stream bits:
+//              length << 8 | symbol, 0 if no code matches
+//  returns the number of errors, codes that do not fit their length or are the
+//  prefix of another code. The table read from a file is not trusted.
+//----------------------------------------------------------------------------------------
+
+int Huffman_Decode_Table(const unsigned int *huftable, unsigned short *lut)
+{
+  int err_count = 0;
+
+  memset(lut, 0, (1 << MAX_HUFFCODE_BITS) * sizeof(unsigned short));
+
+  for (unsigned int sym = 0; sym < 256; sym++) {
+    unsigned int len = huftable[sym] >> 16;
+    unsigned int code = huftable[sym] & 0xFFFF;
+    if (len == 0)
+      continue;
+    if (len > MAX_HUFFCODE_BITS || code >= (1u << len)) {
+      err_count++;
+      continue;
+    }
+    unsigned int first = code << (MAX_HUFFCODE_BITS - len);
+    for (unsigned int i = 0; i < (1u << (MAX_HUFFCODE_BITS - len)); i++) {
+      if (lut[first + i] != 0) {
+        err_count++;
+        break;
+      }
+      lut[first + i] = (len << 8) | sym;
     }
   }
+
+  return err_count;
+}
+
+//---------------------------------------------------------------------------------------
+//  HELPER FUNCTION: Huffman_Uncompress_Table() - Huffman_Uncompress with a lookup table
+//---------------------------
+//  Decodes outsize LZ bytes from insize stream bytes (MSB first). The bytes after a
+//  marker are read raw, the marker is the first symbol.
+//  returns the number of errors, codes that are not in the table
+//----------------------------------------------------------------------------------------
+
+int Huffman_Uncompress_Table(const unsigned char *in, unsigned int insize, unsigned char *out,
+  unsigned int outsize, const unsigned short *lut)
+{
+  unsigned long long window = 0;
+  unsigned int avail = 0;
+  unsigned int inpos = 0;
+  int err_count = 0;
+
+  // next 64 stream bits, zeros past the end
+  auto refill = [&]() {
+    while (avail <= 56) {
+      unsigned long long b = (inpos < insize) ? in[inpos] : 0;
+      window |= b << (56 - avail);
+      inpos++;
+      avail += 8;
+    }
+  };
+  auto read8 = [&]() {
+    refill();
+    unsigned char b = window >> 56;
+    window <<= 8;
+    avail -= 8;
+    return b;
+  };
+
+  unsigned int k = 0;
+  while (k < outsize) {
+    refill();
+    unsigned short entry = lut[window >> (64 - MAX_HUFFCODE_BITS)];
+    if (entry == 0) {
+      err_count++;
+      break;
+    }
+    window <<= entry >> 8;
+    avail -= entry >> 8;
+    out[k++] = entry & 0xFF;
+
+    // the length/offset bytes of a match follow the marker unencoded
+    if ((entry & 0xFF) != out[0] || k == 1 || k >= outsize)
+      continue;
+
+    unsigned char match_length = read8();
+    out[k++] = match_length;
+    if (match_length == 0 || k >= outsize)
+      continue;
+
+    unsigned char first_offset_byte = read8();
+    out[k++] = first_offset_byte;
+    if ((first_offset_byte & 0x80) && k < outsize)
+      out[k++] = read8();
+
+    // extended match, the extra length byte is not encoded either
+    if ((match_length >> 4) == LZ_EXT_NIBBLE && k < outsize)
+      out[k++] = read8();
+  }
+
+  return err_count;
 }
 
 void Print_Huffman(huff_encodenode_t *tree){
@@ -810,12 +1033,12 @@ void Print_Huffman(huff_encodenode_t *tree){
 //--------------------------------------------------------------------------------------------------
 //  Decompress on HOST
 //---------------------------
-//
+//  The page decodes to its zero padding as well, only the insize input bytes are compared
 //--------------------------------------------------------------------------------------------------
 
 int decompress_on_host(unsigned char *input, huff_encodenode_t *tree, unsigned int insize,
   unsigned int outsize, unsigned char marker, unsigned short *output_huffman,
-  gzip_out_info_t gzip_out_info, unsigned int remaining_bytes, double &time_decompress)
+  gzip_out_info_t gzip_out_info, double &time_decompress)
 {
   unsigned char *output_huffman_char = (unsigned char *)aocl_utils::alignedMalloc(outsize);
   unsigned char *decompress_lz       = (unsigned char *)aocl_utils::alignedMalloc(outsize);
@@ -839,20 +1062,6 @@ int decompress_on_host(unsigned char *input, huff_encodenode_t *tree, unsigned i
   Huffman_Uncompress(output_huffman_char, decompress_huff, tree, gzip_out_info.compsize_huffman[0],
     gzip_out_info.compsize_lz[0], marker);
 
-  //append last VEC bytes starting from fvp
-  for (int i = gzip_out_info.fvp[0]; i < VEC; i++) {
-    decompress_huff[gzip_out_info.compsize_lz[0]++] = input[insize-VEC+i];
-    if (input[insize-VEC+i] == marker)
-      decompress_huff[gzip_out_info.compsize_lz[0]++] = 0;
-  }
-
-  //append to output_huff the ommitted bytes
-  for (int i = 0; i < remaining_bytes; i++) {
-    decompress_huff[gzip_out_info.compsize_lz[0]++] = input[insize++];
-    if (input[insize-1] == marker)
-      decompress_huff[gzip_out_info.compsize_lz[0]++] = 0;
-  }
-
   //---------------------------------------
   // DECOMPRESS LZ
   //---------------------------------------
@@ -860,7 +1069,7 @@ int decompress_on_host(unsigned char *input, huff_encodenode_t *tree, unsigned i
   // Compare input / output_huffman data
   int err_count = 0;
 
-  err_count += LZ_Uncompress(decompress_huff, decompress_huff_lz, gzip_out_info.compsize_lz[0]);
+  err_count += LZ_Uncompress(decompress_huff, decompress_huff_lz, gzip_out_info.compsize_lz[0], outsize);
 
   //---------------------------------------
   double lib_stop = aocl_utils::getCurrentTimestamp();
@@ -883,3 +1092,245 @@ int decompress_on_host(unsigned char *input, huff_encodenode_t *tree, unsigned i
 
   return err_count;
 }
+
+
+//---------------------------------------------------------------------------------------
+//  DEFLATE (GZIP_DEFLATE)
+//---------------------------------------------------------------------------------------
+
+//---------------------------------------------------------------------------------------
+//  HELPER FUNCTION: Deflate_Fixed_Table() - Literal codes of a fixed-Huffman block
+//---------------------------
+//  Same layout as Compute_Huffman (length << 16 | code, MSB first). Lengths and
+//  distances are coded on the device.
+//----------------------------------------------------------------------------------------
+
+void Deflate_Fixed_Table(unsigned int *huftable)
+{
+  for (unsigned int k = 0; k < 256; k++) {
+    if (k < 144)
+      huftable[k] = (8 << 16) | (0x30 + k);
+    else
+      huftable[k] = (9 << 16) | (0x190 + k - 144);
+  }
+}
+
+//---------------------------------------------------------------------------------------
+//  HELPER FUNCTION: Deflate_Uncompress() - Inflate one raw DEFLATE stream with zlib
+//---------------------------
+//  Returns the number of bytes written to out, or -1 if the stream is broken.
+//----------------------------------------------------------------------------------------
+
+int Deflate_Uncompress(const unsigned char *in, unsigned int insize, unsigned char *out, unsigned int outsize)
+{
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, -15) != Z_OK)
+    return -1;
+
+  strm.next_in = (Bytef *)in;
+  strm.avail_in = insize;
+  strm.next_out = out;
+  strm.avail_out = outsize;
+
+  int ret = inflate(&strm, Z_FINISH);
+  int size = (ret == Z_STREAM_END) ? (int)strm.total_out : -1;
+  inflateEnd(&strm);
+
+  return size;
+}
+
+//---------------------------------------------------------------------------------------
+//  HELPER FUNCTION: Deflate_Stored() - Raw DEFLATE stream of stored blocks, for the
+//                   bytes the device does not see
+//---------------------------
+//  out needs insize + 5 bytes per started 64K.
+//----------------------------------------------------------------------------------------
+
+unsigned int Deflate_Stored(unsigned char *out, const unsigned char *in, unsigned int insize)
+{
+  unsigned int pos = 0;
+
+  do {
+    unsigned int len = insize > 0xFFFF ? 0xFFFF : insize;
+    insize -= len;
+
+    out[pos++] = (insize == 0); // BFINAL, BTYPE = 00
+    out[pos++] = len & 0xFF;
+    out[pos++] = len >> 8;
+    out[pos++] = ~len & 0xFF;
+    out[pos++] = (~len >> 8) & 0xFF;
+    memcpy(out + pos, in, len);
+    pos += len;
+    in += len;
+  } while (insize > 0);
+
+  return pos;
+}
+
+//---------------------------------------------------------------------------------------
+//  HELPER FUNCTION: Deflate_Frame() - Wrap one raw DEFLATE stream
+//---------------------------
+//  out     - Needs size + 128 bytes.
+//  deflate - Raw stream of size bytes.
+//  raw     - The uncompressed data, for the gzip/zlib checksums.
+//  frame   - deflate_frame_t.
+//  Returns the number of bytes written to out.
+//----------------------------------------------------------------------------------------
+
+unsigned int Deflate_Frame(unsigned char *out, const unsigned char *deflate, unsigned int size,
+  const unsigned char *raw, unsigned int raw_size, int frame)
+{
+  unsigned int pos = 0;
+
+  if (frame == DEFLATE_FRAME_GZIP) {
+    // ID1 ID2 CM=deflate FLG=0 MTIME=0 XFL=0 OS=unknown
+    const unsigned char header[10] = {0x1f, 0x8b, 0x08, 0, 0, 0, 0, 0, 0, 0xff};
+    memcpy(out, header, 10);
+    pos = 10;
+    memcpy(out + pos, deflate, size);
+    pos += size;
+
+    unsigned int crc = crc32(0L, raw, raw_size);
+    for (int i = 0; i < 4; i++)
+      out[pos++] = (crc >> (8 * i)) & 0xFF;
+    for (int i = 0; i < 4; i++)
+      out[pos++] = (raw_size >> (8 * i)) & 0xFF;
+  } else if (frame == DEFLATE_FRAME_ZLIB) {
+    // CM=8 with a 32K window, FLEVEL=0, no dictionary
+    out[pos++] = 0x78;
+    out[pos++] = 0x01;
+    memcpy(out + pos, deflate, size);
+    pos += size;
+
+    unsigned int adler = adler32(1L, raw, raw_size);
+    for (int i = 3; i >= 0; i--)
+      out[pos++] = (adler >> (8 * i)) & 0xFF;
+  } else {
+    // RawDeflater::deflate_file layout: decimal size in a 64 B line, stream padded to 64 B
+    std::string header = std::to_string(size);
+    memset(out, 0, 64);
+    memcpy(out, header.c_str(), header.size());
+    pos = 64;
+    memcpy(out + pos, deflate, size);
+    pos += size;
+    while (pos % 64 != 0)
+      out[pos++] = 0;
+  }
+
+  return pos;
+}
+
+//---------------------------------------------------------------------------------------
+//  HELPER FUNCTION: deflate_pages_on_host() - Inflate and compare every page of the
+//                   decrypted device output, optionally write it framed to a file
+//---------------------------
+//  output      - Decrypted pages, page_stride bytes apart, each behind its header line.
+//                Only the HDR_PAGE_BYTES input bytes of a page are framed, a page with
+//                zero padding is stored.
+//  framed_size - Size of the framed output.
+//  Returns the number of errors.
+//----------------------------------------------------------------------------------------
+
+int deflate_pages_on_host(unsigned char *input, unsigned int page_size, unsigned int n_pages,
+  const unsigned int *output, unsigned int page_stride, const char *out_filename, int frame,
+  unsigned long &framed_size, double &time_decompress)
+{
+  // stored blocks of a stored page
+  unsigned int stored_size = page_size + 5 * (page_size / 0xFFFF + 1);
+  unsigned int framed_max = (page_stride > stored_size ? page_stride : stored_size) + 128;
+
+  unsigned char *decompressed = (unsigned char *)aocl_utils::alignedMalloc(page_size);
+  unsigned char *stored       = (unsigned char *)aocl_utils::alignedMalloc(stored_size);
+  unsigned char *framed       = (unsigned char *)aocl_utils::alignedMalloc(framed_max);
+  FILE *file = NULL;
+  int err_count = 0;
+
+  if (out_filename != NULL) {
+    file = fopen(out_filename, "wb");
+    if (file == NULL)
+      printf("Unable to open %s \n", out_filename);
+  }
+
+  framed_size = 0;
+  time_decompress = 0.0;
+
+  for (unsigned int p = 0; p < n_pages; p++) {
+    const unsigned char *page = (const unsigned char *)output + (size_t)p * page_stride;
+    const unsigned char *page_in = input + (size_t)p * page_size;
+    unsigned int size = ((const unsigned int *)page)[HDR_COMPSIZE_HUFFMAN];
+    unsigned int page_bytes = ((const unsigned int *)page)[HDR_PAGE_BYTES];
+    const unsigned char *deflate = page + 64;
+
+    if (size > page_stride - 64) {
+      printf("Page %u: compressed size %u does not fit the page slot \n", p, size);
+      err_count++;
+      continue;
+    }
+
+    // stored pages hold the input bytes, they are framed as stored blocks
+    bool is_stored = ((const unsigned int *)page)[HDR_FLAGS] & HDR_FLAG_STORED;
+    if (is_stored) {
+      size = Deflate_Stored(stored, page + 64, page_bytes);
+      deflate = stored;
+    } else if (page_bytes != page_size) {
+      printf("Page %u: %u input bytes, padded pages must be stored \n", p, page_bytes);
+      err_count++;
+      continue;
+    }
+
+    double lib_start = aocl_utils::getCurrentTimestamp();
+    int outsize = Deflate_Uncompress(deflate, size, decompressed, page_size);
+    time_decompress += aocl_utils::getCurrentTimestamp() - lib_start;
+
+    if (outsize != (int)page_bytes || memcmp(decompressed, page_in, page_bytes) != 0) {
+      if (err_count < 10)
+        printf("Page %u: inflated %d of %u bytes, mismatch \n", p, outsize, page_bytes);
+      err_count++;
+    }
+
+    unsigned int framed_page = Deflate_Frame(framed, deflate, size, page_in, page_bytes, frame);
+    framed_size += framed_page;
+    if (file != NULL)
+      fwrite(framed, 1, framed_page, file);
+  }
+
+  if (file != NULL)
+    fclose(file);
+
+  aocl_utils::alignedFree(decompressed);
+  aocl_utils::alignedFree(stored);
+  aocl_utils::alignedFree(framed);
+
+  return err_count;
+}
+
+//--------------------------------------------------------------------------------------------------
+//  Verify the pages inflated on the FPGA
+//---------------------------
+//  inflated       - page p at inflated[p * page_size], inflated_bytes[p] bytes long
+//  output         - decrypted page slots, for the header of every page
+//  returns the number of pages that differ from the input
+//--------------------------------------------------------------------------------------------------
+
+int verify_inflated_pages(const unsigned char *input, unsigned int page_size, unsigned int n_pages,
+  const unsigned char *inflated, const unsigned int *inflated_bytes, const unsigned int *output,
+  unsigned int page_stride)
+{
+  int err_count = 0;
+
+  for (unsigned int p = 0; p < n_pages; p++) {
+    // the zero padding of the last page is not written
+    unsigned int expected = output[p * page_stride / 4 + HDR_PAGE_BYTES];
+    const unsigned char *page_in = input + (size_t)p * page_size;
+
+    if (inflated_bytes[p] != expected ||
+        memcmp(inflated + (size_t)p * page_size, page_in, expected) != 0) {
+      if (err_count < 10)
+        printf("inflate page %u: %u of %u bytes\n", p, inflated_bytes[p], expected);
+      err_count++;
+    }
+  }
+
+  return err_count;
+}
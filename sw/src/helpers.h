@@ -8,9 +8,9 @@
 //-----------------
 // Data types
 typedef struct {
-    uint cntr_nonce[2];
+    uint salt[2];     // file salt, the kernels derive the IV of every page from it
     uint elements[2];
-    uint iv[4];
+    uint iv[4];       // IV of the page, set per page by the kernels
 } aes_config;
 
 typedef struct {
@@ -18,6 +18,7 @@ typedef struct {
 } key_config;
 
 typedef struct {
+    cl_ulong gzip_hist;
     cl_ulong gzip_com;
     cl_ulong gzip_dec;
     cl_ulong aes_enc;
@@ -0,0 +1,477 @@
+//--------------------------------------------------------------------------------------------------
+//  io_uring file streams
+//---------------------------
+// One submission and completion ring per stream, set up with the raw system calls. Every chunk
+// slot of the pool is a registered buffer, so the kernel does not map the pages for every
+// request. The user data of a request is its slot. Short transfers are resubmitted for the rest.
+//--------------------------------------------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <deque>
+#include <vector>
+
+#include "uring_tools.h"
+
+//--------------------------------------------------------------------------------------------------
+//  Ring
+//--------------------------------------------------------------------------------------------------
+
+struct uring_t {
+  int fd;                 // -1: io_uring is not available, requests run synchronously
+  bool fixed;             // the pool is registered
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  // completions of the synchronous fallback, slot and result
+  std::deque<std::pair<unsigned int, int> > done;
+};
+
+static void uring_init(uring_t &u, unsigned int entries, unsigned char *pool, size_t chunk)
+{
+  u.fd = -1;
+  u.fixed = false;
+  u.sq_ring = u.cq_ring = MAP_FAILED;
+  u.sqes = (struct io_uring_sqe *)MAP_FAILED;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    return;
+
+  u.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && u.cq_ring_size > u.sq_ring_size)
+    u.sq_ring_size = u.cq_ring_size;
+  u.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  u.sq_ring = mmap(NULL, u.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+    IORING_OFF_SQ_RING);
+  u.cq_ring = single ? u.sq_ring : mmap(NULL, u.cq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  u.sqes = (struct io_uring_sqe *)mmap(NULL, u.sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (u.sq_ring == MAP_FAILED || u.cq_ring == MAP_FAILED || u.sqes == MAP_FAILED) {
+    if (u.sqes != MAP_FAILED)
+      munmap(u.sqes, u.sqes_size);
+    if (u.cq_ring != MAP_FAILED && u.cq_ring != u.sq_ring)
+      munmap(u.cq_ring, u.cq_ring_size);
+    if (u.sq_ring != MAP_FAILED)
+      munmap(u.sq_ring, u.sq_ring_size);
+    close(fd);
+    return;
+  }
+
+  unsigned char *sq = (unsigned char *)u.sq_ring;
+  unsigned char *cq = (unsigned char *)u.cq_ring;
+  u.sq_head  = (unsigned *)(sq + p.sq_off.head);
+  u.sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+  u.sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+  u.sq_array = (unsigned *)(sq + p.sq_off.array);
+  u.cq_head  = (unsigned *)(cq + p.cq_off.head);
+  u.cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+  u.cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+  u.cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  u.fd = fd;
+
+  // registering pins the pool, it fails beyond RLIMIT_MEMLOCK and plain requests are used
+  std::vector<struct iovec> iov(entries);
+  for (unsigned int s = 0; s < entries; s++) {
+    iov[s].iov_base = pool + s * chunk;
+    iov[s].iov_len = chunk;
+  }
+  u.fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov.data(), entries) == 0;
+}
+
+static void uring_exit(uring_t &u)
+{
+  if (u.fd < 0)
+    return;
+  munmap(u.sqes, u.sqes_size);
+  if (u.cq_ring != u.sq_ring)
+    munmap(u.cq_ring, u.cq_ring_size);
+  munmap(u.sq_ring, u.sq_ring_size);
+  close(u.fd);
+  u.fd = -1;
+}
+
+static void uring_submit(uring_t &u, bool write, int fd, unsigned char *buf, size_t len, off_t offset,
+  unsigned int slot)
+{
+  if (u.fd < 0) {
+    ssize_t res = write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+    u.done.push_back(std::make_pair(slot, res < 0 ? -errno : (int)res));
+    return;
+  }
+
+  unsigned tail = *u.sq_tail;
+  unsigned idx = tail & *u.sq_mask;
+  struct io_uring_sqe *sqe = &u.sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  if (u.fixed) {
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = slot;
+  } else {
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = slot;
+  u.sq_array[idx] = idx;
+  __atomic_store_n(u.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  while (syscall(__NR_io_uring_enter, u.fd, 1, 0, 0, NULL, 0) < 0 && errno == EINTR)
+    ;
+}
+
+// Waits for one completion. Returns false if the ring failed.
+static bool uring_wait(uring_t &u, unsigned int &slot, int &res)
+{
+  if (u.fd < 0) {
+    if (u.done.empty())
+      return false;
+    slot = u.done.front().first;
+    res = u.done.front().second;
+    u.done.pop_front();
+    return true;
+  }
+
+  for (;;) {
+    unsigned head = *u.cq_head;
+    if (head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+      slot = cqe->user_data;
+      res = cqe->res;
+      __atomic_store_n(u.cq_head, head + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+    if (syscall(__NR_io_uring_enter, u.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+      return false;
+  }
+}
+
+static unsigned char *pool_alloc(size_t size)
+{
+  void *pool = NULL;
+  if (posix_memalign(&pool, URING_ALIGN, size) != 0)
+    return NULL;
+  return (unsigned char *)pool;
+}
+
+//--------------------------------------------------------------------------------------------------
+//  Reader
+//---------------------------
+// Chunk k lands in slot k % depth. Chunks are handed out and released in order, so the slot of
+// chunk released + depth is free when chunk released is returned.
+//--------------------------------------------------------------------------------------------------
+
+struct uring_reader_t {
+  int fd;
+  size_t size;
+  size_t chunk;
+  unsigned int depth;
+  unsigned char *pool;
+  uring_t ring;
+  std::vector<size_t> filled;          // bytes read into the slot
+  std::vector<bool> landed;
+  size_t n_chunks;
+  size_t next;                         // next chunk handed out
+  size_t released;                     // chunks back in the pool
+  unsigned int in_flight;
+  bool error;
+};
+
+static size_t reader_bytes(const uring_reader_t *r, size_t k)
+{
+  size_t offset = k * r->chunk;
+  return (r->size - offset < r->chunk) ? r->size - offset : r->chunk;
+}
+
+static void reader_submit(uring_reader_t *r, size_t k)
+{
+  unsigned int slot = k % r->depth;
+  size_t done = r->filled[slot];
+  // O_DIRECT reads whole aligned chunks, the kernel stops at the end of the file
+  uring_submit(r->ring, false, r->fd, r->pool + slot * r->chunk + done, r->chunk - done,
+    k * r->chunk + done, slot);
+  r->in_flight++;
+}
+
+uring_reader_t *uring_reader_open(const char *filename, size_t chunk_size, unsigned int depth)
+{
+  int fd = open(filename, O_RDONLY | O_DIRECT);
+  if (fd < 0 && errno == EINVAL)
+    fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || depth == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  uring_reader_t *r = new uring_reader_t;
+  r->fd = fd;
+  r->size = st.st_size;
+  r->chunk = (chunk_size + URING_ALIGN - 1) / URING_ALIGN * URING_ALIGN;
+  r->depth = depth;
+  r->pool = pool_alloc(r->chunk * depth);
+  r->filled.assign(depth, 0);
+  r->landed.assign(depth, false);
+  r->n_chunks = (r->size + r->chunk - 1) / r->chunk;
+  r->next = 0;
+  r->released = 0;
+  r->in_flight = 0;
+  r->error = false;
+  if (r->pool == NULL) {
+    close(fd);
+    delete r;
+    return NULL;
+  }
+
+  uring_init(r->ring, depth, r->pool, r->chunk);
+  for (size_t k = 0; k < depth && k < r->n_chunks; k++)
+    reader_submit(r, k);
+
+  return r;
+}
+
+size_t uring_reader_size(const uring_reader_t *r)
+{
+  return r->size;
+}
+
+const unsigned char *uring_reader_next(uring_reader_t *r, size_t &bytes)
+{
+  bytes = 0;
+  if (r->error || r->next >= r->n_chunks || r->next >= r->released + r->depth)
+    return NULL;
+
+  unsigned int slot = r->next % r->depth;
+  while (!r->landed[slot]) {
+    unsigned int s;
+    int res;
+    if (!uring_wait(r->ring, s, res)) {
+      r->error = true;
+      return NULL;
+    }
+    r->in_flight--;
+
+    // the chunk of slot s is the one in flight in it, between next and released + depth
+    size_t k = r->next + (s + r->depth - slot) % r->depth;
+    if (res < 0 || (res == 0 && r->filled[s] < reader_bytes(r, k))) {
+      r->error = true;
+      return NULL;
+    }
+    r->filled[s] += res;
+    if (r->filled[s] < reader_bytes(r, k))
+      reader_submit(r, k);
+    else
+      r->landed[s] = true;
+  }
+
+  bytes = reader_bytes(r, r->next);
+  r->next++;
+  return r->pool + slot * r->chunk;
+}
+
+void uring_reader_release(uring_reader_t *r)
+{
+  if (r->released >= r->next)
+    return;
+
+  unsigned int slot = r->released % r->depth;
+  r->filled[slot] = 0;
+  r->landed[slot] = false;
+  r->released++;
+
+  size_t k = r->released - 1 + r->depth;
+  if (k < r->n_chunks && !r->error)
+    reader_submit(r, k);
+}
+
+bool uring_reader_close(uring_reader_t *r)
+{
+  // the kernel may still write into the pool
+  unsigned int s;
+  int res;
+  while (r->in_flight > 0 && uring_wait(r->ring, s, res))
+    r->in_flight--;
+
+  bool ok = !r->error;
+  uring_exit(r->ring);
+  close(r->fd);
+  free(r->pool);
+  delete r;
+  return ok;
+}
+
+//--------------------------------------------------------------------------------------------------
+//  Writer
+//---------------------------
+// The slot being filled is submitted when it is full and the writer moves on to the next one,
+// waiting for its previous write if needed. With O_DIRECT the last chunk is written padded to
+// URING_ALIGN and the file is truncated to its size.
+//--------------------------------------------------------------------------------------------------
+
+struct uring_writer_t {
+  int fd;
+  bool direct;
+  size_t chunk;
+  unsigned int depth;
+  unsigned char *pool;
+  uring_t ring;
+  std::vector<size_t> length;          // bytes of the write in flight in the slot, 0 if free
+  std::vector<size_t> written;
+  std::vector<off_t> offset;
+  unsigned int slot;                   // slot being filled
+  size_t fill;
+  off_t total;                         // bytes appended
+  unsigned int in_flight;
+  bool error;
+};
+
+static void writer_submit(uring_writer_t *w, unsigned int s)
+{
+  size_t done = w->written[s];
+  uring_submit(w->ring, true, w->fd, w->pool + s * w->chunk + done, w->length[s] - done,
+    w->offset[s] + done, s);
+  w->in_flight++;
+}
+
+// Waits for one write. Returns false if the ring failed.
+static bool writer_reap(uring_writer_t *w)
+{
+  unsigned int s;
+  int res;
+  if (!uring_wait(w->ring, s, res)) {
+    w->error = true;
+    return false;
+  }
+  w->in_flight--;
+
+  if (res <= 0) {
+    w->error = true;
+    w->length[s] = 0;
+    return true;
+  }
+  w->written[s] += res;
+  if (w->written[s] < w->length[s])
+    writer_submit(w, s);
+  else
+    w->length[s] = 0;
+  return true;
+}
+
+uring_writer_t *uring_writer_open(const char *filename, size_t chunk_size, unsigned int depth)
+{
+  bool direct = true;
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  if (fd < 0 && errno == EINVAL) {
+    direct = false;
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  if (fd < 0 || depth == 0) {
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  uring_writer_t *w = new uring_writer_t;
+  w->fd = fd;
+  w->direct = direct;
+  w->chunk = (chunk_size + URING_ALIGN - 1) / URING_ALIGN * URING_ALIGN;
+  w->depth = depth;
+  w->pool = pool_alloc(w->chunk * depth);
+  w->length.assign(depth, 0);
+  w->written.assign(depth, 0);
+  w->offset.assign(depth, 0);
+  w->slot = 0;
+  w->fill = 0;
+  w->total = 0;
+  w->in_flight = 0;
+  w->error = false;
+  if (w->pool == NULL) {
+    close(fd);
+    delete w;
+    return NULL;
+  }
+
+  uring_init(w->ring, depth, w->pool, w->chunk);
+  return w;
+}
+
+// Submits the slot being filled, length bytes of it, and waits for the next slot to be free
+static void writer_flush(uring_writer_t *w, size_t length)
+{
+  unsigned int s = w->slot;
+  w->length[s] = length;
+  w->written[s] = 0;
+  w->offset[s] = w->total - w->fill;
+  writer_submit(w, s);
+
+  w->slot = (s + 1) % w->depth;
+  w->fill = 0;
+  while (w->length[w->slot] != 0 && writer_reap(w))
+    ;
+}
+
+bool uring_writer_write(uring_writer_t *w, const void *data, size_t size)
+{
+  const unsigned char *src = (const unsigned char *)data;
+
+  while (size > 0 && !w->error) {
+    size_t n = (w->chunk - w->fill < size) ? w->chunk - w->fill : size;
+    memcpy(w->pool + w->slot * w->chunk + w->fill, src, n);
+    w->fill += n;
+    w->total += n;
+    src += n;
+    size -= n;
+
+    if (w->fill == w->chunk)
+      writer_flush(w, w->chunk);
+  }
+
+  return !w->error;
+}
+
+bool uring_writer_close(uring_writer_t *w)
+{
+  if (w->fill > 0 && !w->error) {
+    size_t length = w->fill;
+    if (w->direct) {
+      length = (w->fill + URING_ALIGN - 1) / URING_ALIGN * URING_ALIGN;
+      memset(w->pool + w->slot * w->chunk + w->fill, 0, length - w->fill);
+    }
+    writer_flush(w, length);
+  }
+
+  while (w->in_flight > 0 && writer_reap(w))
+    ;
+
+  bool ok = !w->error;
+  if (w->direct && ftruncate(w->fd, w->total) != 0)
+    ok = false;
+  uring_exit(w->ring);
+  if (close(w->fd) != 0)
+    ok = false;
+  free(w->pool);
+  delete w;
+  return ok;
+}